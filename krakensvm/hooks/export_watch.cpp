@@ -0,0 +1,195 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <inline_hook.hpp>
+#include <hook_transaction.hpp>
+#include <export_watch.hpp>
+#include <pe_image.hpp>
+
+using namespace pe::literals;
+
+namespace hk::export_watch
+{
+  using lookup_process_t = NTSTATUS (*)(HANDLE process_id, PEPROCESS* process);
+  using stack_attach_t   = VOID     (*)(PRKPROCESS process, PRKAPC_STATE state);
+
+  // Exported, not in the WDK headers
+  using copy_memory_t    = NTSTATUS (*)(PEPROCESS from_process, PVOID from_address, PEPROCESS to_process,
+                                        PVOID to_address, SIZE_T size, KPROCESSOR_MODE mode, PSIZE_T copied);
+
+  enum watched : uint32_t
+  {
+    lookup_process,
+    stack_attach,
+    copy_memory,
+    watched_count,
+  };
+
+  struct watch
+  {
+    const char*       name;
+    inline_hook::hook entry;
+    volatile LONG64   calls;
+  };
+
+  static watch watches[watched_count] =
+  {
+    { "PsLookupProcessByProcessId" },
+    { "KeStackAttachProcess" },
+    { "MmCopyVirtualMemory" },
+  };
+
+  //
+  // Detours on their way through, disable() waits for it to drop back to 0.
+  // A thread that took the jump but hasn't counted itself in yet is a handful
+  // of instructions away from doing so, the wait covers it as well.
+  //
+
+  static volatile LONG inside = 0;
+
+  // Committed by enable(), kept until disable() reverts it
+  static transaction::batch hooks = {};
+
+  static NTSTATUS lookup_process_detour(HANDLE process_id, PEPROCESS* process)
+  {
+    InterlockedIncrement(&inside);
+    InterlockedIncrement64(&watches[lookup_process].calls);
+
+    const NTSTATUS status = inline_hook::original<lookup_process_t>(watches[lookup_process].entry)(process_id, process);
+
+    InterlockedDecrement(&inside);
+    return status;
+  }
+
+  static VOID stack_attach_detour(PRKPROCESS process, PRKAPC_STATE state)
+  {
+    InterlockedIncrement(&inside);
+    InterlockedIncrement64(&watches[stack_attach].calls);
+
+    inline_hook::original<stack_attach_t>(watches[stack_attach].entry)(process, state);
+
+    InterlockedDecrement(&inside);
+  }
+
+  static NTSTATUS copy_memory_detour(PEPROCESS from_process, PVOID from_address, PEPROCESS to_process,
+                                     PVOID to_address, SIZE_T size, KPROCESSOR_MODE mode, PSIZE_T copied)
+  {
+    InterlockedIncrement(&inside);
+    InterlockedIncrement64(&watches[copy_memory].calls);
+
+    const NTSTATUS status = inline_hook::original<copy_memory_t>(watches[copy_memory].entry)(
+      from_process, from_address, to_process, to_address, size, mode, copied);
+
+    InterlockedDecrement(&inside);
+    return status;
+  }
+
+  auto enable() noexcept -> void
+  {
+    void* const targets[watched_count] =
+    {
+      pe::resolve<"PsLookupProcessByProcessId"_h>(),
+      pe::resolve<"KeStackAttachProcess"_h>(),
+      pe::resolve<"MmCopyVirtualMemory"_h>(),
+    };
+
+    void* const detours[watched_count] =
+    {
+      reinterpret_cast<void*>(lookup_process_detour),
+      reinterpret_cast<void*>(stack_attach_detour),
+      reinterpret_cast<void*>(copy_memory_detour),
+    };
+
+    if (!transaction::begin(hooks, watched_count)) return;
+
+    for (uint32_t index = 0; index < watched_count; ++index)
+    {
+      watch& current = watches[index];
+
+      if (targets[index] == nullptr)
+      {
+        kprint_info("%s isn't exported, not watched\n", current.name);
+        continue;
+      }
+
+      const trampoline::status prepared = inline_hook::prepare(current.entry, targets[index], detours[index]);
+
+      if (prepared != trampoline::status::ok)
+      {
+        kprint_info("%s can't be hooked (%u), not watched\n", current.name, static_cast<uint32_t>(prepared));
+        continue;
+      }
+
+      transaction::stage_hook(hooks, current.entry);
+    }
+
+    // All of them in one window, or none
+    if (hooks.count == 0 || !transaction::commit(hooks))
+    {
+      for (size_t index = 0; index < hooks.count; ++index)
+      {
+        const transaction::item& staged = hooks.items[index];
+
+        for (const watch& current : watches)
+        {
+          if (staged.owner != &current.entry) continue;
+
+          kprint_info("%s not hooked, item status %u\n", current.name, static_cast<uint32_t>(staged.status));
+        }
+      }
+
+      transaction::end(hooks);
+      return;
+    }
+
+    kprint_info("%zu exports watched, processors held for %llu TSC ticks\n", hooks.count, hooks.pause);
+  }
+
+  auto disable() noexcept -> void
+  {
+    if (!hooks.committed) return;
+
+    // Nothing to be done about it, the detours stay reachable
+    if (!transaction::revert(hooks))
+    {
+      kprint_info("Failed to take the export watch hooks off\n");
+      return;
+    }
+
+    transaction::end(hooks);
+
+    for (const watch& current : watches)
+    {
+      if (current.entry.trampoline != nullptr) kprint_info("%s: %lld calls\n", current.name, current.calls);
+    }
+
+    LARGE_INTEGER interval = {};
+    interval.QuadPart = -10 * 1000 * 10;      // 10 ms
+
+    while (inside != 0) KeDelayExecutionThread(KernelMode, FALSE, &interval);
+  }
+
+}; // namespace hk::export_watch
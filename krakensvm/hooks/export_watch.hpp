@@ -0,0 +1,58 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// Export watch
+//
+// Counts calls into the ntoskrnl exports a driver or the kernel itself goes
+// through to reach into another process: looking one up by id, attaching to
+// its address space and copying its memory. Each export gets an inline hook
+// whose detour bumps a counter and goes on through the trampoline. The
+// hooks go in as one transaction and come off as one, the totals are
+// printed once they're off.
+//
+// Off unless the ExportWatch registry value is set. Exports the kernel
+// doesn't have, or whose prologue the trampoline can't relocate, are left
+// alone and said so.
+//
+
+namespace hk::export_watch
+{
+  //
+  // Driver side, located in "hooks/export_watch.cpp"
+  //
+
+  // PASSIVE_LEVEL, once the processors are virtualized
+  auto enable  () noexcept -> void;
+
+  // PASSIVE_LEVEL, before they're devirtualized. Returns once no detour is
+  // running anymore, the driver image can go after that.
+  auto disable () noexcept -> void;
+
+}; // namespace hk::export_watch
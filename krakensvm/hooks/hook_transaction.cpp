@@ -0,0 +1,182 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <hook_transaction.hpp>
+#include <krakensvm.hpp>
+#include <processor_mask.hpp>
+#include <vmcb.hpp>
+
+namespace hk::transaction
+{
+  auto begin(batch& transaction, const size_t capacity) noexcept -> bool
+  {
+    transaction = {};
+    if (capacity == 0) return false;
+
+    transaction.items = static_cast<item*>(ExAllocatePoolWithTag(NonPagedPool, capacity * sizeof(item), HV_POOL_TAG));
+    if (transaction.items == nullptr) return false;
+
+    memset(transaction.items, 0, capacity * sizeof(item));
+    transaction.capacity = capacity;
+
+    return true;
+  }
+
+  auto stage_patch(batch& transaction, void* address, const void* bytes, const size_t size) noexcept -> item*
+  {
+    if (transaction.committed || transaction.count == transaction.capacity) return nullptr;
+    if (size == 0 || size > max_patch) return nullptr;
+
+    item& entry = transaction.items[transaction.count++];
+    entry         = {};
+    entry.address = reinterpret_cast<uint64_t>(address);
+    entry.size    = static_cast<uint8_t>(size);
+    entry.status  = item_status::staged;
+
+    memcpy(entry.bytes, bytes, size);
+
+    // An item that can't be mapped stays in, commit reports it and fails
+    // as a whole rather than landing without it
+    uint8_t* last = static_cast<uint8_t*>(address) + size - 1;
+    if (!MmIsAddressValid(address) || !MmIsAddressValid(last)) return &entry;
+
+    memcpy(entry.expected, address, size);
+    entry.writable = inline_hook::map_code(address, size, entry.mapping);
+
+    return &entry;
+  }
+
+  auto stage_hook(batch& transaction, inline_hook::hook& entry) noexcept -> item*
+  {
+    if (entry.trampoline == nullptr || entry.installed) return nullptr;
+
+    item* staged = stage_patch(transaction, reinterpret_cast<void*>(entry.target), entry.patch, sizeof entry.patch);
+    if (staged == nullptr) return nullptr;
+
+    // Against what prepare() saw, not whatever is there now
+    memcpy(staged->expected, entry.original, sizeof entry.original);
+    staged->owner = &entry;
+
+    return staged;
+  }
+
+  //
+  // Virtualized processors join from root mode, where nothing can get at
+  // them between the check and the write; the rest join from the IPI
+  //
+
+  static auto enter_window(ULONG_PTR context) -> ULONG_PTR
+  {
+    auto* window = reinterpret_cast<rendezvous*>(context);
+    const uint32_t processor = KeGetCurrentProcessorIndex();
+
+    if (processor_mask::is_virtualized(processor))
+    {
+      __svm_vmmcall(svm::hypercall_num::hook_window, window);
+    }
+    else
+    {
+      join(*window, processor, [] { return __rdtsc(); }, [] { _mm_pause(); });
+    }
+
+    // Cross-modifying code, nothing runs the new bytes before serializing
+    int registers[4];
+    __cpuid(registers, 0);
+
+    return 0;
+  }
+
+  static auto run_window(batch& transaction, const bool forward) noexcept -> bool
+  {
+    rendezvous window = {};
+    window.items        = transaction.items;
+    window.count        = transaction.count;
+    window.forward      = forward;
+    window.participants = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    // The caller is one of the processors the broadcast runs on, and stays
+    // the writer as long as it can't be moved
+    KIRQL irql;
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    window.writer = KeGetCurrentProcessorIndex();
+    KeIpiGenericCall(enter_window, reinterpret_cast<ULONG_PTR>(&window));
+
+    KeLowerIrql(irql);
+
+    transaction.pause = window.pause;
+
+    for (size_t index = 0; index < transaction.count; ++index)
+    {
+      const item& entry = transaction.items[index];
+      if (entry.owner == nullptr) continue;
+
+      static_cast<inline_hook::hook*>(entry.owner)->installed = entry.status == item_status::applied;
+    }
+
+    return window.result;
+  }
+
+  auto commit(batch& transaction) noexcept -> bool
+  {
+    if (transaction.items == nullptr || transaction.committed) return false;
+
+    transaction.committed = run_window(transaction, true);
+    return transaction.committed;
+  }
+
+  auto revert(batch& transaction) noexcept -> bool
+  {
+    if (!transaction.committed) return false;
+
+    transaction.committed = !run_window(transaction, false);
+    return !transaction.committed;
+  }
+
+  auto end(batch& transaction) noexcept -> void
+  {
+    if (transaction.items == nullptr) return;
+
+    for (size_t index = 0; index < transaction.count; ++index)
+    {
+      item& entry = transaction.items[index];
+      inline_hook::unmap_code(entry.writable, entry.mapping);
+    }
+
+    ExFreePoolWithTag(transaction.items, HV_POOL_TAG);
+    transaction = {};
+  }
+
+  auto join_from_host(const uint64_t context) noexcept -> bool
+  {
+    auto* window = reinterpret_cast<rendezvous*>(context);
+    if (window == nullptr) return false;
+
+    join(*window, KeGetCurrentProcessorIndex(), [] { return __rdtsc(); }, [] { _mm_pause(); });
+    return window->result;
+  }
+
+}; // namespace hk::transaction
@@ -0,0 +1,203 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+#include <inline_hook.hpp>
+
+//
+// Hook transactions
+//
+// Stages any number of code patches and inline hooks, then applies all of
+// them in one stop-the-world window instead of one per hook. Every
+// processor is stopped once; the one that writes checks each item against
+// the bytes it was staged with and, if any has changed under it, puts back
+// the ones already written. A transaction lands whole or not at all, and
+// says per item why.
+//
+// A committed transaction can be reverted the same way, items in reverse
+// order, again whole or not at all.
+//
+// No address translation changes, so there's nothing to flush: VMRUN
+// serializes each vCPU on its way back to the guest, which is all the
+// cross-modifying code rules ask for.
+//
+// The staging, writing and rendezvous below are WDK-free; "hooks/
+// hook_transaction.cpp" maps the targets and brings the processors into
+// root mode.
+//
+
+namespace hk::transaction
+{
+  // Large enough for an inline hook's jump
+  constexpr size_t max_patch = 16;
+
+  enum class item_status : uint8_t
+  {
+    staged,
+    applied,
+    conflict,                 // target no longer held what it was staged against
+    unmapped,                 // couldn't get a writable view of the target
+    rolled_back,              // was written, undone because another item failed
+    reverted,                 // undone by revert()
+  };
+
+  struct item
+  {
+    uint64_t    address;
+    uint8_t*    writable;     // alias of address
+    void*       mapping;      // whatever the driver needs to undo the alias
+    void*       owner;        // the inline_hook::hook, nullptr for raw patches
+
+    uint8_t     size;
+    item_status status;
+
+    uint8_t     bytes[max_patch];       // written by apply
+    uint8_t     expected[max_patch];    // there before, written back by revert
+  };
+
+  //
+  // Moves every item from one of its byte sets to the other. from is what
+  // the target has to hold, all or nothing.
+  //
+
+  inline auto transfer(item* items, const size_t count, const bool forward) noexcept -> bool
+  {
+    const auto from = [forward](const item& entry) { return forward ? entry.expected : entry.bytes; };
+    const auto to   = [forward](const item& entry) { return forward ? entry.bytes : entry.expected; };
+
+    const item_status done = forward ? item_status::applied : item_status::reverted;
+
+    for (size_t step = 0; step < count; ++step)
+    {
+      item& entry = items[forward ? step : count - 1 - step];
+
+      const bool usable = entry.writable != nullptr && memcmp(entry.writable, from(entry), entry.size) == 0;
+
+      if (!usable)
+      {
+        entry.status = entry.writable == nullptr ? item_status::unmapped : item_status::conflict;
+
+        // Undo in the opposite order, so overlapping items come out right
+        for (size_t undo = step; undo-- > 0;)
+        {
+          item& written = items[forward ? undo : count - 1 - undo];
+
+          memcpy(written.writable, from(written), written.size);
+          written.status = forward ? item_status::rolled_back : item_status::applied;
+        }
+
+        return false;
+      }
+
+      memcpy(entry.writable, to(entry), entry.size);
+      entry.status = done;
+    }
+
+    return true;
+  }
+
+  //
+  // The stop-the-world window. Everyone calls join(), the writer applies
+  // once the rest have arrived, and nobody leaves before it's done.
+  //
+
+  struct rendezvous
+  {
+    item*    items;
+    size_t   count;
+    bool     forward;
+
+    uint32_t participants;
+    uint32_t writer;
+
+    uint32_t arrived;
+    uint32_t released;
+    bool     result;
+
+    uint64_t first_arrival;   // clock() of the first one in
+    uint64_t pause;           // clock() ticks from there to the release
+  };
+
+  template<class clock_t, class relax_t>
+  auto join(rendezvous& window, const uint32_t self, clock_t clock, relax_t relax) noexcept -> void
+  {
+    std::atomic_ref<uint32_t> arrived (window.arrived);
+    std::atomic_ref<uint32_t> released(window.released);
+
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) == 0)
+    {
+      window.first_arrival = clock();
+    }
+
+    if (self == window.writer)
+    {
+      while (arrived.load(std::memory_order_acquire) != window.participants) relax();
+
+      window.result = transfer(window.items, window.count, window.forward);
+      window.pause  = clock() - window.first_arrival;
+
+      released.store(1, std::memory_order_release);
+    }
+    else
+    {
+      while (released.load(std::memory_order_acquire) == 0) relax();
+    }
+  }
+
+  //
+  // Driver side, located in "hooks/hook_transaction.cpp"
+  //
+
+  struct batch
+  {
+    item*    items;
+    size_t   count;
+    size_t   capacity;
+    bool     committed;
+    uint64_t pause;           // TSC ticks every processor was held by the last commit/revert
+  };
+
+  auto begin       (batch& transaction, size_t capacity) noexcept -> bool;
+  auto stage_patch (batch& transaction, void* address, const void* bytes, size_t size) noexcept -> item*;
+
+  // The hook has to be prepared, it's marked installed once committed
+  auto stage_hook  (batch& transaction, inline_hook::hook& entry) noexcept -> item*;
+
+  auto commit      (batch& transaction) noexcept -> bool;
+  auto revert      (batch& transaction) noexcept -> bool;
+
+  // Unmaps the targets and frees the items, the patches stay as they are
+  auto end         (batch& transaction) noexcept -> void;
+
+  // vmmcall_handler's end of it, context is the rendezvous
+  auto join_from_host(uint64_t context) noexcept -> bool;
+
+}; // namespace hk::transaction
@@ -25,6 +25,7 @@
 
 #include "hook_utils.hpp"
 #include "pe.hpp"
+#include "pe_image.hpp"
 
 namespace utils
 {
@@ -52,31 +53,101 @@ namespace utils
     return 0;
   }
   
-  static auto find_pattern_section(const uint64_t base, const char* section, const unsigned char* bmask, const char* szmask) noexcept -> uint64_t
+  static auto find_pattern_section(const pe::image& image, const char* section, const unsigned char* bmask, const char* szmask) noexcept -> uint64_t
   {
-    if (!base || !section || !bmask || !szmask) return 0;
+    if (!image.indexed() || !section || !bmask || !szmask) return 0;
 
-    auto* psection = pe::section_header_getter(base, section);
+    const auto* psection = image.section(section);
 
-    return psection ? find_pattern(base + psection->VirtualAddress, psection->SizeOfRawData, bmask, szmask) : 0;
+    return psection ? find_pattern(reinterpret_cast<uint64_t>(image.base()) + psection->virtual_address,
+                                   psection->size_of_raw_data, bmask, szmask) : 0;
   }
 
   uint64_t get_kernelbase_addr()
   {
-    UNICODE_STRING routine{};
-    uint64_t kernel_base{};
+    // The kernel doesn't move, so this is only resolved once
+    static uint64_t kernel_base{};
+    if (kernel_base) return kernel_base;
 
-    RtlInitUnicodeString(&routine, L"RtlPcToFileHeader");
-    using f_RtlPcToFileHeader = PVOID(*) (PVOID PcValue, PVOID* BaseOfImage);
+    // No routine name to convert and look up by string, RtlPcToFileHeader is
+    // linked against directly. Anything else ntoskrnl exports goes through
+    // pe::resolve<"..."_h>() once the kernel image has been indexed.
+    if (!RtlPcToFileHeader(reinterpret_cast<PVOID>(&RtlPcToFileHeader), reinterpret_cast<void**>(&kernel_base)))
+      return 0xdead;
 
-    const f_RtlPcToFileHeader RtlPcToFileHeader =
-      reinterpret_cast<f_RtlPcToFileHeader>(MmGetSystemRoutineAddress(&routine));
+    return kernel_base;
+  }
 
-    if (!RtlPcToFileHeader) return 0xdead;
+  auto get_kernel_identity(uint64_t kernel_base) -> cache::kernel_identity
+  {
+    const auto pimage_dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(kernel_base);
+    const auto pimage_nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(kernel_base + pimage_dos_header->e_lfanew);
 
-    RtlPcToFileHeader(RtlPcToFileHeader, reinterpret_cast<void**>(&kernel_base));
+    return { pimage_nt_headers->FileHeader.TimeDateStamp,
+             pimage_nt_headers->OptionalHeader.SizeOfImage,
+             pimage_nt_headers->OptionalHeader.CheckSum };
+  }
 
-    return kernel_base;
+  // The assembly we'll be interacting with:
+  //
+  // nt!KiSystemServiceStart:
+  // 4889a3d8010000  mov     qword ptr[rbx + 1D8h], rsp
+  // 8bf8            mov     edi, eax
+  // c1ef07          shr     edi, 7
+  // 83e720          and     edi, 20h
+  // 25ff0f0000      and     eax, 0FFFh
+  // nt!KiSystemServiceRepeat:
+  // 4c8d15c7202300  lea     r10, [nt!KeServiceDescriptorTable(fffff800`040c7840)]
+  // 4c8d1d00212300  lea     r11, [nt!KeServiceDescriptorTableShadow
+  static constexpr unsigned char KiSystemServiceStartPattern[] = {
+      0x8B, 0xF8,                     // mov edi,eax
+      0xC1, 0xEF, 0x07,               // shr edi,7
+      0x83, 0xE7, 0x20,               // and edi,20h
+      0x25, 0xFF, 0x0F, 0x00, 0x00    // and eax,0fffh
+  };
+
+  static constexpr const char* KiSystemServiceStartMask = "xxxxxxxxxxx??";
+
+  static_assert(sizeof KiSystemServiceStartPattern == cache::signature_size,
+                "blob_validate() bounds the signature and both lea's with this");
+
+  // Resolves the target of a "lea r64, [rip + disp32]" with a REX.WR prefix,
+  // the modrm byte tells which of r10 (0x15) or r11 (0x1d) is expected
+  static auto resolve_lea_target(const uint64_t address_of_lea, const unsigned char modrm) noexcept -> uint64_t
+  {
+    // Check to see if we're managing the right opcodes;
+    //
+    // The "+ 0" was not needed, just added it to be more verbose
+    if ( *(unsigned char*) (address_of_lea + 0) != 0x4c ||
+         *(unsigned char*) (address_of_lea + 1) != 0x8d ||
+         *(unsigned char*) (address_of_lea + 2) != modrm)
+    {
+      return 0;
+    }
+
+    // The displacement is a signed 32 bit value relative to the next instruction
+    const int32_t relative_offset = *(int32_t*) (address_of_lea + 3);
+
+    return address_of_lea + 7 + relative_offset;
+  }
+
+  // Cheap check of a cached blob against the running kernel, the signature must
+  // still sit at the cached offset and both lea's must still land on the cached tables
+  static auto verify_cached_offsets(const uint64_t kernel_base, const cache::offset_blob& blob) noexcept -> bool
+  {
+    const uint64_t address_of_nonshadow_lea = kernel_base + blob.ki_system_service_start + sizeof KiSystemServiceStartPattern;
+    const uint64_t end_of_span              = kernel_base + blob.ki_system_service_start + cache::verified_span - 1;
+
+    // Inside the image is checked at load, a stale offset can still point
+    // into a discarded INIT section
+    if (!MmIsAddressValid(reinterpret_cast<PVOID>(kernel_base + blob.ki_system_service_start)) ||
+        !MmIsAddressValid(reinterpret_cast<PVOID>(end_of_span))) return false;
+
+    if (!memory_compare(reinterpret_cast<const char*>(kernel_base + blob.ki_system_service_start),
+                        KiSystemServiceStartPattern, KiSystemServiceStartMask)) return false;
+
+    return resolve_lea_target(address_of_nonshadow_lea,     0x15) == kernel_base + blob.service_table &&
+           resolve_lea_target(address_of_nonshadow_lea + 7, 0x1d) == kernel_base + blob.service_table_shadow;
   }
 
   auto get_service_descriptor_table() -> std::pair<PKSERVICE_TABLE_DESCRIPTOR, PKSERVICE_TABLE_DESCRIPTOR>
@@ -86,24 +157,6 @@ namespace utils
     PKSERVICE_TABLE_DESCRIPTOR service_descriptor_table      = nullptr,
                                service_descriptor_table_shdw = nullptr;
 
-    // The assembly we'll be interacting with:
-    //
-    // nt!KiSystemServiceStart:
-    // 4889a3d8010000  mov     qword ptr[rbx + 1D8h], rsp
-    // 8bf8            mov     edi, eax
-    // c1ef07          shr     edi, 7
-    // 83e720          and     edi, 20h
-    // 25ff0f0000      and     eax, 0FFFh
-    // nt!KiSystemServiceRepeat:
-    // 4c8d15c7202300  lea     r10, [nt!KeServiceDescriptorTable(fffff800`040c7840)]
-    // 4c8d1d00212300  lea     r11, [nt!KeServiceDescriptorTableShadow
-    constexpr unsigned char KiSystemServiceStartPattern[] = {
-        0x8B, 0xF8,                     // mov edi,eax
-        0xC1, 0xEF, 0x07,               // shr edi,7
-        0x83, 0xE7, 0x20,               // and edi,20h
-        0x25, 0xFF, 0x0F, 0x00, 0x00    // and eax,0fffh  
-    };
-
     uint32_t siganture_size = sizeof KiSystemServiceStartPattern;
 
     // "address_of_nonshadow_lea" will hold the address to this instruction:
@@ -116,14 +169,22 @@ namespace utils
     // 4c8d1d00212300  lea     r11, [nt!KeServiceDescriptorTableShadow
              address_of_shadow_lea    = {};
 
-    uint64_t kernel_base {}, kiSSS_offset{};
-
-    uint64_t relative_offest_shadow {}, relative_offest_nonshadow {};
+    uint64_t kernel_base {};
 
     kernel_base = get_kernelbase_addr();
     if ( kernel_base == 0xdead) return { nullptr, nullptr };
 
-    const auto pattern_result = find_pattern_section(kernel_base, ".text", KiSystemServiceStartPattern, "xxxxxxxxxxx??");
+    // On a cache hit the whole .text scan is skipped
+    if (const auto* blob = cache::cached(); blob != nullptr && verify_cached_offsets(kernel_base, *blob))
+    {
+      return { (PKSERVICE_TABLE_DESCRIPTOR) (kernel_base + blob->service_table),
+               (PKSERVICE_TABLE_DESCRIPTOR) (kernel_base + blob->service_table_shadow) };
+    }
+
+    const auto* kernel_image = pe::kernel_image();
+    if ( kernel_image == nullptr) return { nullptr, nullptr };
+
+    const auto pattern_result = find_pattern_section(*kernel_image, ".text", KiSystemServiceStartPattern, KiSystemServiceStartMask);
     if ( pattern_result == 0) return { nullptr, nullptr };
 
     // 4c8d15c7202300  lea     r10, [nt!KeServiceDescriptorTable(fffff800`040c7840)]
@@ -132,30 +193,15 @@ namespace utils
     // 4c8d1d00212300  lea     r11, [nt!KeServiceDescriptorTableShadow
     address_of_shadow_lea = address_of_nonshadow_lea + 7; // Skip by 7 bytes
 
-    // Check to see if we're managing the right opcodes;
-    //
-    // The "+ 0" was not needed, just added it to be more verbose
-
-    // 4c 8d 15 c7 20 23 00
-    if ( *(unsigned char*) (address_of_nonshadow_lea + 0) == 0x4c &&
-         *(unsigned char*) (address_of_nonshadow_lea + 1) == 0x8d && 
-         *(unsigned char*) (address_of_nonshadow_lea + 2) == 0x15)
-    {
-      relative_offest_nonshadow = *(uint64_t*) (address_of_nonshadow_lea + 3);
-    }
-
-    // 4c 8d 1d 00 21 23 00
-    if ( *(unsigned char*) (address_of_shadow_lea + 0) == 0x4c &&
-         *(unsigned char*) (address_of_shadow_lea + 1) == 0x8d && 
-         *(unsigned char*) (address_of_shadow_lea + 2) == 0x1d)
-    {
-      relative_offest_shadow = *(uint64_t*) (address_of_shadow_lea + 3);
-    }
+    service_descriptor_table      = (PKSERVICE_TABLE_DESCRIPTOR) resolve_lea_target(address_of_nonshadow_lea, 0x15);
+    service_descriptor_table_shdw = (PKSERVICE_TABLE_DESCRIPTOR) resolve_lea_target(address_of_shadow_lea,    0x1d);
 
-    if (!relative_offest_shadow || !relative_offest_nonshadow) return { nullptr, nullptr };
+    if (!service_descriptor_table || !service_descriptor_table_shdw) return { nullptr, nullptr };
 
-    service_descriptor_table = (PKSERVICE_TABLE_DESCRIPTOR) (address_of_nonshadow_lea + relative_offest_nonshadow + 7);
-    service_descriptor_table_shdw = (PKSERVICE_TABLE_DESCRIPTOR)(address_of_shadow_lea + relative_offest_shadow + 7);
+    cache::update(cache::blob_build(get_kernel_identity(kernel_base),
+                                    static_cast<uint32_t>(pattern_result - kernel_base),
+                                    static_cast<uint32_t>((uint64_t) service_descriptor_table      - kernel_base),
+                                    static_cast<uint32_t>((uint64_t) service_descriptor_table_shdw - kernel_base)));
 
     return { service_descriptor_table, service_descriptor_table_shdw };
   }
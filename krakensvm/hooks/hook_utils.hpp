@@ -27,12 +27,13 @@
 
 #include <stdint.h>
 #include <utility>
+#include "offset_cache.hpp"
 
 //#include <windef.h>
 
 typedef  struct _KSYSTEM_SERVICE_TABLE
 {
-  uint64_t* ServiceTableBase;								// The base address of the service function address table   
+  int32_t*  ServiceTableBase;								// The base address of the service table, compressed (offset << 4 | stack args) entries, see "hooks/ssdt.hpp"
   uint64_t* ServiceCounterTableBase; 				// The number of times the SSDT function is called 
   uint64_t  NumberOfService; 								// The number of   service functions PULONG 
   char8_t*  ParamTableBase; 						    // The base address of the service function parameter table    
@@ -49,5 +50,6 @@ typedef  struct _KSERVICE_TABLE_DESCRIPTOR
 namespace utils
 {
   uint64_t get_kernelbase_addr     ();
+  auto get_kernel_identity         (uint64_t kernel_base) -> cache::kernel_identity;
   auto get_service_descriptor_table() -> std::pair<PKSERVICE_TABLE_DESCRIPTOR, PKSERVICE_TABLE_DESCRIPTOR>;
 };
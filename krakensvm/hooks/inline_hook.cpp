@@ -0,0 +1,163 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <inline_hook.hpp>
+#include <hook_transaction.hpp>
+#include <syscall_hook.hpp>
+
+namespace hk::inline_hook
+{
+  //
+  // Kernel code is read-only, it's written through a second mapping of the
+  // same pages
+  //
+
+  auto map_code(void* address, const size_t size, void*& mapping) noexcept -> uint8_t*
+  {
+    mapping = nullptr;
+
+    PMDL mdl = IoAllocateMdl(address, static_cast<ULONG>(size), FALSE, FALSE, nullptr);
+    if (mdl == nullptr) return nullptr;
+
+    __try
+    {
+      MmProbeAndLockPages(mdl, KernelMode, IoReadAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+      IoFreeMdl(mdl);
+      return nullptr;
+    }
+
+    auto* alias = static_cast<uint8_t*>(MmMapLockedPagesSpecifyCache(mdl, KernelMode, MmCached,
+                                                                     nullptr, FALSE, NormalPagePriority));
+
+    if (alias == nullptr || !NT_SUCCESS(MmProtectMdlSystemAddress(mdl, PAGE_READWRITE)))
+    {
+      if (alias != nullptr) MmUnmapLockedPages(alias, mdl);
+
+      MmUnlockPages(mdl);
+      IoFreeMdl(mdl);
+      return nullptr;
+    }
+
+    mapping = mdl;
+    return alias;
+  }
+
+  auto unmap_code(uint8_t* alias, void* mapping) noexcept -> void
+  {
+    if (alias == nullptr || mapping == nullptr) return;
+
+    PMDL mdl = static_cast<PMDL>(mapping);
+
+    MmUnmapLockedPages(alias, mdl);
+    MmUnlockPages(mdl);
+    IoFreeMdl(mdl);
+  }
+
+  auto prepare(hook& entry, void* target, void* detour) noexcept -> trampoline::status
+  {
+    entry = {};
+    entry.target = reinterpret_cast<uint64_t>(target);
+    entry.detour = reinterpret_cast<uint64_t>(detour);
+
+    if (hypervisor_arena == nullptr || !MmIsAddressValid(target)) return trampoline::status::undecodable;
+
+    // The decoder reads whatever it's handed, only hand it the next page if
+    // there is one
+    const uint8_t* code    = static_cast<const uint8_t*>(target);
+    const size_t   room    = PAGE_SIZE - BYTE_OFFSET(target);
+    const size_t available = room >= trampoline::max_stolen ||
+                             MmIsAddressValid(const_cast<uint8_t*>(code + trampoline::max_stolen - 1))
+                           ? trampoline::max_stolen : room;
+
+    // The arena never gives anything back, so the trampoline is built on the
+    // stack against where the arena's next allocation lands and only takes
+    // room in it once it built. The arena isn't locked, like the service
+    // table decoding this runs at PASSIVE_LEVEL with one caller at a time.
+    uint8_t built_code[trampoline::max_size];
+    const uint64_t address = reinterpret_cast<uint64_t>(hypervisor_arena + appended_alloc);
+
+    size_t written = 0;
+    const trampoline::status built = trampoline::build(code, available, entry.target,
+                                                       built_code, sizeof built_code,
+                                                       address, entry.stolen, written);
+    if (built != trampoline::status::ok) return built;
+
+    uint8_t* memory = reinterpret_cast<uint8_t*>(arena_alloc(written));
+    if (memory == nullptr) return trampoline::status::no_room;
+
+    memcpy(memory, built_code, written);
+    entry.trampoline = memory;
+
+    memcpy(entry.original, target, sizeof entry.original);
+    trampoline::emit_jump(entry.patch, entry.detour);
+
+    return trampoline::status::ok;
+  }
+
+  //
+  // A hook on its own is a transaction of one, written from root mode on
+  // every virtualized processor like any other
+  //
+
+  auto install(hook& entry) noexcept -> bool
+  {
+    if (entry.trampoline == nullptr || entry.installed) return entry.installed;
+
+    transaction::batch single;
+    if (!transaction::begin(single, 1)) return false;
+
+    // commit() marks the hook installed
+    if (transaction::stage_hook(single, entry) != nullptr) transaction::commit(single);
+
+    transaction::end(single);
+    return entry.installed;
+  }
+
+  auto remove(hook& entry) noexcept -> bool
+  {
+    if (!entry.installed) return true;
+
+    transaction::batch single;
+    if (!transaction::begin(single, 1)) return false;
+
+    // The trampoline stays, a thread may still be on its way through it
+    transaction::item* restore = transaction::stage_patch(single, reinterpret_cast<void*>(entry.target),
+                                                          entry.original, sizeof entry.original);
+
+    if (restore != nullptr)
+    {
+      // Only over our own jump, not whatever somebody put there since
+      memcpy(restore->expected, entry.patch, sizeof entry.patch);
+      entry.installed = !transaction::commit(single);
+    }
+
+    transaction::end(single);
+    return !entry.installed;
+  }
+}; // namespace hk::inline_hook
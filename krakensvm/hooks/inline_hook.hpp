@@ -0,0 +1,79 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <trampoline.hpp>
+
+//
+// Inline hooks
+//
+// prepare() sizes the stolen range of the target with the length decoder
+// and builds its trampoline out of the hypervisor arena, install() then
+// replaces the start of the target with an absolute jump to the detour.
+// The detour reaches the original function through original<>().
+//
+// install() and remove() are single item transactions ("hooks/
+// hook_transaction.hpp"): the jump is written through an MDL alias of the
+// target pages while every other processor waits in root mode, so none of
+// them can fetch a half written jump. A thread that was preempted inside
+// the stolen bytes still resumes in the middle of the jump, hooks are
+// expected on function entries nobody sleeps in. Several hooks go in
+// cheaper as one transaction::batch.
+//
+
+namespace hk::inline_hook
+{
+  struct hook
+  {
+    uint64_t target;
+    uint64_t detour;
+    uint8_t* trampoline;                              // hypervisor arena, never freed
+    size_t   stolen;
+
+    uint8_t  original[trampoline::jump_size];         // what the jump replaced
+    uint8_t  patch[trampoline::jump_size];
+
+    bool     installed;
+  };
+
+  auto prepare   (hook& entry, void* target, void* detour) noexcept -> trampoline::status;
+  auto install   (hook& entry) noexcept -> bool;
+  auto remove    (hook& entry) noexcept -> bool;
+
+  // Writable alias of kernel code, mapping is what unmap_code needs back
+  auto map_code  (void* address, size_t size, void*& mapping) noexcept -> uint8_t*;
+  auto unmap_code(uint8_t* alias, void* mapping) noexcept -> void;
+
+  template<class fn_t>
+  auto original(const hook& entry) noexcept -> fn_t
+  {
+    return reinterpret_cast<fn_t>(entry.trampoline);
+  }
+
+}; // namespace hk::inline_hook
@@ -0,0 +1,108 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <offset_cache.hpp>
+#include <hook_utils.hpp>
+
+namespace utils::cache
+{
+  // Name of the REG_BINARY value under the driver's service key
+  static UNICODE_STRING cache_value_name = RTL_CONSTANT_STRING(L"OffsetCache");
+
+  static offset_blob cached_blob {};
+  static bool        cache_hit   = false,
+                     cache_dirty = false;
+
+  static auto open_service_key(PUNICODE_STRING registry_path, ACCESS_MASK access, HANDLE& key) noexcept -> bool
+  {
+    OBJECT_ATTRIBUTES attributes;
+
+    InitializeObjectAttributes(&attributes, registry_path,
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr, nullptr);
+
+    return NT_SUCCESS(ZwOpenKey(&key, access, &attributes));
+  }
+
+  auto load(PUNICODE_STRING registry_path) noexcept -> void
+  {
+    HANDLE key = nullptr;
+    ULONG result_length = {};
+
+    // KEY_VALUE_PARTIAL_INFORMATION already holds one byte of Data
+    uint8_t buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(offset_blob)] = {};
+    auto* information = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(buffer);
+
+    cache_hit = false;
+
+    if (registry_path == nullptr) return;
+
+    const uint64_t kernel_base = get_kernelbase_addr();
+    if (kernel_base == 0xdead) return;
+
+    if (!open_service_key(registry_path, KEY_QUERY_VALUE, key)) return;
+
+    const NTSTATUS status = ZwQueryValueKey(key, &cache_value_name, KeyValuePartialInformation,
+                                           information, sizeof buffer, &result_length);
+    ZwClose(key);
+
+    if (!NT_SUCCESS(status) || information->Type != REG_BINARY) return;
+
+    cache_hit = blob_validate(information->Data, information->DataLength,
+                              get_kernel_identity(kernel_base), cached_blob);
+
+    kprint_info("Offset cache %s\n", cache_hit ? "hit" : "miss");
+  }
+
+  auto store(PUNICODE_STRING registry_path) noexcept -> void
+  {
+    HANDLE key = nullptr;
+
+    if (!cache_dirty || registry_path == nullptr) return;
+
+    if (!open_service_key(registry_path, KEY_SET_VALUE, key)) return;
+
+    if (NT_SUCCESS(ZwSetValueKey(key, &cache_value_name, 0, REG_BINARY,
+                                 &cached_blob, sizeof(offset_blob))))
+    {
+      cache_dirty = false;
+    }
+
+    ZwClose(key);
+  }
+
+  auto cached() noexcept -> const offset_blob*
+  {
+    return cache_hit ? &cached_blob : nullptr;
+  }
+
+  auto update(const offset_blob& blob) noexcept -> void
+  {
+    cached_blob = blob;
+    cache_hit   = true;
+    cache_dirty = true;
+  }
+
+}; // namespace utils::cache
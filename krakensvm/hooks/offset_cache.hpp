@@ -0,0 +1,188 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct _UNICODE_STRING;
+
+//
+// Persistent KiSystemServiceStart / KeServiceDescriptorTable(Shadow) offset cache.
+//
+// The blob is stored as a REG_BINARY value under the driver's service key and is
+// keyed by the identity of the loaded ntoskrnl (TimeDateStamp, SizeOfImage and
+// CheckSum out of the PE headers). Everything in here is free of any WDK headers
+// so the format and its validation can be compiled and exercised in user mode.
+//
+
+namespace utils::cache
+{
+  constexpr uint32_t blob_magic   = 0x424f434b; // "KCOB", Kraken Cached Offset Blob
+  constexpr uint16_t blob_version = 1;
+
+  //
+  // The identity of the loaded kernel image, pulled from IMAGE_NT_HEADERS
+  //
+
+  struct kernel_identity
+  {
+    uint32_t time_date_stamp;
+    uint32_t size_of_image;
+    uint32_t checksum;
+  };
+
+  //
+  // Every offset is relative to the kernel base (RVA)
+  //
+
+#pragma pack(push, 1)
+  struct offset_blob
+  {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length;                  // sizeof(offset_blob), lets later versions grow the blob
+
+    kernel_identity identity;
+
+    uint32_t ki_system_service_start; // RVA of the KiSystemServiceStart signature
+    uint32_t service_table;           // RVA of nt!KeServiceDescriptorTable
+    uint32_t service_table_shadow;    // RVA of nt!KeServiceDescriptorTableShadow
+
+    uint32_t integrity;               // FNV-1a over every byte above this member
+  };
+#pragma pack(pop)
+
+  static_assert(sizeof(offset_blob) == 36,
+                  "Size of the offset cache blob changed, bump blob_version");
+
+  //
+  // Bytes verify_cached_offsets() reads at ki_system_service_start: the 13
+  // byte signature and the two 7 byte lea's right after it
+  //
+
+  constexpr uint32_t signature_size = 13;
+  constexpr uint32_t verified_span  = signature_size + 2 * 7;
+
+  //
+  // FNV-1a, 32 bit
+  //
+
+  constexpr auto fnv1a(const uint8_t* data, size_t size) noexcept -> uint32_t
+  {
+    uint32_t hash = 0x811c9dc5;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+      hash ^= data[i];
+      hash *= 0x01000193;
+    }
+
+    return hash;
+  }
+
+  inline auto blob_integrity(const offset_blob& blob) noexcept -> uint32_t
+  {
+    return fnv1a(reinterpret_cast<const uint8_t*>(&blob), offsetof(offset_blob, integrity));
+  }
+
+  inline auto blob_build(const kernel_identity& identity,
+                         uint32_t ki_system_service_start,
+                         uint32_t service_table,
+                         uint32_t service_table_shadow) noexcept -> offset_blob
+  {
+    offset_blob blob {};
+
+    blob.magic    = blob_magic;
+    blob.version  = blob_version;
+    blob.length   = sizeof(offset_blob);
+    blob.identity = identity;
+
+    blob.ki_system_service_start = ki_system_service_start;
+    blob.service_table           = service_table;
+    blob.service_table_shadow    = service_table_shadow;
+
+    blob.integrity = blob_integrity(blob);
+
+    return blob;
+  }
+
+  //
+  // Validates a raw blob read back from the registry. The blob is only accepted
+  // when the header, the integrity hash and the kernel identity all match, and
+  // every offset lands inside of the image, along with everything read there.
+  //
+
+  inline auto blob_validate(const void* data, size_t size,
+                            const kernel_identity& identity,
+                            offset_blob& out) noexcept -> bool
+  {
+    if (data == nullptr || size != sizeof(offset_blob)) return false;
+
+    offset_blob blob {};
+    const auto* source = static_cast<const uint8_t*>(data);
+    auto* destination  = reinterpret_cast<uint8_t*>(&blob);
+
+    for (size_t i = 0; i < sizeof(offset_blob); ++i) destination[i] = source[i];
+
+    if (blob.magic   != blob_magic   ||
+        blob.version != blob_version ||
+        blob.length  != sizeof(offset_blob)) return false;
+
+    if (blob.integrity != blob_integrity(blob)) return false;
+
+    if (blob.identity.time_date_stamp != identity.time_date_stamp ||
+        blob.identity.size_of_image   != identity.size_of_image   ||
+        blob.identity.checksum        != identity.checksum) return false;
+
+    if (blob.ki_system_service_start == 0 ||
+        blob.ki_system_service_start > identity.size_of_image ||
+        identity.size_of_image - blob.ki_system_service_start < verified_span ||
+        blob.service_table           == 0 || blob.service_table           >= identity.size_of_image ||
+        blob.service_table_shadow    == 0 || blob.service_table_shadow    >= identity.size_of_image)
+      return false;
+
+    out = blob;
+    return true;
+  }
+
+  //
+  // Driver side, the registry plumbing lives in "hooks/offset_cache.cpp"
+  //
+
+  // Reads the blob out of the driver's service key, call from driver_entry
+  auto load  (_UNICODE_STRING* registry_path) noexcept -> void;
+
+  // Writes the blob back if the scanner produced a new one
+  auto store (_UNICODE_STRING* registry_path) noexcept -> void;
+
+  // Returns the blob read at load time, or nullptr on a cache miss
+  auto cached() noexcept -> const offset_blob*;
+
+  // Hands a freshly scanned blob to the cache, persisted on the next store()
+  auto update(const offset_blob& blob) noexcept -> void;
+
+}; // namespace utils::cache
@@ -72,6 +72,23 @@ extern "C"
       _Out_ PUNICODE_STRING DestinationString,
       _In_opt_z_ __drv_aliasesMem PCWSTR SourceString
     );
+
+  // Imported straight out of ntoskrnl, so taking its address goes through the
+  // import table and lands inside of the kernel image
+  NTSYSAPI
+    PVOID
+    NTAPI
+    RtlPcToFileHeader(
+      _In_  PVOID  PcValue,
+      _Out_ PVOID* BaseOfImage
+    );
+
+  NTSYSAPI
+    BOOLEAN
+    NTAPI
+    MmIsAddressValid(
+      _In_ PVOID VirtualAddress
+    );
 }
 
 // PE header manager
@@ -0,0 +1,94 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <paging.hpp>
+#include <pe_image.hpp>
+#include <hook_utils.hpp>
+
+using namespace ia32e;
+
+namespace pe
+{
+  //
+  // ntoskrnl is indexed once, the first time anything asks for it (PASSIVE_LEVEL,
+  // from the syscall hook construction) and stays around until driver unload.
+  //
+
+  static image kernel_image_instance;
+  static void* kernel_image_storage = nullptr;
+  static bool  kernel_image_ready   = false;
+
+  auto kernel_image() noexcept -> const image*
+  {
+    if (kernel_image_ready) return &kernel_image_instance;
+
+    const uint64_t kernel_base = utils::get_kernelbase_addr();
+    if (kernel_base == 0xdead) return nullptr;
+
+    // The kernel is a loaded module, so the size comes out of SizeOfImage
+    if (!kernel_image_instance.parse(reinterpret_cast<const void*>(kernel_base), 0, layout::mapped))
+    {
+      return nullptr;
+    }
+
+    const size_t storage_size = kernel_image_instance.index_size();
+
+    kernel_image_storage = storage_size ? mm::system_aligned_alloc(storage_size) : nullptr;
+    if (storage_size && kernel_image_storage == nullptr) return nullptr;
+
+    if (!kernel_image_instance.build_index(kernel_image_storage, storage_size))
+    {
+      release_kernel_image();
+      return nullptr;
+    }
+
+    kprint_info("ntoskrnl indexed: %u sections, %u exports, %u functions\n",
+                kernel_image_instance.section_count(),
+                kernel_image_instance.export_count(),
+                kernel_image_instance.function_count());
+
+    // Colliding names are left unresolvable rather than resolving to the wrong routine
+    if (kernel_image_instance.hash_collisions() != 0)
+    {
+      kprint_info("ntoskrnl has %u colliding export hashes\n", kernel_image_instance.hash_collisions());
+    }
+
+    kernel_image_ready = true;
+    return &kernel_image_instance;
+  }
+
+  auto release_kernel_image() noexcept -> void
+  {
+    if (kernel_image_storage != nullptr)
+    {
+      system_free_alloc(kernel_image_storage);
+      kernel_image_storage = nullptr;
+    }
+
+    kernel_image_instance = image {};
+    kernel_image_ready    = false;
+  }
+};
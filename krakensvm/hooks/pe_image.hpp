@@ -0,0 +1,679 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Indexed PE image model
+//
+// A pe::image is built once per module. Sections are indexed by their packed
+// 8 byte name, named exports by a 64 bit FNV-1a hash of the name and .pdata
+// RUNTIME_FUNCTION entries are kept sorted so a pc can be binary searched.
+// The structures below mirror winnt.h under different names, so the image
+// model can be parsed out of a memory-mapped file in user mode as well as out
+// of a loaded module in the kernel.
+//
+
+namespace pe
+{
+  //
+  // PE32+ layouts
+  //
+
+  constexpr uint16_t dos_signature      = 0x5a4d;     // MZ
+  constexpr uint32_t nt_signature       = 0x00004550; // PE\0\0
+  constexpr uint16_t optional_magic_64  = 0x20b;
+
+  constexpr uint32_t directory_export    = 0;
+  constexpr uint32_t directory_exception = 3;
+
+  struct dos_header_t
+  {
+    uint16_t e_magic;
+    uint16_t e_unused[29];
+    int32_t  e_lfanew;
+  };
+
+  struct file_header_t
+  {
+    uint16_t machine;
+    uint16_t number_of_sections;
+    uint32_t time_date_stamp;
+    uint32_t pointer_to_symbol_table;
+    uint32_t number_of_symbols;
+    uint16_t size_of_optional_header;
+    uint16_t characteristics;
+  };
+
+  struct data_directory_t
+  {
+    uint32_t virtual_address;
+    uint32_t size;
+  };
+
+  struct optional_header64_t
+  {
+    uint16_t magic;
+    uint8_t  major_linker_version;
+    uint8_t  minor_linker_version;
+    uint32_t size_of_code;
+    uint32_t size_of_initialized_data;
+    uint32_t size_of_uninitialized_data;
+    uint32_t address_of_entry_point;
+    uint32_t base_of_code;
+    uint64_t image_base;
+    uint32_t section_alignment;
+    uint32_t file_alignment;
+    uint16_t major_os_version;
+    uint16_t minor_os_version;
+    uint16_t major_image_version;
+    uint16_t minor_image_version;
+    uint16_t major_subsystem_version;
+    uint16_t minor_subsystem_version;
+    uint32_t win32_version_value;
+    uint32_t size_of_image;
+    uint32_t size_of_headers;
+    uint32_t checksum;
+    uint16_t subsystem;
+    uint16_t dll_characteristics;
+    uint64_t size_of_stack_reserve;
+    uint64_t size_of_stack_commit;
+    uint64_t size_of_heap_reserve;
+    uint64_t size_of_heap_commit;
+    uint32_t loader_flags;
+    uint32_t number_of_rva_and_sizes;
+    data_directory_t data_directory[16];
+  };
+
+  struct nt_headers64_t
+  {
+    uint32_t            signature;
+    file_header_t       file_header;
+    optional_header64_t optional_header;
+  };
+
+  struct section_header_t
+  {
+    char     name[8];
+    uint32_t virtual_size;
+    uint32_t virtual_address;
+    uint32_t size_of_raw_data;
+    uint32_t pointer_to_raw_data;
+    uint32_t pointer_to_relocations;
+    uint32_t pointer_to_linenumbers;
+    uint16_t number_of_relocations;
+    uint16_t number_of_linenumbers;
+    uint32_t characteristics;
+  };
+
+  struct export_directory_t
+  {
+    uint32_t characteristics;
+    uint32_t time_date_stamp;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint32_t name;
+    uint32_t base;
+    uint32_t number_of_functions;
+    uint32_t number_of_names;
+    uint32_t address_of_functions;
+    uint32_t address_of_names;
+    uint32_t address_of_name_ordinals;
+  };
+
+  struct runtime_function_t
+  {
+    uint32_t begin_address;
+    uint32_t end_address;
+    uint32_t unwind_data;
+  };
+
+  static_assert(sizeof(dos_header_t)        == 0x40,  "Size of the DOS header is not Valid");
+  static_assert(sizeof(file_header_t)       == 0x14,  "Size of the File header is not Valid");
+  static_assert(sizeof(optional_header64_t) == 0xf0,  "Size of the Optional header is not Valid");
+  static_assert(sizeof(nt_headers64_t)      == 0x108, "Size of the NT headers is not Valid");
+  static_assert(sizeof(section_header_t)    == 0x28,  "Size of the Section header is not Valid");
+  static_assert(sizeof(export_directory_t)  == 0x28,  "Size of the Export directory is not Valid");
+  static_assert(sizeof(runtime_function_t)  == 0xc,   "Size of the RUNTIME_FUNCTION is not Valid");
+
+  //
+  // FNV-1a, 64 bit, used to index the export names
+  //
+
+  constexpr uint64_t fnv_offset_basis = 0xcbf29ce484222325;
+  constexpr uint64_t fnv_prime        = 0x00000100000001b3;
+
+  constexpr auto name_hash(const char* name) noexcept -> uint64_t
+  {
+    uint64_t hash = fnv_offset_basis;
+
+    for (; *name; ++name)
+    {
+      hash ^= static_cast<uint8_t>(*name);
+      hash *= fnv_prime;
+    }
+
+    return hash;
+  }
+
+  inline namespace literals
+  {
+    //
+    // "RtlPcToFileHeader"_h, the name is hashed by the compiler so only the
+    // 64 bit integer ends up in the binary
+    //
+
+    consteval auto operator""_h(const char* name, size_t length) noexcept -> uint64_t
+    {
+      uint64_t hash = fnv_offset_basis;
+
+      for (size_t i = 0; i < length; ++i)
+      {
+        hash ^= static_cast<uint8_t>(name[i]);
+        hash *= fnv_prime;
+      }
+
+      return hash;
+    }
+  };
+
+  static_assert("RtlPcToFileHeader"_h == name_hash("RtlPcToFileHeader"),
+                  "Compile-time and run-time export hashes have to agree");
+
+  // Packs up to 8 characters of a section name into an integer key
+  constexpr auto section_key(const char* name) noexcept -> uint64_t
+  {
+    uint64_t key = 0;
+
+    for (uint32_t i = 0; i < 8 && name[i]; ++i)
+    {
+      key |= static_cast<uint64_t>(static_cast<uint8_t>(name[i])) << (i * 8);
+    }
+
+    return key;
+  }
+
+  namespace detail
+  {
+    // In-place heap sort, there is no STL to lean on in the kernel
+    template<class T, class Less>
+    auto heap_sort(T* items, size_t count, Less less) noexcept -> void
+    {
+      auto sift_down = [&](size_t root, size_t end)
+      {
+        while (root * 2 + 1 < end)
+        {
+          size_t child = root * 2 + 1;
+
+          if (child + 1 < end && less(items[child], items[child + 1])) ++child;
+          if (!less(items[root], items[child])) return;
+
+          T temp = items[root]; items[root] = items[child]; items[child] = temp;
+          root = child;
+        }
+      };
+
+      if (count < 2) return;
+
+      for (size_t start = count / 2; start-- > 0;) sift_down(start, count);
+
+      for (size_t end = count - 1; end > 0; --end)
+      {
+        T temp = items[0]; items[0] = items[end]; items[end] = temp;
+        sift_down(0, end);
+      }
+    }
+  };
+
+  //
+  // Whether the image bytes are laid out like a loaded module (RVA == offset)
+  // or like the raw file on disk (RVA has to go through the section table)
+  //
+
+  enum class layout : uint8_t
+  {
+    mapped,
+    file
+  };
+
+  struct section_entry_t
+  {
+    uint64_t                key;
+    const section_header_t* header;
+  };
+
+  struct export_entry_t
+  {
+    uint64_t hash;
+    uint32_t rva;
+    uint32_t ordinal;
+  };
+
+  class image
+  {
+  public:
+    image() noexcept = default;
+
+    //
+    // Validates the headers. For a mapped image, a size of 0 means the size is
+    // taken from SizeOfImage.
+    //
+
+    auto parse(const void* base, size_t size, layout kind) noexcept -> bool
+    {
+      *this = image {};
+
+      base_ = static_cast<const uint8_t*>(base);
+      size_ = size;
+      kind_ = kind;
+
+      if (base_ == nullptr) return false;
+      if (size_ != 0 && size_ < sizeof(dos_header_t)) return false;
+
+      const auto* dos_header = reinterpret_cast<const dos_header_t*>(base_);
+      if (dos_header->e_magic != dos_signature || dos_header->e_lfanew <= 0) return false;
+
+      if (size_ != 0 && static_cast<size_t>(dos_header->e_lfanew) + sizeof(nt_headers64_t) > size_) return false;
+
+      nt_headers_ = reinterpret_cast<const nt_headers64_t*>(base_ + dos_header->e_lfanew);
+
+      if (nt_headers_->signature != nt_signature ||
+          nt_headers_->optional_header.magic != optional_magic_64) return false;
+
+      if (size_ == 0)
+      {
+        if (kind_ != layout::mapped) return false;
+        size_ = nt_headers_->optional_header.size_of_image;
+      }
+
+      sections_ = reinterpret_cast<const section_header_t*>(
+        reinterpret_cast<const uint8_t*>(&nt_headers_->optional_header) + nt_headers_->file_header.size_of_optional_header);
+      section_count_ = nt_headers_->file_header.number_of_sections;
+
+      if (reinterpret_cast<const uint8_t*>(sections_ + section_count_) > base_ + size_) return false;
+
+      // Export directory
+      if (const auto* directory = data_directory(directory_export); directory && directory->size)
+      {
+        exports_ = reinterpret_cast<const export_directory_t*>(rva_to_pointer(directory->virtual_address, sizeof(export_directory_t)));
+
+        if (exports_ != nullptr)
+        {
+          export_begin_  = directory->virtual_address;
+          export_end_    = directory->virtual_address + directory->size;
+          names_         = reinterpret_cast<const uint32_t*>(rva_to_pointer(exports_->address_of_names,         exports_->number_of_names     * sizeof(uint32_t)));
+          name_ordinals_ = reinterpret_cast<const uint16_t*>(rva_to_pointer(exports_->address_of_name_ordinals, exports_->number_of_names     * sizeof(uint16_t)));
+          functions_     = reinterpret_cast<const uint32_t*>(rva_to_pointer(exports_->address_of_functions,     exports_->number_of_functions * sizeof(uint32_t)));
+
+          if (!names_ || !name_ordinals_ || !functions_) exports_ = nullptr;
+        }
+      }
+
+      // Exception directory (.pdata), the PE specification requires it to be
+      // sorted by BeginAddress, a copy is only sorted when a linker didn't
+      if (const auto* directory = data_directory(directory_exception); directory && directory->size)
+      {
+        const uint32_t count = directory->size / sizeof(runtime_function_t);
+
+        functions_table_ = reinterpret_cast<const runtime_function_t*>(rva_to_pointer(directory->virtual_address, count * sizeof(runtime_function_t)));
+
+        if (functions_table_ != nullptr)
+        {
+          function_count_  = count;
+          functions_sorted_ = true;
+
+          for (uint32_t i = 1; i < count; ++i)
+          {
+            if (functions_table_[i - 1].begin_address > functions_table_[i].begin_address)
+            {
+              functions_sorted_ = false;
+              break;
+            }
+          }
+        }
+      }
+
+      return true;
+    }
+
+    // Bytes of storage the caller has to hand to build_index()
+    auto index_size() const noexcept -> size_t
+    {
+      size_t bytes = section_count_ * sizeof(section_entry_t);
+
+      if (exports_ != nullptr) bytes += exports_->number_of_names * sizeof(export_entry_t);
+      if (!functions_sorted_)  bytes += function_count_ * sizeof(runtime_function_t);
+
+      return bytes;
+    }
+
+    //
+    // Builds the lookup tables into caller owned storage, which has to outlive
+    // the image. Nothing is allocated in here.
+    //
+
+    auto build_index(void* storage, size_t storage_size) noexcept -> bool
+    {
+      if (nt_headers_ == nullptr || storage_size < index_size()) return false;
+      if (index_size() != 0 && storage == nullptr) return false;
+
+      auto* cursor = static_cast<uint8_t*>(storage);
+
+      // Sections, sorted by packed name, ties broken on table order so the first
+      // section of a given name wins, the same as walking the table
+      section_index_ = reinterpret_cast<section_entry_t*>(cursor);
+      cursor += section_count_ * sizeof(section_entry_t);
+
+      for (uint32_t i = 0; i < section_count_; ++i)
+      {
+        uint64_t key = 0;
+        for (uint32_t j = 0; j < 8; ++j) key |= static_cast<uint64_t>(static_cast<uint8_t>(sections_[i].name[j])) << (j * 8);
+
+        section_index_[i] = { key, &sections_[i] };
+      }
+
+      detail::heap_sort(section_index_, section_count_,
+        [](const section_entry_t& a, const section_entry_t& b)
+        { return a.key < b.key || (a.key == b.key && a.header < b.header); });
+
+      // Named exports, sorted by hash
+      if (exports_ != nullptr)
+      {
+        export_index_ = reinterpret_cast<export_entry_t*>(cursor);
+        cursor += exports_->number_of_names * sizeof(export_entry_t);
+
+        for (uint32_t i = 0; i < exports_->number_of_names; ++i)
+        {
+          const uint16_t function_index = name_ordinals_[i];
+          const uint32_t rva = function_index < exports_->number_of_functions ? functions_[function_index] : 0;
+
+          export_index_[export_count_++] = { bounded_hash(names_[i]), rva, exports_->base + function_index };
+        }
+
+        detail::heap_sort(export_index_, export_count_,
+          [](const export_entry_t& a, const export_entry_t& b) { return a.hash < b.hash; });
+
+        for (uint32_t i = 1; i < export_count_; ++i)
+        {
+          if (export_index_[i - 1].hash == export_index_[i].hash) ++hash_collisions_;
+        }
+      }
+
+      // .pdata copy, only when the table on the image isn't sorted already
+      if (!functions_sorted_ && function_count_ != 0)
+      {
+        auto* sorted = reinterpret_cast<runtime_function_t*>(cursor);
+
+        for (uint32_t i = 0; i < function_count_; ++i) sorted[i] = functions_table_[i];
+
+        detail::heap_sort(sorted, function_count_,
+          [](const runtime_function_t& a, const runtime_function_t& b) { return a.begin_address < b.begin_address; });
+
+        functions_table_  = sorted;
+        functions_sorted_ = true;
+      }
+
+      indexed_ = true;
+      return true;
+    }
+
+    //
+    // Lookups
+    //
+
+    auto section(const char* name) const noexcept -> const section_header_t*
+    {
+      if (!indexed_ || name == nullptr) return nullptr;
+
+      const uint64_t key = section_key(name);
+      size_t low = 0, high = section_count_;
+
+      while (low < high)
+      {
+        const size_t middle = low + (high - low) / 2;
+
+        if (section_index_[middle].key < key) low = middle + 1;
+        else high = middle;
+      }
+
+      return low < section_count_ && section_index_[low].key == key ? section_index_[low].header : nullptr;
+    }
+
+    //
+    // RVA of the named export, 0 if it isn't there. A hash shared by two names
+    // is ambiguous and never resolves, build_index() counts those up front.
+    //
+
+    auto export_by_hash(const uint64_t hash) const noexcept -> uint32_t
+    {
+      if (!indexed_) return 0;
+
+      size_t low = 0, high = export_count_;
+
+      while (low < high)
+      {
+        const size_t middle = low + (high - low) / 2;
+
+        if (export_index_[middle].hash < hash) low = middle + 1;
+        else high = middle;
+      }
+
+      if (low >= export_count_ || export_index_[low].hash != hash) return 0;
+      if (low + 1 < export_count_ && export_index_[low + 1].hash == hash) return 0;
+
+      return export_index_[low].rva;
+    }
+
+    auto export_by_name(const char* name) const noexcept -> uint32_t
+    {
+      return name ? export_by_hash(name_hash(name)) : 0;
+    }
+
+    // RVA of the export at the biased ordinal, 0 if it isn't there
+    auto export_by_ordinal(const uint32_t ordinal) const noexcept -> uint32_t
+    {
+      if (exports_ == nullptr || ordinal < exports_->base) return 0;
+
+      const uint32_t function_index = ordinal - exports_->base;
+
+      return function_index < exports_->number_of_functions ? functions_[function_index] : 0;
+    }
+
+    // Exports that land inside of the export directory are forwarder strings
+    auto is_forwarder(const uint32_t rva) const noexcept -> bool
+    {
+      return rva >= export_begin_ && rva < export_end_;
+    }
+
+    //
+    // Stands in for RtlLookupFunctionEntry, returns the RUNTIME_FUNCTION whose
+    // [BeginAddress, EndAddress) covers the RVA
+    //
+
+    auto lookup_function(const uint32_t rva) const noexcept -> const runtime_function_t*
+    {
+      if (!functions_sorted_ || function_count_ == 0) return nullptr;
+
+      // First entry with a BeginAddress above the RVA, the candidate is the one before
+      size_t low = 0, high = function_count_;
+
+      while (low < high)
+      {
+        const size_t middle = low + (high - low) / 2;
+
+        if (functions_table_[middle].begin_address <= rva) low = middle + 1;
+        else high = middle;
+      }
+
+      if (low == 0) return nullptr;
+
+      const auto* entry = &functions_table_[low - 1];
+      return rva < entry->end_address ? entry : nullptr;
+    }
+
+    //
+    // Translates an RVA into a pointer into the image bytes, nullptr when the
+    // [rva, rva + length) range is not backed by the image
+    //
+
+    auto rva_to_pointer(const uint32_t rva, const size_t length = 1) const noexcept -> const uint8_t*
+    {
+      if (base_ == nullptr) return nullptr;
+
+      if (kind_ == layout::mapped)
+      {
+        return static_cast<size_t>(rva) + length <= size_ ? base_ + rva : nullptr;
+      }
+
+      if (nt_headers_ != nullptr && rva < nt_headers_->optional_header.size_of_headers)
+      {
+        return static_cast<size_t>(rva) + length <= size_ ? base_ + rva : nullptr;
+      }
+
+      for (uint32_t i = 0; i < section_count_; ++i)
+      {
+        const auto& header = sections_[i];
+
+        if (rva >= header.virtual_address && rva - header.virtual_address < header.size_of_raw_data)
+        {
+          const size_t offset = static_cast<size_t>(header.pointer_to_raw_data) + (rva - header.virtual_address);
+
+          if (rva - header.virtual_address + length > header.size_of_raw_data || offset + length > size_) return nullptr;
+
+          return base_ + offset;
+        }
+      }
+
+      return nullptr;
+    }
+
+    auto data_directory(const uint32_t index) const noexcept -> const data_directory_t*
+    {
+      if (nt_headers_ == nullptr || index >= nt_headers_->optional_header.number_of_rva_and_sizes || index >= 16) return nullptr;
+
+      return &nt_headers_->optional_header.data_directory[index];
+    }
+
+    auto base()            const noexcept -> const uint8_t*        { return base_; }
+    auto size()            const noexcept -> size_t                { return size_; }
+    auto nt_headers()      const noexcept -> const nt_headers64_t* { return nt_headers_; }
+    auto section_count()   const noexcept -> uint32_t              { return section_count_; }
+    auto export_count()    const noexcept -> uint32_t              { return export_count_; }
+    auto function_count()  const noexcept -> uint32_t              { return function_count_; }
+    auto hash_collisions() const noexcept -> uint32_t              { return hash_collisions_; }
+    auto indexed()         const noexcept -> bool                  { return indexed_; }
+
+  private:
+    // Hashes an export name without reading past the end of the image
+    auto bounded_hash(const uint32_t rva) const noexcept -> uint64_t
+    {
+      const uint8_t* name = rva_to_pointer(rva);
+      if (name == nullptr) return 0;
+
+      const uint8_t* end = base_ + size_;
+      uint64_t hash = fnv_offset_basis;
+
+      for (; name < end && *name; ++name)
+      {
+        hash ^= *name;
+        hash *= fnv_prime;
+      }
+
+      return hash;
+    }
+
+    const uint8_t*            base_            = nullptr;
+    size_t                    size_            = 0;
+    layout                    kind_            = layout::mapped;
+
+    const nt_headers64_t*     nt_headers_      = nullptr;
+    const section_header_t*   sections_        = nullptr;
+    uint32_t                  section_count_   = 0;
+
+    const export_directory_t* exports_         = nullptr;
+    const uint32_t*           names_           = nullptr;
+    const uint16_t*           name_ordinals_   = nullptr;
+    const uint32_t*           functions_       = nullptr;
+    uint32_t                  export_begin_    = 0,
+                              export_end_      = 0;
+
+    const runtime_function_t* functions_table_ = nullptr;
+    uint32_t                  function_count_  = 0;
+    bool                      functions_sorted_ = true;
+
+    section_entry_t*          section_index_   = nullptr;
+    export_entry_t*           export_index_    = nullptr;
+    uint32_t                  export_count_    = 0;
+    uint32_t                  hash_collisions_ = 0;
+    bool                      indexed_         = false;
+  };
+
+  //
+  // The loaded ntoskrnl, built once on first use, located in "hooks/pe_image.cpp"
+  //
+
+  auto kernel_image()         noexcept -> const image*;
+  auto release_kernel_image() noexcept -> void;
+
+  //
+  // Resolves an export of the module by hash. Forwarders aren't followed.
+  //
+
+  template<uint64_t hash, class T = void*>
+  auto resolve(const image& module) noexcept -> T
+  {
+    const uint32_t rva = module.export_by_hash(hash);
+    if (rva == 0 || module.is_forwarder(rva)) return T {};
+
+    // Through the section table for a file, the same as base + rva once mapped
+    return reinterpret_cast<T>(const_cast<uint8_t*>(module.rva_to_pointer(rva)));
+  }
+
+  //
+  // Resolves an ntoskrnl export by hash, i.e. resolve<"KeQueryNodeActiveAffinity2"_h>(),
+  // for routines not every supported kernel exports. Every hash instantiates its
+  // own cache slot, so after the first hit this is a single load. Not for
+  // RtlPcToFileHeader, finding the kernel base to index depends on it.
+  //
+
+  template<uint64_t hash, class T = void*>
+  auto resolve() noexcept -> T
+  {
+    static T cached {};
+
+    if (cached == T {})
+    {
+      const auto* kernel = kernel_image();
+      if (kernel == nullptr) return T {};
+
+      cached = resolve<hash, T>(*kernel);
+    }
+
+    return cached;
+  }
+};
@@ -0,0 +1,113 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+//
+// KiServiceTable decoding
+//
+// On x64 every entry of a service table is a 32 bit value: the signed offset
+// of the handler from the start of the table shifted left by 4, and the number
+// of arguments passed on the stack in the low 4 bits.
+//
+//   handler    = table_base + (entry >> 4)   (arithmetic shift)
+//   stack_args = entry & 0xf
+//
+// The decoder only reads the entries it is handed and never dereferences
+// table_base, so a table captured out of a dump decodes the same way.
+//
+
+namespace hk::ssdt
+{
+  // Syscall numbers carry the table index in bit 12, 0 for ntoskrnl, 1 for win32k
+  constexpr uint32_t table_shift  = 12;
+  constexpr uint32_t index_mask   = 0xfff;
+  constexpr uint32_t max_services = index_mask + 1;
+
+  constexpr auto decode_handler(const uint64_t table_base, const int32_t entry) noexcept -> uint64_t
+  {
+    return table_base + static_cast<int64_t>(entry >> 4);
+  }
+
+  constexpr auto decode_stack_args(const int32_t entry) noexcept -> uint8_t
+  {
+    return static_cast<uint8_t>(entry & 0xf);
+  }
+
+  //
+  // Decodes `count` entries into a dense array of absolute handler addresses and
+  // a parallel array of stack argument counts. Four entries go through per
+  // iteration with SSE2, which every x64 processor has.
+  //
+
+  inline auto decode(const int32_t* entries, const uint32_t count, const uint64_t table_base,
+                     uint64_t* handlers, uint8_t* stack_args) noexcept -> void
+  {
+    uint32_t i = 0;
+
+#if defined(_M_X64) || defined(__x86_64__)
+    const __m128i base       = _mm_set1_epi64x(static_cast<long long>(table_base));
+    const __m128i args_mask  = _mm_set1_epi32(0xf);
+
+    for (; i + 4 <= count; i += 4)
+    {
+      const __m128i raw     = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entries + i));
+
+      // Offsets, sign extended from 32 to 64 bits by interleaving with the sign mask
+      const __m128i offsets = _mm_srai_epi32(raw, 4);
+      const __m128i sign    = _mm_srai_epi32(offsets, 31);
+      const __m128i low     = _mm_add_epi64(base, _mm_unpacklo_epi32(offsets, sign));
+      const __m128i high    = _mm_add_epi64(base, _mm_unpackhi_epi32(offsets, sign));
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(handlers + i),     low);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(handlers + i + 2), high);
+
+      // Argument counts, narrowed 32 -> 16 -> 8 bits, only the low 4 bytes are kept
+      const __m128i args = _mm_and_si128(raw, args_mask);
+      const __m128i args_bytes = _mm_packus_epi16(_mm_packs_epi32(args, args), args);
+
+      const uint32_t packed = static_cast<uint32_t>(_mm_cvtsi128_si32(args_bytes));
+      stack_args[i + 0] = static_cast<uint8_t>(packed >> 0);
+      stack_args[i + 1] = static_cast<uint8_t>(packed >> 8);
+      stack_args[i + 2] = static_cast<uint8_t>(packed >> 16);
+      stack_args[i + 3] = static_cast<uint8_t>(packed >> 24);
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+      handlers[i]   = decode_handler(table_base, entries[i]);
+      stack_args[i] = decode_stack_args(entries[i]);
+    }
+  }
+
+}; // namespace hk::ssdt
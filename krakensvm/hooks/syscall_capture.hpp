@@ -0,0 +1,333 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+//
+// Syscall argument capture stream
+//
+// One region holds a stream header followed by a ring per CPU. The driver maps
+// the same pages into the collector, so records are never copied on their way
+// out: the syscall trap (see "hooks/syscall_trap.hpp") is the only producer of
+// a CPU's ring, in root mode on that CPU, the collector the only consumer.
+//
+// The collector gets that region read-only. What it writes, the tail of each
+// ring, is in a second region of its own, a cache line per ring. The producer
+// goes by its own copy of everything else (ring_producer, kept in driver
+// memory) and publishes head and dropped for the collector to read; the only
+// thing it ever reads back out of shared memory is a tail.
+//
+// Nothing in here depends on the WDK, a collector can include it as it is.
+//
+
+namespace hk::capture
+{
+  constexpr uint32_t stream_magic   = 0x5041434b; // "KCAP"
+  constexpr uint32_t stream_version = 2;
+
+  constexpr size_t   cache_line     = 64;
+  constexpr size_t   page_size      = 0x1000;
+
+  struct alignas(cache_line) capture_record
+  {
+    uint64_t tsc;
+    uint64_t cr3;
+    uint64_t thread_id;
+    uint64_t args[4];         // rcx(r10), rdx, r8, r9 at syscall entry
+    uint32_t syscall_number;
+    uint32_t reserved;
+  };
+
+  static_assert(sizeof(capture_record) == cache_line,
+                  "A capture record has to fill exactly one cache line");
+
+  struct ring_header
+  {
+    uint32_t capacity;        // records, a power of two
+    uint32_t cpu;
+    uint64_t records_offset;  // from the start of this header
+
+    // Published by the producer, which keeps its own copies (ring_producer)
+    alignas(cache_line) uint64_t head;
+    alignas(cache_line) uint64_t dropped;  // records lost to a full ring
+  };
+
+  // The consumer's side of a ring, in the region the consumer can write
+  struct alignas(cache_line) ring_tail
+  {
+    uint64_t tail;
+  };
+
+  struct stream_header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cpu_count;
+    uint32_t record_size;
+    uint64_t ring_bytes;      // distance between two rings
+    uint64_t rings_offset;    // from the start of the stream
+  };
+
+  //
+  // Layout. The rings don't care what they carry, so everything below takes the
+  // record type, capture_record unless said otherwise (see "inc/exit_trace.hpp")
+  //
+
+  constexpr auto round_up(const size_t value, const size_t alignment) noexcept -> size_t
+  {
+    return (value + alignment - 1) & ~(alignment - 1);
+  }
+
+  template <typename record_t = capture_record>
+  constexpr auto ring_bytes(const uint32_t capacity) noexcept -> size_t
+  {
+    return round_up(round_up(sizeof(ring_header), cache_line) + static_cast<size_t>(capacity) * sizeof(record_t), page_size);
+  }
+
+  template <typename record_t = capture_record>
+  constexpr auto stream_bytes(const uint32_t cpu_count, const uint32_t capacity) noexcept -> size_t
+  {
+    return round_up(sizeof(stream_header), page_size) + static_cast<size_t>(cpu_count) * ring_bytes<record_t>(capacity);
+  }
+
+  constexpr auto tails_bytes(const uint32_t cpu_count) noexcept -> size_t
+  {
+    return round_up(static_cast<size_t>(cpu_count) * sizeof(ring_tail), page_size);
+  }
+
+  // Rounds a requested record count down to a power of two, 0 stays 0
+  constexpr auto ring_capacity(uint32_t records) noexcept -> uint32_t
+  {
+    uint32_t capacity = records ? 1 : 0;
+    while (capacity && (capacity << 1) != 0 && (capacity << 1) <= records) capacity <<= 1;
+    return capacity;
+  }
+
+  //
+  // Lays out a zeroed region of stream_bytes(cpu_count, capacity)
+  //
+
+  template <typename record_t = capture_record>
+  inline auto stream_init(void* region, const uint32_t cpu_count, const uint32_t capacity) noexcept -> stream_header*
+  {
+    if (region == nullptr || cpu_count == 0 || capacity == 0 || (capacity & (capacity - 1)) != 0) return nullptr;
+
+    auto* stream = static_cast<stream_header*>(region);
+
+    stream->magic        = stream_magic;
+    stream->version      = stream_version;
+    stream->cpu_count    = cpu_count;
+    stream->record_size  = sizeof(record_t);
+    stream->ring_bytes   = ring_bytes<record_t>(capacity);
+    stream->rings_offset = round_up(sizeof(stream_header), page_size);
+
+    for (uint32_t cpu = 0; cpu < cpu_count; ++cpu)
+    {
+      auto* ring = reinterpret_cast<ring_header*>(static_cast<uint8_t*>(region) + stream->rings_offset + cpu * stream->ring_bytes);
+
+      ring->capacity       = capacity;
+      ring->cpu            = cpu;
+      ring->records_offset = round_up(sizeof(ring_header), cache_line);
+    }
+
+    return stream;
+  }
+
+  //
+  // Checks a mapped stream before trusting any of its offsets
+  //
+
+  template <typename record_t = capture_record>
+  inline auto stream_validate(const void* region, const size_t region_size) noexcept -> const stream_header*
+  {
+    if (region == nullptr || region_size < sizeof(stream_header)) return nullptr;
+
+    const auto* stream = static_cast<const stream_header*>(region);
+
+    if (stream->magic != stream_magic || stream->version != stream_version) return nullptr;
+    if (stream->record_size != sizeof(record_t) || stream->cpu_count == 0)  return nullptr;
+
+    if (stream->rings_offset > region_size ||
+        stream->ring_bytes < sizeof(ring_header) ||
+        (region_size - stream->rings_offset) / stream->ring_bytes < stream->cpu_count)
+    {
+      return nullptr;
+    }
+
+    for (uint32_t cpu = 0; cpu < stream->cpu_count; ++cpu)
+    {
+      const auto* ring = reinterpret_cast<const ring_header*>(static_cast<const uint8_t*>(region) +
+                                                              stream->rings_offset + cpu * stream->ring_bytes);
+
+      if (ring->capacity == 0 || (ring->capacity & (ring->capacity - 1)) != 0) return nullptr;
+
+      if (ring->records_offset < sizeof(ring_header) ||
+          ring->records_offset > stream->ring_bytes ||
+          (stream->ring_bytes - ring->records_offset) / sizeof(record_t) < ring->capacity)
+      {
+        return nullptr;
+      }
+    }
+
+    return stream;
+  }
+
+  // The consumer's tail of every ring, nullptr when the region is too small for them
+  inline auto stream_tails(const stream_header* stream, void* tails, const size_t tails_size) noexcept -> ring_tail*
+  {
+    if (tails == nullptr || tails_size / sizeof(ring_tail) < stream->cpu_count) return nullptr;
+
+    return static_cast<ring_tail*>(tails);
+  }
+
+  inline auto stream_ring(const stream_header* stream, const uint32_t cpu) noexcept -> ring_header*
+  {
+    if (cpu >= stream->cpu_count) return nullptr;
+
+    return reinterpret_cast<ring_header*>(reinterpret_cast<uintptr_t>(stream) + stream->rings_offset + cpu * stream->ring_bytes);
+  }
+
+  template <typename record_t = capture_record>
+  inline auto ring_records(ring_header* ring) noexcept -> record_t*
+  {
+    return reinterpret_cast<record_t*>(reinterpret_cast<uint8_t*>(ring) + ring->records_offset);
+  }
+
+  template <typename record_t = capture_record>
+  inline auto ring_records(const ring_header* ring) noexcept -> const record_t*
+  {
+    return reinterpret_cast<const record_t*>(reinterpret_cast<const uint8_t*>(ring) + ring->records_offset);
+  }
+
+  //
+  // Producer, a single one per ring. It keeps its own copy of the ring's
+  // layout and position out of the consumer's reach.
+  //
+
+  template <typename record_t = capture_record>
+  struct ring_producer
+  {
+    ring_header*     shared;  // head and dropped are published here
+    record_t*        records;
+    const ring_tail* tail;
+    uint32_t         capacity;
+    uint64_t         head;
+    uint64_t         dropped;
+  };
+
+  //
+  // cpu's producer for a region stream_init() laid out, from the same layout
+  // arithmetic, not from anything read back out of the region
+  //
+
+  template <typename record_t = capture_record>
+  inline auto producer_init(ring_producer<record_t>& producer, void* region, const ring_tail* tails,
+                            const uint32_t cpu, const uint32_t capacity) noexcept -> void
+  {
+    auto* ring = reinterpret_cast<ring_header*>(static_cast<uint8_t*>(region) + round_up(sizeof(stream_header), page_size) +
+                                                cpu * ring_bytes<record_t>(capacity));
+
+    producer.shared   = ring;
+    producer.records  = reinterpret_cast<record_t*>(reinterpret_cast<uint8_t*>(ring) + round_up(sizeof(ring_header), cache_line));
+    producer.tail     = &tails[cpu];
+    producer.capacity = capacity;
+    producer.head     = 0;
+    producer.dropped  = 0;
+  }
+
+  template <typename record_t>
+  inline auto ring_push(ring_producer<record_t>& producer, const record_t& record) noexcept -> bool
+  {
+    const uint64_t tail = std::atomic_ref<uint64_t>(const_cast<uint64_t&>(producer.tail->tail)).load(std::memory_order_acquire);
+
+    // A consumer writing garbage into its tail can only cost records, never memory
+    if (producer.head - tail >= producer.capacity)
+    {
+      std::atomic_ref<uint64_t>(producer.shared->dropped).store(++producer.dropped, std::memory_order_relaxed);
+      return false;
+    }
+
+    producer.records[producer.head & (producer.capacity - 1)] = record;
+
+    std::atomic_ref<uint64_t>(producer.shared->head).store(++producer.head, std::memory_order_release);
+    return true;
+  }
+
+  //
+  // Consumer, copies out up to max_records and frees them in one tail update
+  //
+
+  template <typename record_t>
+  inline auto ring_drain(const ring_header* ring, ring_tail& consumer, record_t* out, const uint32_t max_records) noexcept -> uint32_t
+  {
+    const uint64_t tail = consumer.tail;
+    const uint64_t head = std::atomic_ref<uint64_t>(const_cast<uint64_t&>(ring->head)).load(std::memory_order_acquire);
+
+    uint64_t available = head - tail;
+    if (available > ring->capacity) available = ring->capacity;
+
+    const uint32_t count = available < max_records ? static_cast<uint32_t>(available) : max_records;
+    const record_t* records = ring_records<record_t>(ring);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      out[i] = records[(tail + i) & (ring->capacity - 1)];
+    }
+
+    std::atomic_ref<uint64_t>(consumer.tail).store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  //
+  // Driver side, located in "hooks/syscall_capture.cpp"
+  //
+
+  // A collector's views of a stream: the stream itself read-only, the tails
+  // read-write
+  struct user_views
+  {
+    void*  stream;
+    size_t stream_size;
+    void*  tails;
+    size_t tails_size;
+  };
+
+  // records_per_cpu is rounded down to a power of two, PASSIVE_LEVEL
+  auto enable    (uint32_t records_per_cpu) noexcept -> bool;
+  auto disable   () noexcept -> void;
+
+  // Maps both into the current process, all or nothing
+  auto map_user  (user_views& views) noexcept -> bool;
+  auto unmap_user(const user_views& views) noexcept -> void;
+
+  // Host side, from the syscall trap at SYSCALL. args are RCX (R10), RDX, R8
+  // and R9 as the guest had them.
+  auto record    (uint32_t processor, uint64_t cr3, uint32_t syscall_number, const uint64_t (&args)[4]) noexcept -> void;
+
+}; // namespace hk::capture
@@ -25,15 +25,73 @@
 
 #include <syscall_hook.hpp>
 #include <hook_utils.hpp>
+#include <pe_image.hpp>
+#include <pe.hpp>
+#include <ssdt.hpp>
 
 #include <capstone/capstone.h>
 #include <windef.h>
 #include <winnt.h>
 
-void* arena_alloc(size_t n) { appended_alloc += n; return hypervisor_arena + appended_alloc - n; }
+// Rounded up to 16 bytes so every allocation out of the arena stays aligned
+void* arena_alloc(size_t n)
+{
+  n = (n + 15) & ~size_t(15);
+  if (hypervisor_arena == nullptr || n > hypervisor_arena_size - appended_alloc) return nullptr;
+
+  appended_alloc += n;
+  return hypervisor_arena + appended_alloc - n;
+}
 
 namespace hk
 {
+  _hook_lstar_info hook_lstar_info;
+
+  //
+  // Decodes a single KSYSTEM_SERVICE_TABLE into the arena. The win32k table only
+  // exists in session space, in_session() gets it mapped first.
+  //
+
+  static auto decode_service_table(const KSYSTEM_SERVICE_TABLE& service_table,
+                                   uint64_t*& handlers, uint8_t*& stack_args, size_t& count) noexcept -> bool
+  {
+    const uint32_t number_of_service = static_cast<uint32_t>(service_table.NumberOfService);
+
+    if (service_table.ServiceTableBase == nullptr ||
+        number_of_service == 0 || number_of_service > ssdt::max_services) return false;
+
+    if (!MmIsAddressValid(service_table.ServiceTableBase) ||
+        !MmIsAddressValid(service_table.ServiceTableBase + number_of_service - 1)) return false;
+
+    // Both or neither, what's taken goes back when the second one doesn't fit
+    const uint64_t arena_mark = appended_alloc;
+
+    handlers   = reinterpret_cast<uint64_t*>(arena_alloc(number_of_service * sizeof(uint64_t)));
+    stack_args = reinterpret_cast<uint8_t*> (arena_alloc(number_of_service));
+
+    if (handlers == nullptr || stack_args == nullptr)
+    {
+      appended_alloc = arena_mark;
+      handlers       = nullptr;
+      stack_args     = nullptr;
+
+      return false;
+    }
+
+    ssdt::decode(service_table.ServiceTableBase, number_of_service,
+                 reinterpret_cast<uint64_t>(service_table.ServiceTableBase), handlers, stack_args);
+
+    count = number_of_service;
+    return true;
+  }
+
+  static auto decode_shadow_table(void* service_table) noexcept -> bool
+  {
+    return decode_service_table(*static_cast<const KSYSTEM_SERVICE_TABLE*>(service_table),
+                                hook_lstar_info.hook_lstar_table_shadow,
+                                hook_lstar_info.stack_args_shadow,
+                                hook_lstar_info.hook_table_shdw_size);
+  }
 
   auto contruct_lstar_hook(uint64_t kernal_base, uint64_t original_lstar) noexcept -> std::pair<bool, int>
   {
@@ -56,23 +114,39 @@ namespace hk
     bool existence_of_syscall        = false,
          existence_of_syscall_shadow = false;
 
-    PRUNTIME_FUNCTION handler_function_entry = nullptr;
+    const pe::runtime_function_t* handler_function_entry = nullptr;
 
-    // This will be stored info about ServiceDescriptorTable(Shadow)
-    _hook_lstar_info hook_table_instance;
+    // KiSystemCall64(Shadow)'s unwind entry, out of the indexed .pdata of ntoskrnl
+    const auto* kernel_image = pe::kernel_image();
+    if (kernel_image == nullptr) return { status, 0 };
 
-    handler_function_entry = RtlLookupFunctionEntry(kernal_base, &original_lstar, 0);
+    handler_function_entry = kernel_image->lookup_function(static_cast<uint32_t>(original_lstar - kernal_base));
+    if (handler_function_entry == nullptr) return { status, 0 };
 
     // Pointers to our PKSERVICE_TABLE_DESCRIPTOR
     auto [service_descriptor_table, service_descriptor_table_shadow] = utils::get_service_descriptor_table();
     if (!service_descriptor_table || !service_descriptor_table_shadow) return { status, 0 };
 
+    // Both service tables are decoded once, the hook and the tracing index
+    // hook_lstar_info directly from then on
+    if (hook_lstar_info.hook_lstar_table == nullptr)
+    {
+      if (!decode_service_table(service_descriptor_table->NTOSKRNL,
+                                hook_lstar_info.hook_lstar_table,
+                                hook_lstar_info.stack_args,
+                                hook_lstar_info.hooked_table_size)) return { status, 0 };
+
+      // Leaves hook_table_shdw_size at 0 when there's no session to read it in,
+      // the syscall trap then takes every win32k number as known
+      in_session(decode_shadow_table, &service_descriptor_table_shadow->Win32k);
+    }
+
     //if (cs_open(CS_ARCH_X86, CS_MODE_64, &handle) != CS_ERR_OK) return { status, 0 };
 
     return { status, 0 };
   }
 
-  auto syscallhook_init(int context) noexcept -> bool
+  auto syscallhook_init(uint64_t context) noexcept -> bool
   {
     contruct_lstar_hook(utils::get_kernelbase_addr(), context);
     return true;
@@ -28,33 +28,100 @@
 #include <stdint.h>
 #include <utility>
 
+#include <rcu.hpp>
+
 // extern "C" int MyKiSystemCall64Hook();
 
 //
 // Hypervisor Allocation
 //
 
+constexpr size_t hypervisor_arena_size = 0x3d0900;
+
 __declspec(selectany) uint64_t appended_alloc   {};
 __declspec(selectany) char8_t* hypervisor_arena {};
 
+// Bump allocation out of hypervisor_arena, located in "hooks/syscall_hook.cpp".
+// nullptr when the arena wasn't allocated or has no room left.
+void* arena_alloc(size_t n);
+
 namespace hk
 {
+  //
+  // The decoded ntoskrnl (hook_lstar_table) and win32k (hook_lstar_table_shadow)
+  // service tables: absolute handler addresses and the number of arguments each
+  // handler takes on the stack, indexed by the syscall number
+  //
+
   struct _hook_lstar_info
   {
     uint64_t* hook_lstar_table;
     uint64_t* hook_lstar_table_shadow;
 
+    uint8_t* stack_args;
+    uint8_t* stack_args_shadow;
+
     size_t hooked_table_size, hook_table_shdw_size;
 
     _hook_lstar_info() noexcept : hook_table_shdw_size (0),
                                   hooked_table_size    (0),
                                   hook_lstar_table     (nullptr),
-                                  hook_lstar_table_shadow (nullptr) {}
+                                  hook_lstar_table_shadow (nullptr),
+                                  stack_args           (nullptr),
+                                  stack_args_shadow    (nullptr) {}
 
     ~_hook_lstar_info() = default;
 
   };
 
-  auto syscallhook_init    (int context)          noexcept -> bool;
-  auto contruct_lstar_hook (uint64_t kernal_base) noexcept -> std::pair<bool, int>;
+  // Filled once by contruct_lstar_hook, located in "hooks/syscall_hook.cpp"
+  extern _hook_lstar_info hook_lstar_info;
+
+  //
+  // The version the host side reads, hook_lstar_info until a handler is
+  // redirected. A version is never written once published, redirect_syscall()
+  // builds a new one and swaps the pointer. Located in "hooks/syscall_table.cpp".
+  //
+  // Nothing dispatches through it. The guest's SYSCALL still lands in
+  // KiSystemCall64, which goes through the kernel's own KiServiceTable, so a
+  // redirected handler is never called. All it changes is what
+  // syscall_handler() reports, and with it whether the syscall trap counts
+  // and captures a number.
+  //
+
+  extern const _hook_lstar_info* active_lstar_info;
+
+  //
+  // Handler of the syscall number in EAX, 0 if there is none. Host side, from
+  // the syscall trap inside an exit's RCU read section.
+  //
+
+  inline auto syscall_handler(const uint32_t syscall_number) noexcept -> uint64_t
+  {
+    const _hook_lstar_info* current = rcu::dereference(active_lstar_info);
+    const uint32_t index = syscall_number & 0xfff;
+
+    if ((syscall_number >> 12) & 1)
+    {
+      return index < current->hook_table_shdw_size ? current->hook_lstar_table_shadow[index] : 0;
+    }
+
+    return index < current->hooked_table_size ? current->hook_lstar_table[index] : 0;
+  }
+
+  // PASSIVE_LEVEL. Publishes a version with one handler replaced, handler 0
+  // puts the decoded one back. Returns once nobody reads the old version.
+  // No caller in the driver yet, see active_lstar_info about what it does.
+  auto redirect_syscall    (uint32_t syscall_number, uint64_t handler) noexcept -> bool;
+
+  // Back to hook_lstar_info and the last version freed, once devirtualized
+  auto restore_syscalls    () noexcept -> void;
+
+  // PASSIVE_LEVEL. Calls routine attached to a process that has a session,
+  // win32k's service table is only mapped in there. False without calling
+  // it when there's no session yet.
+  auto in_session          (bool (*routine)(void* context), void* context) noexcept -> bool;
+
+  auto syscallhook_init    (uint64_t context)     noexcept -> bool;
+  auto contruct_lstar_hook (uint64_t kernal_base, uint64_t original_lstar) noexcept -> std::pair<bool, int>;
 };
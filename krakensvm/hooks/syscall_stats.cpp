@@ -0,0 +1,95 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <paging.hpp>
+#include <syscall_hook.hpp>
+#include <syscall_stats.hpp>
+
+using namespace ia32e;
+
+namespace hk::stats
+{
+  static per_cpu_table  stats_table;
+  static void*          stats_storage = nullptr;   // only when allocated in here
+
+  // Published last by enable(), the trap only ever reads it
+  static per_cpu_table* volatile active_table = nullptr;
+
+  auto enable(void* storage) noexcept -> bool
+  {
+    if (active_table != nullptr) return true;
+
+    const uint32_t nt_slots     = static_cast<uint32_t>(hook_lstar_info.hooked_table_size);
+    const uint32_t win32k_slots = static_cast<uint32_t>(hook_lstar_info.hook_table_shdw_size);
+
+    // Sized for every processor the system can have, not only the active ones
+    const uint32_t cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    const size_t storage_size = per_cpu_table::storage_size(cpu_count, nt_slots + win32k_slots);
+    if (storage_size == 0) return false;
+
+    // Pool allocations of a page and up come back page aligned
+    if (storage == nullptr)
+    {
+      storage = stats_storage = mm::system_aligned_alloc(storage_size < PAGE_SIZE ? PAGE_SIZE : storage_size);
+      if (storage == nullptr) return false;
+    }
+
+    if (!stats_table.init(storage, cpu_count, nt_slots, win32k_slots))
+    {
+      if (stats_storage != nullptr) system_free_alloc(stats_storage);
+      stats_storage = nullptr;
+      return false;
+    }
+
+    kprint_info("Syscall profiling: %u cpus, %u slots, %llu bytes\n",
+                cpu_count, stats_table.slot_count(), static_cast<uint64_t>(storage_size));
+
+    _ReadWriteBarrier();
+    active_table = &stats_table;
+
+    return true;
+  }
+
+  auto disable() noexcept -> void
+  {
+    // Only called once the processors have been devirtualized and the trap is gone
+    active_table = nullptr;
+
+    if (stats_storage != nullptr)
+    {
+      system_free_alloc(stats_storage);
+      stats_storage = nullptr;
+    }
+
+    stats_table = per_cpu_table {};
+  }
+
+  auto table() noexcept -> per_cpu_table*
+  {
+    return active_table;
+  }
+}; // namespace hk::stats
@@ -0,0 +1,203 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <bit>
+
+//
+// Per-syscall profiling out of the syscall trap (see "hooks/syscall_trap.hpp")
+//
+// Every CPU owns a block of rows, one 64 byte row per syscall slot holding the
+// invocation count and a log2 histogram of the entry-to-return cycles. A CPU
+// only ever writes its own block, blocks start on a cache line and never share
+// one, so the fast path touches exactly one line that no other CPU writes.
+// Totals are only formed when somebody reads them.
+//
+// Slots: ntoskrnl syscalls take [0, nt_slots), win32k syscalls follow them.
+//
+
+namespace hk::stats
+{
+  constexpr size_t   cache_line    = 64;
+
+  // Bucket 0 holds everything under 2^bucket_shift cycles, the last bucket
+  // everything from 2^(bucket_shift + histogram_buckets - 2) up
+  constexpr uint32_t histogram_buckets = 14;
+  constexpr uint32_t bucket_shift      = 7;
+
+  struct alignas(cache_line) syscall_row
+  {
+    uint64_t count;
+    uint32_t buckets[histogram_buckets];
+  };
+
+  static_assert(sizeof(syscall_row) == cache_line,
+                  "A syscall row has to fill exactly one cache line");
+
+  constexpr auto bucket_of(const uint64_t cycles) noexcept -> uint32_t
+  {
+    const uint32_t width = static_cast<uint32_t>(std::bit_width(cycles >> bucket_shift));
+    return width < histogram_buckets ? width : histogram_buckets - 1;
+  }
+
+  // Aggregated view of one slot, summed over every CPU on read
+  struct syscall_summary
+  {
+    uint64_t count;
+    uint64_t completed;
+    uint64_t buckets[histogram_buckets];
+  };
+
+  class per_cpu_table
+  {
+  public:
+    static constexpr auto storage_size(const uint32_t cpu_count, const uint32_t slot_count) noexcept -> size_t
+    {
+      return static_cast<size_t>(cpu_count) * slot_count * sizeof(syscall_row);
+    }
+
+    //
+    // The storage has to be cache line aligned and storage_size() bytes long,
+    // it's zeroed in here
+    //
+
+    auto init(void* storage, const uint32_t cpu_count, const uint32_t nt_slots, const uint32_t win32k_slots) noexcept -> bool
+    {
+      if (storage == nullptr || cpu_count == 0 || nt_slots + win32k_slots == 0) return false;
+      if (reinterpret_cast<uintptr_t>(storage) % cache_line != 0) return false;
+
+      rows_         = static_cast<syscall_row*>(storage);
+      cpu_count_    = cpu_count;
+      nt_slots_     = nt_slots;
+      slot_count_   = nt_slots + win32k_slots;
+
+      auto* bytes = static_cast<uint8_t*>(storage);
+      for (size_t i = 0; i < storage_size(cpu_count_, slot_count_); ++i) bytes[i] = 0;
+
+      return true;
+    }
+
+    // Maps a syscall number (table index in bit 12) to a slot, slot_count() if untracked
+    auto slot_of(const uint32_t syscall_number) const noexcept -> uint32_t
+    {
+      const uint32_t index = syscall_number & 0xfff;
+
+      if ((syscall_number >> 12) & 1)
+      {
+        return index < slot_count_ - nt_slots_ ? nt_slots_ + index : slot_count_;
+      }
+
+      return index < nt_slots_ ? index : slot_count_;
+    }
+
+    //
+    // Fast path, root mode on the CPU that owns the row, so plain increments
+    //
+
+    auto record_entry(const uint32_t cpu, const uint32_t syscall_number) noexcept -> void
+    {
+      const uint32_t slot = slot_of(syscall_number);
+      if (cpu >= cpu_count_ || slot >= slot_count_) return;
+
+      ++row(cpu, slot).count;
+    }
+
+    auto record_return(const uint32_t cpu, const uint32_t syscall_number, const uint64_t cycles) noexcept -> void
+    {
+      const uint32_t slot = slot_of(syscall_number);
+      if (cpu >= cpu_count_ || slot >= slot_count_) return;
+
+      ++row(cpu, slot).buckets[bucket_of(cycles)];
+    }
+
+    //
+    // Read side
+    //
+
+    auto aggregate_slot(const uint32_t slot, syscall_summary& summary) const noexcept -> bool
+    {
+      summary = {};
+      if (slot >= slot_count_) return false;
+
+      for (uint32_t cpu = 0; cpu < cpu_count_; ++cpu)
+      {
+        const syscall_row& source = row(cpu, slot);
+
+        summary.count += source.count;
+
+        for (uint32_t bucket = 0; bucket < histogram_buckets; ++bucket)
+        {
+          summary.buckets[bucket] += source.buckets[bucket];
+          summary.completed       += source.buckets[bucket];
+        }
+      }
+
+      return true;
+    }
+
+    auto aggregate(const uint32_t syscall_number, syscall_summary& summary) const noexcept -> bool
+    {
+      return aggregate_slot(slot_of(syscall_number), summary);
+    }
+
+    auto reset() noexcept -> void
+    {
+      if (rows_ == nullptr) return;
+
+      auto* bytes = reinterpret_cast<uint8_t*>(rows_);
+      for (size_t i = 0; i < storage_size(cpu_count_, slot_count_); ++i) bytes[i] = 0;
+    }
+
+    auto row(const uint32_t cpu, const uint32_t slot)       noexcept -> syscall_row&       { return rows_[static_cast<size_t>(cpu) * slot_count_ + slot]; }
+    auto row(const uint32_t cpu, const uint32_t slot) const noexcept -> const syscall_row& { return rows_[static_cast<size_t>(cpu) * slot_count_ + slot]; }
+
+    auto cpu_count()  const noexcept -> uint32_t { return cpu_count_; }
+    auto slot_count() const noexcept -> uint32_t { return slot_count_; }
+    auto nt_slots()   const noexcept -> uint32_t { return nt_slots_; }
+
+  private:
+    syscall_row* rows_       = nullptr;
+    uint32_t     cpu_count_  = 0;
+    uint32_t     nt_slots_   = 0;
+    uint32_t     slot_count_ = 0;
+  };
+
+  //
+  // Driver side, located in "hooks/syscall_stats.cpp"
+  //
+
+  // Sizes the table after the decoded service tables, PASSIVE_LEVEL. storage is
+  // per_cpu_table::storage_size() bytes of cache line aligned memory for every
+  // possible processor, or nullptr to allocate it from the pool
+  auto enable (void* storage) noexcept -> bool;
+  auto disable() noexcept -> void;
+
+  // nullptr while profiling is off
+  auto table  () noexcept -> per_cpu_table*;
+
+}; // namespace hk::stats
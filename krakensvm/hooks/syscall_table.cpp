@@ -0,0 +1,157 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <syscall_hook.hpp>
+#include <pe_image.hpp>
+
+using namespace pe::literals;
+
+namespace hk
+{
+  const _hook_lstar_info* active_lstar_info = &hook_lstar_info;
+
+  // Serializes the writers of active_lstar_info, readers never take it
+  static EX_PUSH_LOCK version_lock = 0;
+
+  //
+  // A version is one allocation, the handler tables right behind the header.
+  // stack_args never changes and stays shared with hook_lstar_info.
+  //
+
+  static auto copy_version(const _hook_lstar_info& source) noexcept -> _hook_lstar_info*
+  {
+    const size_t handlers = source.hooked_table_size + source.hook_table_shdw_size;
+    const size_t bytes    = sizeof(_hook_lstar_info) + handlers * sizeof(uint64_t);
+
+    auto* version = static_cast<_hook_lstar_info*>(ExAllocatePoolWithTag(NonPagedPool, bytes, HV_POOL_TAG));
+    if (version == nullptr) return nullptr;
+
+    *version = source;
+    version->hook_lstar_table        = reinterpret_cast<uint64_t*>(version + 1);
+    version->hook_lstar_table_shadow = version->hook_lstar_table + source.hooked_table_size;
+
+    memcpy(version->hook_lstar_table, source.hook_lstar_table, source.hooked_table_size * sizeof(uint64_t));
+
+    if (source.hook_table_shdw_size != 0)
+    {
+      memcpy(version->hook_lstar_table_shadow, source.hook_lstar_table_shadow,
+             source.hook_table_shdw_size * sizeof(uint64_t));
+    }
+
+    return version;
+  }
+
+  static auto replace_version(const _hook_lstar_info* replacement) noexcept -> void
+  {
+    const _hook_lstar_info* previous = rcu::publish(active_lstar_info, replacement);
+    rcu::synchronize();
+
+    if (previous != &hook_lstar_info)
+    {
+      ExFreePoolWithTag(const_cast<_hook_lstar_info*>(previous), HV_POOL_TAG);
+    }
+  }
+
+  auto redirect_syscall(const uint32_t syscall_number, const uint64_t handler) noexcept -> bool
+  {
+    if (!rcu::ready() || hook_lstar_info.hook_lstar_table == nullptr) return false;
+
+    const bool     shadow = ((syscall_number >> 12) & 1) != 0;
+    const uint32_t index  = syscall_number & 0xfff;
+
+    if (index >= (shadow ? hook_lstar_info.hook_table_shdw_size : hook_lstar_info.hooked_table_size)) return false;
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&version_lock, 0);
+
+    _hook_lstar_info* version = copy_version(*active_lstar_info);
+
+    if (version != nullptr)
+    {
+      uint64_t* table    = shadow ? version->hook_lstar_table_shadow : version->hook_lstar_table;
+      uint64_t* original = shadow ? hook_lstar_info.hook_lstar_table_shadow : hook_lstar_info.hook_lstar_table;
+
+      table[index] = handler != 0 ? handler : original[index];
+      replace_version(version);
+    }
+
+    ExReleasePushLockExclusiveEx(&version_lock, 0);
+    KeLeaveCriticalRegion();
+
+    return version != nullptr;
+  }
+
+  auto restore_syscalls() noexcept -> void
+  {
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&version_lock, 0);
+
+    if (active_lstar_info != &hook_lstar_info) replace_version(&hook_lstar_info);
+
+    ExReleasePushLockExclusiveEx(&version_lock, 0);
+    KeLeaveCriticalRegion();
+  }
+
+  //
+  // The System process the driver runs in belongs to no session. The first
+  // process that has one is attached to instead, csrss.exe of session 0 in
+  // practice; a driver started before it exists finds none.
+  //
+
+  // Exported since Windows 7, not in the WDK headers. (ULONG)-1 for no session
+  using session_id_t = ULONG (*)(PEPROCESS process);
+
+  auto in_session(bool (*routine)(void* context), void* context) noexcept -> bool
+  {
+    const auto session_of = pe::resolve<"PsGetProcessSessionIdEx"_h, session_id_t>();
+    if (session_of == nullptr) return false;
+
+    for (uintptr_t process_id = 8; process_id < 0x10000; process_id += 4)
+    {
+      PEPROCESS process = nullptr;
+      if (!NT_SUCCESS(PsLookupProcessByProcessId(reinterpret_cast<HANDLE>(process_id), &process))) continue;
+
+      if (session_of(process) == static_cast<ULONG>(-1))
+      {
+        ObDereferenceObject(process);
+        continue;
+      }
+
+      KAPC_STATE attached;
+      KeStackAttachProcess(process, &attached);
+
+      const bool done = routine(context);
+
+      KeUnstackDetachProcess(&attached);
+      ObDereferenceObject(process);
+
+      return done;
+    }
+
+    kprint_info("no session process, win32k's service table left out\n");
+    return false;
+  }
+}; // namespace hk
@@ -0,0 +1,130 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <syscall_trap.hpp>
+#include <syscall_hook.hpp>
+#include <syscall_stats.hpp>
+#include <syscall_capture.hpp>
+#include <telemetry.hpp>
+
+namespace hk::trap
+{
+  static bool trap_syscalls = false;
+
+  // One per vCPU, by processor index. A few thousand threads sit blocked in
+  // a syscall on any system, spread over the processors they entered on;
+  // the oldest of them give way when a probe window fills up.
+  using pairing = in_flight<0x400>;
+
+  static pairing* syscalls_in_flight = nullptr;
+  static uint32_t pairing_count      = 0;
+
+  auto configure(const bool trap) noexcept -> void
+  {
+    trap_syscalls = trap;
+
+    if (!trap || syscalls_in_flight != nullptr) return;
+
+    const uint32_t cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    auto* tables = static_cast<pairing*>(ExAllocatePoolWithTag(NonPagedPool, cpu_count * sizeof(pairing), HV_POOL_TAG));
+    if (tables == nullptr) return;
+
+    memset(tables, 0, cpu_count * sizeof(pairing));
+
+    syscalls_in_flight = tables;
+    pairing_count      = cpu_count;
+  }
+
+  auto release() noexcept -> void
+  {
+    if (syscalls_in_flight == nullptr) return;
+
+    ExFreePoolWithTag(syscalls_in_flight, HV_POOL_TAG);
+    syscalls_in_flight = nullptr;
+    pairing_count      = 0;
+  }
+
+  auto enabled() noexcept -> bool
+  {
+    return trap_syscalls;
+  }
+
+  //
+  // A number the decoded service tables don't have only makes the kernel's
+  // dispatcher fail the call, there's nothing worth profiling or capturing.
+  // A table that wasn't decoded can't tell, its numbers all count as known:
+  // win32k's when no session process was around to read it from.
+  // Runs inside the exit's RCU read section, the tables are only ever
+  // republished by redirect_syscall() and the version read here stays valid
+  // until the exit is over.
+  //
+
+  static auto known_service(const uint32_t syscall_number) noexcept -> bool
+  {
+    const bool decoded = ((syscall_number >> 12) & 1) != 0 ? hook_lstar_info.hook_table_shdw_size != 0
+                                                           : hook_lstar_info.hook_lstar_table != nullptr;
+
+    return !decoded || syscall_handler(syscall_number) != 0;
+  }
+
+  auto on_syscall(const uint32_t processor, const uint64_t cr3, const uint64_t gs_base,
+                  const uint32_t syscall_number, const uint64_t (&args)[4]) noexcept -> void
+  {
+    telemetry::vcpu_stats* const counters = telemetry::vcpu(processor);
+    if (counters != nullptr) ++counters->syscalls;
+
+    if (!known_service(syscall_number)) return;
+
+    capture::record(processor, cr3, syscall_number, args);
+
+    stats::per_cpu_table* const table = stats::table();
+    if (table == nullptr) return;
+
+    table->record_entry(processor, syscall_number);
+
+    if (processor >= pairing_count) return;
+
+    const bool evicted = syscalls_in_flight[processor].begin(thread_key(cr3, gs_base), pack(__rdtsc(), syscall_number));
+    if (evicted && counters != nullptr) ++counters->evicted;
+  }
+
+  auto on_sysret(const uint32_t processor, const uint64_t cr3, const uint64_t gs_base) noexcept -> void
+  {
+    stats::per_cpu_table* const table = stats::table();
+    if (table == nullptr || processor >= pairing_count) return;
+
+    uint64_t packed = {};
+
+    if (!syscalls_in_flight[processor].end(thread_key(cr3, gs_base), packed))
+    {
+      if (telemetry::vcpu_stats* counters = telemetry::vcpu(processor)) ++counters->unpaired;
+      return;
+    }
+
+    table->record_return(processor, number_of(packed), cycles_since(packed, __rdtsc()));
+  }
+}; // namespace hk::trap
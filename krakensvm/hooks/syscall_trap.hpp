@@ -0,0 +1,343 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Syscalls trapped from the host side
+//
+// Nothing runs in the guest's syscall path. While the trap is on the guest's
+// EFER.SCE is kept clear behind its back (RDMSR still reports what it last
+// wrote), so every SYSCALL and SYSRET raises #UD, which is intercepted. The
+// host decodes the instruction at RIP, does what the processor would have
+// done and resumes the guest past it; any other #UD goes back to the guest.
+// That costs two #VMEXITs per syscall, it's only on while a syscall profile
+// or capture is.
+//
+// The entry and the return of one syscall are paired up through an
+// in_flight table of the vCPU, keyed by the thread: the user CR3 and the
+// user GS base (the TEB) are both the same at the SYSCALL and at the
+// SYSRET. A thread that blocked and returns on another processor finds no
+// entry there and its sample is lost, counted as unpaired. Syscalls that
+// return through IRETQ, or on another processor, leave their entry behind;
+// the next SYSCALL of the thread or the oldest-first eviction takes the
+// slot back.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace hk::trap
+{
+  constexpr uint64_t efer_sce       = 1ull << 0;
+  constexpr uint64_t efer_lma       = 1ull << 10;
+
+  constexpr uint64_t rflags_fixed   = 1ull << 1;
+  constexpr uint64_t rflags_rf      = 1ull << 16;
+
+  // What SYSRET takes from R11, everything but VM, RF and the reserved bits
+  constexpr uint64_t sysret_rflags  = 0x3c7fd7;
+
+  // Segment attributes the way the VMCB packs them (type, S, DPL, P, AVL, L, D/B, G)
+  constexpr uint16_t attr_kernel_cs = 0xa9b;    // 64-bit code, DPL 0
+  constexpr uint16_t attr_kernel_ss = 0xc93;    // data, DPL 0
+  constexpr uint16_t attr_user_cs   = 0xafb;    // 64-bit code, DPL 3
+  constexpr uint16_t attr_user_cs32 = 0xcfb;    // 32-bit code, DPL 3
+  constexpr uint16_t attr_user_ss   = 0xcf3;    // data, DPL 3
+  constexpr uint16_t attr_long      = 1u << 9;
+
+  enum class instruction : uint8_t
+  {
+    other,
+    syscall,
+    sysret,                   // back to compatibility mode
+    sysret64,                 // REX.W, back to 64-bit mode
+  };
+
+  struct decoded
+  {
+    instruction kind;
+    uint8_t     length;
+  };
+
+  //
+  // What raised the #UD, size is how many bytes at RIP could be read. Only
+  // the encodings compilers emit, a REX prefix at most.
+  //
+
+  constexpr auto decode(const uint8_t* code, const size_t size) noexcept -> decoded
+  {
+    size_t at = 0;
+    bool wide = false;
+
+    if (size > 0 && (code[0] & 0xf0) == 0x40)
+    {
+      wide = (code[0] & 0x08) != 0;
+      at = 1;
+    }
+
+    if (size < at + 2 || code[at] != 0x0f) return { instruction::other, 0 };
+
+    const uint8_t length = static_cast<uint8_t>(at + 2);
+
+    switch (code[at + 1])
+    {
+      case 0x05: return { instruction::syscall, length };
+      case 0x07: return { wide ? instruction::sysret64 : instruction::sysret, length };
+      default:   return { instruction::other, 0 };
+    }
+  }
+
+  //
+  // The part of the guest state the two instructions touch
+  //
+
+  struct segment
+  {
+    uint16_t selector;
+    uint16_t attribute;
+    uint32_t limit;
+    uint64_t base;
+  };
+
+  struct state
+  {
+    uint64_t rip;
+    uint64_t rflags;
+    uint64_t rcx;
+    uint64_t r11;
+    segment  cs;
+    segment  ss;
+    uint8_t  cpl;
+  };
+
+  struct msrs
+  {
+    uint64_t efer;            // what the guest wrote, SCE included
+    uint64_t star;
+    uint64_t lstar;
+    uint64_t cstar;
+    uint64_t sfmask;
+  };
+
+  enum class outcome : uint8_t
+  {
+    done,
+    undefined,                // #UD, as without the trap
+    general_protection,       // #GP(0)
+  };
+
+  constexpr auto canonical(const uint64_t address) noexcept -> bool
+  {
+    return static_cast<uint64_t>(static_cast<int64_t>(address << 16) >> 16) == address;
+  }
+
+  constexpr auto flat(const uint16_t selector, const uint16_t attribute) noexcept -> segment
+  {
+    return { selector, attribute, 0xffffffff, 0 };
+  }
+
+  //
+  // SYSCALL from 64-bit or compatibility mode, length is the instruction's
+  //
+
+  constexpr auto emulate_syscall(state& guest, const msrs& msr, const uint8_t length) noexcept -> outcome
+  {
+    if ((msr.efer & efer_sce) == 0 || (msr.efer & efer_lma) == 0) return outcome::undefined;
+
+    const bool     compat   = (guest.cs.attribute & attr_long) == 0;
+    const uint16_t selector = static_cast<uint16_t>(msr.star >> 32) & 0xfffc;
+
+    guest.rcx    = guest.rip + length;
+    guest.r11    = guest.rflags;
+    guest.rflags = (guest.rflags & ~msr.sfmask & ~rflags_rf) | rflags_fixed;
+    guest.rip    = compat ? msr.cstar : msr.lstar;
+    guest.cs     = flat(selector, attr_kernel_cs);
+    guest.ss     = flat(static_cast<uint16_t>(selector + 8), attr_kernel_ss);
+    guest.cpl    = 0;
+
+    return outcome::done;
+  }
+
+  //
+  // SYSRET, to 64-bit mode (REX.W) or compatibility mode
+  //
+
+  constexpr auto emulate_sysret(state& guest, const msrs& msr, const bool to_64) noexcept -> outcome
+  {
+    if ((msr.efer & efer_sce) == 0 || (msr.efer & efer_lma) == 0) return outcome::undefined;
+    if (guest.cpl != 0)                                             return outcome::general_protection;
+    if (to_64 && !canonical(guest.rcx))                             return outcome::general_protection;
+
+    const uint16_t base = static_cast<uint16_t>(msr.star >> 48);
+
+    guest.rip    = to_64 ? guest.rcx : guest.rcx & 0xffffffff;
+    guest.rflags = (guest.r11 & sysret_rflags) | rflags_fixed;
+    guest.cs     = to_64 ? flat(static_cast<uint16_t>((base + 16) | 3), attr_user_cs)
+                         : flat(static_cast<uint16_t>(base | 3), attr_user_cs32);
+    guest.ss     = flat(static_cast<uint16_t>((base + 8) | 3), attr_user_ss);
+    guest.cpl    = 3;
+
+    return outcome::done;
+  }
+
+  //
+  // Syscalls between their entry and their return
+  //
+
+  // The TSC keeps its low 48 bits, the syscall number goes in the rest
+  constexpr auto pack(const uint64_t tsc, const uint32_t syscall_number) noexcept -> uint64_t
+  {
+    return tsc << 16 | (syscall_number & 0xffff);
+  }
+
+  constexpr auto number_of(const uint64_t packed) noexcept -> uint32_t
+  {
+    return static_cast<uint32_t>(packed & 0xffff);
+  }
+
+  // Cycles from the packed entry to now, good for 2^48 of them
+  constexpr auto cycles_since(const uint64_t packed, const uint64_t now) noexcept -> uint64_t
+  {
+    return (now - (packed >> 16)) & ((1ull << 48) - 1);
+  }
+
+  // Never 0, which marks a free slot
+  constexpr auto thread_key(const uint64_t cr3, const uint64_t gs_base) noexcept -> uint64_t
+  {
+    const uint64_t key = gs_base ^ (cr3 & ~0xfffull) * 0x9e3779b97f4a7c15ull;
+    return key != 0 ? key : 1;
+  }
+
+  template <uint32_t slot_count>
+  class in_flight
+  {
+    static_assert(slot_count != 0 && (slot_count & (slot_count - 1)) == 0,
+                    "The slot count has to be a power of two");
+
+  public:
+    static constexpr uint32_t probe = 8;
+
+    //
+    // A thread entering a syscall. Takes its own slot, a free one or the
+    // oldest in its probe window, in that order. True when that pushed out
+    // another thread's entry. Only ever the owning vCPU, nothing to lock.
+    //
+
+    auto begin(const uint64_t thread, const uint64_t packed) noexcept -> bool
+    {
+      const uint32_t first = index_of(thread);
+
+      uint32_t oldest     = first;
+      uint64_t oldest_age = 0;
+
+      for (uint32_t i = 0; i < probe; ++i)
+      {
+        const uint32_t index   = (first + i) & (slot_count - 1);
+        slot&          current = slots_[index];
+
+        if (current.thread == thread || current.thread == 0)
+        {
+          current = { thread, packed };
+          return false;
+        }
+
+        const uint64_t age = cycles_since(current.packed, packed >> 16);
+        if (age >= oldest_age)
+        {
+          oldest     = index;
+          oldest_age = age;
+        }
+      }
+
+      slots_[oldest] = { thread, packed };
+      return true;
+    }
+
+    //
+    // The thread returning, frees its slot. False when there's no entry for
+    // it: it was evicted, entered on another processor, or the trap came on
+    // during the syscall.
+    //
+
+    auto end(const uint64_t thread, uint64_t& packed) noexcept -> bool
+    {
+      const uint32_t first = index_of(thread);
+
+      for (uint32_t i = 0; i < probe; ++i)
+      {
+        slot& current = slots_[(first + i) & (slot_count - 1)];
+        if (current.thread != thread) continue;
+
+        packed  = current.packed;
+        current = {};
+        return true;
+      }
+
+      return false;
+    }
+
+  private:
+    struct slot
+    {
+      uint64_t thread;
+      uint64_t packed;
+    };
+
+    static constexpr auto index_of(const uint64_t thread) noexcept -> uint32_t
+    {
+      return static_cast<uint32_t>((thread * 0xff51afd7ed558ccdull) >> 40) & (slot_count - 1);
+    }
+
+    slot slots_[slot_count] = {};
+  };
+
+  //
+  // Driver side, located in "hooks/syscall_trap.cpp"
+  //
+
+  // PASSIVE_LEVEL, before the processors are virtualized. Each vCPU sets up
+  // its EFER and #UD intercept from it at virtualization. Also allocates the
+  // vCPUs' in_flight tables, without them nothing gets paired up.
+  auto configure  (bool trap) noexcept -> void;
+  auto enabled    () noexcept -> bool;
+
+  // Once the processors have been devirtualized
+  auto release    () noexcept -> void;
+
+  //
+  // Host side, from the #UD intercept of "svm/vmexit_handler.cpp" once the
+  // instruction was emulated. cr3 and gs_base are the guest's user mode ones,
+  // args are the first four syscall arguments (R10, RDX, R8, R9) as the guest
+  // had them at the SYSCALL.
+  //
+
+  auto on_syscall (uint32_t processor, uint64_t cr3, uint64_t gs_base, uint32_t syscall_number,
+                   const uint64_t (&args)[4]) noexcept -> void;
+  auto on_sysret  (uint32_t processor, uint64_t cr3, uint64_t gs_base) noexcept -> void;
+
+}; // namespace hk::trap
@@ -0,0 +1,419 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <insn_length.hpp>
+
+//
+// Trampolines for inline hooks
+//
+// A hook overwrites the start of the target with an absolute jump to the
+// detour, 14 bytes of "jmp [rip+0]" followed by the address, so no register
+// is clobbered and the detour can sit anywhere. Whatever instructions those
+// 14 bytes cover are "stolen": they're copied into a trampoline, followed by
+// a jump back to the first instruction after them. Calling the trampoline
+// runs the original function.
+//
+// Position dependent instructions can't be copied as they are:
+//
+//   - a RIP-relative operand keeps pointing at the same address. Its disp32
+//     is rebased when the trampoline is within 2 GB of it, otherwise the
+//     address is loaded into a scratch register (r8-r11, one the instruction
+//     doesn't name) saved around it on the stack, and the operand becomes
+//     [scratch]
+//   - JMP, CALL, Jcc and LOOP/JrCXZ become absolute forms
+//
+// Refused (the hook isn't installed) are prologues that return or jump away
+// before 14 bytes, branches back into the stolen bytes, and the handful of
+// RIP-relative forms that can't take a scratch register: those using the
+// stack pointer implicitly or as an operand, and 32-bit (67h) addressing.
+// XBEGIN and 16-bit branches aren't relocated either.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace hk::trampoline
+{
+  // FF 25 00000000 <address>
+  constexpr size_t jump_size  = 14;
+
+  // Bytes of the target a hook replaces at most, the 14 of the jump plus
+  // whatever the last instruction it cuts into sticks out
+  constexpr size_t max_stolen = jump_size + ia32e::insn::max_length - 1;
+
+  // At most jump_size instructions are stolen, none of which grows past 32
+  // bytes (the scratch register form: push, mov r64, imm64, the instruction
+  // a byte longer, pop), plus the way back
+  constexpr size_t max_size   = jump_size * 32 + jump_size;
+
+  enum class status : uint8_t
+  {
+    ok,
+    undecodable,              // an instruction in the stolen range doesn't decode
+    too_short,                // the function leaves before the jump would end
+    branch_into_patch,        // a stolen branch targets the stolen bytes
+    unsupported,              // a position dependent form that can't be relocated
+    no_room,                  // out isn't big enough
+  };
+
+  inline auto emit_jump(uint8_t* at, const uint64_t destination) noexcept -> void
+  {
+    constexpr uint8_t jump[6] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 };
+
+    memcpy(at, jump, sizeof jump);
+    memcpy(at + sizeof jump, &destination, sizeof destination);
+  }
+
+  namespace detail
+  {
+    using ia32e::insn::instruction;
+
+    constexpr auto fits_rel32(const int64_t value) noexcept -> bool
+    {
+      return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    // Where control can't fall through to the next instruction
+    inline auto ends_flow(const instruction& decoded) noexcept -> bool
+    {
+      if (decoded.encoding != ia32e::insn::encoding_legacy) return false;
+
+      if (decoded.map == ia32e::insn::map_one_byte)
+      {
+        switch (decoded.opcode)
+        {
+          case 0xc2: case 0xc3: case 0xca: case 0xcb: case 0xcf:     // RET, RETF, IRET
+          case 0xcc:                                                  // int3 padding
+          case 0xe9: case 0xeb:                                       // JMP
+            return true;
+
+          case 0xff:
+            return ((decoded.modrm >> 3) & 7) == 4 || ((decoded.modrm >> 3) & 7) == 5;
+        }
+
+        return false;
+      }
+
+      // UD2
+      return decoded.map == ia32e::insn::map_0f && decoded.opcode == 0x0b;
+    }
+
+    inline auto read_signed(const uint8_t* at, const size_t size) noexcept -> int64_t
+    {
+      switch (size)
+      {
+        case 1: return static_cast<int8_t>(at[0]);
+        case 2: { int16_t value; memcpy(&value, at, sizeof value); return value; }
+        case 4: { int32_t value; memcpy(&value, at, sizeof value); return value; }
+      }
+
+      return 0;
+    }
+
+    //
+    // Output cursor, keeps writing past the end harmlessly so a single
+    // check at the end catches running out of room
+    //
+
+    struct writer
+    {
+      uint8_t* out;
+      size_t   capacity;
+      size_t   position;
+
+      auto put(const uint8_t* bytes, const size_t size) noexcept -> void
+      {
+        if (position + size <= capacity) memcpy(out + position, bytes, size);
+        position += size;
+      }
+
+      auto put(const uint8_t byte) noexcept -> void { put(&byte, 1); }
+
+      auto put64(const uint64_t value) noexcept -> void
+      {
+        put(reinterpret_cast<const uint8_t*>(&value), sizeof value);
+      }
+
+      auto jump(const uint64_t destination) noexcept -> void
+      {
+        uint8_t bytes[jump_size];
+        emit_jump(bytes, destination);
+        put(bytes, sizeof bytes);
+      }
+    };
+
+    //
+    // Rewrites an instruction whose RIP-relative operand is out of rel32 reach
+    // of the trampoline so it addresses [scratch] instead
+    //
+
+    inline auto relocate_far(writer& out, const uint8_t* code, const instruction& decoded,
+                             const uint64_t address) noexcept -> status
+    {
+      using namespace ia32e::insn;
+
+      // Register operands the instruction names, the scratch register has to
+      // be neither of them
+      uint8_t reg  = (decoded.modrm >> 3) & 7;
+      uint8_t vvvv = 0xff;
+
+      if (decoded.encoding == encoding_legacy)
+      {
+        if ((decoded.rex & 0x04) != 0) reg |= 8;
+
+        // Implicit stack users: CALL/JMP/PUSH [rip], POP [rip]
+        if (decoded.map == map_one_byte &&
+            ((decoded.opcode == 0xff && reg >= 2 && reg <= 6) || decoded.opcode == 0x8f)) return status::unsupported;
+
+        // The stack pointer moves by the scratch push
+        if (reg == 4) return status::unsupported;
+      }
+      else
+      {
+        const bool two_byte_vex = code[decoded.opcode_offset - 2] == 0xc5 && decoded.encoding == encoding_vex;
+        const uint8_t* payload  = two_byte_vex ? code + decoded.opcode_offset - 1
+                                               : code + decoded.opcode_offset - (decoded.encoding == encoding_evex ? 3 : 2);
+
+        if ((payload[0] & 0x80) == 0) reg |= 8;
+
+        const uint8_t vvvv_byte = two_byte_vex ? payload[0] : payload[1];
+        vvvv = static_cast<uint8_t>((~vvvv_byte >> 3) & 0x0f);
+      }
+
+      uint8_t scratch = 11;
+      while (scratch == reg || scratch == vvvv) --scratch;
+
+      const uint8_t low = scratch & 7;
+
+      // push scratch, mov scratch, address
+      out.put(0x41);
+      out.put(static_cast<uint8_t>(0x50 + low));
+      out.put(0x49);
+      out.put(static_cast<uint8_t>(0xb8 + low));
+      out.put64(address);
+
+      // The instruction, disp32 dropped, ModRM now mod 00 rm scratch, and the
+      // base register extension bit set
+      const uint8_t modrm = static_cast<uint8_t>((decoded.modrm & 0x38) | low);
+
+      if (decoded.encoding == encoding_legacy)
+      {
+        // Escapes sit between the REX and the opcode byte
+        const size_t escape = decoded.map == map_one_byte ? 0 : decoded.map == map_0f ? 1 : 2;
+        const size_t start  = decoded.opcode_offset - escape;
+
+        if (decoded.rex != 0)
+        {
+          out.put(code, start - 1);
+          out.put(static_cast<uint8_t>(decoded.rex | 0x01));
+        }
+        else
+        {
+          out.put(code, start);
+          out.put(0x41);
+        }
+
+        out.put(code + start, decoded.opcode_offset + 1 - start);
+      }
+      else if (decoded.encoding == encoding_vex && code[decoded.opcode_offset - 2] == 0xc5)
+      {
+        // Two byte VEX has no B bit, grows into the three byte form
+        const size_t start   = decoded.opcode_offset - 2;
+        const uint8_t byte1  = code[decoded.opcode_offset - 1];
+
+        out.put(code, start);
+        out.put(0xc4);
+        out.put(static_cast<uint8_t>((byte1 & 0x80) | 0x40 | map_0f));      // R, X clear, B set (inverted)
+        out.put(static_cast<uint8_t>(byte1 & 0x7f));                        // W0, vvvv, L, pp
+        out.put(decoded.opcode);
+      }
+      else
+      {
+        // VEX3/XOP/EVEX, B is bit 5 of the first payload byte, inverted
+        const size_t payload = decoded.encoding == encoding_evex ? 3 : 2;
+        const size_t start   = decoded.opcode_offset - payload - 1;
+
+        out.put(code, start + 1);
+        out.put(static_cast<uint8_t>(code[start + 1] & ~0x20));
+        out.put(code + start + 2, decoded.opcode_offset + 1 - (start + 2));
+      }
+
+      out.put(modrm);
+      out.put(code + decoded.immediate_offset, decoded.immediate_size);
+
+      // pop scratch
+      out.put(0x41);
+      out.put(static_cast<uint8_t>(0x58 + low));
+
+      return status::ok;
+    }
+  };
+
+  //
+  // Sizes the stolen range: whole instructions covering at least patch_size
+  // bytes of code. 0 if the range can't be stolen, why in result.
+  //
+
+  inline auto steal(const uint8_t* code, const size_t available, const size_t patch_size,
+                    status& result) noexcept -> size_t
+  {
+    size_t stolen = 0;
+
+    while (stolen < patch_size)
+    {
+      ia32e::insn::instruction decoded;
+
+      if (!ia32e::insn::decode(code + stolen, available - stolen, decoded))
+      {
+        result = status::undecodable;
+        return 0;
+      }
+
+      stolen += decoded.length;
+
+      if (stolen < patch_size && detail::ends_flow(decoded))
+      {
+        result = status::too_short;
+        return 0;
+      }
+    }
+
+    result = status::ok;
+    return stolen;
+  }
+
+  //
+  // Builds the trampoline for the code at source (code being a readable copy
+  // of it) into out, which will execute at out_address. written is the size
+  // of the trampoline, stolen the number of bytes the hook will replace.
+  //
+
+  inline auto build(const uint8_t* code, const size_t available, const uint64_t source,
+                    uint8_t* out, const size_t capacity, const uint64_t out_address,
+                    size_t& stolen, size_t& written, const size_t patch_size = jump_size) noexcept -> status
+  {
+    using namespace ia32e::insn;
+
+    status result = status::ok;
+
+    stolen  = steal(code, available, patch_size, result);
+    written = 0;
+    if (stolen == 0) return result;
+
+    detail::writer output = { out, capacity, 0 };
+
+    for (size_t at = 0; at < stolen;)
+    {
+      instruction decoded;
+      decode(code + at, available - at, decoded);
+
+      const uint8_t* bytes    = code + at;
+      const uint64_t next_ip  = source + at + decoded.length;
+
+      if (decoded.relative_branch)
+      {
+        const uint64_t target = next_ip + detail::read_signed(bytes + decoded.immediate_offset, decoded.immediate_size);
+
+        const bool one_byte = decoded.map == map_one_byte;
+        const bool call     = one_byte && decoded.opcode == 0xe8;
+
+        // A call to the start is recursion and should go through the hook, a
+        // jump there is a loop over stolen code
+        if (decoded.immediate_size == 2) return status::unsupported;
+        if (target >= source + (call ? 1 : 0) && target < source + stolen) return status::branch_into_patch;
+
+        if (one_byte && (decoded.opcode == 0xe9 || decoded.opcode == 0xeb))
+        {
+          output.jump(target);
+        }
+        else if (call)
+        {
+          // call [rip+2], jmp over the address
+          constexpr uint8_t call[8] = { 0xff, 0x15, 0x02, 0x00, 0x00, 0x00, 0xeb, 0x08 };
+          output.put(call, sizeof call);
+          output.put64(target);
+        }
+        else if ((one_byte && decoded.opcode >= 0x70 && decoded.opcode <= 0x7f) || decoded.map == map_0f)
+        {
+          // The inverse condition skips the absolute jump
+          const uint8_t condition = decoded.opcode & 0x0f;
+          output.put(static_cast<uint8_t>(0x70 | (condition ^ 1)));
+          output.put(static_cast<uint8_t>(jump_size));
+          output.jump(target);
+        }
+        else if (one_byte && decoded.opcode >= 0xe0 && decoded.opcode <= 0xe3)
+        {
+          // LOOPcc/JrCXZ only come in rel8: taken lands on the jump, not
+          // taken hops over it
+          output.put(bytes, decoded.opcode_offset);
+          output.put(decoded.opcode);
+          output.put(0x02);
+          output.put(0xeb);
+          output.put(static_cast<uint8_t>(jump_size));
+          output.jump(target);
+        }
+        else return status::unsupported;                      // XBEGIN
+      }
+      else if (decoded.rip_relative)
+      {
+        // EIP-relative, wraps at 4 GB
+        if ((decoded.prefixes & prefix_address_size) != 0) return status::unsupported;
+
+        const uint64_t address      = next_ip + detail::read_signed(bytes + decoded.displacement_offset, 4);
+        const int64_t  displacement = static_cast<int64_t>(address - (out_address + output.position + decoded.length));
+
+        if (detail::fits_rel32(displacement))
+        {
+          const int32_t rebased = static_cast<int32_t>(displacement);
+          const size_t  start   = output.position;
+
+          output.put(bytes, decoded.length);
+          if (output.position <= capacity) memcpy(out + start + decoded.displacement_offset, &rebased, sizeof rebased);
+        }
+        else
+        {
+          const status relocated = detail::relocate_far(output, bytes, decoded, address);
+          if (relocated != status::ok) return relocated;
+        }
+      }
+      else output.put(bytes, decoded.length);
+
+      at += decoded.length;
+    }
+
+    output.jump(source + stolen);
+
+    if (output.position > capacity) return status::no_room;
+
+    written = output.position;
+    return status::ok;
+  }
+
+}; // namespace hk::trampoline
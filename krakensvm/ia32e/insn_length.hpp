@@ -0,0 +1,493 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// x86-64 instruction length decoder
+//
+// Sizes one long mode instruction: legacy prefixes, REX, VEX/XOP/EVEX,
+// opcode, ModRM, SIB, displacement and immediate. It also says where each
+// part sits and whether the instruction is position dependent, which is all
+// hook installation and n_rip-less exit handling need. Disassembling into
+// mnemonics and operands isn't its job.
+//
+// The opcode maps are constexpr tables of one byte per opcode, built at
+// compile time from the ranges in APM vol. 3 appendix A. Decoding walks them
+// without allocating, so it's fine at any IRQL and in root mode.
+//
+// The decoder only sizes: an opcode that is undefined but encodes cleanly
+// (a hole in the 0F 38 map, say) still gets a length. The opcodes long mode
+// removed and anything malformed or truncated are rejected.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace ia32e::insn
+{
+  constexpr size_t max_length = 15;
+
+  enum encoding : uint8_t
+  {
+    encoding_legacy,
+    encoding_vex,
+    encoding_xop,
+    encoding_evex,
+  };
+
+  // Opcode maps, a VEX/XOP/EVEX map select means the same thing
+  enum map : uint8_t
+  {
+    map_one_byte = 0,
+    map_0f       = 1,
+    map_0f38     = 2,
+    map_0f3a     = 3,
+  };
+
+  enum prefix : uint8_t
+  {
+    prefix_lock          = 1u << 0,
+    prefix_rep           = 1u << 1,       // F3
+    prefix_repne         = 1u << 2,       // F2
+    prefix_operand_size  = 1u << 3,       // 66
+    prefix_address_size  = 1u << 4,       // 67
+    prefix_segment       = 1u << 5,       // any of CS, SS, DS, ES, FS, GS
+  };
+
+  struct instruction
+  {
+    uint8_t length;
+    uint8_t encoding;
+    uint8_t map;
+    uint8_t opcode;                       // the byte after the escapes and prefixes
+    uint8_t opcode_offset;
+    uint8_t prefixes;                     // legacy ones, prefix bits
+    uint8_t rex;                          // 0 if there is none in effect
+
+    bool    has_modrm;
+    uint8_t modrm;
+    uint8_t modrm_offset;
+
+    uint8_t displacement_offset;
+    uint8_t displacement_size;            // 0, 1, 4
+
+    uint8_t immediate_offset;
+    uint8_t immediate_size;               // 0, 1, 2, 3 (ENTER), 4, 8
+
+    bool    rip_relative;                 // disp32 of a ModRM operand is relative to the next instruction
+    bool    relative_branch;              // the immediate is a branch displacement
+  };
+
+  namespace detail
+  {
+    //
+    // A table entry: flag bits in the low nibble, immediate kind in the high one
+    //
+
+    enum flag : uint8_t
+    {
+      flag_modrm    = 1u << 0,
+      flag_relative = 1u << 1,
+      flag_invalid  = 1u << 2,
+      flag_register = 1u << 3,            // ModRM never addresses memory, mod is ignored
+    };
+
+    enum immediate : uint8_t
+    {
+      imm_none,
+      imm_byte,
+      imm_word,
+      imm_z,                              // 16 with 66, 32 otherwise
+      imm_v,                              // 16, 32 or 64 with REX.W (MOV r, imm)
+      imm_offset,                         // moffs, the address size
+      imm_word_byte,                      // ENTER
+      imm_group3,                         // F6/F7, TEST only
+      imm_extrq,                          // 0F 78, EXTRQ/INSERTQ (SSE4a) take two bytes, VMREAD none
+    };
+
+    constexpr auto entry(const uint8_t flags, const immediate kind = imm_none) noexcept -> uint8_t
+    {
+      return static_cast<uint8_t>(flags | (kind << 4));
+    }
+
+    struct opcode_table
+    {
+      uint8_t entries[256];
+
+      constexpr auto set(const uint8_t first, const uint8_t last, const uint8_t value) noexcept -> void
+      {
+        for (unsigned op = first; op <= last; ++op) entries[op] = value;
+      }
+    };
+
+    constexpr auto build_one_byte() noexcept -> opcode_table
+    {
+      opcode_table table = {};
+
+      // ALU block 00-3F: op r/m,r and op r,r/m, then AL/eAX with an immediate
+      for (unsigned row = 0; row < 0x40; row += 8)
+      {
+        table.set(row,     row + 3, entry(flag_modrm));
+        table.set(row + 4, row + 4, entry(0, imm_byte));
+        table.set(row + 5, row + 5, entry(0, imm_z));
+      }
+
+      // PUSH/POP seg, DAA and friends are gone in long mode; 26/2E/36/3E are
+      // prefixes and 0F the escape, those never reach the table
+      constexpr uint8_t removed[] = { 0x06, 0x07, 0x0e, 0x16, 0x17, 0x1e, 0x1f, 0x27, 0x2f, 0x37, 0x3f };
+      for (const uint8_t op : removed) table.set(op, op, entry(flag_invalid));
+
+      table.set(0x60, 0x62, entry(flag_invalid));         // 62 is EVEX, taken before the table
+      table.set(0x63, 0x63, entry(flag_modrm));           // MOVSXD
+      table.set(0x68, 0x68, entry(0, imm_z));
+      table.set(0x69, 0x69, entry(flag_modrm, imm_z));
+      table.set(0x6a, 0x6a, entry(0, imm_byte));
+      table.set(0x6b, 0x6b, entry(flag_modrm, imm_byte));
+      table.set(0x70, 0x7f, entry(flag_relative, imm_byte));
+
+      table.set(0x80, 0x80, entry(flag_modrm, imm_byte));
+      table.set(0x81, 0x81, entry(flag_modrm, imm_z));
+      table.set(0x82, 0x82, entry(flag_invalid));
+      table.set(0x83, 0x83, entry(flag_modrm, imm_byte));
+      table.set(0x84, 0x8f, entry(flag_modrm));           // 8F with a map select >= 8 is XOP
+
+      table.set(0x9a, 0x9a, entry(flag_invalid));         // CALL far
+      table.set(0xa0, 0xa3, entry(0, imm_offset));
+      table.set(0xa8, 0xa8, entry(0, imm_byte));
+      table.set(0xa9, 0xa9, entry(0, imm_z));
+      table.set(0xb0, 0xb7, entry(0, imm_byte));
+      table.set(0xb8, 0xbf, entry(0, imm_v));
+
+      table.set(0xc0, 0xc1, entry(flag_modrm, imm_byte));
+      table.set(0xc2, 0xc2, entry(0, imm_word));
+      table.set(0xc4, 0xc5, entry(flag_invalid));         // VEX, taken before the table
+      table.set(0xc6, 0xc6, entry(flag_modrm, imm_byte));
+      table.set(0xc7, 0xc7, entry(flag_modrm, imm_z));    // C7 F8 is XBEGIN, see decode
+      table.set(0xc8, 0xc8, entry(0, imm_word_byte));
+      table.set(0xca, 0xca, entry(0, imm_word));
+      table.set(0xcd, 0xcd, entry(0, imm_byte));
+      table.set(0xce, 0xce, entry(flag_invalid));         // INTO
+
+      table.set(0xd0, 0xd3, entry(flag_modrm));
+      table.set(0xd4, 0xd6, entry(flag_invalid));         // AAM, AAD, SALC
+      table.set(0xd8, 0xdf, entry(flag_modrm));           // x87
+
+      table.set(0xe0, 0xe3, entry(flag_relative, imm_byte));
+      table.set(0xe4, 0xe7, entry(0, imm_byte));
+      table.set(0xe8, 0xe9, entry(flag_relative, imm_z));
+      table.set(0xea, 0xea, entry(flag_invalid));         // JMP far
+      table.set(0xeb, 0xeb, entry(flag_relative, imm_byte));
+
+      table.set(0xf6, 0xf7, entry(flag_modrm, imm_group3));
+      table.set(0xfe, 0xff, entry(flag_modrm));
+
+      return table;
+    }
+
+    constexpr auto build_0f() noexcept -> opcode_table
+    {
+      opcode_table table = {};
+
+      // Nearly everything in the map takes a ModRM, the exceptions follow
+      table.set(0x00, 0xff, entry(flag_modrm));
+
+      table.set(0x04, 0x04, entry(flag_invalid));
+      table.set(0x05, 0x09, entry(0));                    // SYSCALL, CLTS, SYSRET, INVD, WBINVD
+      table.set(0x0a, 0x0a, entry(flag_invalid));
+      table.set(0x0b, 0x0b, entry(0));                    // UD2
+      table.set(0x0c, 0x0c, entry(flag_invalid));
+      table.set(0x0e, 0x0e, entry(0));                    // FEMMS
+      table.set(0x0f, 0x0f, entry(flag_modrm, imm_byte)); // 3DNow!, the opcode is the trailing byte
+      table.set(0x20, 0x23, entry(flag_modrm | flag_register));
+      table.set(0x24, 0x27, entry(flag_invalid));
+      table.set(0x30, 0x37, entry(0));                    // WRMSR ... GETSEC
+      table.set(0x36, 0x36, entry(flag_invalid));
+      table.set(0x39, 0x39, entry(flag_invalid));
+      table.set(0x3b, 0x3f, entry(flag_invalid));
+      table.set(0x70, 0x73, entry(flag_modrm, imm_byte));
+      table.set(0x77, 0x77, entry(0));                    // EMMS
+      table.set(0x78, 0x78, entry(flag_modrm, imm_extrq));
+      table.set(0x7a, 0x7b, entry(flag_invalid));
+      table.set(0x80, 0x8f, entry(flag_relative, imm_z));
+      table.set(0xa0, 0xa2, entry(0));                    // PUSH FS, POP FS, CPUID
+      table.set(0xa4, 0xa4, entry(flag_modrm, imm_byte));
+      table.set(0xa8, 0xaa, entry(0));                    // PUSH GS, POP GS, RSM
+      table.set(0xac, 0xac, entry(flag_modrm, imm_byte));
+      table.set(0xba, 0xba, entry(flag_modrm, imm_byte));
+      table.set(0xc2, 0xc2, entry(flag_modrm, imm_byte));
+      table.set(0xc4, 0xc6, entry(flag_modrm, imm_byte));
+      table.set(0xc8, 0xcf, entry(0));                    // BSWAP
+
+      return table;
+    }
+
+    constexpr auto build_0f38() noexcept -> opcode_table
+    {
+      opcode_table table = {};
+      table.set(0x00, 0xff, entry(flag_modrm));
+      return table;
+    }
+
+    constexpr auto build_0f3a() noexcept -> opcode_table
+    {
+      opcode_table table = {};
+      table.set(0x00, 0xff, entry(flag_modrm, imm_byte));
+      return table;
+    }
+
+    inline constexpr opcode_table table_one_byte = build_one_byte();
+    inline constexpr opcode_table table_0f       = build_0f();
+    inline constexpr opcode_table table_0f38     = build_0f38();
+    inline constexpr opcode_table table_0f3a     = build_0f3a();
+
+    // Legacy prefix bytes to their prefix bit, 0 for anything else
+    constexpr auto build_prefixes() noexcept -> opcode_table
+    {
+      opcode_table table = {};
+
+      table.set(0xf0, 0xf0, prefix_lock);
+      table.set(0xf3, 0xf3, prefix_rep);
+      table.set(0xf2, 0xf2, prefix_repne);
+      table.set(0x66, 0x66, prefix_operand_size);
+      table.set(0x67, 0x67, prefix_address_size);
+
+      constexpr uint8_t segments[] = { 0x26, 0x2e, 0x36, 0x3e, 0x64, 0x65 };
+      for (const uint8_t op : segments) table.set(op, op, prefix_segment);
+
+      return table;
+    }
+
+    inline constexpr opcode_table table_prefixes = build_prefixes();
+
+    //
+    // Immediates of the VEX/EVEX maps: everything in 0F 3A takes one, in 0F
+    // only the shifts by immediate, the compares and the shuffles/inserts do
+    //
+
+    constexpr auto vector_immediate(const uint8_t map, const uint8_t opcode) noexcept -> uint8_t
+    {
+      if (map == map_0f3a) return 1;
+      if (map != map_0f)   return 0;
+
+      return (opcode >= 0x70 && opcode <= 0x73) || opcode == 0xc2 || (opcode >= 0xc4 && opcode <= 0xc6);
+    }
+  };
+
+  //
+  // Decodes the instruction at code, of which available bytes are readable.
+  // Nothing past them is touched. Fails on malformed, truncated and long
+  // mode invalid encodings.
+  //
+
+  inline auto decode(const uint8_t* code, size_t available, instruction& result) noexcept -> bool
+  {
+    using namespace detail;
+
+    result = {};
+
+    const size_t limit = available < max_length ? available : max_length;
+    size_t at = 0;
+
+    // Legacy prefixes and REX, a REX only counts right before the opcode
+    for (;; ++at)
+    {
+      if (at >= limit) return false;
+
+      const uint8_t byte = code[at];
+
+      if (table_prefixes.entries[byte] != 0)
+      {
+        result.prefixes |= table_prefixes.entries[byte];
+        result.rex       = 0;
+      }
+      else if ((byte & 0xf0) == 0x40) result.rex = byte;
+      else break;
+    }
+
+    const bool rex_w       = (result.rex & 0x08) != 0;
+    bool       operand_16  = (result.prefixes & prefix_operand_size) != 0 && !rex_w;
+
+    uint8_t table_entry = 0;
+    const uint8_t first = code[at];
+
+    const bool xop = first == 0x8f && at + 1 < limit && (code[at + 1] & 0x1f) >= 8;
+
+    if (first == 0xc4 || first == 0xc5 || first == 0x62 || xop)
+    {
+      // None of these may follow a REX, 66, F2, F3 or LOCK
+      if (result.rex != 0 ||
+          (result.prefixes & (prefix_lock | prefix_rep | prefix_repne | prefix_operand_size)) != 0) return false;
+
+      const size_t payload = first == 0xc5 ? 1 : first == 0x62 ? 3 : 2;
+      if (at + 1 + payload >= limit) return false;
+
+      const uint8_t* p = code + at + 1;
+
+      if (first == 0xc5)
+      {
+        result.encoding = encoding_vex;
+        result.map      = map_0f;
+      }
+      else if (first == 0xc4)
+      {
+        result.encoding = encoding_vex;
+        result.map      = p[0] & 0x1f;
+        if (result.map < map_0f || result.map > map_0f3a) return false;
+      }
+      else if (xop)
+      {
+        result.encoding = encoding_xop;
+        result.map      = p[0] & 0x1f;
+        if (result.map > 0x0a) return false;
+      }
+      else
+      {
+        // P0 bit 3 is reserved zero, P1 bit 2 reserved one, maps 5/6 are AVX512-FP16
+        result.encoding = encoding_evex;
+        result.map      = p[0] & 0x07;
+        if ((p[0] & 0x08) != 0 || (p[1] & 0x04) == 0) return false;
+        if (result.map == 0 || result.map == 4 || result.map == 7) return false;
+      }
+
+      at += 1 + payload;
+
+      result.opcode_offset = static_cast<uint8_t>(at);
+      result.opcode        = code[at++];
+
+      // VZEROUPPER/VZEROALL are the only ones without a ModRM
+      const bool modrm = !(result.encoding == encoding_vex && result.map == map_0f && result.opcode == 0x77);
+
+      const uint8_t immediate = result.encoding == encoding_xop ? (result.map == 0x08 ? 1 : result.map == 0x0a ? 4 : 0)
+                                                                : vector_immediate(result.map, result.opcode);
+
+      table_entry = entry(modrm ? flag_modrm : 0, immediate == 1 ? imm_byte : immediate == 4 ? imm_z : imm_none);
+      operand_16  = false;
+    }
+    else
+    {
+      const opcode_table* table = &table_one_byte;
+      result.map = map_one_byte;
+
+      if (first == 0x0f)
+      {
+        if (++at >= limit) return false;
+
+        table      = &table_0f;
+        result.map = map_0f;
+
+        if (code[at] == 0x38 || code[at] == 0x3a)
+        {
+          table      = code[at] == 0x38 ? &table_0f38 : &table_0f3a;
+          result.map = code[at] == 0x38 ? map_0f38 : map_0f3a;
+          if (++at >= limit) return false;
+        }
+      }
+
+      result.opcode_offset = static_cast<uint8_t>(at);
+      result.opcode        = code[at++];
+      table_entry          = table->entries[result.opcode];
+
+      if ((table_entry & flag_invalid) != 0) return false;
+    }
+
+    // ModRM, SIB and displacement
+    if ((table_entry & flag_modrm) != 0)
+    {
+      if (at >= limit) return false;
+
+      result.has_modrm    = true;
+      result.modrm_offset = static_cast<uint8_t>(at);
+      result.modrm        = code[at++];
+
+      const uint8_t mod = result.modrm >> 6;
+      const uint8_t rm  = result.modrm & 7;
+
+      if (mod != 3 && (table_entry & flag_register) == 0)
+      {
+        uint8_t displacement = mod == 1 ? 1 : mod == 2 ? 4 : 0;
+
+        if (rm == 4)
+        {
+          if (at >= limit) return false;
+          const uint8_t sib = code[at++];
+          if (mod == 0 && (sib & 7) == 5) displacement = 4;
+        }
+        else if (mod == 0 && rm == 5)
+        {
+          displacement        = 4;
+          result.rip_relative = true;
+        }
+
+        result.displacement_offset = static_cast<uint8_t>(at);
+        result.displacement_size   = displacement;
+        at += displacement;
+      }
+    }
+
+    // Immediate
+    uint8_t immediate = 0;
+
+    switch (table_entry >> 4)
+    {
+    case imm_byte:      immediate = 1; break;
+    case imm_word:      immediate = 2; break;
+    case imm_z:         immediate = operand_16 ? 2 : 4; break;
+    case imm_v:         immediate = rex_w ? 8 : operand_16 ? 2 : 4; break;
+    case imm_offset:    immediate = (result.prefixes & prefix_address_size) != 0 ? 4 : 8; break;
+    case imm_word_byte: immediate = 3; break;
+    case imm_group3:
+      if (((result.modrm >> 3) & 7) < 2) immediate = (result.opcode & 1) != 0 ? (operand_16 ? 2 : 4) : 1;
+      break;
+    case imm_extrq:
+      if ((result.prefixes & (prefix_operand_size | prefix_repne)) != 0 && (result.modrm >> 6) == 3) immediate = 2;
+      break;
+    default: break;
+    }
+
+    result.relative_branch = (table_entry & flag_relative) != 0 ||
+                             (result.encoding == encoding_legacy && result.map == map_one_byte &&
+                              result.opcode == 0xc7 && result.modrm == 0xf8);        // XBEGIN
+
+    result.immediate_offset = static_cast<uint8_t>(at);
+    result.immediate_size   = immediate;
+    at += immediate;
+
+    if (at > limit) return false;
+
+    result.length = static_cast<uint8_t>(at);
+    return true;
+  }
+
+  // Length of the instruction at code, 0 if it doesn't decode
+  inline auto length(const uint8_t* code, const size_t available) noexcept -> size_t
+  {
+    instruction decoded;
+    return decode(code, available, decoded) ? decoded.length : 0;
+  }
+
+}; // namespace ia32e::insn
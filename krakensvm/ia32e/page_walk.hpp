@@ -0,0 +1,387 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Guest page table walker
+//
+// GVA -> GPA for 4 and 5 level long mode paging, 1 GB and 2 MB pages
+// included, with the R/W, U/S and NX checks the processor would do. Entries
+// are the PML4E/PDPE/PDE/PTE formats of "ia32e/paging.hpp", only the bits
+// the walk needs are spelled out here so this header stays WDK-free.
+//
+// Physical memory is read through whatever the caller hands in, the driver
+// reads guest physical memory through its own mapping (there's no nested
+// paging, GPA == SPA), a test can hand in a buffer with made-up tables.
+//
+// In front of the walk sits a small direct mapped cache per vCPU keyed by
+// (CR3, VA page). It's dropped on a CR3 write, a CR4 paging bit change or
+// INVPCID and narrowed on INVLPG, see tlb below for when those are actually
+// seen.
+//
+
+namespace ia32e::walk
+{
+  constexpr uint64_t page_size_4k = 0x1000;
+  constexpr uint64_t page_size_2m = 0x200000;
+  constexpr uint64_t page_size_1g = 0x40000000;
+
+  // Entry bits, APM vol. 2 5.3.3
+  constexpr uint64_t entry_present    = 1ull << 0;
+  constexpr uint64_t entry_write      = 1ull << 1;
+  constexpr uint64_t entry_user       = 1ull << 2;
+  constexpr uint64_t entry_accessed   = 1ull << 5;
+  constexpr uint64_t entry_dirty      = 1ull << 6;        // the mapping's last level only
+  constexpr uint64_t entry_large      = 1ull << 7;        // PS, PDPE and PDE only
+  constexpr uint64_t entry_nx         = 1ull << 63;
+  constexpr uint64_t entry_address    = 0x000ffffffffff000ull;
+
+  constexpr uint64_t cr3_address      = 0x000ffffffffff000ull;
+
+  //
+  // What the access is, the same bits a #PF error code uses. access_dirty
+  // isn't one of them: the caller is about to write to the page, permitted
+  // or not, so the walk sets A and D the way the processor would.
+  //
+
+  enum access : uint32_t
+  {
+    access_read    = 0,
+    access_write   = 1u << 1,
+    access_user    = 1u << 2,
+    access_execute = 1u << 4,
+    access_dirty   = 1u << 31,
+  };
+
+  enum class status : uint8_t
+  {
+    ok,
+    non_canonical,
+    not_present,
+    reserved,                 // PS where it can't be, the walk can't go on
+    protection,               // translated, but access isn't allowed
+    unreadable,               // the physical read of a table failed, or its
+                              // A/D bits kept changing under the walk
+  };
+
+  //
+  // The parts of guest state the walk depends on
+  //
+
+  struct context
+  {
+    uint64_t cr3;
+    bool     la57;            // CR4.LA57, 5 level paging
+    bool     nxe;             // EFER.NXE
+    bool     write_protect;   // CR0.WP
+  };
+
+  struct translation
+  {
+    uint64_t gpa;
+    uint64_t page_size;       // of the mapping gpa is in
+    bool     writable;        // ANDed over every level
+    bool     user;
+    bool     executable;
+    bool     dirty;           // D of the last level, set now or before
+  };
+
+  constexpr auto canonical(const uint64_t va, const bool la57) noexcept -> bool
+  {
+    const uint32_t bits = la57 ? 57 : 48;
+    const int64_t  high = static_cast<int64_t>(va) >> (bits - 1);
+
+    return high == 0 || high == -1;
+  }
+
+  constexpr auto allowed(const translation& result, const uint32_t requested, const bool write_protect) noexcept -> bool
+  {
+    const bool user_access = (requested & access_user) != 0;
+
+    if (user_access && !result.user)                                           return false;
+    if ((requested & access_write) && !result.writable &&
+        (user_access || write_protect))                                        return false;
+    if ((requested & access_execute) && !result.executable)                    return false;
+
+    return true;
+  }
+
+  //
+  // read_entry(uint64_t gpa, uint64_t& entry) -> bool
+  //
+  // update_entry(uint64_t gpa, uint64_t expected, uint64_t desired) -> bool,
+  // a compare-exchange of the entry at gpa, false when it isn't expected
+  // any more. Only called for access_dirty walks. Bits must not be ORed in
+  // blindly: once the guest cleared P the rest of the entry is Windows'
+  // own, a D bit set there corrupts it.
+  //
+
+  struct no_update
+  {
+    constexpr auto operator()(uint64_t, uint64_t, uint64_t) const noexcept -> bool { return true; }
+  };
+
+  // Walks restarted because the guest changed an entry before A/D went in
+  constexpr uint32_t max_update_attempts = 8;
+
+  struct path_entry
+  {
+    uint64_t gpa;
+    uint64_t value;
+  };
+
+  template<class reader>
+  constexpr auto walk_once(const context& state, const uint64_t va, const uint32_t requested,
+                           reader&& read_entry, translation& result, path_entry* path, uint32_t& depth) noexcept -> status
+  {
+    if (!canonical(va, state.la57)) return status::non_canonical;
+
+    uint64_t table = state.cr3 & cr3_address;
+
+    result.writable   = true;
+    result.user       = true;
+    result.executable = true;
+
+    depth = 0;
+
+    for (int32_t level = state.la57 ? 5 : 4; level >= 1; --level)
+    {
+      const uint32_t shift = 12 + 9 * (level - 1);
+      const uint64_t gpa   = table + ((va >> shift) & 0x1ff) * 8;
+      uint64_t entry = 0;
+
+      if (!read_entry(gpa, entry))                                  return status::unreadable;
+      if ((entry & entry_present) == 0)                             return status::not_present;
+
+      path[depth++] = { gpa, entry };
+
+      result.writable   = result.writable && (entry & entry_write) != 0;
+      result.user       = result.user     && (entry & entry_user)  != 0;
+      result.executable = result.executable && !(state.nxe && (entry & entry_nx) != 0);
+
+      const bool large = (entry & entry_large) != 0;
+
+      // PS is reserved in the PML5E and PML4E, a 4 KB PTE uses bit 7 for PAT
+      if (large && level >= 4) return status::reserved;
+
+      if (level == 1 || (large && level <= 3))
+      {
+        result.page_size = 1ull << shift;
+        result.dirty     = (entry & entry_dirty) != 0;
+
+        const uint64_t base = entry & entry_address & ~(result.page_size - 1);
+        result.gpa          = base | (va & (result.page_size - 1));
+
+        return allowed(result, requested, state.write_protect) ? status::ok : status::protection;
+      }
+
+      table = entry & entry_address;
+    }
+
+    return status::not_present;
+  }
+
+  // A on every level, D on the last, false when an entry changed meanwhile
+  template<class updater>
+  constexpr auto mark_dirty(const path_entry* path, const uint32_t depth, updater&& update_entry) noexcept -> bool
+  {
+    for (uint32_t level = 0; level < depth; ++level)
+    {
+      const uint64_t bits = entry_accessed | (level + 1 == depth ? entry_dirty : 0);
+
+      if ((path[level].value & bits) == bits) continue;
+
+      if (!update_entry(path[level].gpa, path[level].value, path[level].value | bits)) return false;
+    }
+
+    return true;
+  }
+
+  template<class reader, class updater>
+  constexpr auto translate(const context& state, const uint64_t va, const uint32_t requested,
+                           reader&& read_entry, updater&& update_entry, translation& result) noexcept -> status
+  {
+    for (uint32_t attempt = 0; attempt < max_update_attempts; ++attempt)
+    {
+      path_entry path[5] = {};
+      uint32_t   depth   = 0;
+
+      const status walked = walk_once(state, va, requested, read_entry, result, path, depth);
+      if (walked != status::ok || (requested & access_dirty) == 0) return walked;
+
+      if (mark_dirty(path, depth, update_entry))
+      {
+        result.dirty = true;
+        return status::ok;
+      }
+    }
+
+    return status::unreadable;
+  }
+
+  // Tables taken as read-only, A and D are left alone
+  template<class reader>
+  constexpr auto translate(const context& state, const uint64_t va, const uint32_t requested,
+                           reader&& read_entry, translation& result) noexcept -> status
+  {
+    return translate(state, va, requested & ~access_dirty, read_entry, no_update {}, result);
+  }
+
+  //
+  // Per-vCPU translation cache
+  //
+  // Direct mapped on the VA page, tagged with CR3 and a generation so a flush
+  // is one increment. Large mappings are cached a 4 KB piece at a time, an
+  // INVLPG has to drop the whole cache while any of those are in it.
+  //
+  // The cache only outlives a #VMEXIT while every way the guest has of
+  // dropping translations is intercepted (the tracing intercept profile, see
+  // intercept_profile::tracks_invalidations()). Otherwise vmexit_handler
+  // flushes it on every exit and it only saves walks within one.
+  //
+
+  constexpr uint32_t tlb_entries = 64;
+
+  static_assert((tlb_entries & (tlb_entries - 1)) == 0, "The cache has to be a power of two");
+
+  struct tlb_entry
+  {
+    uint64_t cr3;
+    uint64_t va_page;
+    uint64_t gpa_page;
+    uint32_t generation;
+    uint8_t  writable;
+    uint8_t  user;
+    uint8_t  executable;
+    uint8_t  large;
+    uint8_t  dirty;
+  };
+
+  struct tlb
+  {
+    tlb_entry entries[tlb_entries];
+    uint32_t  generation;     // entries of another generation are empty
+    uint32_t  large_entries;  // of the current generation, roughly
+    uint64_t  hits;
+    uint64_t  misses;
+
+    auto flush() noexcept -> void
+    {
+      // 0 is what a zeroed cache starts with, never make it current
+      if (++generation == 0) generation = 1;
+      large_entries = 0;
+    }
+
+    auto invalidate(const uint64_t va) noexcept -> void
+    {
+      if (large_entries != 0) return flush();
+
+      tlb_entry& entry = entries[(va >> 12) & (tlb_entries - 1)];
+      if (entry.va_page == (va & ~(page_size_4k - 1))) entry.generation = 0;
+    }
+
+    auto lookup(const uint64_t cr3, const uint64_t va, translation& result) noexcept -> bool
+    {
+      const tlb_entry& entry = entries[(va >> 12) & (tlb_entries - 1)];
+
+      if (generation == 0 || entry.generation != generation ||
+          entry.cr3 != (cr3 & cr3_address) || entry.va_page != (va & ~(page_size_4k - 1)))
+      {
+        ++misses;
+        return false;
+      }
+
+      ++hits;
+
+      result.gpa        = entry.gpa_page | (va & (page_size_4k - 1));
+      result.page_size  = page_size_4k;
+      result.writable   = entry.writable;
+      result.user       = entry.user;
+      result.executable = entry.executable;
+      result.dirty      = entry.dirty;
+
+      return true;
+    }
+
+    auto insert(const uint64_t cr3, const uint64_t va, const translation& result) noexcept -> void
+    {
+      if (generation == 0) generation = 1;
+
+      tlb_entry& entry = entries[(va >> 12) & (tlb_entries - 1)];
+
+      entry.cr3        = cr3 & cr3_address;
+      entry.va_page    = va & ~(page_size_4k - 1);
+      entry.gpa_page   = result.gpa & ~(page_size_4k - 1);
+      entry.generation = generation;
+      entry.writable   = result.writable;
+      entry.user       = result.user;
+      entry.executable = result.executable;
+      entry.large      = result.page_size != page_size_4k;
+      entry.dirty      = result.dirty;
+
+      if (entry.large) ++large_entries;
+    }
+  };
+
+  //
+  // The walk with the cache in front of it. What's cached is the translation,
+  // the permission check runs on every lookup, hit or not. Like the
+  // processor's TLB it remembers D, an access_dirty hit on a clean entry
+  // walks again to set it.
+  //
+
+  template<class reader, class updater>
+  auto translate_cached(tlb& cache, const context& state, const uint64_t va, const uint32_t requested,
+                        reader&& read_entry, updater&& update_entry, translation& result) noexcept -> status
+  {
+    const bool dirtying = (requested & access_dirty) != 0;
+
+    if (cache.lookup(state.cr3, va, result) && (result.dirty || !dirtying))
+    {
+      return allowed(result, requested, state.write_protect) ? status::ok : status::protection;
+    }
+
+    // Walked as a plain read so the translation can be cached either way,
+    // unless A/D have to go in, which only happens for an allowed access
+    const status walked = translate(state, va, dirtying ? requested : access_read, read_entry, update_entry, result);
+    if (walked != status::ok) return walked;
+
+    cache.insert(state.cr3, va, result);
+
+    return allowed(result, requested, state.write_protect) ? status::ok : status::protection;
+  }
+
+  template<class reader>
+  auto translate_cached(tlb& cache, const context& state, const uint64_t va, const uint32_t requested,
+                        reader&& read_entry, translation& result) noexcept -> status
+  {
+    return translate_cached(cache, state, va, requested & ~access_dirty, read_entry, no_update {}, result);
+  }
+
+}; // namespace ia32e::walk
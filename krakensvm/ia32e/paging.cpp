@@ -47,4 +47,23 @@ namespace ia32e::mm
     return memory;
   }
 
+  auto system_node_alloc(size_t bytes_number, uint32_t node) -> void*
+  {
+    void* memory = nullptr;
+    PHYSICAL_ADDRESS lowest, highest, boundary;
+
+    lowest.QuadPart   = 0;
+    highest.QuadPart  = -1;
+    boundary.QuadPart = 0;
+
+    // Windows 8 and up, node is only a preference
+    memory = MmAllocateContiguousNodeMemory(bytes_number, lowest, highest, boundary,
+                                            PAGE_READWRITE, static_cast<NODE_REQUIREMENT>(node));
+
+    if (memory == nullptr) { return system_contiguous_alloc(bytes_number); }
+
+    memset(memory, 0, bytes_number);
+    return memory;
+  }
+
 }; // namespace ia32e::mm
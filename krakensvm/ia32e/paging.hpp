@@ -181,6 +181,10 @@ namespace ia32e::mm
   // page_aligned_alloc free_page_aligned_alloc
 #define system_free_contiguous(base_address) MmFreeContiguousMemory(base_address)
 
+  // Same, out of the given NUMA node's memory when it has any left. Freed
+  // with system_free_contiguous as well.
+  auto system_node_alloc(size_t bytes_number, uint32_t node) -> void*;
+
   //
   // Hypervisor Allocation
   //
@@ -0,0 +1,460 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <type_traits>
+
+//
+// Deferred formatting binary log
+//
+// kprint_info formats and calls into the debugger transport right where it's
+// called, which is far too slow for anything that runs on a #VMEXIT. klog_info
+// only writes the address of its (checked at compile time) format string and
+// the raw arguments into the current CPU's ring, the text is put together later
+// at PASSIVE_LEVEL on the deferred worker ("inc/deferred_work.hpp") or by
+// whoever reads the rings out.
+//
+// %s arguments are stored as pointers and read when the record is formatted, so
+// they have to be string literals or other strings that outlive the record.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace binlog
+{
+  constexpr size_t   cache_line  = 64;
+  constexpr uint32_t max_args    = 4;
+
+  //
+  // Records
+  //
+
+  struct alignas(cache_line) record
+  {
+    uint64_t sequence;    // position in the ring + 1, written last
+    uint64_t tsc;
+    uint64_t format;      // address of the format string in the driver image
+    uint32_t format_id;   // FNV-1a of the format string, for readers outside the driver
+    uint8_t  arg_count;
+    uint8_t  reserved;
+    uint16_t arg_widths;  // size in bytes of each argument, a nibble each
+    uint64_t args[max_args];
+  };
+
+  static_assert(sizeof(record) == cache_line, "A log record has to fill exactly one cache line");
+
+  struct ring_header
+  {
+    uint32_t capacity;          // records, a power of two
+    uint32_t cpu;
+    uint64_t records_offset;    // from the start of this header
+
+    alignas(cache_line) uint64_t head;     // producers, reserved with a CAS
+    alignas(cache_line) uint64_t tail;     // consumer
+    alignas(cache_line) uint64_t dropped;  // records lost to a full ring
+  };
+
+  inline auto ring_records(ring_header* ring) noexcept -> record*
+  {
+    return reinterpret_cast<record*>(reinterpret_cast<uint8_t*>(ring) + ring->records_offset);
+  }
+
+  constexpr auto ring_bytes(const uint32_t capacity) noexcept -> size_t
+  {
+    return ((sizeof(ring_header) + cache_line - 1) & ~(cache_line - 1)) + static_cast<size_t>(capacity) * sizeof(record);
+  }
+
+  inline auto ring_init(void* region, const uint32_t capacity, const uint32_t cpu) noexcept -> ring_header*
+  {
+    if (region == nullptr || capacity == 0 || (capacity & (capacity - 1)) != 0) return nullptr;
+
+    auto* ring = static_cast<ring_header*>(region);
+
+    *ring = {};
+    ring->capacity       = capacity;
+    ring->cpu            = cpu;
+    ring->records_offset = (sizeof(ring_header) + cache_line - 1) & ~(cache_line - 1);
+
+    record* records = ring_records(ring);
+    for (uint32_t i = 0; i < capacity; ++i) records[i].sequence = 0;
+
+    return ring;
+  }
+
+  //
+  // Producers. A CPU can log from the guest and then again from a #VMEXIT that
+  // interrupts it, so slots are reserved with a CAS on head and only become
+  // visible to the consumer once their sequence is written.
+  //
+
+  inline auto ring_reserve(ring_header* ring) noexcept -> record*
+  {
+    std::atomic_ref<uint64_t> head(ring->head);
+    uint64_t position = head.load(std::memory_order_relaxed);
+
+    do
+    {
+      const uint64_t tail = std::atomic_ref<uint64_t>(ring->tail).load(std::memory_order_acquire);
+
+      if (position - tail >= ring->capacity)
+      {
+        std::atomic_ref<uint64_t>(ring->dropped).fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+    } while (!head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed));
+
+    record* slot = &ring_records(ring)[position & (ring->capacity - 1)];
+    slot->reserved = 0;
+    slot->tsc      = position + 1; // the sequence to publish, until commit
+    return slot;
+  }
+
+  inline auto ring_commit(record* slot, const uint64_t tsc) noexcept -> void
+  {
+    const uint64_t sequence = slot->tsc;
+
+    slot->tsc = tsc;
+    std::atomic_ref<uint64_t>(slot->sequence).store(sequence, std::memory_order_release);
+  }
+
+  //
+  // Consumer, a single one per ring. Stops at the first slot that's reserved
+  // but not committed yet.
+  //
+
+  inline auto ring_pop(ring_header* ring, record& out) noexcept -> bool
+  {
+    const uint64_t position = ring->tail;
+    const record&  slot     = ring_records(ring)[position & (ring->capacity - 1)];
+
+    if (std::atomic_ref<uint64_t>(const_cast<uint64_t&>(slot.sequence)).load(std::memory_order_acquire) != position + 1)
+    {
+      return false;
+    }
+
+    out = slot;
+    std::atomic_ref<uint64_t>(ring->tail).store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  //
+  // Compile time format checking
+  //
+
+  enum class arg_kind : uint8_t
+  {
+    integer,
+    pointer,
+    string
+  };
+
+  template<class T>
+  constexpr auto kind_of() noexcept -> arg_kind
+  {
+    using type = std::remove_cv_t<T>;
+
+    if constexpr (std::is_same_v<type, const char*> || std::is_same_v<type, char*>) return arg_kind::string;
+    else if constexpr (std::is_pointer_v<type> || std::is_null_pointer_v<type>)    return arg_kind::pointer;
+    else
+    {
+      static_assert(std::is_integral_v<type> || std::is_enum_v<type>,
+                    "klog_info only takes integers, enums, pointers and C strings");
+      return arg_kind::integer;
+    }
+  }
+
+  template<class T>
+  constexpr auto pack(const T value) noexcept -> uint64_t
+  {
+    if constexpr (std::is_pointer_v<T>)        return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value));
+    else if constexpr (std::is_null_pointer_v<T>) return 0;
+    else if constexpr (std::is_enum_v<T>)      return pack(static_cast<std::underlying_type_t<T>>(value));
+    else if constexpr (std::is_signed_v<T>)    return static_cast<uint64_t>(static_cast<int64_t>(value));
+    else                                       return static_cast<uint64_t>(value);
+  }
+
+  constexpr auto fnv1a(const char* text) noexcept -> uint32_t
+  {
+    uint32_t hash = 0x811c9dc5;
+
+    for (; *text; ++text)
+    {
+      hash ^= static_cast<uint8_t>(*text);
+      hash *= 0x01000193;
+    }
+
+    return hash;
+  }
+
+  // Never defined, reaching it while checking a format string stops the build
+  void format_string_does_not_match_its_arguments() noexcept;
+
+  // Walks one conversion specification, returns the conversion character
+  constexpr auto parse_spec(const char*& cursor) noexcept -> char
+  {
+    while (*cursor == '-' || *cursor == '0' || *cursor == '+' || *cursor == ' ' || *cursor == '#') ++cursor;
+    while (*cursor >= '0' && *cursor <= '9') ++cursor;
+
+    while (*cursor == 'h' || *cursor == 'l' || *cursor == 'z' || *cursor == 'I' ||
+           *cursor == '6' || *cursor == '4') ++cursor;
+
+    return *cursor ? *cursor++ : 0;
+  }
+
+  constexpr auto check_format(const char* text, const arg_kind* kinds, const size_t count) noexcept -> bool
+  {
+    size_t used = 0;
+
+    while (*text)
+    {
+      if (*text++ != '%') continue;
+      if (*text == '%') { ++text; continue; }
+
+      const char conversion = parse_spec(text);
+      if (used >= count) return false;
+
+      const arg_kind kind = kinds[used++];
+
+      switch (conversion)
+      {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'c':
+          if (kind != arg_kind::integer) return false;
+          break;
+
+        case 'p':
+          if (kind == arg_kind::string) return false;
+          break;
+
+        case 's':
+          if (kind != arg_kind::string) return false;
+          break;
+
+        default:
+          return false;
+      }
+    }
+
+    return used == count;
+  }
+
+  template<class... Args>
+  struct checked_format
+  {
+    const char* text;
+    uint32_t    id;
+
+    template<size_t N>
+    consteval checked_format(const char (&format)[N]) noexcept : text(format), id(fnv1a(format))
+    {
+      constexpr arg_kind kinds[sizeof...(Args) + 1] = { kind_of<Args>()..., arg_kind::integer };
+
+      if (!check_format(format, kinds, sizeof...(Args)))
+      {
+        format_string_does_not_match_its_arguments();
+      }
+    }
+  };
+
+  //
+  // Formatting, same conversions the checker lets through
+  //
+
+  namespace detail
+  {
+    struct writer
+    {
+      char*  out;
+      size_t size;
+      size_t length;
+
+      constexpr auto put(const char c) noexcept -> void
+      {
+        if (length + 1 < size) out[length] = c;
+        ++length;
+      }
+    };
+
+    constexpr auto put_number(writer& w, uint64_t value, const uint32_t base, const bool upper,
+                              const bool negative, uint32_t width, const bool zero_pad, const bool left) noexcept -> void
+    {
+      char digits[24] = {};
+      uint32_t count  = 0;
+
+      do
+      {
+        const uint32_t digit = static_cast<uint32_t>(value % base);
+        digits[count++] = static_cast<char>(digit < 10 ? '0' + digit : (upper ? 'A' : 'a') + digit - 10);
+        value /= base;
+      } while (value != 0);
+
+      const uint32_t total = count + (negative ? 1 : 0);
+      const uint32_t pad   = width > total ? width - total : 0;
+
+      if (!left && !zero_pad) for (uint32_t i = 0; i < pad; ++i) w.put(' ');
+      if (negative) w.put('-');
+      if (!left && zero_pad)  for (uint32_t i = 0; i < pad; ++i) w.put('0');
+
+      while (count) w.put(digits[--count]);
+
+      if (left) for (uint32_t i = 0; i < pad; ++i) w.put(' ');
+    }
+  };
+
+  //
+  // Formats a record into out, always terminated. Returns the length the full
+  // text would have.
+  //
+
+  inline auto format(const record& current, const char* format_text, char* out, const size_t size) noexcept -> size_t
+  {
+    detail::writer w { out, size, 0 };
+    uint32_t used = 0;
+
+    for (const char* cursor = format_text; cursor && *cursor;)
+    {
+      if (*cursor != '%')    { w.put(*cursor++); continue; }
+      if (*++cursor == '%')  { w.put(*cursor++); continue; }
+
+      bool left = false, zero_pad = false;
+      uint32_t width = 0;
+
+      for (;; ++cursor)
+      {
+        if      (*cursor == '-') left = true;
+        else if (*cursor == '0') zero_pad = true;
+        else if (*cursor != '+' && *cursor != ' ' && *cursor != '#') break;
+      }
+
+      while (*cursor >= '0' && *cursor <= '9') width = width * 10 + (*cursor++ - '0');
+
+      while (*cursor == 'h' || *cursor == 'l' || *cursor == 'z' || *cursor == 'I' ||
+             *cursor == '6' || *cursor == '4') ++cursor;
+
+      const char conversion = *cursor ? *cursor++ : 0;
+      if (conversion == 0 || used >= current.arg_count) break;
+
+      const uint32_t bytes = (current.arg_widths >> (used * 4)) & 0xf;
+      uint64_t value = current.args[used++];
+
+      // Unsigned conversions only show as many bytes as the argument had
+      if (bytes != 0 && bytes < 8 && conversion != 'd' && conversion != 'i')
+      {
+        value &= (1ull << (bytes * 8)) - 1;
+      }
+
+      switch (conversion)
+      {
+        case 'd': case 'i':
+        {
+          const bool negative = static_cast<int64_t>(value) < 0;
+          detail::put_number(w, negative ? 0 - value : value, 10, false, negative, width, zero_pad, left);
+          break;
+        }
+
+        case 'u': detail::put_number(w, value, 10, false, false, width, zero_pad, left); break;
+        case 'x': detail::put_number(w, value, 16, false, false, width, zero_pad, left); break;
+        case 'X': detail::put_number(w, value, 16, true,  false, width, zero_pad, left); break;
+        case 'p': detail::put_number(w, value, 16, true,  false, 16,    true,     false); break;
+        case 'c': w.put(static_cast<char>(value)); break;
+
+        case 's':
+        {
+          const char* text = reinterpret_cast<const char*>(static_cast<uintptr_t>(value));
+          for (text = text ? text : "(null)"; *text; ++text) w.put(*text);
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+
+    if (size != 0) out[w.length < size ? w.length : size - 1] = '\0';
+    return w.length;
+  }
+
+  //
+  // Fills in everything of a record but its sequence and TSC, which are the
+  // ring's
+  //
+
+  template<class... Args>
+  inline auto encode(record& slot, const checked_format<std::type_identity_t<Args>...>& format,
+                     const Args... args) noexcept -> void
+  {
+    static_assert(sizeof...(Args) <= max_args, "A record takes at most binlog::max_args arguments");
+
+    const uint64_t packed[sizeof...(Args) + 1] = { pack(args)..., 0 };
+    uint16_t widths = 0;
+    uint32_t index  = 0;
+
+    ((widths |= static_cast<uint16_t>((sizeof(Args) & 0xf) << (index++ * 4))), ...);
+
+    slot.format     = reinterpret_cast<uint64_t>(format.text);
+    slot.format_id  = format.id;
+    slot.arg_count  = static_cast<uint8_t>(sizeof...(Args));
+    slot.arg_widths = widths;
+
+    for (uint32_t i = 0; i < sizeof...(Args); ++i) slot.args[i] = packed[i];
+  }
+
+  //
+  // Driver side, located in "svm/binlog.cpp"
+  //
+
+  // Reserves a record in the current CPU's ring, nullptr if logging is off or it's full
+  auto reserve() noexcept -> record*;
+  auto commit (record* slot) noexcept -> void;
+
+  // PASSIVE_LEVEL. flush() is the rings' only reader: it runs on the deferred
+  // worker, shutdown() only after deferred::shutdown(). The one exception is
+  // a bugcheck, initialize() registers a callback that drains whatever is
+  // left into the crash dump so a record logged right before the machine
+  // went down isn't lost with it.
+  auto initialize(uint32_t records_per_cpu) noexcept -> bool;
+  auto flush     () noexcept -> void;
+  auto shutdown  () noexcept -> void;
+
+}; // namespace binlog
+
+//
+// printf style front end, the format string is checked against the arguments
+// at compile time
+//
+
+template<class... Args>
+inline auto klog_info(binlog::checked_format<std::type_identity_t<Args>...> format, const Args... args) noexcept -> void
+{
+  binlog::record* slot = binlog::reserve();
+  if (slot == nullptr) return;
+
+  binlog::encode(*slot, format, args...);
+  binlog::commit(slot);
+}
+
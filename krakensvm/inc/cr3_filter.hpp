@@ -0,0 +1,184 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <rcu.hpp>
+
+//
+// Set of "interesting" CR3 values
+//
+// Hook and trace consumers mostly care about a handful of processes, so every
+// event first asks whether its address space is one of them. A 2 KB Bloom filter
+// turns almost every other process away after three bit tests, the few that get
+// through are settled by an exact open addressing table behind it.
+//
+// A set is built once and never written again, it's replaced as a whole.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace cr3_filter
+{
+  constexpr uint32_t set_magic    = 0x33524343; // "CCR3"
+
+  constexpr uint32_t max_entries  = 256;
+  constexpr uint32_t table_slots  = max_entries * 2;      // load factor stays at or below 0.5
+  constexpr uint32_t bloom_bits   = 2048 * 8;
+  constexpr uint32_t bloom_words  = bloom_bits / 64;
+
+  static_assert((table_slots & (table_slots - 1)) == 0, "The table has to be a power of two");
+  static_assert((bloom_bits  & (bloom_bits  - 1)) == 0, "The Bloom filter has to be a power of two");
+
+  struct set
+  {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t bloom[bloom_words];
+    uint64_t slots[table_slots];  // 0 marks an empty slot
+  };
+
+  //
+  // CR3 without the PCID / PWT / PCD bits, the page frame is all that names
+  // an address space
+  //
+
+  constexpr auto normalize(const uint64_t cr3) noexcept -> uint64_t
+  {
+    return cr3 & 0x000ffffffffff000;
+  }
+
+  constexpr auto mix(uint64_t key) noexcept -> uint64_t
+  {
+    key ^= key >> 30; key *= 0xbf58476d1ce4e5b9;
+    key ^= key >> 27; key *= 0x94d049bb133111eb;
+    key ^= key >> 31;
+    return key;
+  }
+
+  // Three probes out of one hash, 14 bits each
+  constexpr auto bloom_probe(const uint64_t hash, const uint32_t probe) noexcept -> uint32_t
+  {
+    return static_cast<uint32_t>(hash >> (probe * 16)) & (bloom_bits - 1);
+  }
+
+  constexpr auto table_start(const uint64_t hash) noexcept -> uint32_t
+  {
+    return static_cast<uint32_t>(hash >> 48) & (table_slots - 1);
+  }
+
+  constexpr auto bloom_test(const set& current, const uint64_t hash) noexcept -> bool
+  {
+    for (uint32_t probe = 0; probe < 3; ++probe)
+    {
+      const uint32_t bit = bloom_probe(hash, probe);
+      if ((current.bloom[bit / 64] & (1ull << (bit % 64))) == 0) return false;
+    }
+
+    return true;
+  }
+
+  //
+  // Builds a set out of up to max_entries CR3 values, duplicates are folded
+  //
+
+  constexpr auto build(set& out, const uint64_t* cr3s, const uint32_t count) noexcept -> bool
+  {
+    out = {};
+    out.magic = set_magic;
+
+    if (count > max_entries || (count != 0 && cr3s == nullptr)) return false;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      const uint64_t key = normalize(cr3s[i]);
+      if (key == 0) continue;
+
+      const uint64_t hash = mix(key);
+
+      for (uint32_t slot = table_start(hash);; slot = (slot + 1) & (table_slots - 1))
+      {
+        if (out.slots[slot] == key) break;
+
+        if (out.slots[slot] == 0)
+        {
+          out.slots[slot] = key;
+          ++out.count;
+
+          for (uint32_t probe = 0; probe < 3; ++probe)
+          {
+            const uint32_t bit = bloom_probe(hash, probe);
+            out.bloom[bit / 64] |= 1ull << (bit % 64);
+          }
+          break;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  constexpr auto contains(const set& current, const uint64_t cr3) noexcept -> bool
+  {
+    const uint64_t key  = normalize(cr3);
+    const uint64_t hash = mix(key);
+
+    if (!bloom_test(current, hash)) return false;
+
+    for (uint32_t slot = table_start(hash);; slot = (slot + 1) & (table_slots - 1))
+    {
+      if (current.slots[slot] == key) return key != 0;
+      if (current.slots[slot] == 0)   return false;
+    }
+  }
+
+  //
+  // Driver side, located in "svm/cr3_filter.cpp"
+  //
+
+  // Installed by the cr3_filter_swap hypercall, nullptr lets every process
+  // through. Published through rcu, only read from the host side of a #VMEXIT.
+  extern const set* active_set;
+
+  inline auto interesting(const uint64_t cr3) noexcept -> bool
+  {
+    const set* current = rcu::dereference(active_set);
+    return current == nullptr || contains(*current, cr3);
+  }
+
+  // Root mode side of the hypercall, returns false for a set that doesn't look like one
+  auto swap(const set* replacement) noexcept -> bool;
+
+  // PASSIVE_LEVEL, builds a new set and hands it to the hypervisor, count 0 clears it
+  auto update(const uint64_t* cr3s, uint32_t count) noexcept -> bool;
+
+  // Frees the last set update() installed, only once the processors have
+  // been devirtualized
+  auto shutdown() noexcept -> void;
+
+}; // namespace cr3_filter
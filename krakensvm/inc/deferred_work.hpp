@@ -0,0 +1,237 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+//
+// Deferred work
+//
+// Anything a #VMEXIT wants done that's too slow for root mode (policy
+// updates, symbol lookups, anything that allocates or waits) is posted to a
+// single queue every vCPU shares and run later by a PASSIVE_LEVEL worker.
+// Posting is one CAS on the head and a 64 byte copy, no lock is taken and
+// nothing waits; a full queue drops the item and counts it.
+//
+// The worker sleeps while the queue is empty. Whoever posts into an empty
+// queue with the worker asleep is told to ring the doorbell, and only that
+// one: the worker is woken once per batch, not once per item.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace deferred
+{
+  constexpr size_t   cache_line = 64;
+  constexpr uint32_t max_args   = 5;
+
+  struct work;
+  using routine_t = void (*)(const work& item);
+
+  struct work
+  {
+    routine_t routine;
+    uint64_t  tsc;            // when it was posted
+    uint64_t  args[max_args];
+  };
+
+  struct alignas(cache_line) slot
+  {
+    uint64_t sequence;        // position + 1 once filled, position + capacity once free again
+    work     item;
+  };
+
+  static_assert(sizeof(slot) == cache_line, "A work slot has to fill exactly one cache line");
+
+  struct queue_header
+  {
+    uint32_t capacity;        // slots, a power of two
+    uint64_t slots_offset;    // from the start of this header
+
+    alignas(cache_line) uint64_t head;      // producers, reserved with a CAS
+    alignas(cache_line) uint64_t tail;      // the consumer
+    alignas(cache_line) uint64_t dropped;   // posted into a full queue
+    alignas(cache_line) uint32_t sleeping;  // the consumer is, or is about to be
+  };
+
+  inline auto queue_slots(queue_header* queue) noexcept -> slot*
+  {
+    return reinterpret_cast<slot*>(reinterpret_cast<uint8_t*>(queue) + queue->slots_offset);
+  }
+
+  constexpr auto queue_bytes(const uint32_t capacity) noexcept -> size_t
+  {
+    return ((sizeof(queue_header) + cache_line - 1) & ~(cache_line - 1)) + static_cast<size_t>(capacity) * sizeof(slot);
+  }
+
+  inline auto queue_init(void* region, const uint32_t capacity) noexcept -> queue_header*
+  {
+    if (region == nullptr || capacity == 0 || (capacity & (capacity - 1)) != 0) return nullptr;
+
+    auto* queue = static_cast<queue_header*>(region);
+
+    *queue = {};
+    queue->capacity     = capacity;
+    queue->slots_offset = (sizeof(queue_header) + cache_line - 1) & ~(cache_line - 1);
+
+    slot* slots = queue_slots(queue);
+    for (uint32_t i = 0; i < capacity; ++i) slots[i].sequence = i;
+
+    return queue;
+  }
+
+  enum class posted : uint8_t
+  {
+    queued,
+    queued_ring,              // and the worker has to be woken
+    full
+  };
+
+  //
+  // Producers, any number of them. A slot is free for position once its
+  // sequence reads position, filled once it reads position + 1.
+  //
+
+  inline auto push(queue_header* queue, const work& item) noexcept -> posted
+  {
+    std::atomic_ref<uint64_t> head(queue->head);
+    uint64_t position = head.load(std::memory_order_relaxed);
+    slot*    target   = nullptr;
+
+    for (;;)
+    {
+      target = &queue_slots(queue)[position & (queue->capacity - 1)];
+
+      const uint64_t sequence = std::atomic_ref<uint64_t>(target->sequence).load(std::memory_order_acquire);
+
+      if (sequence == position)
+      {
+        if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+      }
+      else if (sequence < position)
+      {
+        // Still holding what was posted a lap ago
+        std::atomic_ref<uint64_t>(queue->dropped).fetch_add(1, std::memory_order_relaxed);
+        return posted::full;
+      }
+      else
+      {
+        position = head.load(std::memory_order_relaxed);
+      }
+    }
+
+    target->item = item;
+    std::atomic_ref<uint64_t>(target->sequence).store(position + 1, std::memory_order_release);
+
+    // Pairs with prepare_sleep(): either the consumer sees this item, or
+    // this sees it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    std::atomic_ref<uint32_t> sleeping(queue->sleeping);
+
+    return sleeping.load(std::memory_order_relaxed) != 0 && sleeping.exchange(0, std::memory_order_acq_rel) != 0
+         ? posted::queued_ring : posted::queued;
+  }
+
+  //
+  // Consumer, a single one. Stops at the first slot that's reserved but not
+  // filled yet.
+  //
+
+  inline auto pop(queue_header* queue, work& out) noexcept -> bool
+  {
+    const uint64_t position = queue->tail;
+    slot&          current  = queue_slots(queue)[position & (queue->capacity - 1)];
+
+    std::atomic_ref<uint64_t> sequence(current.sequence);
+    if (sequence.load(std::memory_order_acquire) != position + 1) return false;
+
+    out = current.item;
+    sequence.store(position + queue->capacity, std::memory_order_release);
+
+    std::atomic_ref<uint64_t>(queue->tail).store(position + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  //
+  // The consumer's way to sleep. Announces it, then looks once more; false
+  // means something came in and it should drain again instead.
+  //
+
+  inline auto prepare_sleep(queue_header* queue) noexcept -> bool
+  {
+    std::atomic_ref<uint32_t> sleeping(queue->sleeping);
+    sleeping.store(1, std::memory_order_seq_cst);
+
+    const slot& next = queue_slots(queue)[queue->tail & (queue->capacity - 1)];
+
+    if (std::atomic_ref<uint64_t>(const_cast<uint64_t&>(next.sequence)).load(std::memory_order_seq_cst) == queue->tail + 1)
+    {
+      sleeping.store(0, std::memory_order_relaxed);
+      return false;
+    }
+
+    return true;
+  }
+
+  // Every item that was in the queue is done by the time this returns
+  inline auto drain(queue_header* queue) noexcept -> uint64_t
+  {
+    uint64_t done = 0;
+
+    for (work item; pop(queue, item); ++done)
+    {
+      if (item.routine != nullptr) item.routine(item);
+    }
+
+    return done;
+  }
+
+  //
+  // Driver side, located in "svm/deferred_work.cpp"
+  //
+
+  constexpr uint32_t default_capacity = 1024;
+
+  // PASSIVE_LEVEL, before the processors are virtualized. capacity is rounded
+  // down to a power of two.
+  auto initialize (uint32_t capacity) noexcept -> bool;
+
+  // Only once the processors have been devirtualized, runs what's left
+  auto shutdown   () noexcept -> void;
+
+  // Root mode, or anywhere else. The routine runs at PASSIVE_LEVEL on the
+  // worker thread and gets the arguments back in item.args.
+  auto post       (routine_t routine, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0,
+                   uint64_t arg3 = 0, uint64_t arg4 = 0) noexcept -> bool;
+
+  // End of a #VMEXIT. Wakes the worker if a post asked for it and the guest
+  // is somewhere it can take a DPC.
+  auto doorbell   (uint64_t guest_rflags) noexcept -> void;
+
+}; // namespace deferred
@@ -0,0 +1,461 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct _UNICODE_STRING;
+
+//
+// Event filter
+//
+// A small BPF-like bytecode deciding which syscall and #VMEXIT events are worth
+// recording. There is one register (A), jumps only go forward and every program
+// ends on a ret, so a program always terminates within its own length. Programs
+// are validated and compiled once at load:
+//
+//   - straight line code working on constants is folded, conditional jumps on
+//     a known A become unconditional
+//   - "ld field; jxx k" pairs are fused into a single compare against the event
+//   - jump offsets become absolute instruction indices
+//
+// The compiled form is dispatched with computed gotos where the compiler has
+// them, and a switch (one jump table) everywhere else.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace filter
+{
+  constexpr uint32_t max_insns = 256;
+
+  enum class event_kind : uint64_t
+  {
+    syscall = 1,
+    vmexit  = 2
+  };
+
+  enum field : uint8_t
+  {
+    kind          = 0,  // event_kind
+    syscall_index = 1,  // syscall number, table index in bit 12
+    cr3           = 2,
+    rip           = 3,  // guest RIP, VMEXIT only
+    exit_code     = 4,  // VMEXIT
+    exitinfo1     = 5,
+    exitinfo2     = 6,
+    field_count
+  };
+
+  struct event
+  {
+    uint64_t fields[field_count];
+  };
+
+  enum class op : uint8_t
+  {
+    ld_field,   // A = event.fields[field]
+    ld_imm,     // A = k
+
+    and_imm,    // A &= k
+    or_imm,     // A |= k
+    add_imm,    // A += k
+    sub_imm,    // A -= k
+    lsh_imm,    // A <<= k, k < 64
+    rsh_imm,    // A >>= k, k < 64
+
+    ja,         // pc += 1 + jt
+    jeq,        // pc += 1 + (A == k ? jt : jf)
+    jgt,        // pc += 1 + (A >  k ? jt : jf)
+    jge,        // pc += 1 + (A >= k ? jt : jf)
+    jset,       // pc += 1 + (A &  k ? jt : jf)
+
+    ret_imm,    // return k
+    ret_a,      // return A
+    op_count
+  };
+
+  struct insn
+  {
+    op       code;
+    uint8_t  field;
+    uint8_t  jt;
+    uint8_t  jf;
+    uint32_t reserved;
+    uint64_t k;
+  };
+
+  static_assert(sizeof(insn) == 16, "Filter instructions are 16 bytes");
+
+  enum class load_status : uint32_t
+  {
+    ok,
+    empty,
+    too_long,
+    bad_opcode,
+    bad_field,
+    bad_jump,
+    bad_shift,
+    no_return       // the last instruction has to be a ret
+  };
+
+  //
+  // Validation, every path has to end on a ret inside the program
+  //
+
+  constexpr auto is_jump(const op code) noexcept -> bool
+  {
+    return code >= op::ja && code <= op::jset;
+  }
+
+  constexpr auto is_return(const op code) noexcept -> bool
+  {
+    return code == op::ret_imm || code == op::ret_a;
+  }
+
+  constexpr auto validate(const insn* insns, const uint32_t count) noexcept -> load_status
+  {
+    if (insns == nullptr || count == 0) return load_status::empty;
+    if (count > max_insns)              return load_status::too_long;
+
+    for (uint32_t pc = 0; pc < count; ++pc)
+    {
+      const insn& current = insns[pc];
+
+      if (current.code >= op::op_count) return load_status::bad_opcode;
+
+      if (current.code == op::ld_field && current.field >= field_count) return load_status::bad_field;
+
+      if ((current.code == op::lsh_imm || current.code == op::rsh_imm) && current.k >= 64)
+      {
+        return load_status::bad_shift;
+      }
+
+      if (is_jump(current.code))
+      {
+        if (pc + 1 + current.jt >= count) return load_status::bad_jump;
+        if (current.code != op::ja && pc + 1 + current.jf >= count) return load_status::bad_jump;
+      }
+    }
+
+    // Everything else falls through to pc + 1, so this is enough for every path
+    // to reach a ret
+    return is_return(insns[count - 1].code) ? load_status::ok : load_status::no_return;
+  }
+
+  //
+  // Compiled form
+  //
+
+  enum class cop : uint8_t
+  {
+    ld_field, ld_imm,
+    and_imm, or_imm, add_imm, sub_imm, lsh_imm, rsh_imm,
+    ja, jeq, jgt, jge, jset,
+    jeq_field, jgt_field, jge_field, jset_field,
+    ret_imm, ret_a
+  };
+
+  struct compiled_insn
+  {
+    cop      code;
+    uint8_t  field;
+    uint16_t jt;        // absolute
+    uint16_t jf;        // absolute
+    uint16_t reserved;
+    uint64_t k;
+  };
+
+  struct program
+  {
+    uint32_t      length;
+    uint32_t      source_length;
+    compiled_insn insns[max_insns];
+  };
+
+  namespace detail
+  {
+    constexpr auto fold_alu(const op code, const uint64_t a, const uint64_t k) noexcept -> uint64_t
+    {
+      switch (code)
+      {
+        case op::and_imm: return a & k;
+        case op::or_imm:  return a | k;
+        case op::add_imm: return a + k;
+        case op::sub_imm: return a - k;
+        case op::lsh_imm: return a << k;
+        case op::rsh_imm: return a >> k;
+        default:          return a;
+      }
+    }
+
+    constexpr auto fold_jump(const op code, const uint64_t a, const uint64_t k) noexcept -> bool
+    {
+      switch (code)
+      {
+        case op::jeq:  return a == k;
+        case op::jgt:  return a >  k;
+        case op::jge:  return a >= k;
+        case op::jset: return (a & k) != 0;
+        default:       return true;
+      }
+    }
+
+    constexpr auto to_cop(const op code) noexcept -> cop
+    {
+      return static_cast<cop>(static_cast<uint8_t>(code) < static_cast<uint8_t>(op::ret_imm) ?
+                              static_cast<uint8_t>(code) :
+                              static_cast<uint8_t>(code) + (static_cast<uint8_t>(cop::ret_imm) - static_cast<uint8_t>(op::ret_imm)));
+    }
+
+    constexpr auto to_fused(const op code) noexcept -> cop
+    {
+      return static_cast<cop>(static_cast<uint8_t>(cop::jeq_field) + (static_cast<uint8_t>(code) - static_cast<uint8_t>(op::jeq)));
+    }
+  };
+
+  //
+  // Validates and compiles, the program is only touched on success
+  //
+
+  constexpr auto compile(const insn* insns, const uint32_t count, program& out) noexcept -> load_status
+  {
+    const load_status status = validate(insns, count);
+    if (status != load_status::ok) return status;
+
+    insn     folded    [max_insns] = {};
+    bool     is_target [max_insns] = {};
+    uint16_t new_index [max_insns] = {};
+
+    for (uint32_t pc = 0; pc < count; ++pc)
+    {
+      folded[pc] = insns[pc];
+
+      if (is_jump(insns[pc].code))
+      {
+        is_target[pc + 1 + insns[pc].jt] = true;
+        if (insns[pc].code != op::ja) is_target[pc + 1 + insns[pc].jf] = true;
+      }
+    }
+
+    // Constant folding, A is only known along straight line code
+    bool     a_known = false;
+    uint64_t a_value = 0;
+
+    for (uint32_t pc = 0; pc < count; ++pc)
+    {
+      insn& current = folded[pc];
+
+      if (is_target[pc]) a_known = false;
+
+      switch (current.code)
+      {
+        case op::ld_imm:
+          a_known = true;
+          a_value = current.k;
+          break;
+
+        case op::ld_field:
+          a_known = false;
+          break;
+
+        case op::and_imm: case op::or_imm:  case op::add_imm:
+        case op::sub_imm: case op::lsh_imm: case op::rsh_imm:
+          if (a_known)
+          {
+            a_value      = detail::fold_alu(current.code, a_value, current.k);
+            current.code = op::ld_imm;
+            current.k    = a_value;
+          }
+          break;
+
+        case op::jeq: case op::jgt: case op::jge: case op::jset:
+          if (a_known)
+          {
+            current.jt   = detail::fold_jump(current.code, a_value, current.k) ? current.jt : current.jf;
+            current.code = op::ja;
+          }
+          break;
+
+        case op::ret_a:
+          if (a_known)
+          {
+            current.code = op::ret_imm;
+            current.k    = a_value;
+          }
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    // Fusion, jump targets are still source indices in here
+    uint32_t length = 0;
+
+    for (uint32_t pc = 0; pc < count; ++pc)
+    {
+      const insn& current = folded[pc];
+      compiled_insn& emit = out.insns[length];
+
+      new_index[pc] = static_cast<uint16_t>(length);
+      emit = {};
+
+      const bool fusable = current.code == op::ld_field && pc + 1 < count && !is_target[pc + 1] &&
+                           is_jump(folded[pc + 1].code) && folded[pc + 1].code != op::ja;
+
+      if (fusable)
+      {
+        const insn& jump = folded[pc + 1];
+
+        emit.code  = detail::to_fused(jump.code);
+        emit.field = current.field;
+        emit.k     = jump.k;
+        emit.jt    = static_cast<uint16_t>(pc + 2 + jump.jt);
+        emit.jf    = static_cast<uint16_t>(pc + 2 + jump.jf);
+
+        new_index[++pc] = static_cast<uint16_t>(length++);
+        continue;
+      }
+
+      emit.code  = detail::to_cop(current.code);
+      emit.field = current.field;
+      emit.k     = current.k;
+
+      if (is_jump(current.code))
+      {
+        emit.jt = static_cast<uint16_t>(pc + 1 + current.jt);
+        emit.jf = static_cast<uint16_t>(pc + 1 + current.jf);
+      }
+
+      ++length;
+    }
+
+    for (uint32_t pc = 0; pc < length; ++pc)
+    {
+      compiled_insn& current = out.insns[pc];
+
+      if (current.code >= cop::ja && current.code <= cop::jset_field)
+      {
+        current.jt = new_index[current.jt];
+        current.jf = current.code == cop::ja ? current.jt : new_index[current.jf];
+      }
+    }
+
+    out.length        = length;
+    out.source_length = count;
+
+    return load_status::ok;
+  }
+
+  //
+  // Runs a compiled program, non-zero accepts the event
+  //
+
+  inline auto run(const program& compiled, const event& current) noexcept -> uint64_t
+  {
+    const compiled_insn* const base = compiled.insns;
+    const compiled_insn* pc = base;
+    uint64_t a = 0;
+
+#if defined(__GNUC__) || defined(__clang__)
+    static void* const dispatch_table[] =
+    {
+      &&do_ld_field, &&do_ld_imm,
+      &&do_and_imm, &&do_or_imm, &&do_add_imm, &&do_sub_imm, &&do_lsh_imm, &&do_rsh_imm,
+      &&do_ja, &&do_jeq, &&do_jgt, &&do_jge, &&do_jset,
+      &&do_jeq_field, &&do_jgt_field, &&do_jge_field, &&do_jset_field,
+      &&do_ret_imm, &&do_ret_a
+    };
+
+#define FILTER_OP(name)   do_##name:
+#define FILTER_NEXT()     goto *dispatch_table[static_cast<uint8_t>(pc->code)]
+
+    FILTER_NEXT();
+#else
+#define FILTER_OP(name)   case cop::name:
+#define FILTER_NEXT()     continue
+
+    for (;;) switch (pc->code)
+    {
+#endif
+
+    FILTER_OP(ld_field)   a = current.fields[pc->field];  ++pc; FILTER_NEXT();
+    FILTER_OP(ld_imm)     a = pc->k;                      ++pc; FILTER_NEXT();
+
+    FILTER_OP(and_imm)    a &= pc->k;                     ++pc; FILTER_NEXT();
+    FILTER_OP(or_imm)     a |= pc->k;                     ++pc; FILTER_NEXT();
+    FILTER_OP(add_imm)    a += pc->k;                     ++pc; FILTER_NEXT();
+    FILTER_OP(sub_imm)    a -= pc->k;                     ++pc; FILTER_NEXT();
+    FILTER_OP(lsh_imm)    a <<= pc->k;                    ++pc; FILTER_NEXT();
+    FILTER_OP(rsh_imm)    a >>= pc->k;                    ++pc; FILTER_NEXT();
+
+    FILTER_OP(ja)         pc = base + pc->jt;                                     FILTER_NEXT();
+    FILTER_OP(jeq)        pc = base + (a == pc->k ? pc->jt : pc->jf);             FILTER_NEXT();
+    FILTER_OP(jgt)        pc = base + (a >  pc->k ? pc->jt : pc->jf);             FILTER_NEXT();
+    FILTER_OP(jge)        pc = base + (a >= pc->k ? pc->jt : pc->jf);             FILTER_NEXT();
+    FILTER_OP(jset)       pc = base + ((a & pc->k) ? pc->jt : pc->jf);            FILTER_NEXT();
+
+    // Fused compares still leave the field in A for whatever comes next
+    FILTER_OP(jeq_field)  a = current.fields[pc->field]; pc = base + (a == pc->k ? pc->jt : pc->jf);  FILTER_NEXT();
+    FILTER_OP(jgt_field)  a = current.fields[pc->field]; pc = base + (a >  pc->k ? pc->jt : pc->jf);  FILTER_NEXT();
+    FILTER_OP(jge_field)  a = current.fields[pc->field]; pc = base + (a >= pc->k ? pc->jt : pc->jf);  FILTER_NEXT();
+    FILTER_OP(jset_field) a = current.fields[pc->field]; pc = base + ((a & pc->k) ? pc->jt : pc->jf); FILTER_NEXT();
+
+    FILTER_OP(ret_imm)    return pc->k;
+    FILTER_OP(ret_a)      return a;
+
+#if !defined(__GNUC__) && !defined(__clang__)
+    }
+#endif
+
+#undef FILTER_OP
+#undef FILTER_NEXT
+  }
+
+  //
+  // Driver side, located in "svm/event_filter.cpp"
+  //
+
+  enum class hook_point : uint32_t
+  {
+    syscall,
+    vmexit,
+    hook_point_count
+  };
+
+  // PASSIVE_LEVEL, swaps in a new program for the hook point
+  auto load   (hook_point point, const insn* insns, uint32_t count) noexcept -> load_status;
+  auto unload (hook_point point) noexcept -> void;
+
+  // Loads the SyscallFilter and VmexitFilter REG_BINARY values, if there are any
+  auto load_registry(_UNICODE_STRING* registry_path) noexcept -> void;
+
+  // true when nothing is loaded
+  auto accept (hook_point point, const event& current) noexcept -> bool;
+
+}; // namespace filter
@@ -0,0 +1,101 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <syscall_capture.hpp>
+
+//
+// #VMEXIT trace stream
+//
+// Every exit vmexit_traced() lets through is pushed as one exit_record into
+// the ring of the processor that took it. The rings are the ones of
+// "hooks/syscall_capture.hpp" carrying a different record, so a collector maps
+// and drains them the same way (\\.\KrakenSvm, IOCTL_KRAKEN_MAP_EXIT_TRACE):
+// the stream read-only, its ring tails in a region of their own.
+// Turning the records into something that fits on disk for hours is the
+// collector's business, see "krakentrace/trace_format.hpp".
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace exit_trace
+{
+  struct alignas(hk::capture::cache_line) exit_record
+  {
+    uint64_t tsc;             // at #VMEXIT
+    uint64_t rip;             // guest RIP of the exiting instruction
+    uint64_t cr3;
+    uint64_t exit_code;
+    uint64_t exitinfo1;
+    uint64_t exitinfo2;
+    uint64_t qualifier;       // see qualifier_of()
+    uint32_t cycles;          // spent in vmexit_handler, saturated
+    uint32_t reserved;
+  };
+
+  static_assert(sizeof(exit_record) == hk::capture::cache_line,
+                  "An exit record has to fill exactly one cache line");
+
+  //
+  // What the exit code alone doesn't tell: the MSR of an MSR exit (ECX) and
+  // the leaf and subleaf of a CPUID exit (EAX, ECX). Has to be taken before a
+  // handler overwrites the guest registers.
+  //
+
+  constexpr uint64_t exit_msr   = 0x7c;
+  constexpr uint64_t exit_cpuid = 0x72;
+
+  constexpr auto qualifier_of(const uint64_t exit_code, const uint64_t rax, const uint64_t rcx) noexcept -> uint64_t
+  {
+    if (exit_code == exit_msr)   return rcx & 0xffffffff;
+    if (exit_code == exit_cpuid) return (rax & 0xffffffff) | (rcx & 0xffffffff) << 32;
+    return 0;
+  }
+
+  inline auto saturate(const uint64_t cycles) noexcept -> uint32_t
+  {
+    return cycles > 0xffffffff ? 0xffffffff : static_cast<uint32_t>(cycles);
+  }
+
+  //
+  // Driver side, located in "svm/exit_trace.cpp"
+  //
+
+  // records_per_cpu is rounded down to a power of two, PASSIVE_LEVEL
+  auto enable    (uint32_t records_per_cpu) noexcept -> bool;
+  auto disable   () noexcept -> void;
+
+  // Maps the stream and its tails into the current process, all or nothing
+  auto map_user  (hk::capture::user_views& views) noexcept -> bool;
+  auto unmap_user(const hk::capture::user_views& views) noexcept -> void;
+
+  // Root mode, from vmexit_handler on the processor the record belongs to
+  auto record    (uint32_t cpu, const exit_record& current) noexcept -> void;
+
+}; // namespace exit_trace
@@ -0,0 +1,224 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <page_walk.hpp>
+
+//
+// Copies between host buffers and guest virtual memory
+//
+// Each guest page is translated once. Pages that turn out to be physically
+// contiguous are merged into one run, and a run goes to the backend as a
+// single copy, so a 64 KB read of a contiguous buffer is one memcpy rather
+// than sixteen. The batched variants run a list of segments through the same
+// loop and keep the last translation around, since capture and hook code
+// tends to read several small structures out of one page.
+//
+// Everything goes through a backend:
+//
+//   auto translate      (uint64_t va, uint32_t access, translation& result) -> status;
+//   auto read_physical  (uint64_t gpa, void* buffer, size_t size) -> bool;
+//   auto write_physical (uint64_t gpa, const void* buffer, size_t size) -> bool;
+//
+// the driver's walk guest page tables ("svm/guest_memory.cpp"), a test's can
+// sit on top of a plain buffer. Writes translate with access_dirty on top of
+// whatever access was asked for, whatever gets written to has its A and D
+// bits set, the way it would if the guest had done the write.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace guest_copy
+{
+  using ia32e::walk::status;
+  using ia32e::walk::translation;
+
+  struct segment
+  {
+    uint64_t va;              // guest
+    void*    buffer;          // host, the source for writes
+    size_t   size;
+  };
+
+  //
+  // Last page translated, carried from one segment to the next
+  //
+
+  struct page_memo
+  {
+    uint64_t    va_page;
+    uint32_t    access;
+    bool        valid;
+    translation page;
+  };
+
+  // Bytes of the mapping left at va, the mapping being whatever result covers
+  constexpr auto remaining(const translation& result) noexcept -> uint64_t
+  {
+    return result.page_size - (result.gpa & (result.page_size - 1));
+  }
+
+  template<class backend>
+  auto translate_page(backend& memory, page_memo& memo, const uint64_t va,
+                      const uint32_t access, translation& result) noexcept -> status
+  {
+    const uint64_t va_page = va & ~(ia32e::walk::page_size_4k - 1);
+
+    if (memo.valid && memo.va_page == va_page && memo.access == access)
+    {
+      result      = memo.page;
+      result.gpa  = (memo.page.gpa & ~(ia32e::walk::page_size_4k - 1)) | (va & (ia32e::walk::page_size_4k - 1));
+      result.page_size = ia32e::walk::page_size_4k;
+      return status::ok;
+    }
+
+    const status translated = memory.translate(va, access, result);
+    if (translated != status::ok) return translated;
+
+    memo.va_page = va_page;
+    memo.access  = access;
+    memo.page    = result;
+    memo.valid   = true;
+
+    return status::ok;
+  }
+
+  //
+  // The loop both directions share. host is advanced as guest memory is.
+  //
+
+  template<bool writing, class backend, class host_t>
+  auto transfer(backend& memory, page_memo& memo, uint64_t va, host_t* host,
+                size_t size, const uint32_t access) noexcept -> status
+  {
+    auto* cursor = static_cast<uint8_t*>(const_cast<void*>(static_cast<const void*>(host)));
+
+    const uint32_t walk_access = writing ? access | ia32e::walk::access_dirty : access;
+
+    translation current = {}, next = {};
+    bool have_current   = false;
+
+    while (size != 0)
+    {
+      if (!have_current)
+      {
+        const status translated = translate_page(memory, memo, va, walk_access, current);
+        if (translated != status::ok) return translated;
+      }
+
+      have_current = false;
+
+      const uint64_t run_gpa = current.gpa;
+      uint64_t       run     = remaining(current) < size ? remaining(current) : size;
+
+      // Grow the run for as long as the next page follows physically
+      while (run < size)
+      {
+        const status translated = translate_page(memory, memo, va + run, walk_access, next);
+        if (translated != status::ok) break;
+
+        if (next.gpa != run_gpa + run)
+        {
+          current      = next;
+          have_current = true;
+          break;
+        }
+
+        run += remaining(next) < size - run ? remaining(next) : size - run;
+      }
+
+      const bool copied = writing ? memory.write_physical(run_gpa, cursor, run)
+                                  : memory.read_physical(run_gpa, cursor, run);
+      if (!copied) return status::unreadable;
+
+      va     += run;
+      cursor += run;
+      size   -= run;
+    }
+
+    return status::ok;
+  }
+
+  template<class backend>
+  auto read(backend& memory, const uint64_t va, void* buffer, const size_t size,
+            const uint32_t access = ia32e::walk::access_read) noexcept -> status
+  {
+    page_memo memo = {};
+    return transfer<false>(memory, memo, va, buffer, size, access);
+  }
+
+  template<class backend>
+  auto write(backend& memory, const uint64_t va, const void* buffer, const size_t size,
+             const uint32_t access = ia32e::walk::access_write) noexcept -> status
+  {
+    page_memo memo = {};
+    return transfer<true>(memory, memo, va, buffer, size, access);
+  }
+
+  //
+  // Scatter-gather. results (optional) gets one status per segment, the
+  // return value is how many came back ok. A failed segment doesn't stop the
+  // ones after it.
+  //
+
+  template<bool writing, class backend>
+  auto transfer_batch(backend& memory, const segment* segments, const size_t count,
+                      status* results, const uint32_t access) noexcept -> size_t
+  {
+    page_memo memo = {};
+    size_t succeeded = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      const status done = transfer<writing>(memory, memo, segments[i].va, segments[i].buffer,
+                                            segments[i].size, access);
+
+      if (results != nullptr) results[i] = done;
+      if (done == status::ok) ++succeeded;
+    }
+
+    return succeeded;
+  }
+
+  template<class backend>
+  auto read_batch(backend& memory, const segment* segments, const size_t count, status* results = nullptr,
+                  const uint32_t access = ia32e::walk::access_read) noexcept -> size_t
+  {
+    return transfer_batch<false>(memory, segments, count, results, access);
+  }
+
+  template<class backend>
+  auto write_batch(backend& memory, const segment* segments, const size_t count, status* results = nullptr,
+                   const uint32_t access = ia32e::walk::access_write) noexcept -> size_t
+  {
+    return transfer_batch<true>(memory, segments, count, results, access);
+  }
+
+}; // namespace guest_copy
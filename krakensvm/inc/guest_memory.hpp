@@ -0,0 +1,94 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <vmcb.hpp>
+#include <page_walk.hpp>
+#include <guest_copy.hpp>
+
+//
+// Guest memory, as seen from the host side of a #VMEXIT
+//
+// Translation goes through the vCPU's own cache (vcpu_ctx_t::guest_tlb) and
+// the walker of "ia32e/page_walk.hpp". There's no nested paging, so a guest
+// physical address is a system physical one. Tables and data are read
+// through a page of VA per processor whose PTE gets pointed at them, see
+// "svm/guest_memory.cpp".
+//
+// read_guest/write_guest come in two flavours. The ones taking a vCPU are for
+// the host side and use its cache and VMCB state. The others are for code
+// running as the guest (capture, hook installers): paging state comes from
+// the live control registers and translations only live for the call, since
+// a #VMEXIT can land in the middle and the vCPU's cache is the host's.
+//
+
+namespace guest_memory
+{
+  using ia32e::walk::status;
+  using ia32e::walk::translation;
+
+  // PASSIVE_LEVEL, before the processors are virtualized. Reserves the
+  // mapping windows, false when they can't be set up.
+  auto initialize      () noexcept -> bool;
+
+  // Only once every processor has been devirtualized
+  auto shutdown        () noexcept -> void;
+
+  // Paging mode and permission bits out of the guest VMCB
+  auto context_of      (vmcb::pvcpu_ctx_t vcpu_data, uint64_t cr3) noexcept -> ia32e::walk::context;
+
+  // Host side, false for anything that isn't RAM
+  auto read_physical   (uint64_t gpa, void* buffer, size_t size) noexcept -> bool;
+  auto write_physical  (uint64_t gpa, const void* buffer, size_t size) noexcept -> bool;
+
+  // GVA -> GPA in the address space of cr3 (the guest's current one most of
+  // the time), access is a combination of ia32e::walk::access
+  auto translate       (vmcb::pvcpu_ctx_t vcpu_data, uint64_t cr3, uint64_t va,
+                        uint32_t access, translation& result) noexcept -> status;
+
+  using guest_copy::segment;
+
+  // Host side
+  auto read_guest        (vmcb::pvcpu_ctx_t vcpu_data, uint64_t cr3, uint64_t va, void* buffer,
+                          size_t size, uint32_t access = ia32e::walk::access_read) noexcept -> status;
+  auto write_guest       (vmcb::pvcpu_ctx_t vcpu_data, uint64_t cr3, uint64_t va, const void* buffer,
+                          size_t size, uint32_t access = ia32e::walk::access_write) noexcept -> status;
+  auto read_guest_batch  (vmcb::pvcpu_ctx_t vcpu_data, uint64_t cr3, const segment* segments, size_t count,
+                          status* results = nullptr) noexcept -> size_t;
+  auto write_guest_batch (vmcb::pvcpu_ctx_t vcpu_data, uint64_t cr3, const segment* segments, size_t count,
+                          status* results = nullptr) noexcept -> size_t;
+
+  // Guest side, at or below DISPATCH_LEVEL (status::unreadable above it)
+  auto read_guest        (uint64_t cr3, uint64_t va, void* buffer, size_t size,
+                          uint32_t access = ia32e::walk::access_read) noexcept -> status;
+  auto write_guest       (uint64_t cr3, uint64_t va, const void* buffer, size_t size,
+                          uint32_t access = ia32e::walk::access_write) noexcept -> status;
+  auto read_guest_batch  (uint64_t cr3, const segment* segments, size_t count,
+                          status* results = nullptr) noexcept -> size_t;
+  auto write_guest_batch (uint64_t cr3, const segment* segments, size_t count,
+                          status* results = nullptr) noexcept -> size_t;
+
+}; // namespace guest_memory
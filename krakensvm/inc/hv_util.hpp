@@ -50,6 +50,14 @@ uint64_t __readeflags(void);
 
 auto kprint_info(const char* format, ...) noexcept -> void;
 
+//
+// Registry, values under the driver's service key
+//
+
+auto registry_read_value(PUNICODE_STRING registry_path, PCWSTR value_name, ULONG type,
+                         void* buffer, size_t buffer_size) noexcept -> size_t;
+auto registry_read_dword(PUNICODE_STRING registry_path, PCWSTR value_name, uint32_t default_value) noexcept -> uint32_t;
+
 //
 // CPUID
 //
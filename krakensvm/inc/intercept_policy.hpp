@@ -0,0 +1,182 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct _UNICODE_STRING;
+
+//
+// MSR intercept policy
+//
+// Which MSR accesses end up in the MSR permission map. Without a policy the map
+// is built by setup_msrpermissions_bitmap() as it always was; with one, only
+// the accesses the policy lists are intercepted, plus the ones msr_handler
+// can't do without (see required_rules). Policies are written by
+// "krakentrace analyze" from recorded traces and loaded from the
+// InterceptPolicy registry value before the processors are virtualized.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace intercept_policy
+{
+  constexpr uint32_t policy_magic   = 0x4c4f504b; // "KPOL"
+  constexpr uint32_t policy_version = 1;
+  constexpr uint32_t max_rules      = 512;
+
+  enum access : uint8_t
+  {
+    access_read  = 1,
+    access_write = 2,
+  };
+
+  struct rule
+  {
+    uint32_t msr;
+    uint32_t access;          // access_read | access_write
+  };
+
+  struct header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rule_count;      // rules follow the header
+    uint32_t reserved;
+  };
+
+  //
+  // What msr_handler in "svm/vmexit_handler.cpp" actually does something
+  // with. An intercepted access that isn't in here only goes through its
+  // default branch, which replays the access and gains nothing.
+  //
+
+  constexpr uint32_t msr_efer  = 0xc0000080;
+  constexpr uint32_t msr_lstar = 0xc0000082;
+
+  constexpr rule handled_rules[] =
+  {
+    { msr_efer,  access_write },               // keeps EFER.SVME set
+    { msr_lstar, access_read | access_write }, // hides the syscall hook
+  };
+
+  // Never dropped, whatever the policy says
+  constexpr rule required_rules[] =
+  {
+    { msr_efer,  access_write },
+  };
+
+  constexpr auto handled(const uint32_t msr, const uint32_t access) noexcept -> bool
+  {
+    for (const rule& current : handled_rules)
+    {
+      if (current.msr == msr && (current.access & access) == access) return true;
+    }
+
+    return false;
+  }
+
+  //
+  // MSR permission map: three 2 KB vectors of two bits per MSR (read, then
+  // write), for 0000_0000 - 0000_1fff, c000_0000 - c000_1fff and
+  // c001_0000 - c001_1fff. Everything else is always intercepted.
+  //
+
+  constexpr size_t msrpm_size = 0x2000;
+
+  // Bit of the read access, the write access is the next one. -1 when out of range.
+  constexpr auto msrpm_bit(const uint32_t msr) noexcept -> int64_t
+  {
+    constexpr uint32_t range_base[]  = { 0x00000000, 0xc0000000, 0xc0010000 };
+    constexpr uint32_t msrs_per_range = 0x2000;
+
+    for (uint32_t range = 0; range < 3; ++range)
+    {
+      if (msr - range_base[range] < msrs_per_range)
+      {
+        return static_cast<int64_t>(range) * msrs_per_range * 2 + (msr - range_base[range]) * 2;
+      }
+    }
+
+    return -1;
+  }
+
+  inline auto validate(const void* blob, const size_t size) noexcept -> const header*
+  {
+    const auto* policy = static_cast<const header*>(blob);
+
+    if (blob == nullptr || size < sizeof(header))                                  return nullptr;
+    if (policy->magic != policy_magic || policy->version != policy_version)        return nullptr;
+    if (policy->rule_count > max_rules ||
+        size < sizeof(header) + static_cast<size_t>(policy->rule_count) * sizeof(rule)) return nullptr;
+
+    const auto* rules = reinterpret_cast<const rule*>(policy + 1);
+
+    for (uint32_t i = 0; i < policy->rule_count; ++i)
+    {
+      if (msrpm_bit(rules[i].msr) < 0 || rules[i].access == 0 ||
+          (rules[i].access & ~static_cast<uint32_t>(access_read | access_write)) != 0)
+      {
+        return nullptr;
+      }
+    }
+
+    return policy;
+  }
+
+  // Builds the whole map out of a validated policy
+  inline auto build_msrpm(const header* policy, uint8_t* msrpm) noexcept -> void
+  {
+    for (size_t i = 0; i < msrpm_size; ++i) msrpm[i] = 0;
+
+    const auto set = [msrpm](const rule& current)
+    {
+      const int64_t bit = msrpm_bit(current.msr);
+      if (bit < 0) return;
+
+      if (current.access & access_read)  msrpm[bit / 8]       |= static_cast<uint8_t>(1u << (bit % 8));
+      if (current.access & access_write) msrpm[(bit + 1) / 8] |= static_cast<uint8_t>(1u << ((bit + 1) % 8));
+    };
+
+    for (const rule& current : required_rules) set(current);
+
+    const auto* rules = reinterpret_cast<const rule*>(policy + 1);
+    for (uint32_t i = 0; i < policy->rule_count; ++i) set(rules[i]);
+  }
+
+  //
+  // Driver side, located in "svm/intercept_policy.cpp"
+  //
+
+  // PASSIVE_LEVEL, before the processors are virtualized
+  auto load_registry (_UNICODE_STRING* registry_path) noexcept -> void;
+  auto unload        () noexcept -> void;
+
+  // Fills the map from the loaded policy, false when there is none
+  auto apply         (void* msrpm) noexcept -> bool;
+
+}; // namespace intercept_policy
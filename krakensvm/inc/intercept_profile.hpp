@@ -0,0 +1,250 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+//
+// Per-vCPU intercept profiles
+//
+// vmcb_prepartion() used to give every core the same intercepts. A profile is
+// a named set of them that can be switched on a single vCPU at runtime: a core
+// carrying a latency sensitive workload drops to the minimal set, one that's
+// being looked at gets the tracing set. Requests go through the
+// set_intercept_profile hypercall and each vCPU picks its own up at the end of
+// its next #VMEXIT, right before VMRUN, so the VMCB is never touched while the
+// processor owns it.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace intercept_profile
+{
+  enum id : uint32_t
+  {
+    standard = 0,             // what vmcb_prepartion() always set
+    minimal,                  // only what the hypervisor can't run without
+    tracing,                  // standard, plus CR3/CR4 writes, INVLPG, INVPCID and RDTSC(P)
+
+    profile_count
+  };
+
+  //
+  // Intercept bits, APM vol. 2 Table B-1. The same values hv_util.hpp has as
+  // INTERCEPT_*, repeated so this header stays usable outside the driver.
+  //
+
+  // Vector 00CH
+  constexpr uint32_t misc3_rdtsc    = 1u << 14;
+  constexpr uint32_t misc3_cpuid    = 1u << 18;
+  constexpr uint32_t misc3_invlpg   = 1u << 25;
+  constexpr uint32_t misc3_msr_prot = 1u << 28;
+
+  // Vector 010H
+  constexpr uint32_t misc4_vmrun    = 1u << 0;
+  constexpr uint32_t misc4_vmmcall  = 1u << 1;
+  constexpr uint32_t misc4_rdtscp   = 1u << 7;
+
+  // Vector 014H
+  constexpr uint32_t misc5_invpcid  = 1u << 2;
+
+  // Offset 000H, upper word
+  constexpr uint16_t cr_cr3         = 1u << 3;
+  constexpr uint16_t cr_cr4         = 1u << 4;
+
+  //
+  // VMRUN has to be intercepted or VMRUN fails, CPUID carries the unload
+  // request and VMMCALL is how a core gets out of the minimal profile again
+  //
+
+  constexpr uint32_t required_misc3 = misc3_cpuid;
+  constexpr uint32_t required_misc4 = misc4_vmrun | misc4_vmmcall;
+
+  struct intercept_set
+  {
+    uint32_t misc3;           // intercept_misc_vector_3
+    uint32_t misc4;           // intercept_misc_vector_4
+    uint16_t cr_write;        // intercept_write_cr0
+    uint32_t misc5;           // intercept_misc_vector_5
+  };
+
+  constexpr intercept_set profiles[profile_count] =
+  {
+    // standard
+    { required_misc3 | misc3_msr_prot, required_misc4, 0, 0 },
+
+    // minimal, EFER and LSTAR are left alone, so neither EFER.SVME nor the
+    // syscall hook are guarded on such a core
+    { required_misc3, required_misc4, 0, 0 },
+
+    // tracing
+    { required_misc3 | misc3_msr_prot | misc3_rdtsc | misc3_invlpg,
+      required_misc4 | misc4_rdtscp, cr_cr3 | cr_cr4, misc5_invpcid },
+  };
+
+  static_assert((profiles[standard].misc3 & required_misc3) == required_misc3 &&
+                (profiles[minimal].misc3  & required_misc3) == required_misc3 &&
+                (profiles[tracing].misc3  & required_misc3) == required_misc3, "A profile lost a required intercept");
+
+  static_assert((profiles[standard].misc4 & required_misc4) == required_misc4 &&
+                (profiles[minimal].misc4  & required_misc4) == required_misc4 &&
+                (profiles[tracing].misc4  & required_misc4) == required_misc4, "A profile lost a required intercept");
+
+  //
+  // Emulating MOV CR3/CR4, INVLPG and INVPCID needs the operands, which only
+  // DecodeAssists (CPUID Fn8000_000A EDX[7]) hands over in EXITINFO1/2.
+  // Without it those intercepts are left out of whatever profile asked for
+  // them, and so is INVPCID on a processor that doesn't have the instruction
+  // (CPUID Fn0000_0007_EBX[10]), the intercept bit is reserved there.
+  //
+
+  constexpr auto resolve(const id profile, const bool decode_assists, const bool invpcid) noexcept -> intercept_set
+  {
+    intercept_set current = profiles[profile < profile_count ? profile : standard];
+
+    if (!decode_assists)
+    {
+      current.misc3    &= ~misc3_invlpg;
+      current.cr_write &= static_cast<uint16_t>(~(cr_cr3 | cr_cr4));
+      current.misc5    &= ~misc5_invpcid;
+    }
+
+    if (!invpcid) current.misc5 &= ~misc5_invpcid;
+
+    return current;
+  }
+
+  //
+  // Whether every way the guest has of dropping translations exits, so a
+  // cache of them can outlive a #VMEXIT: MOV CR3, INVLPG, MOV CR4 (toggling
+  // PGE or PCIDE flushes everything, globals included) and INVPCID where
+  // the processor has it. INVLPGB (CPUID Fn8000_0008_EBX[3]) invalidates on
+  // every processor at once, the other vCPUs' caches would never hear of
+  // it, so where it exists nothing is coherent.
+  //
+  // CR0.PG isn't in the list, Windows doesn't turn paging off at runtime.
+  //
+
+  constexpr auto tracks_invalidations(const intercept_set& active, const bool invpcid, const bool invlpgb) noexcept -> bool
+  {
+    constexpr uint16_t cr_paging = cr_cr3 | cr_cr4;
+
+    return !invlpgb &&
+           (active.cr_write & cr_paging) == cr_paging &&
+           (active.misc3 & misc3_invlpg) != 0 &&
+           (!invpcid || (active.misc5 & misc5_invpcid) != 0);
+  }
+
+  // VMCB clean bit 0 covers every intercept vector
+  constexpr uint64_t clean_intercepts = 1ull << 0;
+
+  constexpr auto clean_after(const intercept_set& from, const intercept_set& to, const uint64_t clean) noexcept -> uint64_t
+  {
+    const bool changed = from.misc3 != to.misc3 || from.misc4 != to.misc4 ||
+                         from.cr_write != to.cr_write || from.misc5 != to.misc5;
+
+    return changed ? clean & ~clean_intercepts : clean;
+  }
+
+  //
+  // Hypercall argument (RDX): the target processor index in the low half,
+  // all_processors for every one of them, the profile in bits 32 - 39
+  //
+
+  constexpr uint32_t all_processors = 0xffffffff;
+
+  constexpr auto encode(const uint32_t processor, const id profile) noexcept -> uint64_t
+  {
+    return static_cast<uint64_t>(profile & 0xff) << 32 | processor;
+  }
+
+  constexpr auto decode(const uint64_t context, uint32_t& processor, id& profile) noexcept -> bool
+  {
+    if (context >> 40 != 0 || (context >> 32 & 0xff) >= profile_count) return false;
+
+    processor = static_cast<uint32_t>(context);
+    profile   = static_cast<id>(context >> 32 & 0xff);
+    return true;
+  }
+
+  //
+  // Per-vCPU switch. requested is written by whichever vCPU handled the
+  // hypercall, active only ever by the owner.
+  //
+
+  struct vcpu_state
+  {
+    uint32_t requested;
+    uint32_t active;
+  };
+
+  inline auto request(vcpu_state& state, const id profile) noexcept -> void
+  {
+    std::atomic_ref<uint32_t>(state.requested).store(profile, std::memory_order_release);
+  }
+
+  // The profile to install when a switch is pending
+  inline auto take_pending(vcpu_state& state, id& next) noexcept -> bool
+  {
+    const uint32_t requested = std::atomic_ref<uint32_t>(state.requested).load(std::memory_order_acquire);
+
+    if (requested == state.active || requested >= profile_count) return false;
+
+    state.active = requested;
+    next         = static_cast<id>(requested);
+    return true;
+  }
+
+  //
+  // Driver side, located in "svm/intercept_profile.cpp"
+  //
+
+  // PASSIVE_LEVEL, before the processors are virtualized, every vCPU starts
+  // out with default_profile
+  auto initialize        (id default_profile) noexcept -> void;
+  auto shutdown          () noexcept -> void;
+
+  // nullptr past the processor count, or when initialize() couldn't allocate
+  auto vcpu              (uint32_t processor) noexcept -> vcpu_state*;
+
+  // resolve() against what this machine supports
+  auto installable       (id profile) noexcept -> intercept_set;
+  auto initial           () noexcept -> intercept_set;
+
+  // tracks_invalidations() against what this machine supports
+  auto coherent          (const intercept_set& active) noexcept -> bool;
+
+  // Host side of the hypercall, false when processor doesn't exist
+  auto request_from_host (uint32_t processor, id profile) noexcept -> bool;
+
+  // PASSIVE_LEVEL. Issues the hypercall, then sends every processor through
+  // a #VMEXIT so the switch doesn't wait for the next natural one.
+  auto select            (uint32_t processor, id profile) noexcept -> bool;
+
+}; // namespace intercept_profile
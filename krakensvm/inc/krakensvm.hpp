@@ -58,7 +58,16 @@ namespace svm
   enum hypercall_num : uint64_t
   {
     syscallhook = 4,
-    un_syscallhook
+    un_syscallhook,
+
+    // RDX = the new cr3_filter::set, or 0 to let every process through
+    cr3_filter_swap,
+
+    // RDX = intercept_profile::encode(processor, profile)
+    set_intercept_profile,
+
+    // RDX = the hk::transaction::rendezvous every processor is joining
+    hook_window
   };
 
   auto svm_support_checking  () noexcept -> bool;
@@ -71,4 +80,8 @@ namespace svm
   auto devirt_each_processors() noexcept -> void;
   auto devirt_processor(void* shared_context) noexcept -> bool;
 
+  // VMMCALL from a processor the hypervisor runs on, which the caller's may
+  // not be when only some are virtualized. PASSIVE_LEVEL.
+  auto hypercall(uint64_t hypercall_number, void* context) noexcept -> uint64_t;
+
 }; // namespace svm
@@ -0,0 +1,156 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <processor_mask.hpp>
+
+//
+// NUMA placement
+//
+// Which node every processor index sits on, so a vCPU's VMCBs and host state
+// come out of its own node's memory and read-mostly structures every VMRUN
+// looks at (the MSR permission map) have a copy per node. On a 2 socket box
+// a VMCB on the far node is cross-socket traffic on every #VMEXIT.
+//
+// The map is built from each node's processor affinity, one entry per group
+// the node has processors in (KeQueryNodeActiveAffinity2() reports them all,
+// a node can span groups on Server 2022 and up), through the processor_mask
+// topology. Processors that weren't there when it was built, or that no
+// entry named, map to unknown_node.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace numa
+{
+  constexpr uint32_t max_nodes      = 64;
+  constexpr uint8_t  unknown_node   = 0xff;
+
+  // A node per group and then some for the nodes spanning groups, whatever
+  // doesn't fit stays unknown_node
+  constexpr uint32_t max_affinities = max_nodes + processor_mask::max_groups;
+
+  struct node_affinity
+  {
+    uint8_t  node;
+    uint16_t group;
+    uint64_t mask;            // processor numbers within group
+  };
+
+  struct affinity_list
+  {
+    uint32_t      count;
+    bool          truncated;
+    node_affinity entries[max_affinities];
+
+    constexpr auto add(const uint32_t node, const uint16_t group, const uint64_t mask) noexcept -> void
+    {
+      if (mask == 0) return;
+
+      if (count == max_affinities)
+      {
+        truncated = true;
+        return;
+      }
+
+      entries[count++] = { static_cast<uint8_t>(node), group, mask };
+    }
+  };
+
+  struct node_map
+  {
+    uint32_t node_count;
+    uint8_t  node_of[processor_mask::max_processors];
+
+    constexpr auto node(const uint32_t index) const noexcept -> uint32_t
+    {
+      return index < processor_mask::max_processors ? node_of[index] : unknown_node;
+    }
+
+    // Processors of the set that are on node
+    constexpr auto count(const processor_mask::set& processors, const uint32_t on_node) const noexcept -> uint32_t
+    {
+      uint32_t total = 0;
+
+      for (uint32_t index = processors.next(0); index != processor_mask::none; index = processors.next(index + 1))
+      {
+        if (node_of[index] == on_node) ++total;
+      }
+
+      return total;
+    }
+  };
+
+  // False when an entry names a processor the topology doesn't have, or a
+  // node past node_count
+  constexpr auto build(const affinity_list& affinities, const uint32_t node_count,
+                       const processor_mask::topology& layout, node_map& map) noexcept -> bool
+  {
+    for (uint8_t& node : map.node_of) node = unknown_node;
+
+    map.node_count = node_count < max_nodes ? node_count : max_nodes;
+
+    for (uint32_t entry = 0; entry < affinities.count; ++entry)
+    {
+      const node_affinity& affinity = affinities.entries[entry];
+      if (affinity.node >= map.node_count) return false;
+
+      for (uint32_t number = 0; number < 64; ++number)
+      {
+        if ((affinity.mask >> number & 1) == 0) continue;
+
+        const uint32_t index = layout.index_of(affinity.group, number);
+        if (index == processor_mask::none) return false;
+
+        map.node_of[index] = affinity.node;
+      }
+    }
+
+    return true;
+  }
+
+  // Where to look after the preferred node ran dry, the preferred one first
+  constexpr auto fallback(const uint32_t preferred, const uint32_t node_count, const uint32_t attempt) noexcept -> uint32_t
+  {
+    const uint32_t first = preferred < node_count ? preferred : 0;
+
+    return (first + attempt) % node_count;
+  }
+
+  //
+  // Driver side, located in "svm/numa.cpp"
+  //
+
+  // PASSIVE_LEVEL, before the processors are virtualized
+  auto initialize  () noexcept -> void;
+
+  auto map         () noexcept -> const node_map&;
+  auto node_count  () noexcept -> uint32_t;
+
+}; // namespace numa
@@ -0,0 +1,283 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+struct _UNICODE_STRING;
+
+//
+// Processors the hypervisor runs on
+//
+// By default every active processor is virtualized. The VirtualizedProcessors
+// registry value (REG_SZ) narrows that down, so cores isolated for latency
+// critical work never take a #VMEXIT. It's a comma separated list, applied
+// left to right:
+//
+//   *          every processor
+//   3          processor index 3
+//   0-7        processor indexes 0 through 7
+//   1:0-15     processors 0 through 15 of group 1
+//   ~2-3       removes indexes 2 and 3 from what's selected so far
+//
+// so "*,~6-7" keeps the hypervisor off the last two cores of an 8 core box.
+// Indexes are the system wide ones KeGetProcessorIndexFromNumber() hands out,
+// the group form is converted through the topology the driver passes in.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace processor_mask
+{
+  constexpr uint32_t max_groups     = 32;
+  constexpr uint32_t group_width    = 64;
+  constexpr uint32_t max_processors = max_groups * group_width;
+
+  constexpr uint32_t max_text       = 512;       // characters of VirtualizedProcessors
+  constexpr uint32_t none           = 0xffffffff;
+
+  struct set
+  {
+    uint64_t words[max_processors / 64];
+
+    constexpr auto contains(const uint32_t index) const noexcept -> bool
+    {
+      return index < max_processors && (words[index / 64] >> (index % 64) & 1) != 0;
+    }
+
+    constexpr auto insert(const uint32_t index) noexcept -> void
+    {
+      if (index < max_processors) words[index / 64] |= 1ull << (index % 64);
+    }
+
+    constexpr auto erase(const uint32_t index) noexcept -> void
+    {
+      if (index < max_processors) words[index / 64] &= ~(1ull << (index % 64));
+    }
+
+    constexpr auto count() const noexcept -> uint32_t
+    {
+      uint32_t total = 0;
+
+      for (uint64_t word : words)
+      {
+        for (; word != 0; word &= word - 1) ++total;
+      }
+
+      return total;
+    }
+
+    // First member at or after index, none past the last one
+    constexpr auto next(uint32_t index) const noexcept -> uint32_t
+    {
+      while (index < max_processors)
+      {
+        const uint64_t word = words[index / 64] >> (index % 64);
+
+        if (word != 0)
+        {
+          uint32_t bit = 0;
+          while ((word >> bit & 1) == 0) ++bit;
+
+          return index + bit;
+        }
+
+        index = (index / 64 + 1) * 64;
+      }
+
+      return none;
+    }
+  };
+
+  //
+  // Where each group's processors start in the system wide index space and
+  // how many it can hold
+  //
+
+  struct topology
+  {
+    uint32_t group_count;
+    uint32_t first_index[max_groups];
+    uint32_t group_size[max_groups];
+
+    constexpr auto processor_count() const noexcept -> uint32_t
+    {
+      uint32_t total = 0;
+      for (uint32_t group = 0; group < group_count; ++group) total += group_size[group];
+
+      return total;
+    }
+
+    constexpr auto index_of(const uint32_t group, const uint32_t number) const noexcept -> uint32_t
+    {
+      if (group >= group_count || number >= group_size[group]) return none;
+
+      return first_index[group] + number;
+    }
+  };
+
+  constexpr auto all(const topology& layout) noexcept -> set
+  {
+    set everything = {};
+
+    for (uint32_t group = 0; group < layout.group_count; ++group)
+    {
+      for (uint32_t number = 0; number < layout.group_size[group]; ++number)
+      {
+        everything.insert(layout.index_of(group, number));
+      }
+    }
+
+    return everything;
+  }
+
+  //
+  // VirtualizedProcessors, see the top of the file. False on anything
+  // malformed or out of range, or when no processor is left.
+  //
+
+  template<class char_t>
+  constexpr auto parse(const char_t* text, const size_t length, const topology& layout, set& selected) noexcept -> bool
+  {
+    // REG_SZ comes with its terminator
+    size_t end = 0, position = 0;
+    while (end < length && text[end] != 0) ++end;
+
+    const auto skip_blanks = [&]()
+    {
+      while (position < end && (text[position] == ' ' || text[position] == '\t')) ++position;
+    };
+
+    const auto number = [&](uint32_t& value) -> bool
+    {
+      skip_blanks();
+
+      const size_t start = position;
+      value = 0;
+
+      while (position < end && text[position] >= '0' && text[position] <= '9')
+      {
+        value = value * 10 + static_cast<uint32_t>(text[position] - '0');
+        if (value >= max_processors) return false;
+
+        ++position;
+      }
+
+      return position != start;
+    };
+
+    const set everything = all(layout);
+    selected = {};
+
+    for (;;)
+    {
+      skip_blanks();
+      if (position >= end) return false;
+
+      bool remove = false;
+      if (text[position] == '~')
+      {
+        remove = true;
+        ++position;
+        skip_blanks();
+      }
+
+      if (position < end && text[position] == '*')
+      {
+        ++position;
+
+        for (uint32_t i = 0; i < max_processors / 64; ++i)
+        {
+          selected.words[i] = remove ? selected.words[i] & ~everything.words[i]
+                                     : selected.words[i] |  everything.words[i];
+        }
+      }
+      else
+      {
+        uint32_t group = none, first = 0, last = 0;
+
+        if (!number(first)) return false;
+        skip_blanks();
+
+        if (position < end && text[position] == ':')
+        {
+          ++position;
+
+          group = first;
+          if (!number(first)) return false;
+          skip_blanks();
+        }
+
+        last = first;
+
+        if (position < end && text[position] == '-')
+        {
+          ++position;
+          if (!number(last) || last < first) return false;
+        }
+
+        for (uint32_t current = first; current <= last; ++current)
+        {
+          const uint32_t index = group == none ? current : layout.index_of(group, current);
+          if (!everything.contains(index)) return false;
+
+          if (remove) selected.erase(index);
+          else        selected.insert(index);
+        }
+      }
+
+      skip_blanks();
+      if (position >= end) break;
+      if (text[position] != ',') return false;
+
+      ++position;
+    }
+
+    return selected.count() != 0;
+  }
+
+  //
+  // Driver side, located in "svm/processor_mask.cpp"
+  //
+
+  // PASSIVE_LEVEL, before the processors are virtualized
+  auto load_registry (_UNICODE_STRING* registry_path) noexcept -> void;
+
+  // Every group the system can have, not just the active ones
+  auto current_topology(topology& layout) noexcept -> void;
+
+  // What bring-up goes through, every active processor unless narrowed down
+  auto selected      () noexcept -> const set&;
+
+  // Processors actually running under the hypervisor right now
+  auto virtualized   () noexcept -> const set&;
+  auto mark          (uint32_t index, bool running) noexcept -> void;
+  auto is_virtualized(uint32_t index) noexcept -> bool;
+
+}; // namespace processor_mask
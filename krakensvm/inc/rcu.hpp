@@ -0,0 +1,153 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+//
+// Read-copy-update for tables the host side of a #VMEXIT reads
+//
+// Readers never lock or write anything shared: a table is built off to the
+// side, never written again once published, and replaced as a whole by a
+// single pointer store. The writer then waits out a grace period before it
+// frees the old one.
+//
+// Every vCPU keeps a sequence number that's odd while it's inside a #VMEXIT
+// and even while the guest runs. Guest mode is the quiescent state, no host
+// side pointer survives a VMRUN. A grace period is over once every vCPU that
+// was odd when the new table went out has moved on; an even one has nothing
+// to wait for, so an idle vCPU that doesn't exit doesn't hold anybody up.
+//
+// Readers in the guest aren't covered.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace rcu
+{
+  // One cache line each, vCPUs write theirs twice per exit
+  struct vcpu_state
+  {
+    uint64_t sequence;
+    uint64_t padding[7];
+  };
+
+  //
+  // Reader side. enter() has to be visible before anything the exit reads: a
+  // writer that doesn't see it yet is then guaranteed to have its new table
+  // seen by this exit instead.
+  //
+
+  inline auto enter(vcpu_state& state) noexcept -> void
+  {
+    std::atomic_ref<uint64_t>(state.sequence).fetch_add(1, std::memory_order_seq_cst);
+  }
+
+  inline auto leave(vcpu_state& state) noexcept -> void
+  {
+    std::atomic_ref<uint64_t> sequence(state.sequence);
+    sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  inline auto inside(const vcpu_state& state) noexcept -> bool
+  {
+    return (std::atomic_ref<uint64_t>(const_cast<uint64_t&>(state.sequence)).load(std::memory_order_acquire) & 1) != 0;
+  }
+
+  template<class table_t>
+  inline auto dereference(table_t* const& published) noexcept -> table_t*
+  {
+    return std::atomic_ref<table_t*>(const_cast<table_t*&>(published)).load(std::memory_order_acquire);
+  }
+
+  //
+  // Writer side, writers are serialized by the caller
+  //
+
+  // Returns the table that was there before, it's the caller's once
+  // synchronize() is done
+  template<class table_t>
+  inline auto publish(table_t*& published, table_t* replacement) noexcept -> table_t*
+  {
+    table_t* previous = std::atomic_ref<table_t*>(published).exchange(replacement, std::memory_order_seq_cst);
+
+    // Pairs with enter(), the sequence numbers read next are no older than
+    // the store above
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return previous;
+  }
+
+  //
+  // Waits until every vCPU that was inside an exit has left it or entered a
+  // later one. Processors are looked at one after the other, none of them has
+  // to be caught anywhere at the same time as the others.
+  //
+
+  template<class relax_t>
+  auto synchronize(vcpu_state* states, const uint32_t count, relax_t relax) noexcept -> void
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for (uint32_t index = 0; index < count; ++index)
+    {
+      std::atomic_ref<uint64_t> sequence(states[index].sequence);
+
+      const uint64_t seen = sequence.load(std::memory_order_acquire);
+      if ((seen & 1) == 0) continue;
+
+      while (sequence.load(std::memory_order_acquire) == seen) relax();
+    }
+
+    // Whatever the readers did with the old table happens before the caller
+    // frees it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  //
+  // Driver side, located in "svm/rcu.cpp"
+  //
+
+  // PASSIVE_LEVEL, before the processors are virtualized
+  auto initialize  () noexcept -> bool;
+
+  // Only once the processors have been devirtualized
+  auto shutdown    () noexcept -> void;
+
+  // nullptr past the processor count, or when initialize() couldn't allocate
+  auto vcpu        (uint32_t processor) noexcept -> vcpu_state*;
+
+  // Without it nothing can be published, nobody could tell when the old
+  // table is free
+  auto ready       () noexcept -> bool;
+
+  // PASSIVE_LEVEL, from the guest. Exits are short and can't be preempted,
+  // so this spins.
+  auto synchronize () noexcept -> void;
+
+}; // namespace rcu
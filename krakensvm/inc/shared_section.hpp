@@ -0,0 +1,68 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <hv_util.hpp>
+
+//
+// Memory shared with user mode readers
+//
+// A pagefile backed section, mapped into system space and locked down since
+// it's written from root mode. The driver writes it through an MDL mapping of
+// the locked pages, not through the section: a section that isn't
+// user_writable is created read-only, so no view of it can be made writable
+// again with NtProtectVirtualMemory either.
+//
+// Whatever the driver goes by when writing into the section (offsets, sizes,
+// where the next record goes) has to live outside of it, the readers can at
+// most see it.
+//
+
+namespace shared_section
+{
+  struct section
+  {
+    HANDLE handle;
+    PVOID  object;
+    PVOID  system_view;       // read-only for a section that isn't user_writable
+    PMDL   locked_pages;
+    void*  address;           // where the driver writes, zeroed by create()
+    size_t size;
+    bool   user_writable;
+  };
+
+  // PASSIVE_LEVEL, size is rounded up to pages. Leaves the section empty on
+  // failure.
+  auto create     (section& shared, size_t size, bool user_writable) noexcept -> bool;
+
+  // Only once nothing writes into it any more and every view is gone
+  auto destroy    (section& shared) noexcept -> void;
+
+  // A view in the current process, read-write only for a user_writable section
+  auto map_user   (const section& shared, void*& address, size_t& size) noexcept -> bool;
+  auto unmap_user (void* address) noexcept -> void;
+
+}; // namespace shared_section
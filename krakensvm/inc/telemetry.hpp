@@ -0,0 +1,324 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Shared telemetry section
+//
+// One section mapped read-only into readers (\\.\KrakenSvm, IOCTL_KRAKEN_MAP_TELEMETRY)
+// and locked into system space for the hypervisor. It starts with a header, then
+// one vcpu_stats block per processor, then, when syscall profiling is on, the
+// per-CPU syscall rows of "hooks/syscall_stats.hpp".
+//
+// Every block is only written by the processor it belongs to, readers take
+// deltas between two snapshots. The driver finds the blocks through pointers
+// of its own, the offsets in the header are only there for the readers.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace telemetry
+{
+  constexpr uint32_t section_magic   = 0x4d4c544b; // "KTLM"
+  constexpr uint32_t section_version = 1;
+
+  constexpr size_t   cache_line      = 64;
+
+  //
+  // #VMEXIT codes folded into buckets, following the VMEXIT enum of
+  // "inc/hv_util.hpp": 0x000 - 0x09f map onto themselves, _NPF through
+  // _VMGEXIT (0x400 - 0x403) follow them, then _INVALID and anything else
+  //
+
+  constexpr uint32_t direct_exits    = 0xa0;
+  constexpr uint32_t bucket_npf      = direct_exits;        // 0x400 - 0x403
+  constexpr uint32_t bucket_invalid  = direct_exits + 4;
+  constexpr uint32_t bucket_other    = direct_exits + 5;
+  constexpr uint32_t exit_buckets    = direct_exits + 8;
+
+  constexpr auto bucket_of(const uint64_t exit_code) noexcept -> uint32_t
+  {
+    if (exit_code < direct_exits)                       return static_cast<uint32_t>(exit_code);
+    if (exit_code >= 0x400 && exit_code <= 0x403)       return bucket_npf + static_cast<uint32_t>(exit_code - 0x400);
+    if (exit_code == static_cast<uint64_t>(-1))         return bucket_invalid;
+    return bucket_other;
+  }
+
+  // The exit code a bucket stands for, -1 for "other"
+  constexpr auto exit_code_of(const uint32_t bucket) noexcept -> int64_t
+  {
+    if (bucket < direct_exits)     return bucket;
+    if (bucket < bucket_invalid)   return 0x400 + (bucket - bucket_npf);
+    return -1;
+  }
+
+  //
+  // Readable name of a bucket, spelled like the VMEXIT enum without the
+  // leading underscore. Families (CRn, DRn, EXCPn) are formatted into buffer.
+  //
+
+  inline auto exit_name(const uint32_t bucket, char (&buffer)[24]) noexcept -> const char*
+  {
+    static constexpr const char* named[] =
+    {
+      "INTR", "NMI", "SMI", "INIT", "VINTR", "CR0_SEL_WRITE", "IDTR_READ", "GDTR_READ",
+      "LDTR_READ", "TR_READ", "IDTR_WRITE", "GDTR_WRITE", "LDTR_WRITE", "TR_WRITE", "RDTSC", "RDPMC",
+      "PUSHF", "POPF", "CPUID", "RSM", "IRET", "SWINT", "INVD", "PAUSE",
+      "HLT", "INVLPG", "INVLPGA", "IOIO", "MSR", "TASK_SWITCH", "FERR_FREEZE", "SHUTDOWN",
+      "VMRUN", "VMMCALL", "VMLOAD", "VMSAVE", "STGI", "CLGI", "SKINIT", "RDTSCP",
+      "ICEBP", "WBINVD", "MONITOR", "MWAIT", "MWAIT_CONDITIONAL", "RDPRU", "XSETBV", "EFER_WRITE_TRAP",
+    };
+
+    static constexpr const char* nested[] = { "NPF", "INCOMPLETE_IPI", "0x402", "VMGEXIT" };
+
+    const auto family = [&buffer](const char* prefix, const uint32_t number, const char* suffix) -> const char*
+    {
+      size_t at = 0;
+
+      for (; *prefix && at < sizeof(buffer) - 1; ++prefix) buffer[at++] = *prefix;
+      if (number >= 10) buffer[at++] = static_cast<char>('0' + number / 10);
+      buffer[at++] = static_cast<char>('0' + number % 10);
+      for (; *suffix && at < sizeof(buffer) - 1; ++suffix) buffer[at++] = *suffix;
+
+      buffer[at] = '\0';
+      return buffer;
+    };
+
+    if (bucket < 0x10)            return family("CR", bucket, "_READ");
+    if (bucket < 0x20)            return family("CR", bucket - 0x10, "_WRITE");
+    if (bucket < 0x30)            return family("DR", bucket - 0x20, "_READ");
+    if (bucket < 0x40)            return family("DR", bucket - 0x30, "_WRITE");
+    if (bucket < 0x60)            return family("EXCP", bucket - 0x40, "");
+    if (bucket < 0x90)            return named[bucket - 0x60];
+    if (bucket < direct_exits)    return family("CR", bucket - 0x90, "_WRITE_TRAP");
+    if (bucket < bucket_invalid)  return nested[bucket - bucket_npf];
+    if (bucket == bucket_invalid) return "INVALID";
+
+    return "OTHER";
+  }
+
+  //
+  // Hottest guest RIPs of a vCPU, a small Misra-Gries summary: a RIP takes over
+  // a slot only once the slot's count has been worn down to zero
+  //
+
+  constexpr uint32_t hot_rip_slots = 64;  // indexed by the top 6 bits of a Fibonacci hash
+
+  struct rip_entry
+  {
+    uint64_t rip;
+    uint64_t count;
+  };
+
+  struct alignas(cache_line) vcpu_stats
+  {
+    // Written on #VMEXIT
+    uint64_t  exits;
+    uint64_t  root_cycles;       // TSC spent in vmexit_handler
+    uint64_t  last_exit_tsc;
+    uint64_t  traced_exits;      // exits vmexit_traced() let through
+
+    // Written by the syscall trap (hooks/syscall_trap.cpp) in root mode,
+    // on the #VMEXIT of the trapped SYSCALL or SYSRET
+    alignas(cache_line)
+    uint64_t  syscalls;
+    uint64_t  captured;          // records written into the capture ring
+    uint64_t  filtered;          // events the CR3 set or the bytecode filter turned away
+    uint64_t  unpaired;          // SYSRETs without an entry on this vCPU, migrated threads among them
+    uint64_t  evicted;           // entries pushed out of the vCPU's in_flight table
+
+    alignas(cache_line)
+    uint64_t  exit_count [exit_buckets];
+    uint64_t  exit_cycles[exit_buckets];
+
+    rip_entry hot_rips[hot_rip_slots];
+  };
+
+  struct header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t total_size;
+    uint64_t tsc_frequency;      // TSC ticks per second, measured at load
+
+    uint32_t vcpu_count;
+    uint32_t vcpu_stride;
+    uint64_t vcpu_offset;
+
+    uint64_t syscall_offset;     // 0 while syscall profiling is off
+    uint32_t syscall_cpu_count;
+    uint32_t syscall_slots;
+    uint32_t syscall_nt_slots;   // win32k slots follow the ntoskrnl ones
+    uint32_t syscall_row_size;
+  };
+
+  //
+  // Layout
+  //
+
+  constexpr auto align_up(const size_t value, const size_t alignment) noexcept -> size_t
+  {
+    return (value + alignment - 1) & ~(alignment - 1);
+  }
+
+  constexpr auto vcpu_offset() noexcept -> size_t
+  {
+    return align_up(sizeof(header), cache_line);
+  }
+
+  constexpr auto syscall_offset(const uint32_t vcpu_count) noexcept -> size_t
+  {
+    return align_up(vcpu_offset() + static_cast<size_t>(vcpu_count) * sizeof(vcpu_stats), 0x1000);
+  }
+
+  constexpr auto section_size(const uint32_t vcpu_count, const size_t syscall_bytes) noexcept -> size_t
+  {
+    return align_up(syscall_offset(vcpu_count) + syscall_bytes, 0x1000);
+  }
+
+  inline auto vcpu_block(const header* current, const uint32_t index) noexcept -> vcpu_stats*
+  {
+    if (current == nullptr || index >= current->vcpu_count) return nullptr;
+
+    return reinterpret_cast<vcpu_stats*>(reinterpret_cast<uintptr_t>(current) + current->vcpu_offset +
+                                         static_cast<size_t>(index) * current->vcpu_stride);
+  }
+
+  // Checks a mapped section before trusting any of its offsets
+  inline auto validate(const void* view, const size_t view_size) noexcept -> const header*
+  {
+    const auto* current = static_cast<const header*>(view);
+
+    if (current == nullptr || view_size < sizeof(header))                         return nullptr;
+    if (current->magic != section_magic || current->version != section_version)   return nullptr;
+    if (current->vcpu_stride != sizeof(vcpu_stats) || current->total_size > view_size) return nullptr;
+
+    if (current->vcpu_offset > view_size ||
+        (view_size - current->vcpu_offset) / current->vcpu_stride < current->vcpu_count)
+    {
+      return nullptr;
+    }
+
+    return current;
+  }
+
+  //
+  // Writer side, only ever on the vCPU's own block
+  //
+
+  inline auto record_exit(vcpu_stats& stats, const uint64_t exit_code, const uint64_t rip,
+                          const bool traced, const uint64_t exit_tsc, const uint64_t cycles) noexcept -> void
+  {
+    const uint32_t bucket = bucket_of(exit_code);
+
+    ++stats.exits;
+    stats.root_cycles     += cycles;
+    stats.last_exit_tsc    = exit_tsc;
+
+    ++stats.exit_count[bucket];
+    stats.exit_cycles[bucket] += cycles;
+
+    if (!traced) return;
+
+    ++stats.traced_exits;
+
+    // Direct mapped by RIP, a miss wears the resident entry down instead of evicting it
+    rip_entry& slot = stats.hot_rips[(rip * 0x9e3779b97f4a7c15) >> 58];
+
+    if (slot.rip == rip)        ++slot.count;
+    else if (slot.count == 0)   { slot.rip = rip; slot.count = 1; }
+    else                        --slot.count;
+  }
+
+  //
+  // Device interface, \\.\KrakenSvm
+  //
+
+  constexpr auto ctl_code(const uint32_t function, const uint32_t access) noexcept -> uint32_t
+  {
+    // FILE_DEVICE_UNKNOWN, METHOD_BUFFERED
+    return (0x22u << 16) | (access << 14) | (function << 2);
+  }
+
+  // Output: mapping
+  constexpr uint32_t ioctl_map_telemetry  = ctl_code(0x800, 1);  // FILE_READ_DATA
+
+  // Output: stream_mapping, the capture stream of "hooks/syscall_capture.hpp".
+  // The tails view is writable, so the handle has to be.
+  constexpr uint32_t ioctl_map_capture    = ctl_code(0x801, 2);  // FILE_WRITE_DATA
+
+  // Input: up to cr3_filter::max_entries uint64_t CR3 values, none clears the set
+  constexpr uint32_t ioctl_set_cr3_filter = ctl_code(0x802, 2);  // FILE_WRITE_DATA
+
+  // Output: stream_mapping, the #VMEXIT trace stream of "inc/exit_trace.hpp"
+  constexpr uint32_t ioctl_map_exit_trace = ctl_code(0x803, 2);  // FILE_WRITE_DATA
+
+  // Input: uint64_t, intercept_profile::encode() of the processor and profile
+  constexpr uint32_t ioctl_set_intercept_profile = ctl_code(0x804, 2);
+
+  struct mapping
+  {
+    uint64_t address;
+    uint64_t size;
+  };
+
+  // A record stream, read-only, and the ring tails its reader moves
+  struct stream_mapping
+  {
+    mapping stream;
+    mapping tails;
+  };
+
+  //
+  // Driver side, located in "svm/telemetry.cpp"
+  //
+
+  // Published last by initialize(), nullptr until then
+  extern vcpu_stats* volatile vcpu_rows;
+  extern uint32_t             vcpu_rows_count;
+
+  inline auto vcpu(const uint32_t index) noexcept -> vcpu_stats*
+  {
+    vcpu_stats* const rows = vcpu_rows;
+
+    return rows != nullptr && index < vcpu_rows_count ? &rows[index] : nullptr;
+  }
+
+  // PASSIVE_LEVEL, syscall_slots 0 leaves the syscall rows out
+  auto initialize (uint32_t syscall_slots, uint32_t syscall_nt_slots) noexcept -> bool;
+  auto shutdown   () noexcept -> void;
+
+  // Storage for hk::stats, nullptr when the section has no syscall rows
+  auto syscall_storage() noexcept -> void*;
+
+  // Read-only view in the current process
+  auto map_user   (void*& address, size_t& size) noexcept -> bool;
+  auto unmap_user (void* address) noexcept -> void;
+
+}; // namespace telemetry
@@ -0,0 +1,108 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+//
+// Reserve of vCPU contexts
+//
+// Contexts are allocated up front, one per selected processor that's active
+// at load plus HotAddReserve spares, so a processor added later (a VM host
+// growing its vCPU count) gets virtualized from the processor change callback
+// without asking the pool for 16 KB of page aligned memory at that point.
+// Slots are handed out once and all of them go back together at unload.
+//
+// There's one pool per NUMA node, filled from that node's memory. A processor
+// takes from its own node's pool and only falls back to the others once that
+// one ran dry. Selected processors the NUMA map couldn't place get slots of
+// their own in an unplaced pool, filled from any node, so they don't eat
+// into the spares of node 0.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace vcpu_reserve
+{
+  constexpr uint32_t none          = 0xffffffff;
+  constexpr uint32_t default_spare = 4;
+
+  //
+  // Slots of one node's pool. selected: processors on the node that are
+  // active and VirtualizedProcessors allows, active and maximum: system wide,
+  // what's running now and what the system can grow to. Every node gets the
+  // spares since nobody knows where a new processor will show up.
+  //
+
+  constexpr auto capacity(const uint32_t selected, const uint32_t active,
+                          const uint32_t maximum, const uint32_t spare) noexcept -> uint32_t
+  {
+    const uint32_t addable = maximum > active ? maximum - active : 0;
+
+    return selected + (addable < spare ? addable : spare);
+  }
+
+  struct pool
+  {
+    uint32_t capacity;
+    uint32_t claimed;         // only ever grows
+  };
+
+  // Next free slot, none once the reserve ran out
+  inline auto claim(pool& reserve) noexcept -> uint32_t
+  {
+    std::atomic_ref<uint32_t> claimed(reserve.claimed);
+    uint32_t slot = claimed.load(std::memory_order_relaxed);
+
+    do
+    {
+      if (slot >= reserve.capacity) return none;
+    }
+    while (!claimed.compare_exchange_weak(slot, slot + 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    return slot;
+  }
+
+  //
+  // Driver side, located in "svm/vcpu_reserve.cpp"
+  //
+
+  // PASSIVE_LEVEL, after processor_mask::load_registry() and before the
+  // processors are virtualized
+  auto initialize  (uint32_t spare) noexcept -> bool;
+
+  // Only once every processor has been devirtualized
+  auto release_all () noexcept -> void;
+
+  // A zeroed vmcb::vcpu_ctx_t, from node's pool if it can, nullptr once
+  // every pool ran out. placed: the NUMA map knows the processor, the ones
+  // it doesn't try the unplaced pool first.
+  auto take        (uint32_t node, bool placed) noexcept -> void*;
+
+}; // namespace vcpu_reserve
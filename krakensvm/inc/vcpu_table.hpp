@@ -0,0 +1,92 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#include <processor_mask.hpp>
+
+//
+// Per-processor vCPU table
+//
+// One slot per system wide processor index, KeGetCurrentProcessorNumberEx()
+// returns exactly that, groups included, so finding the current vCPU is a
+// read of the index and one load. Works the same from the guest and from the
+// host side of a #VMEXIT, nothing has to come back through CPUID any more.
+//
+// A slot is published by virt_cpu_init() on its own processor before the
+// first VMRUN and retired by devirt_processor() on the way out.
+//
+// Nothing in here depends on the WDK.
+//
+
+namespace vcpu_table
+{
+  struct table
+  {
+    void* entries[processor_mask::max_processors];
+  };
+
+  inline auto publish(table& vcpus, const uint32_t index, void* vcpu) noexcept -> bool
+  {
+    if (index >= processor_mask::max_processors) return false;
+
+    std::atomic_ref<void*>(vcpus.entries[index]).store(vcpu, std::memory_order_release);
+    return true;
+  }
+
+  inline auto lookup(table& vcpus, const uint32_t index) noexcept -> void*
+  {
+    if (index >= processor_mask::max_processors) return nullptr;
+
+    return std::atomic_ref<void*>(vcpus.entries[index]).load(std::memory_order_acquire);
+  }
+
+  // Empties the slot, returns what was in it
+  inline auto retire(table& vcpus, const uint32_t index) noexcept -> void*
+  {
+    if (index >= processor_mask::max_processors) return nullptr;
+
+    return std::atomic_ref<void*>(vcpus.entries[index]).exchange(nullptr, std::memory_order_acq_rel);
+  }
+
+  // Slot of a group relative processor number
+  constexpr auto index_of(const processor_mask::topology& layout, const uint32_t group, const uint32_t number) noexcept -> uint32_t
+  {
+    return layout.index_of(group, number);
+  }
+
+  //
+  // Driver side, defined in "svm/vmcb.cpp". vmcb::current_vcpu() is the
+  // usual way in.
+  //
+
+  extern table vcpus;
+
+}; // namespace vcpu_table
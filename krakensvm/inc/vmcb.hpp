@@ -30,9 +30,14 @@
 #include <segment_intrins.h>
 #include <descriptors_info.hpp>
 #include <hv_util.hpp>
+#include <intercept_profile.hpp>
+#include <numa.hpp>
+#include <vcpu_table.hpp>
+#include <page_walk.hpp>
 
 extern "C" void svmlaunch(uint64_t* guestvmcb_pa);
-extern "C" void __svm_vmmcall(uint64_t hypercall_number, void* context);
+// Returns whatever the hypervisor left in the guest RAX
+extern "C" uint64_t __svm_vmmcall(uint64_t hypercall_number, void* context);
 
 using namespace ia32e::seg;
 
@@ -81,7 +86,7 @@ namespace vmcb
 
     // got the offset formating idea from tandasat =)
 
-    union
+    struct
     {
       uint64_t intercept_read_cr0  : 16;      // +0x000
       uint64_t intercept_write_cr0 : 16;      // +0x002
@@ -220,7 +225,7 @@ namespace vmcb
     seg_register idtr;                        // +0x080
     seg_register tr;                          // +0x090
 
-    uint8_t reserved1[0xca - 0xa0];           // +0x0a0
+    uint8_t reserved1[0xcb - 0xa0];           // +0x0a0
     uint8_t cpl;                              // +0x0cb
     uint32_t reserved2;                       // +0x0cc
     uint64_t efer;                            // +0x0d0
@@ -284,7 +289,16 @@ namespace vmcb
   {
     void* msrpm_addr; // "MSR Permission Maps"
 
-    _paging_data() : msrpm_addr(nullptr) {}
+    // Copies of msrpm_addr in each NUMA node's memory, nullptr for a node
+    // that didn't get one. Whoever changes msrpm_addr changes these too.
+    void* msrpm_replicas[numa::max_nodes];
+
+    _paging_data() : msrpm_addr(nullptr), msrpm_replicas{} {}
+
+    auto msrpm_for(uint32_t node) const -> void*
+    {
+      return node < numa::max_nodes && msrpm_replicas[node] != nullptr ? msrpm_replicas[node] : msrpm_addr;
+    }
   } paging_data, * ppaging_data;
 
   //
@@ -307,9 +321,32 @@ namespace vmcb
     // For syscall hook
     uint64_t original_lstar;
 
+    // EFER.SCE as the guest last wrote it, the real one stays clear while
+    // syscalls are trapped (see "hooks/syscall_trap.hpp")
+    bool guest_syscall_enabled;
+
+    // GVA -> GPA cache of "svm/guest_memory.cpp", only touched on the host side
+    ia32e::walk::tlb guest_tlb;
+
   } vcpu_ctx_t, * pvcpu_ctx_t;
 
 
+  //
+  // vCPU of the processor this runs on, nullptr when it isn't virtualized.
+  // Guest or host side, any IRQL.
+  //
+
+  inline auto current_vcpu() noexcept -> pvcpu_ctx_t
+  {
+    return static_cast<pvcpu_ctx_t>(vcpu_table::lookup(vcpu_table::vcpus, KeGetCurrentProcessorNumberEx(nullptr)));
+  }
+
+  inline auto vcpu_at(uint32_t processor_index) noexcept -> pvcpu_ctx_t
+  {
+    return static_cast<pvcpu_ctx_t>(vcpu_table::lookup(vcpu_table::vcpus, processor_index));
+  }
+
   auto vmcb_prepartion (pvcpu_ctx_t vcpu_data, register_ctx_t& host_info, ppaging_data sharded_page_info) noexcept -> void;
+  auto install_intercepts(pvcpu_ctx_t vcpu_data, const intercept_profile::intercept_set& intercepts) noexcept -> void;
   auto virt_cpu_init   (ppaging_data shared_page_info) noexcept -> bool;
 }; // namespace vmcb
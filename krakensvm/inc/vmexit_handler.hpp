@@ -47,6 +47,12 @@ auto vmmcall_handler       (vmcb::pvcpu_ctx_t vcpu_data, guest_status_t guest_st
 auto vminstructions_handler(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void;
 auto cpuid_handler         (vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status) noexcept -> void;
 auto msr_handler           (vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status) noexcept -> void;
+auto cr3_write_handler     (vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status) noexcept -> void;
+auto cr4_write_handler     (vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status) noexcept -> void;
+auto invlpg_handler        (vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void;
+auto invpcid_handler       (vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void;
+auto ud_handler            (vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status) noexcept -> void;
+auto rdtsc_handler         (vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status, bool rdtscp) noexcept -> void;
 
 extern "C"
 {
@@ -55,11 +61,14 @@ auto vmexit_handler        (vmcb::pvcpu_ctx_t vcpu_data, pguest_reg_ctx_t guest_
 
 auto setup_msrpermissions_bitmap (void* msrpermission_map) noexcept -> void;
 
+// CR3 set and #VMEXIT bytecode filter, for whatever records exits
+auto vmexit_traced         (vmcb::pvcpu_ctx_t vcpu_data) noexcept -> bool;
+
 //
 // Event Injection
 //
 
-// Injecting #GP General Protection
+// Injecting #GP(0) General Protection
 auto inject_gp             (vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void;
 
 // Injection #UD Invalid Opcode
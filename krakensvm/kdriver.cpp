@@ -25,40 +25,399 @@
 
 #include <wdm.h>
 #include <ntddk.h>
+#include <wdmsec.h>
 #include <krakensvm.hpp>
 #include <vmcb.hpp>
+#include <offset_cache.hpp>
+#include <pe_image.hpp>
+#include <syscall_hook.hpp>
+#include <export_watch.hpp>
+#include <syscall_stats.hpp>
+#include <syscall_capture.hpp>
+#include <syscall_trap.hpp>
+#include <exit_trace.hpp>
+#include <intercept_policy.hpp>
+#include <intercept_profile.hpp>
+#include <processor_mask.hpp>
+#include <vcpu_reserve.hpp>
+#include <numa.hpp>
+#include <guest_memory.hpp>
+#include <event_filter.hpp>
+#include <binlog.hpp>
+#include <telemetry.hpp>
+#include <cr3_filter.hpp>
+#include <rcu.hpp>
+#include <deferred_work.hpp>
 
 static void driver_unloading(PDRIVER_OBJECT driver_object);
 
+static UNICODE_STRING device_name     = RTL_CONSTANT_STRING(L"\\Device\\KrakenSvm");
+static UNICODE_STRING dos_device_name = RTL_CONSTANT_STRING(L"\\DosDevices\\KrakenSvm");
+
+// SYSTEM and Administrators only, the views hand out what every process on
+// the box is doing. Applied whatever the INF or the registry say.
+static UNICODE_STRING device_sddl     = RTL_CONSTANT_STRING(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)");
+
+// {5a3c1f0e-7d42-4b9e-9c61-2f8e0b6a4d17}
+static const GUID device_class_guid   = { 0x5a3c1f0e, 0x7d42, 0x4b9e, { 0x9c, 0x61, 0x2f, 0x8e, 0x0b, 0x6a, 0x4d, 0x17 } };
+
+static PDEVICE_OBJECT device_object = nullptr;
+
+//
+// Views a handle has mapped, kept in the file object so they go away with it
+//
+
+typedef struct _client_ctx_t
+{
+  PEPROCESS owner;
+
+  void*     telemetry_view;
+  size_t    telemetry_size;
+
+  hk::capture::user_views capture_views;
+
+  hk::capture::user_views exit_trace_views;
+} client_ctx_t, *pclient_ctx_t;
+
+static auto complete_request(PIRP irp, NTSTATUS status, ULONG_PTR information = 0) -> NTSTATUS
+{
+  irp->IoStatus.Status      = status;
+  irp->IoStatus.Information = information;
+  IoCompleteRequest(irp, IO_NO_INCREMENT);
+
+  return status;
+}
+
+static NTSTATUS device_create(PDEVICE_OBJECT, PIRP irp)
+{
+  PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+
+  auto* client = static_cast<pclient_ctx_t>(ExAllocatePoolWithTag(NonPagedPool, sizeof(client_ctx_t), HV_POOL_TAG));
+  if (client == nullptr) return complete_request(irp, STATUS_INSUFFICIENT_RESOURCES);
+
+  RtlZeroMemory(client, sizeof(client_ctx_t));
+
+  // Views live in the address space of whoever opened the handle
+  client->owner = PsGetCurrentProcess();
+  stack->FileObject->FsContext = client;
+
+  return complete_request(irp, STATUS_SUCCESS);
+}
+
+static NTSTATUS device_cleanup(PDEVICE_OBJECT, PIRP irp)
+{
+  PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+  auto* client = static_cast<pclient_ctx_t>(stack->FileObject->FsContext);
+
+  if (client != nullptr &&
+      (client->telemetry_view != nullptr || client->capture_views.stream != nullptr || client->exit_trace_views.stream != nullptr))
+  {
+    KAPC_STATE apc_state;
+    const bool attached = PsGetCurrentProcess() != client->owner;
+
+    if (attached) KeStackAttachProcess(client->owner, &apc_state);
+
+    telemetry::unmap_user(client->telemetry_view);
+    hk::capture::unmap_user(client->capture_views);
+    exit_trace::unmap_user(client->exit_trace_views);
+
+    if (attached) KeUnstackDetachProcess(&apc_state);
+
+    client->telemetry_view   = nullptr;
+    client->capture_views    = {};
+    client->exit_trace_views = {};
+  }
+
+  return complete_request(irp, STATUS_SUCCESS);
+}
+
+static NTSTATUS device_close(PDEVICE_OBJECT, PIRP irp)
+{
+  PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+
+  if (stack->FileObject->FsContext != nullptr)
+  {
+    ExFreePoolWithTag(stack->FileObject->FsContext, HV_POOL_TAG);
+    stack->FileObject->FsContext = nullptr;
+  }
+
+  return complete_request(irp, STATUS_SUCCESS);
+}
+
+static NTSTATUS device_control(PDEVICE_OBJECT, PIRP irp)
+{
+  PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+  auto* client = static_cast<pclient_ctx_t>(stack->FileObject->FsContext);
+
+  void* buffer = irp->AssociatedIrp.SystemBuffer;
+  const ULONG input_length  = stack->Parameters.DeviceIoControl.InputBufferLength;
+  const ULONG output_length = stack->Parameters.DeviceIoControl.OutputBufferLength;
+
+  if (client == nullptr || PsGetCurrentProcess() != client->owner)
+  {
+    return complete_request(irp, STATUS_ACCESS_DENIED);
+  }
+
+  switch (stack->Parameters.DeviceIoControl.IoControlCode)
+  {
+    case telemetry::ioctl_map_telemetry:
+    {
+      if (output_length < sizeof(telemetry::mapping)) return complete_request(irp, STATUS_BUFFER_TOO_SMALL);
+
+      if (client->telemetry_view == nullptr &&
+          !telemetry::map_user(client->telemetry_view, client->telemetry_size))
+      {
+        return complete_request(irp, STATUS_UNSUCCESSFUL);
+      }
+
+      auto* view = static_cast<telemetry::mapping*>(buffer);
+      view->address = reinterpret_cast<uint64_t>(client->telemetry_view);
+      view->size    = client->telemetry_size;
+
+      return complete_request(irp, STATUS_SUCCESS, sizeof(telemetry::mapping));
+    }
+
+    case telemetry::ioctl_map_capture:
+    {
+      if (output_length < sizeof(telemetry::stream_mapping)) return complete_request(irp, STATUS_BUFFER_TOO_SMALL);
+
+      if (client->capture_views.stream == nullptr && !hk::capture::map_user(client->capture_views))
+      {
+        return complete_request(irp, STATUS_UNSUCCESSFUL);
+      }
+
+      auto* view = static_cast<telemetry::stream_mapping*>(buffer);
+      view->stream.address = reinterpret_cast<uint64_t>(client->capture_views.stream);
+      view->stream.size    = client->capture_views.stream_size;
+      view->tails.address  = reinterpret_cast<uint64_t>(client->capture_views.tails);
+      view->tails.size     = client->capture_views.tails_size;
+
+      return complete_request(irp, STATUS_SUCCESS, sizeof(telemetry::stream_mapping));
+    }
+
+    case telemetry::ioctl_map_exit_trace:
+    {
+      if (output_length < sizeof(telemetry::stream_mapping)) return complete_request(irp, STATUS_BUFFER_TOO_SMALL);
+
+      if (client->exit_trace_views.stream == nullptr && !exit_trace::map_user(client->exit_trace_views))
+      {
+        return complete_request(irp, STATUS_UNSUCCESSFUL);
+      }
+
+      auto* view = static_cast<telemetry::stream_mapping*>(buffer);
+      view->stream.address = reinterpret_cast<uint64_t>(client->exit_trace_views.stream);
+      view->stream.size    = client->exit_trace_views.stream_size;
+      view->tails.address  = reinterpret_cast<uint64_t>(client->exit_trace_views.tails);
+      view->tails.size     = client->exit_trace_views.tails_size;
+
+      return complete_request(irp, STATUS_SUCCESS, sizeof(telemetry::stream_mapping));
+    }
+
+    case telemetry::ioctl_set_cr3_filter:
+    {
+      if (input_length % sizeof(uint64_t) != 0 ||
+          input_length / sizeof(uint64_t) > cr3_filter::max_entries)
+      {
+        return complete_request(irp, STATUS_INVALID_PARAMETER);
+      }
+
+      const bool updated = cr3_filter::update(static_cast<const uint64_t*>(buffer),
+                                              input_length / sizeof(uint64_t));
+
+      return complete_request(irp, updated ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+    }
+
+    case telemetry::ioctl_set_intercept_profile:
+    {
+      uint32_t processor = {};
+      intercept_profile::id profile = {};
+
+      if (input_length != sizeof(uint64_t) ||
+          !intercept_profile::decode(*static_cast<const uint64_t*>(buffer), processor, profile))
+      {
+        return complete_request(irp, STATUS_INVALID_PARAMETER);
+      }
+
+      const bool selected = intercept_profile::select(processor, profile);
+
+      return complete_request(irp, selected ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL);
+    }
+
+    default:
+      return complete_request(irp, STATUS_INVALID_DEVICE_REQUEST);
+  }
+}
+
 EXTERN_C
 NTSTATUS driver_entry(
 	_In_ PDRIVER_OBJECT driver_object,
 	_In_ PUNICODE_STRING registry_path
 )
 {
-//  PUNICODE_STRING driver_name    ,
-//                  dos_device_name;
-
-  registry_path;
 	KdPrint(("The Driver Entry \n"));
 
-//  RtlInitUnicodeString(driver_name,     L"\\Device\\KrakenSvm");
-//  RtlInitUnicodeString(dos_device_name, L"\\DosDevices\\KrakenSvm");
-
 	driver_object->DriverUnload = driver_unloading;
 
+  // Hot paths log through per-CPU binary rings, formatted on the deferred worker
+  binlog::initialize(registry_read_dword(registry_path, L"LogRecords", 256));
+
+  // Work too slow for a #VMEXIT is handed to a PASSIVE_LEVEL worker
+  deferred::initialize(registry_read_dword(registry_path, L"DeferredWork", deferred::default_capacity));
+
+  // Pick up the KeServiceDescriptorTable(Shadow) offsets from the last load,
+  // so the syscall hook doesn't have to re-scan ntoskrnl
+  utils::cache::load(registry_path);
+
+  // Processors to leave alone, the rest get virtualized
+  processor_mask::load_registry(registry_path);
+
+  // vCPU contexts for those out of their own node's memory, plus spares for
+  // processors added later on
+  numa::initialize();
+
+  // Without them no processor can be virtualized, and DriverUnload isn't
+  // called for a failed load so what's up so far goes back here
+  if (!vcpu_reserve::initialize(registry_read_dword(registry_path, L"HotAddReserve", vcpu_reserve::default_spare)))
+  {
+    KdPrint(("[-] Failed to reserve the vCPU contexts!"));
+
+    deferred::shutdown();
+    binlog::shutdown();
+    pe::release_kernel_image();
+
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  // Where the host side looks at guest memory from
+  if (!guest_memory::initialize())
+  {
+    KdPrint(("[-] Failed to reserve the guest memory windows!"));
+
+    vcpu_reserve::release_all();
+    deferred::shutdown();
+    binlog::shutdown();
+    pe::release_kernel_image();
+
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  // MSR intercepts trimmed by "krakentrace analyze", the permission map is
+  // built while virtualizing
+  intercept_policy::load_registry(registry_path);
+
+  // Intercept profile every vCPU starts with, switched per vCPU later on
+  // through IOCTL_KRAKEN_SET_INTERCEPT_PROFILE
+  intercept_profile::initialize(static_cast<intercept_profile::id>(
+    registry_read_dword(registry_path, L"InterceptProfile", intercept_profile::standard)));
+
+  // Quiescent state tracking for the tables the host side reads, nothing can
+  // be republished without it
+  rcu::initialize();
+
+  // Per-syscall profiling and argument capture both work off the syscall
+  // trap, which each vCPU sets up as it's virtualized. The profile is sized
+  // after the service tables, virt_each_processors() decodes them into the
+  // hypervisor arena it allocates.
+  const bool     syscall_profiling = registry_read_dword(registry_path, L"SyscallProfiling", 0) != 0;
+  const uint32_t capture_records   = registry_read_dword(registry_path, L"SyscallCapture", 0);
+
+  if (syscall_profiling || capture_records != 0)
+  {
+    hk::trap::configure(true);
+  }
+
   if (svm::virt_each_processors() == false)
   {
     KdPrint(("[-] Failed to virtualize each processor!"));
   }
 
+  // Per-syscall counters and latency histograms, off unless asked for. Their
+  // rows live in the telemetry section so readers see them as well.
+  const uint32_t nt_slots      = static_cast<uint32_t>(hk::hook_lstar_info.hooked_table_size);
+  const uint32_t syscall_slots = nt_slots + static_cast<uint32_t>(hk::hook_lstar_info.hook_table_shdw_size);
+
+  telemetry::initialize(syscall_profiling ? syscall_slots : 0, nt_slots);
+
+  if (syscall_profiling)
+  {
+    hk::stats::enable(telemetry::syscall_storage());
+  }
+
+  // Predicates deciding which syscall and #VMEXIT events get recorded
+  filter::load_registry(registry_path);
+
+  // Argument capture rings, the value is the number of records per CPU
+  if (capture_records != 0)
+  {
+    hk::capture::enable(capture_records);
+  }
+
+  // #VMEXIT trace rings, same deal
+  if (const uint32_t records = registry_read_dword(registry_path, L"ExitTrace", 0); records != 0)
+  {
+    exit_trace::enable(records);
+  }
+
+  // Call counts of the exports that reach into other processes, through
+  // inline hooks
+  if (registry_read_dword(registry_path, L"ExportWatch", 0) != 0)
+  {
+    hk::export_watch::enable();
+  }
+
+  utils::cache::store(registry_path);
+
+  // \\.\KrakenSvm, for the telemetry readers
+  if (NT_SUCCESS(IoCreateDeviceSecure(driver_object, 0, &device_name, FILE_DEVICE_UNKNOWN,
+                                      FILE_DEVICE_SECURE_OPEN, FALSE, &device_sddl, &device_class_guid,
+                                      &device_object)))
+  {
+    driver_object->MajorFunction[IRP_MJ_CREATE]         = device_create;
+    driver_object->MajorFunction[IRP_MJ_CLEANUP]        = device_cleanup;
+    driver_object->MajorFunction[IRP_MJ_CLOSE]          = device_close;
+    driver_object->MajorFunction[IRP_MJ_DEVICE_CONTROL] = device_control;
+
+    if (!NT_SUCCESS(IoCreateSymbolicLink(&dos_device_name, &device_name)))
+    {
+      IoDeleteDevice(device_object);
+      device_object = nullptr;
+    }
+  }
+
 	return STATUS_SUCCESS;
 }
 
 static void driver_unloading(PDRIVER_OBJECT driver_object)
 {
   driver_object;
+
+  // Every handle, and with it every user view, is gone by the time we unload
+  if (device_object != nullptr)
+  {
+    IoDeleteSymbolicLink(&dos_device_name);
+    IoDeleteDevice(device_object);
+    device_object = nullptr;
+  }
+
+  hk::export_watch::disable();
   svm::devirt_each_processors();
+  vcpu_reserve::release_all();
+  guest_memory::shutdown();
+  hk::stats::disable();
+  hk::trap::release();
+  hk::capture::disable();
+  exit_trace::disable();
+  telemetry::shutdown();
+  cr3_filter::shutdown();
+  filter::unload(filter::hook_point::syscall);
+  filter::unload(filter::hook_point::vmexit);
+  intercept_policy::unload();
+  intercept_profile::shutdown();
+  hk::restore_syscalls();
+  rcu::shutdown();
+  deferred::shutdown();
+  binlog::shutdown();
+  pe::release_kernel_image();
 	KdPrint(("driver unloading\n"));
 }
 
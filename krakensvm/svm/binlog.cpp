@@ -0,0 +1,238 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <binlog.hpp>
+#include <deferred_work.hpp>
+
+namespace binlog
+{
+  static uint8_t*  rings_region = nullptr;
+  static size_t    rings_stride = 0;
+  static uint32_t  rings_count  = 0;
+
+  // Published last by initialize(), the log sites only ever read it
+  static uint8_t* volatile active_rings = nullptr;
+
+  static uint64_t dropped_seen   = 0;
+
+  // Set by the commit that posted a flush, cleared once the flush starts.
+  // Every record after that posts again, so nothing waits for a later one.
+  static volatile LONG flush_posted = 0;
+
+  static auto ring_of(const uint32_t cpu) noexcept -> ring_header*
+  {
+    return reinterpret_cast<ring_header*>(rings_region + cpu * rings_stride);
+  }
+
+  auto reserve() noexcept -> record*
+  {
+    uint8_t* const rings = active_rings;
+    if (rings == nullptr) return nullptr;
+
+    const uint32_t cpu = KeGetCurrentProcessorIndex();
+    if (cpu >= rings_count) return nullptr;
+
+    return ring_reserve(reinterpret_cast<ring_header*>(rings + cpu * rings_stride));
+  }
+
+  static auto flush_routine(const deferred::work&) -> void
+  {
+    flush();
+  }
+
+  //
+  // The text is put together on the deferred worker, one flush per batch of
+  // records. Until deferred::initialize() ran, or while its queue is full,
+  // the records wait for the next commit or for shutdown().
+  //
+
+  auto commit(record* slot) noexcept -> void
+  {
+    ring_commit(slot, __rdtsc());
+
+    if (flush_posted != 0 || InterlockedCompareExchange(&flush_posted, 1, 0) != 0) return;
+
+    if (!deferred::post(flush_routine)) InterlockedExchange(&flush_posted, 0);
+  }
+
+  static auto print(const record& current, char (&text)[256]) noexcept -> size_t
+  {
+    const size_t length = format(current, reinterpret_cast<const char*>(current.format), text, sizeof text);
+    kprint_info("%s", text);
+
+    return length < sizeof text ? length : sizeof text - 1;
+  }
+
+  //
+  // Bugcheck. The deferred worker never gets to run again, so whatever the
+  // rings still hold is formatted from the callback: printed for a debugger
+  // that's attached and handed to the dump as secondary data, which WinDbg's
+  // ".enumtag" lists under the GUID below. It runs at HIGH_LEVEL with every
+  // other processor frozen and may be called once for every dump being
+  // written, the text is kept from the first call.
+  //
+
+  // {6b7a1c52-3f0e-4d8b-9a21-7c4e5d3b2f10}
+  static constexpr GUID crash_text_guid = { 0x6b7a1c52, 0x3f0e, 0x4d8b, { 0x9a, 0x21, 0x7c, 0x4e, 0x5d, 0x3b, 0x2f, 0x10 } };
+  constexpr size_t      crash_text_size = 32 * 1024;
+
+  static KBUGCHECK_REASON_CALLBACK_RECORD crash_callback   = {};
+  static bool                             crash_registered = false;
+  static char*                            crash_text       = nullptr;
+  static size_t                           crash_length     = 0;
+  static bool                             crash_drained    = false;
+
+  static auto drain_for_crash() noexcept -> void
+  {
+    record current;
+    char   line[256];
+
+    for (uint32_t cpu = 0; cpu < rings_count; ++cpu)
+    {
+      ring_header* ring = ring_of(cpu);
+
+      while (ring_pop(ring, current))
+      {
+        const size_t length = print(current, line);
+
+        if (length <= crash_text_size - crash_length)
+        {
+          memcpy(crash_text + crash_length, line, length);
+          crash_length += length;
+        }
+      }
+    }
+  }
+
+  static auto crash_dump(KBUGCHECK_CALLBACK_REASON, PKBUGCHECK_REASON_CALLBACK_RECORD,
+                         PVOID data, ULONG data_length) -> void
+  {
+    if (data == nullptr || data_length < sizeof(KBUGCHECK_SECONDARY_DUMP_DATA)) return;
+
+    if (!crash_drained)
+    {
+      crash_drained = true;
+      drain_for_crash();
+    }
+
+    if (crash_length == 0) return;
+
+    auto* dump = static_cast<PKBUGCHECK_SECONDARY_DUMP_DATA>(data);
+
+    dump->Guid            = crash_text_guid;
+    dump->OutBuffer       = crash_text;
+    dump->OutBufferLength = static_cast<ULONG>(crash_length < dump->MaximumAllowed ? crash_length
+                                                                                    : dump->MaximumAllowed);
+  }
+
+  auto flush() noexcept -> void
+  {
+    record current;
+    char     line[256];
+    uint64_t dropped = 0;
+
+    if (active_rings == nullptr) return;
+
+    // Before the rings are read, a record committed from here on posts anew
+    InterlockedExchange(&flush_posted, 0);
+
+    for (uint32_t cpu = 0; cpu < rings_count; ++cpu)
+    {
+      ring_header* ring = ring_of(cpu);
+
+      while (ring_pop(ring, current)) print(current, line);
+
+      dropped += ring->dropped;
+    }
+
+    if (dropped != dropped_seen)
+    {
+      kprint_info("binlog: %llu records dropped\n", dropped - dropped_seen);
+      dropped_seen = dropped;
+    }
+  }
+
+  auto initialize(const uint32_t records_per_cpu) noexcept -> bool
+  {
+    if (active_rings != nullptr) return true;
+
+    uint32_t capacity = 1;
+    while ((capacity << 1) != 0 && (capacity << 1) <= records_per_cpu) capacity <<= 1;
+
+    rings_count  = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    rings_stride = ring_bytes(capacity);
+
+    rings_region = static_cast<uint8_t*>(ExAllocatePoolWithTag(NonPagedPool, rings_stride * rings_count, HV_POOL_TAG));
+    if (rings_region == nullptr) return false;
+
+    for (uint32_t cpu = 0; cpu < rings_count; ++cpu)
+    {
+      ring_init(ring_of(cpu), capacity, cpu);
+    }
+
+    // Logging works without it, only a crash would take the last records along
+    crash_text = static_cast<char*>(ExAllocatePoolWithTag(NonPagedPool, crash_text_size, HV_POOL_TAG));
+
+    if (crash_text != nullptr)
+    {
+      KeInitializeCallbackRecord(&crash_callback);
+      crash_registered = KeRegisterBugCheckReasonCallback(&crash_callback, crash_dump, KbCallbackSecondaryDumpData,
+                                                          reinterpret_cast<PUCHAR>(const_cast<char*>("krakensvm binlog"))) != FALSE;
+    }
+
+    _ReadWriteBarrier();
+    active_rings = rings_region;
+
+    return true;
+  }
+
+  auto shutdown() noexcept -> void
+  {
+    // After deferred::shutdown(), nothing else reads the rings any more. And
+    // nothing logs once the processors have been devirtualized.
+    flush();
+
+    if (crash_registered)
+    {
+      KeDeregisterBugCheckReasonCallback(&crash_callback);
+      crash_registered = false;
+    }
+
+    if (crash_text != nullptr)
+    {
+      ExFreePoolWithTag(crash_text, HV_POOL_TAG);
+      crash_text = nullptr;
+    }
+
+    active_rings = nullptr;
+
+    if (rings_region != nullptr)
+    {
+      ExFreePoolWithTag(rings_region, HV_POOL_TAG);
+      rings_region = nullptr;
+    }
+  }
+}; // namespace binlog
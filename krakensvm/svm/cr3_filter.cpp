@@ -0,0 +1,136 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <krakensvm.hpp>
+#include <vmcb.hpp>
+#include <rcu.hpp>
+#include <cr3_filter.hpp>
+
+namespace cr3_filter
+{
+  // One set for the whole hypervisor, every vCPU reads the same pointer
+  const set* active_set = nullptr;
+
+  // The set the driver last handed over, only touched under update_lock
+  static set* installed_set = nullptr;
+
+  // Serializes update() from build to free, two callers would otherwise both
+  // retire the same installed_set and leak the other one's
+  static EX_PUSH_LOCK update_lock = 0;
+
+  // Every page the set spans, it's read as a whole from root mode
+  static auto mapped(const set* candidate) noexcept -> bool
+  {
+    const uintptr_t first = reinterpret_cast<uintptr_t>(candidate) & ~static_cast<uintptr_t>(PAGE_SIZE - 1);
+    const uintptr_t last  = reinterpret_cast<uintptr_t>(candidate) + sizeof(set) - 1;
+
+    if (last < first) return false;
+
+    for (uintptr_t page = first; page <= last; page += PAGE_SIZE)
+    {
+      if (!MmIsAddressValid(reinterpret_cast<PVOID>(page))) return false;
+    }
+
+    return true;
+  }
+
+  auto swap(const set* replacement) noexcept -> bool
+  {
+    if (replacement != nullptr &&
+        (!mapped(replacement) || replacement->magic != set_magic || replacement->count > max_entries))
+    {
+      return false;
+    }
+
+    // The previous set is installed_set, update() frees it after the grace period
+    rcu::publish(active_set, replacement);
+    return true;
+  }
+
+  static auto install(const uint64_t* cr3s, const uint32_t count) noexcept -> bool
+  {
+    // Nobody could tell when the old set is free
+    if (!rcu::ready()) return false;
+
+    set* replacement = nullptr;
+
+    if (count != 0)
+    {
+      replacement = static_cast<set*>(ExAllocatePoolWithTag(NonPagedPool, sizeof(set), HV_POOL_TAG));
+      if (replacement == nullptr) return false;
+
+      if (!build(*replacement, cr3s, count))
+      {
+        ExFreePoolWithTag(replacement, HV_POOL_TAG);
+        return false;
+      }
+    }
+
+    if (svm::hypercall(svm::hypercall_num::cr3_filter_swap, replacement) == 0)
+    {
+      if (replacement != nullptr) ExFreePoolWithTag(replacement, HV_POOL_TAG);
+      return false;
+    }
+
+    // Readers are the syscall trap and the rest of the host side of a #VMEXIT,
+    // once every vCPU inside one has left it nobody holds the old set any more
+    set* retired   = installed_set;
+    installed_set  = replacement;
+
+    if (retired != nullptr)
+    {
+      rcu::synchronize();
+      ExFreePoolWithTag(retired, HV_POOL_TAG);
+    }
+
+    return true;
+  }
+
+  auto update(const uint64_t* cr3s, const uint32_t count) noexcept -> bool
+  {
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&update_lock, 0);
+
+    const bool installed = install(cr3s, count);
+
+    ExReleasePushLockExclusiveEx(&update_lock, 0);
+    KeLeaveCriticalRegion();
+
+    return installed;
+  }
+
+  auto shutdown() noexcept -> void
+  {
+    // Devirtualized already, nothing reads the set any more
+    active_set = nullptr;
+
+    if (installed_set != nullptr)
+    {
+      ExFreePoolWithTag(installed_set, HV_POOL_TAG);
+      installed_set = nullptr;
+    }
+  }
+}; // namespace cr3_filter
@@ -24,24 +24,28 @@
 */
 
 #include <vmexit_handler.hpp>
+#include <binlog.hpp>
 
 //
 // Debugger Information, function will be located in:
 //            "svm/debugger_info.cpp"
 // Canonicalization and Consistency Checks
 //
+// Runs on the #VMEXIT path, so it goes into the binary log like everything
+// else there. If the vCPU takes the machine down before the deferred worker
+// got to it, binlog's bugcheck callback still puts the lines into the dump.
+//
 
 auto vmexit_invalid_dump(const char* from, vmcb::pvcpu_ctx_t vmcb_data) noexcept -> void
 {
-  kprint_info("From %s Canonicalization and Consistency Checks: \n", from);
+  klog_info("From %s Canonicalization and Consistency Checks: \n", from);
 
   // Checks to see if EFER.SVME is zero
-  kprint_info("*\tEFER.SVME => VALUE: %i; %s",(__readmsr(ia32_efer) >> 12U) & 1,
+  klog_info("*\tEFER.SVME => VALUE: %i; %s",(__readmsr(ia32_efer) >> 12U) & 1,
                                               (__readmsr(ia32_efer) >> 12U) & 1 ? "Is Not Zero\n" :
-                                                                                  "Is Zero - INVALID\n",
-                                              (__readmsr(ia32_efer) >> 12U) & 1 );
+                                                                                  "Is Zero - INVALID\n");
   // Checks CR0.CD is zero and CR0.NW is set
-  kprint_info("*\tCR0.CD => VALUE: %i; %s and CR0.NW %s",
+  klog_info("*\tCR0.CD => VALUE: %i; %s and CR0.NW %s",
     vmcb_data->guest_vmcb.save_state.cr0 & (1U << 30),
     vmcb_data->guest_vmcb.save_state.cr0 & (1U << 30) == 0 ? "Is Zero" :
                                                              "Is Not Zero - INVALID",
@@ -50,33 +54,33 @@ auto vmexit_invalid_dump(const char* from, vmcb::pvcpu_ctx_t vmcb_data) noexcept
                                                              "Is Set - INVALID\n"
     );
   // Checks CR0[63:32] are not zero
-  kprint_info("*\tCR0 => VALUE: 0x%x; Reserved MBZ %s",
+  klog_info("*\tCR0 => VALUE: 0x%x; Reserved MBZ %s",
     vmcb_data->guest_vmcb.save_state.cr0 >> 32U,
     vmcb_data->guest_vmcb.save_state.cr0 >> 32U == 0 ? "Is Zero\n" :
                                                        "Is Not Zero - INVALID\n");
   // Checks Any MBZ bit of CR3 is set
-  kprint_info("*\tCR3 => VALUE: 0x%x; Reserved MBZ %s",
+  klog_info("*\tCR3 => VALUE: 0x%x; Reserved MBZ %s",
     vmcb_data->guest_vmcb.save_state.cr3,
     vmcb_data->guest_vmcb.save_state.cr3 >> 52U == 0 ? "Is Zero\n" :
                                                        "Is Not Zero - INVALID\n");
   // Checks Any MBZ bit of CR4 is set
-  kprint_info("*\tCR4 => VALUE: 0x%x; Reserved MBZ %s",
+  klog_info("*\tCR4 => VALUE: 0x%x; Reserved MBZ %s",
     vmcb_data->guest_vmcb.save_state.cr4,
     vmcb_data->guest_vmcb.save_state.cr4 & (1U << 19) == 0 &&
     vmcb_data->guest_vmcb.save_state.cr4 >> 24U == 0 ? "Is Zero\n" :
                                                        "Is Not Zero - INVALID\n");
   // Checks DR6[63:32] are not zero
-  kprint_info("*\tDR6 => VALUE: 0x%x; Reserved MBZ %s",
+  klog_info("*\tDR6 => VALUE: 0x%x; Reserved MBZ %s",
     vmcb_data->guest_vmcb.save_state.dr6,
     vmcb_data->guest_vmcb.save_state.dr6 >> 32U != 0 ? "Is Not Zero\n" :
                                                        "Is Zero - INVALID\n");
    // Checks DR7[63:32] are not zero
-  kprint_info("*\tDR7 => VALUE: 0x%x; Reserved MBZ %s",
+  klog_info("*\tDR7 => VALUE: 0x%x; Reserved MBZ %s",
     vmcb_data->guest_vmcb.save_state.dr7,
     vmcb_data->guest_vmcb.save_state.dr7 >> 32U != 0 ? "Is Not Zero\n" :
                                                        "Is Zero - INVALID\n");
    // Checks to see if Any MBZ bit of EFER is set.
-  kprint_info("*\tEFER MBZ %s", (__readmsr(ia32_efer) >> 17U) == 0 ? "Is Zero\n" :
+  klog_info("*\tEFER MBZ %s", (__readmsr(ia32_efer) >> 17U) == 0 ? "Is Zero\n" :
                                                                     "Is Not Zero - INVALID\n");
   //
   // Don't a have to do a check for  if
@@ -90,12 +94,12 @@ auto vmexit_invalid_dump(const char* from, vmcb::pvcpu_ctx_t vmcb_data) noexcept
     && (vmcb_data->guest_vmcb.save_state.cs.attribute.longmode != 0)
     && (vmcb_data->guest_vmcb.save_state.cs.attribute.def_bit  != 0))
   {
-    kprint_info("*\tEFER.LME, CR0.PG, CR4.PAE, CS.L and CS.D are all non-zero.\n");
+    klog_info("*\tEFER.LME, CR0.PG, CR4.PAE, CS.L and CS.D are all non-zero.\n");
   }
 
   // INTERCEPT_VMRUN
-  kprint_info("*\tVMRUN intercept bit %s", vmcb_data->guest_vmcb.control_area.
+  klog_info("*\tVMRUN intercept bit %s", vmcb_data->guest_vmcb.control_area.
     intercept_misc_vector_4 & INTERCEPT_VMRUN != 0 ? "Is Not Cleared\n" : "Is Cleared - INVALID\n");
 
-  kprint_info("The END of Canonicalization and Consistency Checks. \n\n");
+  klog_info("The END of Canonicalization and Consistency Checks. \n\n");
 }
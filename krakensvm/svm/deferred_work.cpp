@@ -0,0 +1,186 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <deferred_work.hpp>
+
+namespace deferred
+{
+  // Fallback for a doorbell no exit got around to ringing, in 100ns units
+  static constexpr LONGLONG idle_interval = -250 * 10000;
+
+  static uint8_t* queue_region = nullptr;
+
+  // Published last by initialize(), post() only ever reads it
+  static queue_header* volatile active_queue = nullptr;
+
+  static KEVENT   worker_stop;
+  static KEVENT   worker_wake;
+  static KDPC     wake_dpc;
+  static PVOID    worker_thread = nullptr;
+  static uint64_t dropped_seen  = 0;
+
+  // Set by a post that found the worker asleep, taken by the exit that rings
+  static volatile LONG doorbell_requested = 0;
+
+  static auto wake_routine(PKDPC, PVOID, PVOID, PVOID) -> void
+  {
+    KeSetEvent(&worker_wake, IO_NO_INCREMENT, FALSE);
+  }
+
+  auto post(const routine_t routine, const uint64_t arg0, const uint64_t arg1, const uint64_t arg2,
+            const uint64_t arg3, const uint64_t arg4) noexcept -> bool
+  {
+    queue_header* const queue = active_queue;
+    if (queue == nullptr || routine == nullptr) return false;
+
+    const work item = { routine, __rdtsc(), { arg0, arg1, arg2, arg3, arg4 } };
+
+    const posted result = push(queue, item);
+    if (result == posted::queued_ring) InterlockedExchange(&doorbell_requested, 1);
+
+    return result != posted::full;
+  }
+
+  //
+  // Root mode can't signal anything itself, it queues a DPC the guest runs
+  // later. That's only safe where the guest couldn't be holding this
+  // processor's DPC queue lock (interrupts on, below HIGH_LEVEL); CR8 is the
+  // guest's own here. It's raised to DISPATCH_LEVEL around the insert so
+  // the DPC isn't run on the way back down, in root mode, but by the guest
+  // the next time it drops below DISPATCH_LEVEL.
+  //
+
+  auto doorbell(const uint64_t guest_rflags) noexcept -> void
+  {
+    if (doorbell_requested == 0 || (guest_rflags & (1ull << 9)) == 0) return;
+
+    const uint64_t irql = __readcr8();
+    if (irql >= HIGH_LEVEL) return;
+
+    if (InterlockedExchange(&doorbell_requested, 0) == 0) return;
+
+    if (irql < DISPATCH_LEVEL) __writecr8(DISPATCH_LEVEL);
+
+    KeInsertQueueDpc(&wake_dpc, nullptr, nullptr);
+
+    __writecr8(irql);
+  }
+
+  static auto run_pending(queue_header* queue) noexcept -> void
+  {
+    drain(queue);
+
+    if (queue->dropped != dropped_seen)
+    {
+      kprint_info("deferred: %llu work items dropped\n", queue->dropped - dropped_seen);
+      dropped_seen = queue->dropped;
+    }
+  }
+
+  static auto worker(PVOID) -> void
+  {
+    PVOID events[2] = { &worker_stop, &worker_wake };
+
+    LARGE_INTEGER interval;
+    interval.QuadPart = idle_interval;
+
+    queue_header* queue = active_queue;
+
+    for (;;)
+    {
+      run_pending(queue);
+
+      if (!prepare_sleep(queue)) continue;
+
+      if (KeWaitForMultipleObjects(2, events, WaitAny, Executive, KernelMode, FALSE,
+                                   &interval, nullptr) == STATUS_WAIT_0) break;
+
+      // Woken by the doorbell or the timeout, either way awake now
+      std::atomic_ref<uint32_t>(queue->sleeping).store(0, std::memory_order_relaxed);
+    }
+
+    run_pending(queue);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+  }
+
+  auto initialize(const uint32_t capacity) noexcept -> bool
+  {
+    HANDLE thread = nullptr;
+
+    if (active_queue != nullptr) return true;
+
+    uint32_t slots = 1;
+    while ((slots << 1) != 0 && (slots << 1) <= capacity) slots <<= 1;
+
+    queue_region = static_cast<uint8_t*>(ExAllocatePoolWithTag(NonPagedPool, queue_bytes(slots), HV_POOL_TAG));
+    if (queue_region == nullptr) return false;
+
+    queue_header* queue = queue_init(queue_region, slots);
+
+    KeInitializeEvent(&worker_stop, NotificationEvent, FALSE);
+    KeInitializeEvent(&worker_wake, SynchronizationEvent, FALSE);
+    KeInitializeDpc(&wake_dpc, wake_routine, nullptr);
+
+    // The worker reads the queue before post() can see it
+    active_queue = queue;
+
+    if (!NT_SUCCESS(PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, nullptr, nullptr, nullptr, worker, nullptr)))
+    {
+      active_queue = nullptr;
+      ExFreePoolWithTag(queue_region, HV_POOL_TAG);
+      queue_region = nullptr;
+      return false;
+    }
+
+    ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, nullptr, KernelMode, &worker_thread, nullptr);
+    ZwClose(thread);
+
+    return true;
+  }
+
+  auto shutdown() noexcept -> void
+  {
+    // Nothing posts any more once the processors have been devirtualized
+    active_queue = nullptr;
+
+    if (worker_thread != nullptr)
+    {
+      KeSetEvent(&worker_stop, IO_NO_INCREMENT, FALSE);
+      KeWaitForSingleObject(worker_thread, Executive, KernelMode, FALSE, nullptr);
+      ObDereferenceObject(worker_thread);
+      worker_thread = nullptr;
+    }
+
+    // A doorbell rung just before the processors went may still be queued
+    KeFlushQueuedDpcs();
+
+    if (queue_region != nullptr)
+    {
+      ExFreePoolWithTag(queue_region, HV_POOL_TAG);
+      queue_region = nullptr;
+    }
+  }
+}; // namespace deferred
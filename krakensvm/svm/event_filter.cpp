@@ -0,0 +1,110 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <rcu.hpp>
+#include <event_filter.hpp>
+
+namespace filter
+{
+  static constexpr uint32_t point_count = static_cast<uint32_t>(hook_point::hook_point_count);
+
+  // Only swapped at PASSIVE_LEVEL, read by the host side of a #VMEXIT: the
+  // syscall trap and vmexit_traced(). Published through rcu.
+  static program* loaded_programs[point_count] = {};
+
+  static auto swap_program(const hook_point point, program* replacement) noexcept -> void
+  {
+    program* retired = rcu::publish(loaded_programs[static_cast<uint32_t>(point)], replacement);
+
+    if (retired != nullptr)
+    {
+      rcu::synchronize();
+      ExFreePoolWithTag(retired, HV_POOL_TAG);
+    }
+  }
+
+  auto load(const hook_point point, const insn* insns, const uint32_t count) noexcept -> load_status
+  {
+    if (static_cast<uint32_t>(point) >= point_count) return load_status::empty;
+
+    // Without rcu the old program could never be freed, same as running out of pool
+    if (!rcu::ready()) return load_status::too_long;
+
+    auto* compiled = static_cast<program*>(ExAllocatePoolWithTag(NonPagedPool, sizeof(program), HV_POOL_TAG));
+    if (compiled == nullptr) return load_status::too_long;
+
+    const load_status status = compile(insns, count, *compiled);
+
+    if (status != load_status::ok)
+    {
+      kprint_info("Filter rejected at load: %u\n", static_cast<uint32_t>(status));
+      ExFreePoolWithTag(compiled, HV_POOL_TAG);
+      return status;
+    }
+
+    kprint_info("Filter loaded: %u instructions, %u after compiling\n",
+                compiled->source_length, compiled->length);
+
+    swap_program(point, compiled);
+    return status;
+  }
+
+  auto unload(const hook_point point) noexcept -> void
+  {
+    if (static_cast<uint32_t>(point) >= point_count) return;
+
+    swap_program(point, nullptr);
+  }
+
+  auto load_registry(PUNICODE_STRING registry_path) noexcept -> void
+  {
+    constexpr PCWSTR value_names[point_count] = { L"SyscallFilter", L"VmexitFilter" };
+
+    auto* insns = static_cast<insn*>(ExAllocatePoolWithTag(PagedPool, sizeof(insn) * max_insns, HV_POOL_TAG));
+    if (insns == nullptr) return;
+
+    for (uint32_t point = 0; point < point_count; ++point)
+    {
+      const size_t bytes = registry_read_value(registry_path, value_names[point], REG_BINARY,
+                                               insns, sizeof(insn) * max_insns);
+
+      if (bytes != 0 && bytes % sizeof(insn) == 0)
+      {
+        load(static_cast<hook_point>(point), insns, static_cast<uint32_t>(bytes / sizeof(insn)));
+      }
+    }
+
+    ExFreePoolWithTag(insns, HV_POOL_TAG);
+  }
+
+  auto accept(const hook_point point, const event& current) noexcept -> bool
+  {
+    const program* compiled = rcu::dereference(loaded_programs[static_cast<uint32_t>(point)]);
+    if (compiled == nullptr) return true;
+
+    return run(*compiled, current) != 0;
+  }
+}; // namespace filter
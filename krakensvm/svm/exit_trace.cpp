@@ -0,0 +1,130 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <shared_section.hpp>
+#include <exit_trace.hpp>
+
+namespace exit_trace
+{
+  using namespace hk::capture;
+
+  static shared_section::section stream_pages = {};
+  static shared_section::section tail_pages   = {};
+
+  // One per ring, only vmexit_handler on that processor touches it
+  static ring_producer<exit_record>* producers      = nullptr;
+  static uint32_t                    producer_count = 0;
+
+  // Published last by enable(), vmexit_handler only ever reads it
+  static ring_producer<exit_record>* volatile active_producers = nullptr;
+
+  auto enable(uint32_t records_per_cpu) noexcept -> bool
+  {
+    if (active_producers != nullptr) return true;
+
+    const uint32_t capacity  = ring_capacity(records_per_cpu);
+    const uint32_t cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    if (capacity == 0) return false;
+
+    if (!shared_section::create(stream_pages, stream_bytes<exit_record>(cpu_count, capacity), false) ||
+        !shared_section::create(tail_pages, tails_bytes(cpu_count), true))
+    {
+      disable();
+      return false;
+    }
+
+    producers = static_cast<ring_producer<exit_record>*>(
+      ExAllocatePoolWithTag(NonPagedPool, sizeof(ring_producer<exit_record>) * cpu_count, HV_POOL_TAG));
+
+    if (producers == nullptr || stream_init<exit_record>(stream_pages.address, cpu_count, capacity) == nullptr)
+    {
+      disable();
+      return false;
+    }
+
+    for (uint32_t cpu = 0; cpu < cpu_count; ++cpu)
+    {
+      producer_init(producers[cpu], stream_pages.address, static_cast<const ring_tail*>(tail_pages.address), cpu, capacity);
+    }
+
+    producer_count = cpu_count;
+
+    kprint_info("Exit trace: %u cpus, %u records each, %llu bytes\n",
+                cpu_count, capacity, static_cast<uint64_t>(stream_pages.size));
+
+    _ReadWriteBarrier();
+    active_producers = producers;
+
+    return true;
+  }
+
+  auto disable() noexcept -> void
+  {
+    // Only called after devirtualization, nothing pushes anymore
+    active_producers = nullptr;
+    producer_count   = 0;
+
+    if (producers != nullptr)
+    {
+      ExFreePoolWithTag(producers, HV_POOL_TAG);
+      producers = nullptr;
+    }
+
+    shared_section::destroy(tail_pages);
+    shared_section::destroy(stream_pages);
+  }
+
+  auto map_user(user_views& views) noexcept -> bool
+  {
+    views = {};
+    if (active_producers == nullptr) return false;
+
+    if (!shared_section::map_user(stream_pages, views.stream, views.stream_size) ||
+        !shared_section::map_user(tail_pages, views.tails, views.tails_size))
+    {
+      exit_trace::unmap_user(views);
+      views = {};
+      return false;
+    }
+
+    return true;
+  }
+
+  auto unmap_user(const user_views& views) noexcept -> void
+  {
+    shared_section::unmap_user(views.stream);
+    shared_section::unmap_user(views.tails);
+  }
+
+  auto record(const uint32_t cpu, const exit_record& current) noexcept -> void
+  {
+    ring_producer<exit_record>* const rings = active_producers;
+    if (rings == nullptr || cpu >= producer_count) return;
+
+    ring_push(rings[cpu], current);
+  }
+}; // namespace exit_trace
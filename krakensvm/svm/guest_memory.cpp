@@ -0,0 +1,457 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <guest_memory.hpp>
+
+namespace guest_memory
+{
+  auto context_of(vmcb::pvcpu_ctx_t vcpu_data, const uint64_t cr3) noexcept -> ia32e::walk::context
+  {
+    constexpr uint64_t cr0_wp   = 1ull << 16;
+    constexpr uint64_t cr4_la57 = 1ull << 12;
+    constexpr uint64_t efer_nxe = 1ull << 11;
+
+    const vmcb::save_state_64_t& state = vcpu_data->guest_vmcb.save_state;
+
+    ia32e::walk::context current = {};
+    current.cr3           = cr3;
+    current.la57          = (state.cr4  & cr4_la57) != 0;
+    current.nxe           = (state.efer & efer_nxe) != 0;
+    current.write_protect = (state.cr0  & cr0_wp)   != 0;
+
+    return current;
+  }
+
+  //
+  // Mapping windows
+  //
+  // A physical page is looked at through a page of VA reserved per processor
+  // (MmAllocateMappingAddress()) whose PTE is rewritten in place. Unlike the
+  // kernel's own mapping of physical memory that works for any page, user
+  // pages and another process' tables included, and nothing in Mm is called
+  // from root mode. Every processor has two of them: the host side one, and
+  // one for guest side callers, who hold it at DISPATCH_LEVEL. A #VMEXIT in
+  // the middle of a guest side copy moves the host's window, not theirs.
+  //
+  // Only RAM gets mapped, a table entry pointing at MMIO isn't followed.
+  //
+
+  enum window_kind : uint32_t
+  {
+    host_window = 0,
+    guest_window,
+
+    window_kinds
+  };
+
+  struct window
+  {
+    uint8_t*           address;
+    volatile uint64_t* pte;
+  };
+
+  struct ram_range
+  {
+    uint64_t base;
+    uint64_t end;
+  };
+
+  constexpr uint32_t max_ram_ranges = 64;
+
+  static uint8_t*  window_base   = nullptr;
+  static window*   windows       = nullptr;
+  static uint32_t  window_count  = 0;          // processors, window_kinds each
+
+  static ram_range ram[max_ram_ranges] = {};
+  static uint32_t  ram_count           = 0;
+
+  // The PTE of a system VA, through the tables of the current address space
+  // (the kernel half is the same in all of them)
+  static auto locate_pte(const uint64_t va) noexcept -> volatile uint64_t*
+  {
+    constexpr uint64_t cr4_la57 = 1ull << 12;
+
+    uint64_t table = __readcr3() & ia32e::walk::cr3_address;
+
+    for (int32_t level = (__readcr4() & cr4_la57) != 0 ? 5 : 4; level >= 1; --level)
+    {
+      PHYSICAL_ADDRESS physical;
+      physical.QuadPart = static_cast<LONGLONG>(table);
+
+      auto* const entries = static_cast<volatile uint64_t*>(MmGetVirtualForPhysical(physical));
+      if (entries == nullptr) return nullptr;
+
+      volatile uint64_t* const entry = &entries[(va >> (12 + 9 * (level - 1))) & 0x1ff];
+      if (level == 1) return entry;
+
+      if ((*entry & ia32e::walk::entry_present) == 0 || (*entry & ia32e::walk::entry_large) != 0) return nullptr;
+
+      table = *entry & ia32e::walk::entry_address;
+    }
+
+    return nullptr;
+  }
+
+  static auto load_ram_ranges() noexcept -> bool
+  {
+    PPHYSICAL_MEMORY_RANGE ranges = MmGetPhysicalMemoryRanges();
+    if (ranges == nullptr) return false;
+
+    ram_count = 0;
+
+    for (PPHYSICAL_MEMORY_RANGE range = ranges;
+         (range->BaseAddress.QuadPart != 0 || range->NumberOfBytes.QuadPart != 0) && ram_count < max_ram_ranges;
+         ++range)
+    {
+      const uint64_t base = static_cast<uint64_t>(range->BaseAddress.QuadPart);
+      ram[ram_count++]    = { base, base + static_cast<uint64_t>(range->NumberOfBytes.QuadPart) };
+    }
+
+    ExFreePool(ranges);
+    return ram_count != 0;
+  }
+
+  static auto is_ram(const uint64_t gpa) noexcept -> bool
+  {
+    for (uint32_t i = 0; i < ram_count; ++i)
+    {
+      if (gpa >= ram[i].base && gpa < ram[i].end) return true;
+    }
+
+    return false;
+  }
+
+  auto initialize() noexcept -> bool
+  {
+    const uint32_t count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    const size_t   size  = static_cast<size_t>(count) * window_kinds * PAGE_SIZE;
+
+    if (!load_ram_ranges()) return false;
+
+    windows = static_cast<window*>(ExAllocatePoolWithTag(NonPagedPool, sizeof(window) * count * window_kinds, HV_POOL_TAG));
+    if (windows == nullptr) return false;
+
+    window_base = static_cast<uint8_t*>(MmAllocateMappingAddress(size, HV_POOL_TAG));
+
+    for (uint32_t i = 0; window_base != nullptr && i < count * window_kinds; ++i)
+    {
+      windows[i].address = window_base + static_cast<size_t>(i) * PAGE_SIZE;
+      windows[i].pte     = locate_pte(reinterpret_cast<uint64_t>(windows[i].address));
+
+      if (windows[i].pte != nullptr) continue;
+
+      MmFreeMappingAddress(window_base, HV_POOL_TAG);
+      window_base = nullptr;
+    }
+
+    if (window_base == nullptr)
+    {
+      ExFreePoolWithTag(windows, HV_POOL_TAG);
+      windows = nullptr;
+      return false;
+    }
+
+    window_count = count;
+    return true;
+  }
+
+  // Every processor may still have a window cached in its TLB
+  static auto forget_windows(ULONG_PTR) -> ULONG_PTR
+  {
+    for (uint32_t i = 0; i < window_count * window_kinds; ++i) __invlpg(windows[i].address);
+
+    return 0;
+  }
+
+  auto shutdown() noexcept -> void
+  {
+    if (windows == nullptr) return;
+
+    for (uint32_t i = 0; i < window_count * window_kinds; ++i) *windows[i].pte = 0;
+
+    KeIpiGenericCall(forget_windows, 0);
+
+    MmFreeMappingAddress(window_base, HV_POOL_TAG);
+    ExFreePoolWithTag(windows, HV_POOL_TAG);
+
+    window_base  = nullptr;
+    windows      = nullptr;
+    window_count = 0;
+  }
+
+  static auto window_of(const window_kind kind) noexcept -> window*
+  {
+    const uint32_t processor = KeGetCurrentProcessorIndex();
+
+    return processor < window_count ? &windows[processor * window_kinds + kind] : nullptr;
+  }
+
+  // The page gpa is in, the PTE is only rewritten when it names another one
+  static auto map_page(window& view, const uint64_t gpa) noexcept -> uint8_t*
+  {
+    constexpr uint64_t entry_accessed = 1ull << 5;
+    constexpr uint64_t entry_dirty    = 1ull << 6;
+
+    const uint64_t entry = (gpa & ia32e::walk::entry_address) | ia32e::walk::entry_present |
+                           ia32e::walk::entry_write | entry_accessed | entry_dirty | ia32e::walk::entry_nx;
+
+    if (*view.pte != entry)
+    {
+      *view.pte = entry;
+      __invlpg(view.address);
+    }
+
+    return view.address + (gpa & (PAGE_SIZE - 1));
+  }
+
+  static auto copy_physical(window* view, uint64_t gpa, uint8_t* buffer, size_t size,
+                            const bool writing) noexcept -> bool
+  {
+    if (view == nullptr) return false;
+
+    while (size != 0)
+    {
+      const size_t room  = PAGE_SIZE - (gpa & (PAGE_SIZE - 1));
+      const size_t chunk = size < room ? size : room;
+
+      if (!is_ram(gpa)) return false;
+
+      uint8_t* const mapped = map_page(*view, gpa);
+
+      if (writing) memcpy(mapped, buffer, chunk);
+      else         memcpy(buffer, mapped, chunk);
+
+      gpa    += chunk;
+      buffer += chunk;
+      size   -= chunk;
+    }
+
+    return true;
+  }
+
+  // A table entry, for the walk's A/D updates
+  static auto exchange_entry(window* view, const uint64_t gpa, const uint64_t expected,
+                             const uint64_t desired) noexcept -> bool
+  {
+    if (view == nullptr || (gpa & 7) != 0 || !is_ram(gpa)) return false;
+
+    auto* const entry = reinterpret_cast<volatile LONG64*>(map_page(*view, gpa));
+
+    return InterlockedCompareExchange64(entry, static_cast<LONG64>(desired),
+                                        static_cast<LONG64>(expected)) == static_cast<LONG64>(expected);
+  }
+
+  auto read_physical(const uint64_t gpa, void* buffer, const size_t size) noexcept -> bool
+  {
+    return copy_physical(window_of(host_window), gpa, static_cast<uint8_t*>(buffer), size, false);
+  }
+
+  auto write_physical(const uint64_t gpa, const void* buffer, const size_t size) noexcept -> bool
+  {
+    return copy_physical(window_of(host_window), gpa,
+                         const_cast<uint8_t*>(static_cast<const uint8_t*>(buffer)), size, true);
+  }
+
+  auto translate(vmcb::pvcpu_ctx_t vcpu_data, const uint64_t cr3, const uint64_t va,
+                 const uint32_t access, translation& result) noexcept -> status
+  {
+    window* const view = window_of(host_window);
+
+    const auto read_entry = [view](const uint64_t gpa, uint64_t& entry) -> bool
+    {
+      return copy_physical(view, gpa, reinterpret_cast<uint8_t*>(&entry), sizeof entry, false);
+    };
+
+    const auto update_entry = [view](const uint64_t gpa, const uint64_t expected, const uint64_t desired) -> bool
+    {
+      return exchange_entry(view, gpa, expected, desired);
+    };
+
+    return ia32e::walk::translate_cached(vcpu_data->guest_tlb, context_of(vcpu_data, cr3), va, access,
+                                         read_entry, update_entry, result);
+  }
+
+  //
+  // guest_copy backends
+  //
+
+  struct physical_backend
+  {
+    window* view;
+
+    auto read_physical(const uint64_t gpa, void* buffer, const size_t size) noexcept -> bool
+    {
+      return copy_physical(view, gpa, static_cast<uint8_t*>(buffer), size, false);
+    }
+
+    auto write_physical(const uint64_t gpa, const void* buffer, const size_t size) noexcept -> bool
+    {
+      return copy_physical(view, gpa, const_cast<uint8_t*>(static_cast<const uint8_t*>(buffer)), size, true);
+    }
+  };
+
+  struct host_backend : physical_backend
+  {
+    vmcb::pvcpu_ctx_t vcpu_data;
+    uint64_t          cr3;
+
+    auto translate(const uint64_t va, const uint32_t access, translation& result) noexcept -> status
+    {
+      return guest_memory::translate(vcpu_data, cr3, va, access, result);
+    }
+  };
+
+  struct guest_backend : physical_backend
+  {
+    ia32e::walk::context state;
+
+    auto translate(const uint64_t va, const uint32_t access, translation& result) noexcept -> status
+    {
+      const auto read_entry = [this](const uint64_t gpa, uint64_t& entry) -> bool
+      {
+        return read_physical(gpa, &entry, sizeof entry);
+      };
+
+      const auto update_entry = [this](const uint64_t gpa, const uint64_t expected, const uint64_t desired) -> bool
+      {
+        return exchange_entry(view, gpa, expected, desired);
+      };
+
+      return ia32e::walk::translate(state, va, access, read_entry, update_entry, result);
+    }
+  };
+
+  static auto host_side(vmcb::pvcpu_ctx_t vcpu_data, const uint64_t cr3) noexcept -> host_backend
+  {
+    return { { window_of(host_window) }, vcpu_data, cr3 };
+  }
+
+  //
+  // Guest side callers hold this processor's guest window for the whole
+  // copy, at DISPATCH_LEVEL so nothing else on it can take the window over.
+  // Above that an interrupt may have cut into a holder, nothing's mapped.
+  //
+
+  template<class operation>
+  static auto on_guest_window(const uint64_t cr3, operation&& copy) noexcept -> bool
+  {
+    constexpr uint64_t cr0_wp   = 1ull << 16;
+    constexpr uint64_t cr4_la57 = 1ull << 12;
+    constexpr uint64_t efer_nxe = 1ull << 11;
+
+    if (KeGetCurrentIrql() > DISPATCH_LEVEL) return false;
+
+    KIRQL previous = {};
+    KeRaiseIrql(DISPATCH_LEVEL, &previous);
+
+    guest_backend memory = {};
+    memory.view                = window_of(guest_window);
+    memory.state.cr3           = cr3;
+    memory.state.la57          = (__readcr4() & cr4_la57) != 0;
+    memory.state.nxe           = (__readmsr(ia32_efer) & efer_nxe) != 0;
+    memory.state.write_protect = (__readcr0() & cr0_wp) != 0;
+
+    copy(memory);
+
+    KeLowerIrql(previous);
+    return true;
+  }
+
+  auto read_guest(vmcb::pvcpu_ctx_t vcpu_data, const uint64_t cr3, const uint64_t va, void* buffer,
+                  const size_t size, const uint32_t access) noexcept -> status
+  {
+    host_backend memory = host_side(vcpu_data, cr3);
+    return guest_copy::read(memory, va, buffer, size, access);
+  }
+
+  auto write_guest(vmcb::pvcpu_ctx_t vcpu_data, const uint64_t cr3, const uint64_t va, const void* buffer,
+                   const size_t size, const uint32_t access) noexcept -> status
+  {
+    host_backend memory = host_side(vcpu_data, cr3);
+    return guest_copy::write(memory, va, buffer, size, access);
+  }
+
+  auto read_guest_batch(vmcb::pvcpu_ctx_t vcpu_data, const uint64_t cr3, const segment* segments,
+                        const size_t count, status* results) noexcept -> size_t
+  {
+    host_backend memory = host_side(vcpu_data, cr3);
+    return guest_copy::read_batch(memory, segments, count, results);
+  }
+
+  auto write_guest_batch(vmcb::pvcpu_ctx_t vcpu_data, const uint64_t cr3, const segment* segments,
+                         const size_t count, status* results) noexcept -> size_t
+  {
+    host_backend memory = host_side(vcpu_data, cr3);
+    return guest_copy::write_batch(memory, segments, count, results);
+  }
+
+  static auto unmapped(const size_t count, status* results) noexcept -> size_t
+  {
+    for (size_t i = 0; results != nullptr && i < count; ++i) results[i] = status::unreadable;
+
+    return 0;
+  }
+
+  auto read_guest(const uint64_t cr3, const uint64_t va, void* buffer, const size_t size,
+                  const uint32_t access) noexcept -> status
+  {
+    status result = status::unreadable;
+
+    on_guest_window(cr3, [&](guest_backend& memory) { result = guest_copy::read(memory, va, buffer, size, access); });
+    return result;
+  }
+
+  auto write_guest(const uint64_t cr3, const uint64_t va, const void* buffer, const size_t size,
+                   const uint32_t access) noexcept -> status
+  {
+    status result = status::unreadable;
+
+    on_guest_window(cr3, [&](guest_backend& memory) { result = guest_copy::write(memory, va, buffer, size, access); });
+    return result;
+  }
+
+  auto read_guest_batch(const uint64_t cr3, const segment* segments, const size_t count,
+                        status* results) noexcept -> size_t
+  {
+    size_t copied = 0;
+
+    if (!on_guest_window(cr3, [&](guest_backend& memory) { copied = guest_copy::read_batch(memory, segments, count, results); }))
+      return unmapped(count, results);
+
+    return copied;
+  }
+
+  auto write_guest_batch(const uint64_t cr3, const segment* segments, const size_t count,
+                         status* results) noexcept -> size_t
+  {
+    size_t copied = 0;
+
+    if (!on_guest_window(cr3, [&](guest_backend& memory) { copied = guest_copy::write_batch(memory, segments, count, results); }))
+      return unmapped(count, results);
+
+    return copied;
+  }
+}; // namespace guest_memory
@@ -0,0 +1,72 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <intercept_policy.hpp>
+
+namespace intercept_policy
+{
+  static header* loaded_policy = nullptr;
+
+  auto load_registry(PUNICODE_STRING registry_path) noexcept -> void
+  {
+    constexpr size_t max_bytes = sizeof(header) + sizeof(rule) * max_rules;
+
+    unload();
+
+    auto* blob = static_cast<header*>(ExAllocatePoolWithTag(PagedPool, max_bytes, HV_POOL_TAG));
+    if (blob == nullptr) return;
+
+    const size_t bytes = registry_read_value(registry_path, L"InterceptPolicy", REG_BINARY, blob, max_bytes);
+
+    if (bytes == 0 || validate(blob, bytes) == nullptr)
+    {
+      if (bytes != 0) kprint_info("InterceptPolicy is malformed, keeping the default MSR intercepts\n");
+
+      ExFreePoolWithTag(blob, HV_POOL_TAG);
+      return;
+    }
+
+    kprint_info("MSR intercept policy: %u rules\n", blob->rule_count);
+    loaded_policy = blob;
+  }
+
+  auto unload() noexcept -> void
+  {
+    if (loaded_policy != nullptr)
+    {
+      ExFreePoolWithTag(loaded_policy, HV_POOL_TAG);
+      loaded_policy = nullptr;
+    }
+  }
+
+  auto apply(void* msrpm) noexcept -> bool
+  {
+    if (loaded_policy == nullptr) return false;
+
+    build_msrpm(loaded_policy, static_cast<uint8_t*>(msrpm));
+    return true;
+  }
+}; // namespace intercept_policy
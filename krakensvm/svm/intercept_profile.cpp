@@ -0,0 +1,141 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <vmcb.hpp>
+#include <krakensvm.hpp>
+#include <intercept_profile.hpp>
+#include <processor_mask.hpp>
+
+namespace intercept_profile
+{
+  static vcpu_state* states       = nullptr;
+  static uint32_t    state_count  = 0;
+  static id          startup      = standard;
+  static bool        decode_assist = false;
+  static bool        invpcid       = false;
+  static bool        invlpgb       = false;
+
+  auto initialize(const id default_profile) noexcept -> void
+  {
+    int registers[4] = {};
+
+    // Fn8000_000A EDX[7], DecodeAssists
+    __cpuid(registers, static_cast<int>(svm::cpuid_e::svm_features));
+    decode_assist = (registers[3] & (1 << 7)) != 0;
+
+    // Fn0000_0007 EBX[10], INVPCID
+    __cpuidex(registers, 7, 0);
+    invpcid = (registers[1] & (1 << 10)) != 0;
+
+    // Fn8000_0008 EBX[3], INVLPGB
+    __cpuid(registers, static_cast<int>(0x80000008));
+    invlpgb = (registers[1] & (1 << 3)) != 0;
+
+    startup = default_profile < profile_count ? default_profile : standard;
+
+    const uint32_t count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    states = static_cast<vcpu_state*>(ExAllocatePoolWithTag(NonPagedPool, sizeof(vcpu_state) * count, HV_POOL_TAG));
+    if (states == nullptr) return;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      states[i].requested = states[i].active = startup;
+    }
+
+    state_count = count;
+
+    if (startup != standard) kprint_info("Intercept profile %u on every processor\n", startup);
+  }
+
+  // Only once the processors have been devirtualized
+  auto shutdown() noexcept -> void
+  {
+    if (states != nullptr)
+    {
+      state_count = 0;
+      ExFreePoolWithTag(states, HV_POOL_TAG);
+      states = nullptr;
+    }
+  }
+
+  auto vcpu(const uint32_t processor) noexcept -> vcpu_state*
+  {
+    return processor < state_count ? &states[processor] : nullptr;
+  }
+
+  auto installable(const id profile) noexcept -> intercept_set
+  {
+    return resolve(profile, decode_assist, invpcid);
+  }
+
+  auto coherent(const intercept_set& active) noexcept -> bool
+  {
+    return tracks_invalidations(active, invpcid, invlpgb);
+  }
+
+  auto initial() noexcept -> intercept_set
+  {
+    return installable(startup);
+  }
+
+  auto request_from_host(const uint32_t processor, const id profile) noexcept -> bool
+  {
+    if (processor == all_processors)
+    {
+      for (uint32_t i = 0; i < state_count; ++i) request(states[i], profile);
+      return state_count != 0;
+    }
+
+    // A processor left out by VirtualizedProcessors has no intercepts to switch
+    vcpu_state* state = vcpu(processor);
+    if (state == nullptr || !processor_mask::is_virtualized(processor)) return false;
+
+    request(*state, profile);
+    return true;
+  }
+
+  // CPUID always exits, whatever the profile
+  static auto force_exit(ULONG_PTR) -> ULONG_PTR
+  {
+    int registers[4] = {};
+    __cpuid(registers, static_cast<int>(svm::cpuid_e::hypervisor_vendor_id));
+
+    return 0;
+  }
+
+  auto select(const uint32_t processor, const id profile) noexcept -> bool
+  {
+    if (svm::hypercall(svm::hypercall_num::set_intercept_profile,
+                       reinterpret_cast<void*>(encode(processor, profile))) == 0)
+    {
+      return false;
+    }
+
+    KeIpiGenericCall(force_exit, 0);
+    return true;
+  }
+}; // namespace intercept_profile
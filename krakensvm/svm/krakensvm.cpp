@@ -29,6 +29,8 @@
 #include <paging.hpp>
 #include <vmcb.hpp>
 #include <syscall_hook.hpp>
+#include <processor_mask.hpp>
+#include <numa.hpp>
 
 extern "C" NTSYSAPI NTSTATUS NTAPI ZwYieldExecution();
 
@@ -59,6 +61,63 @@ auto kprint_info(const char* format, ...) noexcept -> void
   va_end(args);
 }
 
+//
+// Copies a registry value of the given type from under the service key into
+// buffer, returns the number of bytes copied, 0 if it's missing or too large
+//
+
+auto registry_read_value(PUNICODE_STRING registry_path, PCWSTR value_name, ULONG type,
+                         void* buffer, size_t buffer_size) noexcept -> size_t
+{
+  OBJECT_ATTRIBUTES attributes;
+  UNICODE_STRING name;
+  HANDLE key = nullptr;
+  ULONG result_length = {};
+  size_t copied = 0;
+
+  if (registry_path == nullptr || buffer == nullptr || buffer_size == 0) return 0;
+
+  // KEY_VALUE_PARTIAL_INFORMATION already holds one byte of Data
+  const size_t information_size = sizeof(KEY_VALUE_PARTIAL_INFORMATION) + buffer_size;
+  auto* information = static_cast<PKEY_VALUE_PARTIAL_INFORMATION>(
+                        ExAllocatePoolWithTag(PagedPool, information_size, HV_POOL_TAG));
+
+  if (information == nullptr) return 0;
+
+  InitializeObjectAttributes(&attributes, registry_path,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr, nullptr);
+
+  if (NT_SUCCESS(ZwOpenKey(&key, KEY_QUERY_VALUE, &attributes)))
+  {
+    RtlInitUnicodeString(&name, value_name);
+
+    const NTSTATUS status = ZwQueryValueKey(key, &name, KeyValuePartialInformation, information,
+                                           static_cast<ULONG>(information_size), &result_length);
+    ZwClose(key);
+
+    if (NT_SUCCESS(status) && information->Type == type && information->DataLength <= buffer_size)
+    {
+      memcpy(buffer, information->Data, information->DataLength);
+      copied = information->DataLength;
+    }
+  }
+
+  ExFreePoolWithTag(information, HV_POOL_TAG);
+  return copied;
+}
+
+auto registry_read_dword(PUNICODE_STRING registry_path, PCWSTR value_name, uint32_t default_value) noexcept -> uint32_t
+{
+  uint32_t value = {};
+
+  if (registry_read_value(registry_path, value_name, REG_DWORD, &value, sizeof value) != sizeof value)
+  {
+    return default_value;
+  }
+
+  return value;
+}
+
 
 namespace svm
 {
@@ -67,7 +126,7 @@ namespace svm
   //
 
   template<class R, class param>
-  auto exec_each_processors(R (*function)(param), param arguments) noexcept -> std::pair<bool, int>;
+  auto exec_each_processors(const processor_mask::set& processors, R (*function)(param), param arguments) noexcept -> std::pair<bool, int>;
 
   template<class R, class param>
   auto ipi_each_processors(R(*function)(param), param arguments) noexcept -> void;
@@ -139,6 +198,64 @@ namespace svm
                  __readmsr(ia32_efer) | ia32_efer_svme);
   }
 
+  //
+  // Processors added while the hypervisor is loaded
+  //
+
+  static PVOID              processor_change_handle = nullptr;
+  static vmcb::ppaging_data running_page_info       = nullptr;
+
+  static auto processor_changed(PVOID, PKE_PROCESSOR_CHANGE_NOTIFY_CONTEXT change_context, PNTSTATUS) -> void
+  {
+    GROUP_AFFINITY old_affinity, affinity;
+
+    if (change_context->State != KeProcessorAddCompleteNotify) return;
+
+    // Registering replays every processor already there, those are done
+    const uint32_t index = change_context->NtNumber;
+    if (!processor_mask::selected().contains(index) || processor_mask::is_virtualized(index)) return;
+
+    memset(&affinity, 0, sizeof GROUP_AFFINITY);
+    affinity.Group = change_context->ProcNumber.Group;
+    affinity.Mask = (KAFFINITY)1ull << change_context->ProcNumber.Number;
+
+    KeSetSystemGroupAffinityThread(&affinity, &old_affinity);
+    const bool virtualized = vmcb::virt_cpu_init(running_page_info);
+    KeRevertToUserGroupAffinityThread(&old_affinity);
+
+    if (!virtualized) kprint_info("Processor %u was added, but couldn't be virtualized\n", index);
+  }
+
+  //
+  // MSR permission map copies, one in each node's memory. Only worth it with
+  // more than one node, msrpm_for() falls back to msrpm_addr otherwise.
+  //
+
+  static auto replicate_msrpm(vmcb::ppaging_data shared_page_info) noexcept -> void
+  {
+    if (numa::node_count() < 2) return;
+
+    for (uint32_t node = 0; node < numa::node_count(); ++node)
+    {
+      void* replica = mm::system_node_alloc(PAGE_SIZE * 2, node);
+      if (replica == nullptr) continue;
+
+      memcpy(replica, shared_page_info->msrpm_addr, PAGE_SIZE * 2);
+      shared_page_info->msrpm_replicas[node] = replica;
+    }
+  }
+
+  static auto release_paging_data(vmcb::ppaging_data shared_page_info) noexcept -> void
+  {
+    for (void* replica : shared_page_info->msrpm_replicas)
+    {
+      if (replica != nullptr) system_free_contiguous(replica);
+    }
+
+    if (shared_page_info->msrpm_addr != nullptr) system_free_contiguous(shared_page_info->msrpm_addr);
+    system_free_alloc(shared_page_info);
+  }
+
   //
   // Virualize all processors
   //
@@ -150,10 +267,15 @@ namespace svm
     shared_page_info =
       static_cast<vmcb::ppaging_data>(mm::system_aligned_alloc(sizeof vmcb::paging_data));
 
+    if (shared_page_info == nullptr) return false;
+
+    // Too small to come out page aligned, so system_aligned_alloc left it as is
+    RtlZeroMemory(shared_page_info, sizeof vmcb::paging_data);
+
     shared_page_info->msrpm_addr = mm::system_contiguous_alloc(PAGE_SIZE * 2);
 
     // Pre-allocation for the syscall hooking
-    hypervisor_arena = reinterpret_cast<char8_t*>(mm::system_aligned_alloc(0x3d0900));
+    hypervisor_arena = reinterpret_cast<char8_t*>(mm::system_aligned_alloc(hypervisor_arena_size));
     
     // I wasn't able to make this into a label to be used with goto's
     // due to all the errors I was encountering, mainly being the
@@ -167,8 +289,7 @@ namespace svm
           devirt_each_processors();
         }
         else {
-          system_free_alloc(shared_page_info);
-          system_free_contiguous(shared_page_info->msrpm_addr);
+          release_paging_data(shared_page_info);
         }
       }
 
@@ -188,12 +309,24 @@ namespace svm
     }
  
     setup_msrpermissions_bitmap(shared_page_info->msrpm_addr);
+    replicate_msrpm(shared_page_info);
     
-    auto [status, completed_processor] = svm::exec_each_processors<bool, vmcb::ppaging_data>(vmcb::virt_cpu_init, shared_page_info);
+    // Only what VirtualizedProcessors selected, the rest never see a #VMEXIT
+    auto [status, completed_processor] = svm::exec_each_processors<bool, vmcb::ppaging_data>(
+                                           processor_mask::selected(), vmcb::virt_cpu_init, shared_page_info);
 
     hk::syscallhook_init(__readmsr(ia32_lstar));
     //vmcb::virt_cpu_init(shared_page_info);
 
+    // Whatever shows up from here on goes through processor_changed(). Adding
+    // the existing ones as well closes the window since the loop above.
+    if (status)
+    {
+      running_page_info       = shared_page_info;
+      processor_change_handle = KeRegisterProcessorChangeCallback(processor_changed, nullptr,
+                                                                  KE_PROCESSOR_CHANGE_ADD_EXISTING);
+    }
+
     return _deallocation(status, completed_processor);
 
   }
@@ -207,47 +340,62 @@ namespace svm
   {
     using namespace vmcb;
 
-    kprint_info("The start of the devirtualization.\n");
     int32_t registers[4] = {};
-    uint64_t high = {}, low = {};
+    const uint32_t index = KeGetCurrentProcessorNumberEx(nullptr);
 
-    // this double pointer("shared_page_ptr") will point to our "shared_page_info" data struct that's
-    // manage in the `function virt_each_processors()`. The shared_context argument of this
-    // function, will point to an empty ppaging_data struct. That we'll make hold
-    // the address of the orignal "shared_page_info" that's been allocated in `function
-    // virt_each_processors()`. This is all done so then we will deallocate the values
-    // of "shared_page_info" by the caller (`function devirt_each_processors()`)
-    ppaging_data* shared_page_ptr = nullptr;
-    pvcpu_ctx_t vcpu_data = nullptr;
+    // The shared_context argument points at the caller's ppaging_data, which
+    // gets the address of the "shared_page_info" allocated in `function
+    // virt_each_processors()` so the caller (`function devirt_each_processors()`)
+    // can deallocate it. Every processor stores the same one.
+    auto* shared_page_ptr = static_cast<ppaging_data*>(shared_context);
+
+    // Processors left out by VirtualizedProcessors have nothing to undo
+    pvcpu_ctx_t vcpu_data = current_vcpu();
+    if (vcpu_data == nullptr)
+    {
+      return false;
+    }
 
     __cpuidex(registers, (int)cpuid_e::unload_feature, (int)cpuid_e::unload_feature);
     if (registers[2] != 'KRKN')
     {
-      // kprint_info("Unable to Devirtualize Processor...\n");
       return false;
     }
 
-    low = *(registers + 0) & 0xffffffff;
-    high = *(registers + 3);
-
-    vcpu_data = reinterpret_cast<pvcpu_ctx_t>(high << 32 | low);
+    InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(shared_page_ptr), vcpu_data->self_shared_page_info);
 
-    shared_page_ptr = static_cast<ppaging_data*>(shared_context);
-    *shared_page_ptr = vcpu_data->self_shared_page_info;
-    system_free_alloc(vcpu_data);
+    vcpu_table::retire(vcpu_table::vcpus, index);
+    processor_mask::mark(index, false);
 
     return true;
   }
 
+  static auto devirt_broadcast(ULONG_PTR shared_context) -> ULONG_PTR
+  {
+    devirt_processor(reinterpret_cast<void*>(shared_context));
+    return 0;
+  }
+
   auto devirt_each_processors() noexcept -> void
   {
     vmcb::ppaging_data shared_page_info = nullptr;
-    svm::exec_each_processors<bool, void*>(devirt_processor, shared_page_info);
+
+    // No processor gets virtualized behind our back from here on
+    if (processor_change_handle != nullptr)
+    {
+      KeDeregisterProcessorChangeCallback(processor_change_handle);
+      processor_change_handle = nullptr;
+      running_page_info       = nullptr;
+    }
+
+    // Every processor at once rather than one affinity switch after another,
+    // each one finds its own vCPU through the table. The IPI interrupts any
+    // thread, the exit handler leaves into it with the guest's CR3.
+    KeIpiGenericCall(devirt_broadcast, reinterpret_cast<ULONG_PTR>(&shared_page_info));
 
     if (shared_page_info != nullptr)
     {
-      system_free_contiguous(shared_page_info->msrpm_addr);
-      system_free_alloc(shared_page_info);
+      release_paging_data(shared_page_info);
     }
   }
 
@@ -258,26 +406,21 @@ namespace svm
   // Thanks to daax wonderful post - https://revers.engineering/day-3-multiprocessor-initialization-error-handling-the-vmcs/
   // -   Generic type R represent the return value type
   template<class R = void, class param = void>
-  auto exec_each_processors(R (*function)(param), param arguments) noexcept -> std::pair<bool, int>
+  auto exec_each_processors(const processor_mask::set& processors, R (*function)(param), param arguments) noexcept -> std::pair<bool, int>
   {
     GROUP_AFFINITY old_affinity, affinity;
     PROCESSOR_NUMBER processor_number;
 
-    bool status{};
-    int completed_processors{}, index{};
-    int processors_amount{};
-
-    processors_amount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
-   
+    bool status{ true };
+    int completed_processors{};
 
-    for (; index < processors_amount; index++)
+    // Indexes are system wide, the affinity wants the group and the number
+    // within it. Processors that aren't selected are skipped, not counted.
+    for (uint32_t index = processors.next(0); index != processor_mask::none; index = processors.next(index + 1))
     {
-      completed_processors += index;
-      
-      // Covert from Index to the processor number
-      if (KeGetProcessorNumberFromIndex(index, &processor_number) != 0)
+      if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(index, &processor_number)))
       {
-        return { false, completed_processors };
+        continue;
       }
 
       memset(&affinity, 0, sizeof GROUP_AFFINITY);
@@ -289,9 +432,40 @@ namespace svm
 
       status = function(arguments);
       KeRevertToUserGroupAffinityThread(&old_affinity);
+
+      if (!status) break;
+
+      completed_processors++;
     }
 
     return { status, completed_processors };
   }
 
+  auto hypercall(uint64_t hypercall_number, void* context) noexcept -> uint64_t
+  {
+    GROUP_AFFINITY old_affinity, affinity;
+    PROCESSOR_NUMBER processor_number;
+
+    uint32_t index = KeGetCurrentProcessorIndex();
+
+    // Good enough as a guess, the affinity below is what makes it stick
+    if (!processor_mask::is_virtualized(index))
+    {
+      index = processor_mask::virtualized().next(0);
+      if (index == processor_mask::none) return 0;
+    }
+
+    if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(index, &processor_number))) return 0;
+
+    memset(&affinity, 0, sizeof GROUP_AFFINITY);
+    affinity.Group = processor_number.Group;
+    affinity.Mask = (KAFFINITY)1ull << processor_number.Number;
+
+    KeSetSystemGroupAffinityThread(&affinity, &old_affinity);
+    const uint64_t result = __svm_vmmcall(hypercall_number, context);
+    KeRevertToUserGroupAffinityThread(&old_affinity);
+
+    return result;
+  }
+
 }; // namespace svm
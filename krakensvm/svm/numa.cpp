@@ -0,0 +1,113 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <numa.hpp>
+#include <pe_image.hpp>
+
+using namespace pe::literals;
+
+namespace numa
+{
+  static node_map current_map = {};
+
+  using query_affinity2_t = NTSTATUS (*)(USHORT node, PGROUP_AFFINITY affinities, USHORT count, PUSHORT required);
+
+  // Every group the node has processors in, false when the kernel doesn't
+  // have the routine or the node spans more groups than fit
+  static auto query_all_groups(const query_affinity2_t query, const USHORT node, affinity_list& affinities) noexcept -> bool
+  {
+    GROUP_AFFINITY groups[processor_mask::max_groups] = {};
+    USHORT required = {};
+
+    if (query == nullptr ||
+        !NT_SUCCESS(query(node, groups, static_cast<USHORT>(processor_mask::max_groups), &required)))
+    {
+      return false;
+    }
+
+    for (USHORT group = 0; group < required; ++group)
+    {
+      affinities.add(node, groups[group].Group, groups[group].Mask);
+    }
+
+    return true;
+  }
+
+  auto initialize() noexcept -> void
+  {
+    static affinity_list affinities;
+    affinities = {};
+
+    processor_mask::topology layout;
+    processor_mask::current_topology(layout);
+
+    uint32_t count = static_cast<uint32_t>(KeQueryHighestNodeNumber()) + 1;
+    if (count > max_nodes) count = max_nodes;
+
+    // Windows 10 20H2 and up, before that a node never spanned groups. Not
+    // imported, the driver has to load on kernels without it.
+    const auto query = pe::resolve<"KeQueryNodeActiveAffinity2"_h, query_affinity2_t>();
+
+    for (USHORT node = 0; node < count; ++node)
+    {
+      if (query_all_groups(query, node, affinities)) continue;
+
+      GROUP_AFFINITY affinity = {};
+      USHORT processors = {};
+
+      KeQueryNodeActiveAffinity(node, &affinity, &processors);
+      affinities.add(node, affinity.Group, affinity.Mask);
+    }
+
+    if (affinities.truncated)
+    {
+      kprint_info("More NUMA affinities than fit, the rest of the processors get any node's memory\n");
+    }
+
+    // A map nobody can trust is worse than none, everything stays on node 0
+    if (!build(affinities, count, layout, current_map))
+    {
+      kprint_info("NUMA affinities don't match the processor topology, ignoring them\n");
+
+      for (uint8_t& node : current_map.node_of) node = 0;
+      current_map.node_count = 1;
+    }
+    else if (count > 1)
+    {
+      kprint_info("%u NUMA nodes\n", count);
+    }
+  }
+
+  auto map() noexcept -> const node_map&
+  {
+    return current_map;
+  }
+
+  auto node_count() noexcept -> uint32_t
+  {
+    return current_map.node_count != 0 ? current_map.node_count : 1;
+  }
+}; // namespace numa
@@ -0,0 +1,119 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <processor_mask.hpp>
+
+namespace processor_mask
+{
+  static set selected_set    = {};
+  static set virtualized_set = {};
+
+  auto current_topology(topology& layout) noexcept -> void
+  {
+    uint32_t next_index = 0;
+
+    // Groups that only come with hot-added processors count as well
+    layout = {};
+    layout.group_count = KeQueryMaximumGroupCount();
+
+    if (layout.group_count > max_groups) layout.group_count = max_groups;
+
+    for (USHORT group = 0; group < layout.group_count; ++group)
+    {
+      PROCESSOR_NUMBER first = {};
+      first.Group = group;
+
+      // Indexes go group after group, sized by what each one can hold
+      const uint32_t index = KeGetProcessorIndexFromNumber(&first);
+
+      layout.first_index[group] = index != INVALID_PROCESSOR_INDEX ? index : next_index;
+      layout.group_size[group]  = KeQueryMaximumProcessorCountEx(group);
+
+      next_index = layout.first_index[group] + layout.group_size[group];
+    }
+  }
+
+  auto load_registry(PUNICODE_STRING registry_path) noexcept -> void
+  {
+    topology layout;
+    current_topology(layout);
+
+    selected_set = all(layout);
+
+    auto* text = static_cast<wchar_t*>(ExAllocatePoolWithTag(PagedPool, max_text * sizeof(wchar_t), HV_POOL_TAG));
+    if (text == nullptr) return;
+
+    const size_t bytes = registry_read_value(registry_path, L"VirtualizedProcessors", REG_SZ,
+                                             text, max_text * sizeof(wchar_t));
+
+    if (bytes != 0)
+    {
+      set narrowed;
+
+      if (parse(text, bytes / sizeof(wchar_t), layout, narrowed))
+      {
+        selected_set = narrowed;
+        kprint_info("Virtualizing %u processors\n", selected_set.count());
+      }
+      else
+      {
+        kprint_info("VirtualizedProcessors is malformed, virtualizing every processor\n");
+      }
+    }
+
+    ExFreePoolWithTag(text, HV_POOL_TAG);
+  }
+
+  auto selected() noexcept -> const set&
+  {
+    return selected_set;
+  }
+
+  auto virtualized() noexcept -> const set&
+  {
+    return virtualized_set;
+  }
+
+  // Bring-up and teardown are serialized, the hypercall paths only read
+  auto mark(const uint32_t index, const bool running) noexcept -> void
+  {
+    if (index >= max_processors) return;
+
+    std::atomic_ref<uint64_t> word(virtualized_set.words[index / 64]);
+    const uint64_t bit = 1ull << (index % 64);
+
+    if (running) word.fetch_or(bit, std::memory_order_release);
+    else         word.fetch_and(~bit, std::memory_order_release);
+  }
+
+  auto is_virtualized(const uint32_t index) noexcept -> bool
+  {
+    if (index >= max_processors) return false;
+
+    const uint64_t word = std::atomic_ref<uint64_t>(virtualized_set.words[index / 64]).load(std::memory_order_acquire);
+    return (word >> (index % 64) & 1) != 0;
+  }
+}; // namespace processor_mask
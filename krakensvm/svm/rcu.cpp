@@ -0,0 +1,73 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <rcu.hpp>
+
+namespace rcu
+{
+  static vcpu_state* states      = nullptr;
+  static uint32_t    state_count = 0;
+
+  auto initialize() noexcept -> bool
+  {
+    const uint32_t count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    states = static_cast<vcpu_state*>(ExAllocatePoolWithTag(NonPagedPool, sizeof(vcpu_state) * count, HV_POOL_TAG));
+    if (states == nullptr) return false;
+
+    memset(states, 0, sizeof(vcpu_state) * count);
+    state_count = count;
+
+    return true;
+  }
+
+  auto shutdown() noexcept -> void
+  {
+    if (states != nullptr)
+    {
+      state_count = 0;
+      ExFreePoolWithTag(states, HV_POOL_TAG);
+      states = nullptr;
+    }
+  }
+
+  auto vcpu(const uint32_t processor) noexcept -> vcpu_state*
+  {
+    return processor < state_count ? &states[processor] : nullptr;
+  }
+
+  auto ready() noexcept -> bool
+  {
+    return states != nullptr;
+  }
+
+  auto synchronize() noexcept -> void
+  {
+    if (states == nullptr) return;
+
+    synchronize(states, state_count, [] { _mm_pause(); });
+  }
+}; // namespace rcu
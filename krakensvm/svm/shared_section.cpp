@@ -0,0 +1,136 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <shared_section.hpp>
+
+extern "C" NTSYSAPI NTSTATUS NTAPI MmMapViewInSystemSpace(PVOID Section, PVOID* MappedBase, PSIZE_T ViewSize);
+extern "C" NTSYSAPI NTSTATUS NTAPI MmUnmapViewInSystemSpace(PVOID MappedBase);
+
+namespace shared_section
+{
+  auto create(section& shared, const size_t size, const bool user_writable) noexcept -> bool
+  {
+    OBJECT_ATTRIBUTES attributes;
+    LARGE_INTEGER maximum_size;
+    SIZE_T mapped_size = 0;
+
+    shared = {};
+    shared.size          = (size + PAGE_SIZE - 1) & ~static_cast<size_t>(PAGE_SIZE - 1);
+    shared.user_writable = user_writable;
+
+    maximum_size.QuadPart = static_cast<LONGLONG>(shared.size);
+
+    InitializeObjectAttributes(&attributes, nullptr, OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+    if (!NT_SUCCESS(ZwCreateSection(&shared.handle, SECTION_ALL_ACCESS, &attributes, &maximum_size,
+                                    user_writable ? PAGE_READWRITE : PAGE_READONLY, SEC_COMMIT, nullptr)))
+    {
+      shared.handle = nullptr;
+      destroy(shared);
+      return false;
+    }
+
+    if (!NT_SUCCESS(ObReferenceObjectByHandle(shared.handle, SECTION_ALL_ACCESS, nullptr,
+                                              KernelMode, &shared.object, nullptr)) ||
+        !NT_SUCCESS(MmMapViewInSystemSpace(shared.object, &shared.system_view, &mapped_size)))
+    {
+      destroy(shared);
+      return false;
+    }
+
+    shared.locked_pages = IoAllocateMdl(shared.system_view, static_cast<ULONG>(shared.size), FALSE, FALSE, nullptr);
+    if (shared.locked_pages == nullptr)
+    {
+      destroy(shared);
+      return false;
+    }
+
+    __try
+    {
+      MmProbeAndLockPages(shared.locked_pages, KernelMode, IoReadAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+      IoFreeMdl(shared.locked_pages);
+      shared.locked_pages = nullptr;
+      destroy(shared);
+      return false;
+    }
+
+    // The system view may be read-only, a mapping of the locked pages isn't
+    shared.address = MmGetSystemAddressForMdlSafe(shared.locked_pages, NormalPagePriority | MdlMappingNoExecute);
+    if (shared.address == nullptr)
+    {
+      destroy(shared);
+      return false;
+    }
+
+    RtlZeroMemory(shared.address, shared.size);
+    return true;
+  }
+
+  auto destroy(section& shared) noexcept -> void
+  {
+    // The MDL mapping goes with the MDL
+    if (shared.locked_pages != nullptr)
+    {
+      MmUnlockPages(shared.locked_pages);
+      IoFreeMdl(shared.locked_pages);
+    }
+
+    if (shared.system_view != nullptr) MmUnmapViewInSystemSpace(shared.system_view);
+    if (shared.object != nullptr)      ObDereferenceObject(shared.object);
+    if (shared.handle != nullptr)      ZwClose(shared.handle);
+
+    shared = {};
+  }
+
+  auto map_user(const section& shared, void*& address, size_t& size) noexcept -> bool
+  {
+    SIZE_T mapped_size = 0;
+
+    address = nullptr;
+    size    = 0;
+
+    if (shared.handle == nullptr) return false;
+
+    if (!NT_SUCCESS(ZwMapViewOfSection(shared.handle, ZwCurrentProcess(), &address, 0, 0, nullptr,
+                                       &mapped_size, ViewUnmap, 0,
+                                       shared.user_writable ? PAGE_READWRITE : PAGE_READONLY)))
+    {
+      address = nullptr;
+      return false;
+    }
+
+    size = mapped_size;
+    return true;
+  }
+
+  auto unmap_user(void* address) noexcept -> void
+  {
+    if (address != nullptr) ZwUnmapViewOfSection(ZwCurrentProcess(), address);
+  }
+}; // namespace shared_section
@@ -0,0 +1,131 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <shared_section.hpp>
+#include <telemetry.hpp>
+#include <syscall_stats.hpp>
+
+namespace telemetry
+{
+  vcpu_stats* volatile vcpu_rows       = nullptr;
+  uint32_t             vcpu_rows_count = 0;
+
+  // Read-only to the readers, see "inc/shared_section.hpp"
+  static shared_section::section pages = {};
+
+  static void* syscall_rows = nullptr;
+
+  static auto measure_tsc_frequency() noexcept -> uint64_t
+  {
+    LARGE_INTEGER frequency;
+
+    const LARGE_INTEGER counter_start = KeQueryPerformanceCounter(&frequency);
+    const uint64_t      tsc_start     = __rdtsc();
+
+    KeStallExecutionProcessor(10000);
+
+    const uint64_t      tsc_end       = __rdtsc();
+    const LARGE_INTEGER counter_end   = KeQueryPerformanceCounter(nullptr);
+
+    const uint64_t elapsed = static_cast<uint64_t>(counter_end.QuadPart - counter_start.QuadPart);
+    if (elapsed == 0) return 0;
+
+    return (tsc_end - tsc_start) * static_cast<uint64_t>(frequency.QuadPart) / elapsed;
+  }
+
+  auto initialize(const uint32_t syscall_slots, const uint32_t syscall_nt_slots) noexcept -> bool
+  {
+    if (vcpu_rows != nullptr) return true;
+
+    const uint32_t vcpu_count    = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    const size_t   syscall_bytes = hk::stats::per_cpu_table::storage_size(syscall_slots ? vcpu_count : 0, syscall_slots);
+
+    if (!shared_section::create(pages, section_size(vcpu_count, syscall_bytes), false)) return false;
+
+    auto* current = static_cast<header*>(pages.address);
+
+    current->magic         = section_magic;
+    current->version       = section_version;
+    current->total_size    = pages.size;
+    current->tsc_frequency = measure_tsc_frequency();
+    current->vcpu_count    = vcpu_count;
+    current->vcpu_stride   = sizeof(vcpu_stats);
+    current->vcpu_offset   = vcpu_offset();
+
+    if (syscall_slots != 0)
+    {
+      current->syscall_offset    = syscall_offset(vcpu_count);
+      current->syscall_cpu_count = vcpu_count;
+      current->syscall_slots     = syscall_slots;
+      current->syscall_nt_slots  = syscall_nt_slots;
+      current->syscall_row_size  = sizeof(hk::stats::syscall_row);
+
+      syscall_rows = static_cast<uint8_t*>(pages.address) + syscall_offset(vcpu_count);
+    }
+
+    kprint_info("Telemetry section: %u vcpus, %llu bytes, TSC %llu Hz\n",
+                vcpu_count, static_cast<uint64_t>(pages.size), current->tsc_frequency);
+
+    vcpu_rows_count = vcpu_count;
+
+    _ReadWriteBarrier();
+    vcpu_rows = reinterpret_cast<vcpu_stats*>(static_cast<uint8_t*>(pages.address) + vcpu_offset());
+
+    return true;
+  }
+
+  auto shutdown() noexcept -> void
+  {
+    // Only called once the processors have been devirtualized
+    vcpu_rows       = nullptr;
+    vcpu_rows_count = 0;
+    syscall_rows    = nullptr;
+
+    shared_section::destroy(pages);
+  }
+
+  auto syscall_storage() noexcept -> void*
+  {
+    return vcpu_rows != nullptr ? syscall_rows : nullptr;
+  }
+
+  auto map_user(void*& address, size_t& size) noexcept -> bool
+  {
+    if (vcpu_rows == nullptr)
+    {
+      address = nullptr;
+      size    = 0;
+      return false;
+    }
+
+    return shared_section::map_user(pages, address, size);
+  }
+
+  auto unmap_user(void* address) noexcept -> void
+  {
+    shared_section::unmap_user(address);
+  }
+}; // namespace telemetry
@@ -0,0 +1,166 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <hv_util.hpp>
+#include <vmcb.hpp>
+#include <paging.hpp>
+#include <processor_mask.hpp>
+#include <numa.hpp>
+#include <vcpu_reserve.hpp>
+
+using namespace ia32e;
+
+namespace vcpu_reserve
+{
+  // After the nodes' pools, for processors on numa::unknown_node
+  constexpr uint32_t unplaced = numa::max_nodes;
+
+  static pool   reserves[numa::max_nodes + 1] = {};
+  static void** slots[numa::max_nodes + 1]    = {};
+
+  static auto fill(const uint32_t node, const uint32_t count) noexcept -> bool
+  {
+    if (count == 0) return true;
+
+    slots[node] = static_cast<void**>(ExAllocatePoolWithTag(NonPagedPool, sizeof(void*) * count, HV_POOL_TAG));
+    if (slots[node] == nullptr) return false;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      slots[node][i] = mm::system_node_alloc(sizeof(vmcb::vcpu_ctx_t), node != unplaced ? node : MM_ANY_NODE_OK);
+
+      if (slots[node][i] == nullptr)
+      {
+        reserves[node].capacity = i;
+        return false;
+      }
+    }
+
+    reserves[node].capacity = count;
+    return true;
+  }
+
+  // Selected processors running now that the NUMA map couldn't place, the
+  // ones hot added later on aren't in the map either but have the spares
+  static auto unplaced_active(const numa::node_map& map) noexcept -> uint32_t
+  {
+    processor_mask::topology layout;
+    processor_mask::current_topology(layout);
+
+    uint32_t total = 0;
+
+    for (USHORT group = 0; group < layout.group_count; ++group)
+    {
+      const KAFFINITY active = KeQueryGroupAffinity(group);
+
+      for (uint32_t number = 0; number < 64; ++number)
+      {
+        if ((active >> number & 1) == 0) continue;
+
+        const uint32_t index = layout.index_of(group, number);
+
+        if (processor_mask::selected().contains(index) && map.node(index) == numa::unknown_node) ++total;
+      }
+    }
+
+    return total;
+  }
+
+  auto initialize(const uint32_t spare) noexcept -> bool
+  {
+    const numa::node_map& map = numa::map();
+
+    const uint32_t active  = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    const uint32_t maximum = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    uint32_t total = 0;
+
+    for (uint32_t node = 0; node < numa::node_count(); ++node)
+    {
+      const uint32_t count = capacity(map.count(processor_mask::selected(), node), active, maximum, spare);
+
+      if (!fill(node, count))
+      {
+        release_all();
+        return false;
+      }
+
+      total += count;
+    }
+
+    const uint32_t unplaced_count = unplaced_active(map);
+
+    if (!fill(unplaced, unplaced_count))
+    {
+      release_all();
+      return false;
+    }
+
+    total += unplaced_count;
+
+    kprint_info("%u vCPU contexts reserved over %u nodes\n", total, numa::node_count());
+    return true;
+  }
+
+  auto release_all() noexcept -> void
+  {
+    for (uint32_t node = 0; node <= unplaced; ++node)
+    {
+      if (slots[node] == nullptr) continue;
+
+      for (uint32_t i = 0; i < reserves[node].capacity; ++i)
+      {
+        system_free_contiguous(slots[node][i]);
+      }
+
+      ExFreePoolWithTag(slots[node], HV_POOL_TAG);
+      slots[node]    = nullptr;
+      reserves[node] = {};
+    }
+  }
+
+  static auto take_from(const uint32_t pool_index) noexcept -> void*
+  {
+    if (slots[pool_index] == nullptr) return nullptr;
+
+    const uint32_t slot = claim(reserves[pool_index]);
+
+    return slot != none ? slots[pool_index][slot] : nullptr;
+  }
+
+  auto take(const uint32_t node, const bool placed) noexcept -> void*
+  {
+    const uint32_t node_count = numa::node_count();
+
+    void* context = placed ? nullptr : take_from(unplaced);
+
+    for (uint32_t attempt = 0; context == nullptr && attempt < node_count; ++attempt)
+    {
+      context = take_from(numa::fallback(node, node_count, attempt));
+    }
+
+    return context != nullptr || !placed ? context : take_from(unplaced);
+  }
+}; // namespace vcpu_reserve
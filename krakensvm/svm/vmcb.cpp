@@ -25,10 +25,17 @@
 
 #include <vmcb.hpp>
 #include <hv_util.hpp>
+#include <processor_mask.hpp>
+#include <vcpu_reserve.hpp>
+#include <numa.hpp>
+#include <syscall_trap.hpp>
 
 //extern "C" NTSYSAPI VOID RtlCaptureContext(PCONTEXT ContextRecord);
 using namespace ia32e;
 
+// Per-processor vCPU table, see "inc/vcpu_table.hpp"
+vcpu_table::table vcpu_table::vcpus = {};
+
 namespace vmcb
 {
   //
@@ -51,6 +58,30 @@ namespace vmcb
     return ( strcmp(vendor_id, "MeddyWasHere") == 0 );
   }
 
+  //
+  // Intercept vectors of the guest VMCB, only while the guest isn't running on it
+  //
+
+  auto install_intercepts(pvcpu_ctx_t vcpu_data, const intercept_profile::intercept_set& intercepts) noexcept -> void
+  {
+    control_area_64_t& control = vcpu_data->guest_vmcb.control_area;
+
+    const intercept_profile::intercept_set current =
+    {
+      control.intercept_misc_vector_3,
+      control.intercept_misc_vector_4,
+      static_cast<uint16_t>(control.intercept_write_cr0),
+      control.intercept_misc_vector_5,
+    };
+
+    control.intercept_misc_vector_3 = intercepts.misc3;
+    control.intercept_misc_vector_4 = intercepts.misc4;
+    control.intercept_write_cr0     = intercepts.cr_write;
+    control.intercept_misc_vector_5 = intercepts.misc5;
+
+    control.vmcb_clean_bits.value = intercept_profile::clean_after(current, intercepts, control.vmcb_clean_bits.value);
+  }
+
   //
   // Preparation for the Virtualization of the processor
   //
@@ -68,14 +99,9 @@ namespace vmcb
     // & Physical Address being assigned & ASID
     //
 
-    vcpu_data->guest_vmcb
-      .control_area.intercept_misc_vector_3 |= INTERCEPT_MSR_PROT |
-                                               INTERCEPT_CPUID    ;
-                                               //INTERCEPT_FERR_FRE;
-
-    vcpu_data->guest_vmcb
-      .control_area.intercept_misc_vector_4 |= INTERCEPT_VMRUN |
-                                               INTERCEPT_VMMCALL;
+    // INTERCEPT_MSR_PROT | INTERCEPT_CPUID and INTERCEPT_VMRUN | INTERCEPT_VMMCALL
+    // unless a different profile was asked for, see "inc/intercept_profile.hpp"
+    install_intercepts(vcpu_data, intercept_profile::initial());
 
     vcpu_data->guest_vmcb.control_area.guest_asid = 1;
 
@@ -83,7 +109,8 @@ namespace vmcb
 
     guest_vmcb_pa = MmGetPhysicalAddress(&vcpu_data->guest_vmcb).QuadPart;
 
-    msrpm_vmcb_pa = MmGetPhysicalAddress(shared_page_info->msrpm_addr).QuadPart;
+    // The copy on this processor's node, VMRUN reads it on every exit
+    msrpm_vmcb_pa = MmGetPhysicalAddress(shared_page_info->msrpm_for(KeGetCurrentNodeNumber())).QuadPart;
 
     //
     // Descriptor Table Registers / Segment Registers & Control Registers & GP Registers
@@ -142,6 +169,16 @@ namespace vmcb
     vcpu_data->guest_vmcb.save_state.cr3 = uint64_t(__readcr3());
     vcpu_data->guest_vmcb.save_state.cr4 = uint64_t(__readcr4());
     vcpu_data->guest_vmcb.save_state.efer = uint64_t(__readmsr(ia32_efer));
+
+    // SYSCALL and SYSRET raise #UD from here on, the #UD intercept carries
+    // them out from the host side
+    vcpu_data->guest_syscall_enabled = (vcpu_data->guest_vmcb.save_state.efer & hk::trap::efer_sce) != 0;
+
+    if (hk::trap::enabled())
+    {
+      vcpu_data->guest_vmcb.save_state.efer &= ~hk::trap::efer_sce;
+      vcpu_data->guest_vmcb.control_area.intercept_exceptions_vector |= 1u << 6;
+    }
     
     // GP Register (where they're suppose to be initialize)
     vcpu_data->guest_vmcb.save_state.rsp = host_info.rsp;
@@ -182,8 +219,11 @@ namespace vmcb
     pvcpu_ctx_t vcpu_data { nullptr };
     bool status = true;
 
-    vcpu_data = reinterpret_cast<pvcpu_ctx_t>
-      ( mm::system_aligned_alloc(sizeof(vcpu_ctx_t)) );
+    // From the reserve, a processor added at runtime gets its context the same
+    // way. Running on the processor, so the current node is its node.
+    const bool placed = numa::map().node(KeGetCurrentProcessorNumberEx(nullptr)) != numa::unknown_node;
+
+    vcpu_data = static_cast<pvcpu_ctx_t>(vcpu_reserve::take(KeGetCurrentNodeNumber(), placed));
 
     //__debugbreak();
 
@@ -204,6 +244,9 @@ namespace vmcb
       vmcb_prepartion(vcpu_data, host_info, shared_page_info);
       kprint_info("VMCB Data Structure finished Initializing.\n");
 
+      // Before the first VMRUN, the first #VMEXIT can already look it up
+      vcpu_table::publish(vcpu_table::vcpus, KeGetCurrentProcessorNumberEx(nullptr), vcpu_data);
+
 #if defined(_DEBUG)
       kprint_info<uint64_t>("Host Register Info:\n\tRSP = %X, RIP = %X, EFLAG = %X \n",
         host_info.rsp, host_info.rip, host_info.eflag);
@@ -226,12 +269,10 @@ namespace vmcb
     }
 
     kprint_info("Processor has been Virtualized! Yessir...\n");
+    processor_mask::mark(KeGetCurrentProcessorIndex(), true);
 
   _deallocation:
-    if (!status && vcpu_data != nullptr)
-    {
-      system_free_alloc(vcpu_data);
-    }
+    // A slot that's been taken stays taken, the reserve goes back as a whole
     return status;
   }
 
@@ -25,6 +25,19 @@
 
 #include <vmexit_handler.hpp>
 #include <syscall_hook.hpp>
+#include <syscall_trap.hpp>
+#include <cr3_filter.hpp>
+#include <event_filter.hpp>
+#include <telemetry.hpp>
+#include <exit_trace.hpp>
+#include <intercept_policy.hpp>
+#include <intercept_profile.hpp>
+#include <guest_memory.hpp>
+#include <insn_length.hpp>
+#include <hook_transaction.hpp>
+#include <rcu.hpp>
+#include <deferred_work.hpp>
+#include <binlog.hpp>
 
 using namespace ia32e;
 
@@ -48,6 +61,57 @@ auto inject_ud(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void;
 // Injecting Page Fault
 auto inject_pf(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void;
 
+//
+// Where the intercepted instruction ends. n_rip is only written by processors
+// with NRIP save (CPUID Fn8000_000A EDX[3]), without it the instruction is
+// fetched from guest memory and sized. If even that fails there's no way past
+// it, and restarting it would only bring the same #VMEXIT back for good: the
+// guest gets a #GP at the instruction instead, so it fails where it can be
+// seen rather than hanging the vCPU.
+//
+
+// Up to size bytes of the instruction at RIP, how many could be read. The
+// page after the one it starts in doesn't have to be mapped, only the bytes
+// up to its end are needed.
+static auto fetch_code(vmcb::pvcpu_ctx_t vcpu_data, uint8_t* code, const size_t size,
+                       const uint32_t access) noexcept -> size_t
+{
+  const uint64_t rip = vcpu_data->guest_vmcb.save_state.rip;
+  const uint64_t cr3 = vcpu_data->guest_vmcb.save_state.cr3;
+
+  const size_t room = PAGE_SIZE - (rip & (PAGE_SIZE - 1));
+  size_t available  = room < size ? room : size;
+
+  if (guest_memory::read_guest(vcpu_data, cr3, rip, code, available, access) != walk::status::ok)
+    return 0;
+
+  if (available < size &&
+      guest_memory::read_guest(vcpu_data, cr3, rip + available, code + available,
+                               size - available, access) == walk::status::ok) available = size;
+
+  return available;
+}
+
+static auto next_rip(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> uint64_t
+{
+  const uint64_t n_rip = vcpu_data->guest_vmcb.control_area.n_rip;
+  if (n_rip != 0) return n_rip;
+
+  const uint64_t rip = vcpu_data->guest_vmcb.save_state.rip;
+
+  uint8_t code[insn::max_length] = {};
+
+  const size_t available = fetch_code(vcpu_data, code, sizeof code, walk::access_execute);
+  const size_t length    = available != 0 ? insn::length(code, available) : 0;
+
+  if (length != 0) return rip + length;
+
+  klog_info("vCPU %u: can't size the instruction at %llx, #GP\n", KeGetCurrentProcessorIndex(), rip);
+
+  inject_gp(vcpu_data);
+  return rip;
+}
+
 
 //
 // #VMEXIT Handler
@@ -80,6 +144,51 @@ auto vmmcall_handler(vmcb::pvcpu_ctx_t vcpu_data, guest_status_t guest_status) n
     __writemsr(ia32_lstar, vcpu_data->original_lstar);
   };
 
+  // Only the kernel gets to pick which processes are traced, the result goes
+  // back in RAX
+  auto cr3_filter_swap = [&]() -> void
+  {
+    seg::segment_attribute_64_t attribute;
+    attribute.value = vcpu_data->guest_vmcb.save_state.ss.attribute.value;
+
+    const bool swapped = attribute.dpl == 0 &&
+                         cr3_filter::swap(reinterpret_cast<const cr3_filter::set*>(context));
+
+    vcpu_data->guest_vmcb.save_state.rax = swapped;
+    vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
+  };
+
+  // Same rules, the target vCPUs install the profile at the end of their
+  // next #VMEXIT
+  auto set_intercept_profile = [&]() -> void
+  {
+    seg::segment_attribute_64_t attribute;
+    attribute.value = vcpu_data->guest_vmcb.save_state.ss.attribute.value;
+
+    uint32_t processor = {};
+    intercept_profile::id profile = {};
+
+    const bool requested = attribute.dpl == 0 &&
+                           intercept_profile::decode(context, processor, profile) &&
+                           intercept_profile::request_from_host(processor, profile);
+
+    vcpu_data->guest_vmcb.save_state.rax = requested;
+    vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
+  };
+
+  // This vCPU's part of a hook transaction, the guest sits here until the
+  // writer is done with every processor's
+  auto hook_window = [&]() -> void
+  {
+    seg::segment_attribute_64_t attribute;
+    attribute.value = vcpu_data->guest_vmcb.save_state.ss.attribute.value;
+
+    const bool joined = attribute.dpl == 0 && hk::transaction::join_from_host(context);
+
+    vcpu_data->guest_vmcb.save_state.rax = joined;
+    vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
+  };
+
   switch (hypercall_number)
   {
     case svm::hypercall_num::syscallhook:
@@ -90,6 +199,18 @@ auto vmmcall_handler(vmcb::pvcpu_ctx_t vcpu_data, guest_status_t guest_status) n
       unsimply_hook();
       break;
 
+    case svm::hypercall_num::cr3_filter_swap:
+      cr3_filter_swap();
+      break;
+
+    case svm::hypercall_num::set_intercept_profile:
+      set_intercept_profile();
+      break;
+
+    case svm::hypercall_num::hook_window:
+      hook_window();
+      break;
+
     default:
       vminstructions_handler(vcpu_data);
   }
@@ -156,7 +277,7 @@ auto cpuid_handler(vmcb::pvcpu_ctx_t vcpu_data,
 
   //kprint_info("EAX: %lx, EBX: %lx, ECX: %lx, EDX: %lx\n", registers[0], registers[1], registers[2], registers[3]);
 
-  vcpu_data->guest_vmcb.save_state.rip = vcpu_data->guest_vmcb.control_area.n_rip;
+  vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
     
 }
 
@@ -176,25 +297,298 @@ auto setup_msrpermissions_bitmap(void* msrpermission_map) noexcept -> void
                       reinterpret_cast<unsigned long*>(msrpermission_map),
                       (size_of_vectors) * 4);
 
-  RtlClearAllBits(&msr_bitmaps);
-
-  // Set the bit to indicating write access should be intercepted for EFER MSR
   constexpr uint64_t offset_2nd_base = (ia32_efer - msr_range_base) * bits_per_msr;
   constexpr uint64_t offset          = offset_2nd_base + size_of_vectors;
-  RtlSetBits(&msr_bitmaps, offset + 1, 1);
 
-  // Set the bit to indicating write/read access should be intercepted for LSTAR MSR
   constexpr uint64_t offset_3nd_base = (ia32_lstar - msr_range_base) * bits_per_msr;
   constexpr uint64_t offset1         = offset_3nd_base + size_of_vectors;
 
-  RtlSetBits(&msr_bitmaps, offset, 1);    // setting the read access
-  RtlSetBits(&msr_bitmaps, offset + 1, 1);// setting the write access
+  // A loaded policy replaces the defaults below altogether
+  if (!intercept_policy::apply(msrpermission_map))
+  {
+    RtlClearAllBits(&msr_bitmaps);
+
+    // Set the bit to indicating write access should be intercepted for EFER MSR
+    RtlSetBits(&msr_bitmaps, offset + 1, 1);
+
+    // Set the bit to indicating write/read access should be intercepted for LSTAR MSR
+    RtlSetBits(&msr_bitmaps, offset1, 1);    // setting the read access
+    RtlSetBits(&msr_bitmaps, offset1 + 1, 1);// setting the write access
+  }
+
+  // The guest must not see the EFER.SCE the syscall trap keeps clear, nor
+  // turn it back on, whatever the policy says
+  if (hk::trap::enabled())
+  {
+    RtlSetBits(&msr_bitmaps, offset, 2);
+  }
+}
+
+//
+// Exits only the tracing intercept profile asks for
+//
+
+static auto guest_tlb_coherent(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> bool
+{
+  const vmcb::control_area_64_t& control = vcpu_data->guest_vmcb.control_area;
+
+  const intercept_profile::intercept_set active =
+  {
+    control.intercept_misc_vector_3,
+    control.intercept_misc_vector_4,
+    static_cast<uint16_t>(control.intercept_write_cr0),
+    control.intercept_misc_vector_5,
+  };
+
+  return intercept_profile::coherent(active);
+}
+
+// GPR number the way EXITINFO1 reports it with decode assists, 0 (RAX) - 15 (R15)
+static auto guest_gpr(vmcb::pvcpu_ctx_t vcpu_data, const guest_status_t& guest_status,
+                      const uint64_t number) noexcept -> uint64_t
+{
+  const pguest_reg_ctx_t registers = guest_status.guest_registers;
+
+  switch (number & 0xf)
+  {
+    case 0:  return vcpu_data->guest_vmcb.save_state.rax;
+    case 1:  return registers->rcx;
+    case 2:  return registers->rdx;
+    case 3:  return registers->rbx;
+    case 4:  return vcpu_data->guest_vmcb.save_state.rsp;
+    case 5:  return registers->rbp;
+    case 6:  return registers->rsi;
+    case 7:  return registers->rdi;
+    case 8:  return registers->r8;
+    case 9:  return registers->r9;
+    case 10: return registers->r10;
+    case 11: return registers->r11;
+    case 12: return registers->r12;
+    case 13: return registers->r13;
+    case 14: return registers->r14;
+    default: return registers->r15;
+  }
+}
+
+auto cr3_write_handler(vmcb::pvcpu_ctx_t vcpu_data,
+                       guest_status_t& guest_status) noexcept -> void
+{
+  constexpr uint64_t pcid_no_flush = 1ull << 63;
+  constexpr uint64_t cr4_pcide     = 1ull << 17;
+
+  // Only intercepted when decode assists are there, EXITINFO1[3:0] is the source
+  uint64_t value = guest_gpr(vcpu_data, guest_status, vcpu_data->guest_vmcb.control_area.exitinfo1);
+  bool flush     = true;
+
+  if (vcpu_data->guest_vmcb.save_state.cr4 & cr4_pcide)
+  {
+    flush  = (value & pcid_no_flush) == 0;
+    value &= ~pcid_no_flush;
+  }
+
+  vcpu_data->guest_vmcb.save_state.cr3 = value;
+  vcpu_data->guest_vmcb.control_area.vmcb_clean_bits.fields.crx = 0;
+
+  vcpu_data->guest_tlb.flush();
+
+  // The whole TLB, the one TLB_CONTROL value every SVM implementation takes.
+  // vmexit_handler puts it back to 0 on the next #VMEXIT.
+  if (flush) vcpu_data->guest_vmcb.control_area.tlb_control = 1;
+
+  vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
+}
+
+//
+// MOV CR4. Changing any of the paging bits drops what the processor had
+// cached, PGE and PCIDE toggles are how Windows flushes global translations.
+// What VMRUN would refuse, or the processor would fault on, gets a #GP.
+//
+
+auto cr4_write_handler(vmcb::pvcpu_ctx_t vcpu_data,
+                       guest_status_t& guest_status) noexcept -> void
+{
+  constexpr uint64_t cr4_pae     = 1ull << 5;
+  constexpr uint64_t cr4_la57    = 1ull << 12;
+  constexpr uint64_t cr4_pcide   = 1ull << 17;
+
+  // PSE, PAE, PGE, PCIDE, SMEP, SMAP, PKE
+  constexpr uint64_t cr4_paging  = 0x00000000007200b0ull;
+
+  // Bits 13 - 15, 19 and 24 up are reserved on AMD
+  constexpr uint64_t cr4_defined = 0x0000000000f71fffull;
+
+  vmcb::save_state_64_t& state = vcpu_data->guest_vmcb.save_state;
+
+  const uint64_t value    = guest_gpr(vcpu_data, guest_status, vcpu_data->guest_vmcb.control_area.exitinfo1);
+  const uint64_t previous = state.cr4;
+  const uint64_t changed  = value ^ previous;
+
+  if ((value & ~cr4_defined) != 0 || (changed & cr4_la57) != 0 || (value & cr4_pae) == 0 ||
+      ((changed & value & cr4_pcide) != 0 && (state.cr3 & 0xfff) != 0))
+  {
+    return inject_gp(vcpu_data);
+  }
+
+  state.cr4 = value;
+  vcpu_data->guest_vmcb.control_area.vmcb_clean_bits.fields.crx = 0;
+
+  if ((changed & cr4_paging) != 0)
+  {
+    vcpu_data->guest_tlb.flush();
+    vcpu_data->guest_vmcb.control_area.tlb_control = 1;
+  }
+
+  state.rip = next_rip(vcpu_data);
+}
+
+auto invlpg_handler(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void
+{
+  // EXITINFO1 is the linear address with decode assists
+  vcpu_data->guest_tlb.invalidate(vcpu_data->guest_vmcb.control_area.exitinfo1);
+
+  __svm_invlpga(reinterpret_cast<void*>(vcpu_data->guest_vmcb.control_area.exitinfo1),
+                static_cast<int>(vcpu_data->guest_vmcb.control_area.guest_asid));
+
+  vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
+}
+
+//
+// INVPCID, every type drops the whole cache and the guest's TLB: a single
+// PCID or address is just less than that, and the descriptor isn't even
+// read. Only the type is checked, the processor did the CPL one already.
+//
+
+auto invpcid_handler(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void
+{
+  // EXITINFO2 is the register operand with decode assists
+  const uint64_t type = vcpu_data->guest_vmcb.control_area.exitinfo2;
+
+  if (type > 3) return inject_gp(vcpu_data);
 
+  vcpu_data->guest_tlb.flush();
+  vcpu_data->guest_vmcb.control_area.tlb_control = 1;
+
+  vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
+}
+
+//
+// #UD, only intercepted while syscalls are trapped (see "hooks/syscall_trap.hpp").
+// SYSCALL and SYSRET are carried out here, any other #UD goes back to the guest
+// as it was.
+//
+
+auto ud_handler(vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status) noexcept -> void
+{
+  vmcb::save_state_64_t& guest = vcpu_data->guest_vmcb.save_state;
+  const pguest_reg_ctx_t registers = guest_status.guest_registers;
+
+  uint8_t code[3] = {};
+
+  const size_t fetched = fetch_code(vcpu_data, code, sizeof code,
+                                    walk::access_execute | (guest.cpl == 3 ? walk::access_user : 0));
+
+  const hk::trap::decoded instruction = hk::trap::decode(code, fetched);
+
+  hk::trap::state state =
+  {
+    guest.rip, guest.rflags, registers->rcx, registers->r11,
+    { guest.cs.selector, guest.cs.attribute.value, guest.cs.limit, guest.cs.base_addr },
+    { guest.ss.selector, guest.ss.attribute.value, guest.ss.limit, guest.ss.base_addr },
+    guest.cpl,
+  };
+
+  const hk::trap::msrs msr =
+  {
+    guest.efer | (vcpu_data->guest_syscall_enabled ? hk::trap::efer_sce : 0),
+    guest.star, guest.lstar, guest.cstar, guest.sfmask,
+  };
+
+  hk::trap::outcome result = hk::trap::outcome::undefined;
+
+  switch (instruction.kind)
+  {
+    case hk::trap::instruction::syscall:
+      result = hk::trap::emulate_syscall(state, msr, instruction.length);
+      break;
+
+    case hk::trap::instruction::sysret:
+    case hk::trap::instruction::sysret64:
+      result = hk::trap::emulate_sysret(state, msr, instruction.kind == hk::trap::instruction::sysret64);
+      break;
+
+    default:
+      break;
+  }
+
+  if (result != hk::trap::outcome::done)
+  {
+    if (result == hk::trap::outcome::general_protection) inject_gp(vcpu_data);
+    else                                                 inject_ud(vcpu_data);
+
+    return;
+  }
+
+  // Either side of the switch, the user CR3 and GS base name the thread
+  const uint32_t processor = KeGetCurrentProcessorIndex();
+
+  if (instruction.kind == hk::trap::instruction::syscall)
+  {
+    const uint64_t args[4] = { registers->r10, registers->rdx, registers->r8, registers->r9 };
+
+    hk::trap::on_syscall(processor, guest.cr3, guest.gs.base_addr, static_cast<uint32_t>(guest.rax), args);
+  }
+  else
+  {
+    hk::trap::on_sysret(processor, guest.cr3, guest.gs.base_addr);
+  }
+
+  guest.rip              = state.rip;
+  guest.rflags           = state.rflags;
+  registers->rcx         = state.rcx;
+  registers->r11         = state.r11;
+
+  guest.cs.selector        = state.cs.selector;
+  guest.cs.attribute.value = state.cs.attribute;
+  guest.cs.limit           = state.cs.limit;
+  guest.cs.base_addr       = state.cs.base;
+
+  guest.ss.selector        = state.ss.selector;
+  guest.ss.attribute.value = state.ss.attribute;
+  guest.ss.limit           = state.ss.limit;
+  guest.ss.base_addr       = state.ss.base;
+
+  guest.cpl = state.cpl;
+
+  vcpu_data->guest_vmcb.control_area.vmcb_clean_bits.fields.segs = 0;
+}
+
+auto rdtsc_handler(vmcb::pvcpu_ctx_t vcpu_data,
+                   guest_status_t& guest_status, bool rdtscp) noexcept -> void
+{
+  unsigned int tsc_aux = {};
+
+  const uint64_t tsc = (rdtscp ? __rdtscp(&tsc_aux) : __rdtsc()) +
+                       vcpu_data->guest_vmcb.control_area.tsc_offset;
+
+  vcpu_data->guest_vmcb.save_state.rax = tsc & 0xffffffff;
+  guest_status.guest_registers->rdx    = tsc >> 32;
+
+  if (rdtscp) guest_status.guest_registers->rcx = tsc_aux;
+
+  vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
 }
 
 //template<>
 //static auto msr_read_manager(uint32_t msr_value) -> void;
 
+// What RDMSR hands back, the guest RAX lives in the VMCB
+static auto complete_rdmsr(vmcb::pvcpu_ctx_t vcpu_data, guest_status_t& guest_status,
+                           const uint64_t value) noexcept -> void
+{
+  vcpu_data->guest_vmcb.save_state.rax = value & 0xffffffff;
+  guest_status.guest_registers->rdx    = value >> 32;
+}
+
 auto msr_handler(vmcb::pvcpu_ctx_t vcpu_data,
                  guest_status_t& guest_status) noexcept -> void
 {
@@ -209,41 +603,53 @@ auto msr_handler(vmcb::pvcpu_ctx_t vcpu_data,
   bool msr_ranges    = ( (ecx_value <= 0x00001fff) || (ecx_value <= 0xC0000000) ||
                          (ecx_value <= 0xC0001fff));
 
-  msr_value = guest_status.guest_registers->rax & 0xffffffff |
-              guest_status.guest_registers->rdx & 0xffffffff;
+  msr_value = (guest_status.guest_registers->rax & 0xffffffff) |
+              (guest_status.guest_registers->rdx << 32);
 
   switch(ecx_value)
   {
     case ia32_efer:
       if (write_access) [[likely]]
       {
+        // A fault leaves RIP on the WRMSR
         if ((msr_value & ia32_efer_svme) == 0)
         {
           inject_gp(vcpu_data);
+          return;
         }
 
+        // SCE stays clear while syscalls are trapped, the guest only ever
+        // sees the one it wrote
+        vcpu_data->guest_syscall_enabled = (msr_value & hk::trap::efer_sce) != 0;
+        if (hk::trap::enabled()) msr_value &= ~hk::trap::efer_sce;
+
         vcpu_data->guest_vmcb.save_state.efer = msr_value;
+        vcpu_data->guest_vmcb.control_area.vmcb_clean_bits.fields.crx = 0;
+      }
+      else
+      {
+        msr_value = vcpu_data->guest_vmcb.save_state.efer;
+        if (vcpu_data->guest_syscall_enabled) msr_value |= hk::trap::efer_sce;
+
+        complete_rdmsr(vcpu_data, guest_status, msr_value);
       }
       break;
 
+    // The guest's LSTAR is in the VMCB, VMLOAD puts it in place before VMRUN
     case ia32_lstar:
       if (write_access)
       {
-        //kprint_info("THERE WAS A IA32_LSTAR WRITE!!!");
-        if (msr_value == vcpu_data->original_lstar)
+        if (!hk::trap::canonical(msr_value))
         {
-          //msr_value = (uint64_t)&MyKiSystemCall64Hook;
+          inject_gp(vcpu_data);
+          return;
         }
-        __writemsr(ia32_lstar, msr_value);
+
+        vcpu_data->guest_vmcb.save_state.lstar = msr_value;
       }
       else
       {
-        //kprint_info("THERE WAS A IA32_LSTAR READ!!!");
-        if (vcpu_data->original_lstar)
-        {
-          msr_value = vcpu_data->original_lstar;
-        }
-        else { msr_value = __readmsr(ia32_lstar); }
+        complete_rdmsr(vcpu_data, guest_status, vcpu_data->guest_vmcb.save_state.lstar);
       }
       break;
 
@@ -261,14 +667,34 @@ auto msr_handler(vmcb::pvcpu_ctx_t vcpu_data,
         }
         else
         {
-          uint64_t readmsr_value = __readmsr(ecx_value);
-          guest_status.guest_registers->rax = readmsr_value & 0xffffffff;
-          guest_status.guest_registers->rdx = readmsr_value >> 32 & 0xffffffff;
+          complete_rdmsr(vcpu_data, guest_status, __readmsr(ecx_value));
         }
       }
   }
   
-  vcpu_data->guest_vmcb.save_state.rip = vcpu_data->guest_vmcb.control_area.n_rip;
+  vcpu_data->guest_vmcb.save_state.rip = next_rip(vcpu_data);
+}
+
+//
+// Whether the current #VMEXIT is worth recording, the CR3 set turns away
+// uninteresting processes before any bytecode runs
+//
+
+auto vmexit_traced(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> bool
+{
+  const uint64_t cr3 = vcpu_data->guest_vmcb.save_state.cr3;
+
+  if (!cr3_filter::interesting(cr3)) return false;
+
+  filter::event current = {};
+  current.fields[filter::kind]      = static_cast<uint64_t>(filter::event_kind::vmexit);
+  current.fields[filter::cr3]       = cr3;
+  current.fields[filter::rip]       = vcpu_data->guest_vmcb.save_state.rip;
+  current.fields[filter::exit_code] = vcpu_data->guest_vmcb.control_area.exitcode;
+  current.fields[filter::exitinfo1] = vcpu_data->guest_vmcb.control_area.exitinfo1;
+  current.fields[filter::exitinfo2] = vcpu_data->guest_vmcb.control_area.exitinfo2;
+
+  return filter::accept(filter::hook_point::vmexit, current);
 }
 
 extern "C" auto vmexit_handler(vmcb::pvcpu_ctx_t vcpu_data,
@@ -280,21 +706,33 @@ extern "C" auto vmexit_handler(vmcb::pvcpu_ctx_t vcpu_data,
   
   __svm_vmload(vcpu_data->host_vmcb_pa);
 
+  // Taken before any handler moves RIP along
+  const uint64_t exit_tsc  = __rdtsc();
+  const uint32_t processor = KeGetCurrentProcessorIndex();
+  const uint64_t exit_code = vcpu_data->guest_vmcb.control_area.exitcode;
+  const uint64_t exit_rip  = vcpu_data->guest_vmcb.save_state.rip;
+
+  // Tables published through rcu stay put until this vCPU is back in the
+  // guest, the CR3 set and the filter programs vmexit_traced() reads included
+  rcu::vcpu_state* quiescent = rcu::vcpu(processor);
+  if (quiescent != nullptr) rcu::enter(*quiescent);
+
+  const bool     traced    = vmexit_traced(vcpu_data);
+  const uint64_t qualifier = exit_trace::qualifier_of(exit_code, vcpu_data->guest_vmcb.save_state.rax,
+                                                      guest_regs->rcx);
+
   // I've been stuck on a bug (VMEXIT_INVALID) for not adding this one line.
   // So this happened because the Guest Rax is overrwritten by host value on
   // the execution of #VMEXIT. Guest Rax value is stored on the Guest VMCB instead
   //
   current_guest_status.guest_registers->rax = vcpu_data->guest_vmcb.save_state.rax;
 
-  OriginalKiSystemCallAddress = vcpu_data->original_lstar;
+  // A flush cr3_write_handler asked for is done once the guest ran again
+  vcpu_data->guest_vmcb.control_area.tlb_control = 0;
 
-  //kprint_info("SYSCALLHOOK_INIT\n");
-  int lstar_value = __readmsr(ia32_lstar);
-  if (lstar_value == OriginalKiSystemCallAddress)
-  {
-    //lstar_value = (uint64_t)&MyKiSystemCall64Hook;
-  }
-  __writemsr(ia32_lstar, lstar_value);
+  // Unless every way of dropping translations exits, the guest may have
+  // changed its page tables behind the cache's back
+  if (!guest_tlb_coherent(vcpu_data)) vcpu_data->guest_tlb.flush();
 
   switch (vcpu_data->guest_vmcb.control_area.exitcode)
   {
@@ -323,6 +761,34 @@ extern "C" auto vmexit_handler(vmcb::pvcpu_ctx_t vcpu_data,
       vmmcall_handler(vcpu_data, current_guest_status);
       break;
 
+    case VMEXIT::_CR3_WRITE:
+      cr3_write_handler(vcpu_data, current_guest_status);
+      break;
+
+    case VMEXIT::_CR4_WRITE:
+      cr4_write_handler(vcpu_data, current_guest_status);
+      break;
+
+    case VMEXIT::_INVLPG:
+      invlpg_handler(vcpu_data);
+      break;
+
+    case VMEXIT::_INVPCID:
+      invpcid_handler(vcpu_data);
+      break;
+
+    case VMEXIT::_EXCP6_WRITE:
+      ud_handler(vcpu_data, current_guest_status);
+      break;
+
+    case VMEXIT::_RDTSC:
+      rdtsc_handler(vcpu_data, current_guest_status, false);
+      break;
+
+    case VMEXIT::_RDTSCP:
+      rdtsc_handler(vcpu_data, current_guest_status, true);
+      break;
+
     case VMEXIT::_INVALID:
       vmexit_invalid_dump(__func__, vcpu_data);
       break;
@@ -331,16 +797,51 @@ extern "C" auto vmexit_handler(vmcb::pvcpu_ctx_t vcpu_data,
       __debugbreak();
   }
 
+  const uint64_t exit_cycles = __rdtsc() - exit_tsc;
+
+  if (telemetry::vcpu_stats* stats = telemetry::vcpu(processor))
+  {
+    telemetry::record_exit(*stats, exit_code, exit_rip, traced, exit_tsc, exit_cycles);
+  }
+
+  if (traced)
+  {
+    exit_trace::exit_record current;
+
+    current.tsc       = exit_tsc;
+    current.rip       = exit_rip;
+    current.cr3       = vcpu_data->guest_vmcb.save_state.cr3;
+    current.exit_code = exit_code;
+    current.exitinfo1 = vcpu_data->guest_vmcb.control_area.exitinfo1;
+    current.exitinfo2 = vcpu_data->guest_vmcb.control_area.exitinfo2;
+    current.qualifier = qualifier;
+    current.cycles    = exit_trace::saturate(exit_cycles);
+    current.reserved  = 0;
+
+    exit_trace::record(processor, current);
+  }
+
   if (current_guest_status.vmexit_status == true)
   {
-    current_guest_status.guest_registers->rax = reinterpret_cast<uint64_t>(vcpu_data) & 0xffffffff;
-    current_guest_status.guest_registers->rbx = vcpu_data->guest_vmcb.control_area.n_rip;
+    // devirt_processor() finds its vCPU through vcpu_table, nothing of it is
+    // handed back in the CPUID registers
+    current_guest_status.guest_registers->rax = 0;
+    // cpuid_handler() already stepped over the CPUID
+    current_guest_status.guest_registers->rbx = vcpu_data->guest_vmcb.save_state.rip;
     current_guest_status.guest_registers->rcx = vcpu_data->guest_vmcb.save_state.rsp;
-    current_guest_status.guest_registers->rdx = reinterpret_cast<uint64_t>(vcpu_data) & 0xffffffff;
+    current_guest_status.guest_registers->rdx = 0;
 
     // Load back the guest state back in the processor
     __svm_vmload(vcpu_data->guest_vmcb_pa);
 
+    // #VMEXIT put the host's control registers back, the CR3 of the process
+    // that virtualized this processor. The devirt IPI lands in whatever
+    // thread was running here, svm_terminate has to resume it in its own
+    // address space.
+    __writecr0(vcpu_data->guest_vmcb.save_state.cr0);
+    __writecr4(vcpu_data->guest_vmcb.save_state.cr4);
+    __writecr3(vcpu_data->guest_vmcb.save_state.cr3);
+
     // Disable interrupts than set the GIF (global interrupt flag)
     _disable();
     // https://docs.microsoft.com/en-us/cpp/intrinsics/svm-stgi?view=msvc-160
@@ -351,12 +852,30 @@ extern "C" auto vmexit_handler(vmcb::pvcpu_ctx_t vcpu_data,
     __writemsr(ia32_efer, __readmsr(ia32_efer) & ~(1 << 12));
     __writeeflags(vcpu_data->guest_vmcb.save_state.rflags);
 
+    // Gone for good, nothing to wait for on this processor any more
+    if (quiescent != nullptr) rcu::leave(*quiescent);
+
     return current_guest_status.vmexit_status;
   }
 
+  // Profile switch asked for through set_intercept_profile, the guest isn't
+  // running on the VMCB until the VMRUN after this
+  intercept_profile::id next_profile = {};
+
+  if (intercept_profile::vcpu_state* profile = intercept_profile::vcpu(processor);
+      profile != nullptr && intercept_profile::take_pending(*profile, next_profile))
+  {
+    vmcb::install_intercepts(vcpu_data, intercept_profile::installable(next_profile));
+  }
+
+  // Work posted from root mode gets its worker woken through the guest
+  deferred::doorbell(vcpu_data->guest_vmcb.save_state.rflags);
+
   // Save guest rax since it'll be overwritten by host memory
   guest_regs->rax = vcpu_data->guest_vmcb.save_state.rax;
 
+  if (quiescent != nullptr) rcu::leave(*quiescent);
+
   return current_guest_status.vmexit_status;
 }
 
@@ -372,7 +891,7 @@ auto inject_gp(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void
   event.type   = 3;
   event.err_val  = 1;
   event.valid    = 1;
-  event.err_code = 1;
+  event.err_code = 0;
   
   vcpu_data->guest_vmcb.control_area.eventinj = event.value;
 }
@@ -383,9 +902,9 @@ auto inject_ud(vmcb::pvcpu_ctx_t vcpu_data) noexcept -> void
   event_injection event;
   event.vector = 6;
   event.type   = 3;
-  event.err_val  = 1;
+  event.err_val  = 0;   // #UD pushes no error code
   event.valid    = 1;
-  event.err_code = 1;
+  event.err_code = 0;
   
   vcpu_data->guest_vmcb.control_area.eventinj = event.value;
 }
@@ -0,0 +1,270 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "dashboard.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <syscall_stats.hpp>
+
+namespace ktop
+{
+  namespace
+  {
+    // Counters only grow, a smaller value means the driver was reloaded in between
+    auto delta(const uint64_t before, const uint64_t after) noexcept -> uint64_t
+    {
+      return after >= before ? after - before : 0;
+    }
+
+    auto percent(const double part, const double whole) noexcept -> double
+    {
+      return whole > 0.0 ? part * 100.0 / whole : 0.0;
+    }
+
+    auto syscall_row(const telemetry::header* stats, const uint32_t cpu, const uint32_t slot) noexcept
+      -> const hk::stats::syscall_row*
+    {
+      return reinterpret_cast<const hk::stats::syscall_row*>(
+        reinterpret_cast<uintptr_t>(stats) + stats->syscall_offset +
+        (static_cast<size_t>(cpu) * stats->syscall_slots + slot) * stats->syscall_row_size);
+    }
+
+    // The rows are optional, only trust them when they fit the section
+    auto has_syscalls(const telemetry::header* stats) noexcept -> bool
+    {
+      if (stats->syscall_offset == 0 || stats->syscall_slots == 0) return false;
+      if (stats->syscall_row_size != sizeof(hk::stats::syscall_row)) return false;
+
+      const uint64_t bytes = static_cast<uint64_t>(stats->syscall_cpu_count) *
+                             stats->syscall_slots * stats->syscall_row_size;
+
+      return stats->syscall_offset <= stats->total_size && bytes <= stats->total_size - stats->syscall_offset;
+    }
+
+    struct ranked
+    {
+      uint64_t key;
+      uint64_t count;
+      uint64_t cycles;
+    };
+
+    auto take_top(std::vector<ranked>& rows, const uint32_t count) -> void
+    {
+      const auto by_weight = [](const ranked& left, const ranked& right)
+      {
+        return left.cycles != right.cycles ? left.cycles > right.cycles : left.count > right.count;
+      };
+
+      const size_t keep = std::min<size_t>(rows.size(), count);
+
+      std::partial_sort(rows.begin(), rows.begin() + keep, rows.end(), by_weight);
+      rows.resize(keep);
+    }
+  }
+
+  auto render(const snapshot& previous, const snapshot& current,
+              const view_options& options, FILE* out) -> bool
+  {
+    const telemetry::header* before = previous.stats();
+    const telemetry::header* after  = current.stats();
+
+    if (before == nullptr || after == nullptr) return false;
+    if (before->vcpu_count != after->vcpu_count || before->tsc_frequency != after->tsc_frequency) return false;
+    if (current.timestamp_ns <= previous.timestamp_ns) return false;
+
+    const double seconds    = static_cast<double>(current.timestamp_ns - previous.timestamp_ns) / 1e9;
+    const double core_ticks = static_cast<double>(after->tsc_frequency) * seconds;
+
+    uint64_t exits_total  = 0;
+    uint64_t cycles_total = 0;
+
+    std::vector<uint64_t> reason_count (telemetry::exit_buckets);
+    std::vector<uint64_t> reason_cycles(telemetry::exit_buckets);
+
+    for (uint32_t cpu = 0; cpu < after->vcpu_count; ++cpu)
+    {
+      const telemetry::vcpu_stats* old_block = telemetry::vcpu_block(before, cpu);
+      const telemetry::vcpu_stats* new_block = telemetry::vcpu_block(after, cpu);
+
+      exits_total  += delta(old_block->exits, new_block->exits);
+      cycles_total += delta(old_block->root_cycles, new_block->root_cycles);
+
+      for (uint32_t bucket = 0; bucket < telemetry::exit_buckets; ++bucket)
+      {
+        reason_count [bucket] += delta(old_block->exit_count [bucket], new_block->exit_count [bucket]);
+        reason_cycles[bucket] += delta(old_block->exit_cycles[bucket], new_block->exit_cycles[bucket]);
+      }
+    }
+
+    if (options.clear_screen) fputs("\x1b[H\x1b[2J", out);
+
+    fprintf(out, "krakentop  %u vcpus  TSC %.2f GHz  interval %.2f s  exits %.0f/s  root %.2f%%\n\n",
+            after->vcpu_count, static_cast<double>(after->tsc_frequency) / 1e9, seconds,
+            static_cast<double>(exits_total) / seconds,
+            percent(static_cast<double>(cycles_total), core_ticks * after->vcpu_count));
+
+    //
+    // Per core
+    //
+
+    char name[24];
+
+    fprintf(out, " CPU      exits/s   root%%   traced/s  top reasons\n");
+
+    for (uint32_t cpu = 0; cpu < after->vcpu_count; ++cpu)
+    {
+      const telemetry::vcpu_stats* old_block = telemetry::vcpu_block(before, cpu);
+      const telemetry::vcpu_stats* new_block = telemetry::vcpu_block(after, cpu);
+
+      const uint64_t exits = delta(old_block->exits, new_block->exits);
+
+      fprintf(out, "%4u %12.0f  %5.1f%% %10.0f ", cpu,
+              static_cast<double>(exits) / seconds,
+              percent(static_cast<double>(delta(old_block->root_cycles, new_block->root_cycles)), core_ticks),
+              static_cast<double>(delta(old_block->traced_exits, new_block->traced_exits)) / seconds);
+
+      std::vector<ranked> reasons;
+
+      for (uint32_t bucket = 0; bucket < telemetry::exit_buckets; ++bucket)
+      {
+        const uint64_t count = delta(old_block->exit_count[bucket], new_block->exit_count[bucket]);
+        if (count != 0) reasons.push_back({ bucket, count, count });
+      }
+
+      take_top(reasons, options.core_reasons);
+
+      for (const ranked& reason : reasons)
+      {
+        fprintf(out, " %s %.0f%%", telemetry::exit_name(static_cast<uint32_t>(reason.key), name),
+                percent(static_cast<double>(reason.count), static_cast<double>(exits)));
+      }
+
+      fputc('\n', out);
+    }
+
+    //
+    // Exit reasons over every core, by time spent handling them
+    //
+
+    std::vector<ranked> reasons;
+
+    for (uint32_t bucket = 0; bucket < telemetry::exit_buckets; ++bucket)
+    {
+      if (reason_count[bucket] != 0) reasons.push_back({ bucket, reason_count[bucket], reason_cycles[bucket] });
+    }
+
+    take_top(reasons, options.top_count);
+
+    fprintf(out, "\n REASON                    exits/s  cycles/exit   root%%\n");
+
+    for (const ranked& reason : reasons)
+    {
+      fprintf(out, " %-20s %12.0f %12.0f  %5.2f%%\n", telemetry::exit_name(static_cast<uint32_t>(reason.key), name),
+              static_cast<double>(reason.count) / seconds,
+              static_cast<double>(reason.cycles) / static_cast<double>(reason.count),
+              percent(static_cast<double>(reason.cycles), core_ticks * after->vcpu_count));
+    }
+
+    //
+    // Hot RIPs. The per-core summaries are estimates rather than counters, so
+    // they're merged as they stand instead of differenced.
+    //
+
+    std::vector<ranked> rips;
+
+    for (uint32_t cpu = 0; cpu < after->vcpu_count; ++cpu)
+    {
+      const telemetry::vcpu_stats* block = telemetry::vcpu_block(after, cpu);
+
+      for (const telemetry::rip_entry& entry : block->hot_rips)
+      {
+        if (entry.count == 0) continue;
+
+        const auto found = std::find_if(rips.begin(), rips.end(),
+                                        [&entry](const ranked& row) { return row.key == entry.rip; });
+
+        if (found != rips.end()) found->count += entry.count, found->cycles += entry.count;
+        else                     rips.push_back({ entry.rip, entry.count, entry.count });
+      }
+    }
+
+    take_top(rips, options.top_count);
+
+    fprintf(out, "\n RIP                     weight\n");
+
+    for (const ranked& rip : rips)
+    {
+      fprintf(out, " %016llx %13llu\n", static_cast<unsigned long long>(rip.key),
+              static_cast<unsigned long long>(rip.count));
+    }
+
+    //
+    // Syscalls, summed over the per-CPU rows
+    //
+
+    if (!has_syscalls(before) || !has_syscalls(after) ||
+        before->syscall_slots != after->syscall_slots || before->syscall_cpu_count != after->syscall_cpu_count)
+    {
+      fprintf(out, "\n syscall profiling is off\n");
+      return true;
+    }
+
+    std::vector<ranked> syscalls;
+    uint64_t            syscalls_total = 0;
+
+    for (uint32_t slot = 0; slot < after->syscall_slots; ++slot)
+    {
+      uint64_t count = 0;
+
+      for (uint32_t cpu = 0; cpu < after->syscall_cpu_count; ++cpu)
+      {
+        count += delta(syscall_row(before, cpu, slot)->count, syscall_row(after, cpu, slot)->count);
+      }
+
+      syscalls_total += count;
+      if (count != 0) syscalls.push_back({ slot, count, count });
+    }
+
+    take_top(syscalls, options.top_count);
+
+    fprintf(out, "\n SYSCALL                calls/s   share\n");
+
+    for (const ranked& syscall : syscalls)
+    {
+      const uint32_t slot   = static_cast<uint32_t>(syscall.key);
+      const bool     win32k = slot >= after->syscall_nt_slots;
+
+      fprintf(out, " %-7s %#06x %15.0f  %5.1f%%\n", win32k ? "win32k" : "nt",
+              win32k ? slot - after->syscall_nt_slots : slot,
+              static_cast<double>(syscall.count) / seconds,
+              percent(static_cast<double>(syscall.count), static_cast<double>(syscalls_total)));
+    }
+
+    return true;
+  }
+
+}; // namespace ktop
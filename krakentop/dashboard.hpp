@@ -0,0 +1,51 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "snapshot_source.hpp"
+
+//
+// Turns two snapshots into one screen: rates come from the counter deltas,
+// so a refresh costs a copy of the section and nothing on the driver side
+//
+
+namespace ktop
+{
+  struct view_options
+  {
+    uint32_t top_count     = 10;   // rows in the reason, RIP and syscall tables
+    uint32_t core_reasons  = 3;    // reasons listed next to every core
+    bool     clear_screen  = true;
+  };
+
+  // false when either snapshot doesn't validate or they come from different loads
+  auto render(const snapshot& previous, const snapshot& current,
+              const view_options& options, FILE* out) -> bool;
+
+}; // namespace ktop
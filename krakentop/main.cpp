@@ -0,0 +1,160 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+//
+// krakentop, a live view of the hypervisor's telemetry
+//
+//   krakentop                          live, from \\.\KrakenSvm
+//   krakentop --record dump.ktop       live, and keep every snapshot
+//   krakentop --replay dump.ktop       play a recorded dump back
+//
+// Only the replay backend needs nothing from Windows, off Windows that's what
+// the host CMake build (krakentop/CMakeLists.txt) gives you.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "snapshot_source.hpp"
+#include "dashboard.hpp"
+
+namespace
+{
+  struct arguments
+  {
+    const char*       replay      = nullptr;
+    const char*       record      = nullptr;
+    uint32_t          interval_ms = 1000;
+    uint32_t          count       = 0;       // refreshes before exiting, 0 runs until the source ends
+    bool              fast        = false;   // replay without waiting out the recorded gaps
+    ktop::view_options view;
+  };
+
+  auto usage() -> int
+  {
+    fputs("usage: krakentop [--replay <dump>] [--record <dump>] [--interval <ms>]\n"
+          "                 [--count <n>] [--top <n>] [--fast] [--plain]\n", stderr);
+    return 2;
+  }
+
+  auto parse(const int argc, char** argv, arguments& out) -> bool
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const char* option = argv[i];
+      const char* value  = i + 1 < argc ? argv[i + 1] : nullptr;
+
+      if      (!strcmp(option, "--fast"))  out.fast              = true;
+      else if (!strcmp(option, "--plain")) out.view.clear_screen = false;
+      else if (value == nullptr)           return false;
+      else if (!strcmp(option, "--replay"))   out.replay      = value, ++i;
+      else if (!strcmp(option, "--record"))   out.record      = value, ++i;
+      else if (!strcmp(option, "--interval")) out.interval_ms = static_cast<uint32_t>(strtoul(value, nullptr, 0)), ++i;
+      else if (!strcmp(option, "--count"))    out.count       = static_cast<uint32_t>(strtoul(value, nullptr, 0)), ++i;
+      else if (!strcmp(option, "--top"))      out.view.top_count = static_cast<uint32_t>(strtoul(value, nullptr, 0)), ++i;
+      else                                    return false;
+    }
+
+    return out.interval_ms != 0;
+  }
+}
+
+auto main(int argc, char** argv) -> int
+{
+  arguments args;
+  if (!parse(argc, argv, args)) return usage();
+
+  std::unique_ptr<ktop::source> source = args.replay ? ktop::open_replay(args.replay) : ktop::open_device();
+
+  if (source == nullptr)
+  {
+    if (args.replay) fprintf(stderr, "krakentop: %s isn't a krakentop dump\n", args.replay);
+    else             fputs("krakentop: can't map the telemetry of \\\\.\\KrakenSvm, is the driver loaded?\n", stderr);
+    return 1;
+  }
+
+  std::unique_ptr<ktop::recorder> recorder;
+
+  if (args.record)
+  {
+    recorder = std::make_unique<ktop::recorder>(args.record);
+
+    if (!recorder->ok())
+    {
+      fprintf(stderr, "krakentop: can't create %s\n", args.record);
+      return 1;
+    }
+  }
+
+#if defined(_WIN32)
+  if (args.view.clear_screen)
+  {
+    const HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD        mode    = 0;
+
+    if (GetConsoleMode(console, &mode)) SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+  }
+#endif
+
+  ktop::snapshot previous;
+  ktop::snapshot current;
+  uint32_t       shown = 0;
+
+  while (source->next(current))
+  {
+    if (recorder && !recorder->write(current))
+    {
+      fprintf(stderr, "krakentop: writing %s failed\n", args.record);
+      return 1;
+    }
+
+    if (!previous.bytes.empty())
+    {
+      if (!source->live() && !args.fast && current.timestamp_ns > previous.timestamp_ns)
+      {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(current.timestamp_ns - previous.timestamp_ns));
+      }
+
+      // A frame that doesn't line up with the last one (reload, torn dump) only restarts the deltas
+      if (ktop::render(previous, current, args.view, stdout)) ++shown;
+      fflush(stdout);
+    }
+
+    std::swap(previous, current);
+
+    if (args.count != 0 && shown >= args.count) break;
+    if (source->live()) std::this_thread::sleep_for(std::chrono::milliseconds(args.interval_ms));
+  }
+
+  return 0;
+}
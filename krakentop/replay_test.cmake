@@ -0,0 +1,34 @@
+#
+# Replays the dump sample_dump writes through krakentop and checks what it
+# shows. Every line below has to be in the output.
+#
+
+execute_process(COMMAND ${SAMPLE_DUMP} ${DUMP} RESULT_VARIABLE status)
+
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "sample_dump failed: ${status}")
+endif()
+
+execute_process(COMMAND ${KRAKENTOP} --replay ${DUMP} --plain --fast --count 1
+                RESULT_VARIABLE status OUTPUT_VARIABLE output ERROR_VARIABLE errors)
+
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "krakentop failed: ${status}\n${errors}")
+endif()
+
+set(expected
+  "krakentop  2 vcpus  TSC 2\\.00 GHz  interval 1\\.00 s  exits 1750/s  root 0\\.15%"
+  "\n +0 +1500 +0\\.2% +0 +CR3_WRITE 67% EXCP14 33%\n"
+  "\n +1 +250 +0\\.1% +250 +NPF 100%\n"
+  "\n CR3_WRITE +1000 +2000  +0\\.05%\n"
+  "\n EXCP14 +500 +4000  +0\\.05%\n"
+  "\n NPF +250 +8000  +0\\.05%\n"
+  "\n fffff80000001000 +250\n"
+  "\n nt +0x0012 +300  +75\\.0%\n"
+  "\n win32k +0x0002 +100  +25\\.0%\n")
+
+foreach(line IN LISTS expected)
+  if(NOT output MATCHES "${line}")
+    message(FATAL_ERROR "krakentop output lacks \"${line}\":\n${output}")
+  endif()
+endforeach()
@@ -0,0 +1,136 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+//
+// Writes a small krakentop dump with known contents, what the host build
+// replays krakentop against:
+//
+//   sample_dump out.ktop
+//
+// Two frames one second apart over two vCPUs. In between, vCPU 0 takes
+// 1000 CR3 writes at 2000 cycles and 500 #PFs at 4000 cycles, vCPU 1 takes
+// 250 nested page faults at 8000 cycles from one RIP, and the syscall rows
+// count 300 calls of nt 0x12 and 100 of win32k 0x2.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#include <syscall_stats.hpp>
+
+#include "snapshot_source.hpp"
+
+namespace
+{
+  constexpr uint32_t vcpu_count    = 2;
+  constexpr uint32_t nt_slots      = 32;
+  constexpr uint32_t win32k_slots  = 8;
+  constexpr uint64_t tsc_frequency = 2'000'000'000;
+
+  constexpr uint64_t hot_rip       = 0xfffff80000001000;
+
+  struct section
+  {
+    size_t   size;
+    uint8_t* bytes;
+
+    section() : size(telemetry::section_size(vcpu_count,
+                                             hk::stats::per_cpu_table::storage_size(vcpu_count, nt_slots + win32k_slots)))
+    {
+      bytes = static_cast<uint8_t*>(operator new(size, std::align_val_t{ 0x1000 }));
+      memset(bytes, 0, size);
+
+      auto* stats = reinterpret_cast<telemetry::header*>(bytes);
+
+      stats->magic             = telemetry::section_magic;
+      stats->version           = telemetry::section_version;
+      stats->total_size        = size;
+      stats->tsc_frequency     = tsc_frequency;
+      stats->vcpu_count        = vcpu_count;
+      stats->vcpu_stride       = sizeof(telemetry::vcpu_stats);
+      stats->vcpu_offset       = telemetry::vcpu_offset();
+      stats->syscall_offset    = telemetry::syscall_offset(vcpu_count);
+      stats->syscall_cpu_count = vcpu_count;
+      stats->syscall_slots     = nt_slots + win32k_slots;
+      stats->syscall_nt_slots  = nt_slots;
+      stats->syscall_row_size  = sizeof(hk::stats::syscall_row);
+    }
+
+    ~section() { operator delete(bytes, std::align_val_t{ 0x1000 }); }
+
+    auto vcpu(const uint32_t index) -> telemetry::vcpu_stats&
+    {
+      return *telemetry::vcpu_block(reinterpret_cast<telemetry::header*>(bytes), index);
+    }
+
+    auto syscall(const uint32_t cpu, const uint32_t slot) -> hk::stats::syscall_row&
+    {
+      auto* rows = reinterpret_cast<hk::stats::syscall_row*>(bytes + telemetry::syscall_offset(vcpu_count));
+      return rows[cpu * (nt_slots + win32k_slots) + slot];
+    }
+
+    auto frame(const uint64_t timestamp_ns) const -> ktop::snapshot
+    {
+      ktop::snapshot current;
+
+      current.timestamp_ns = timestamp_ns;
+      current.bytes.assign(bytes, bytes + size);
+      return current;
+    }
+  };
+}
+
+auto main(int argc, char** argv) -> int
+{
+  if (argc != 2)
+  {
+    fputs("usage: sample_dump <dump>\n", stderr);
+    return 1;
+  }
+
+  ktop::recorder recorder(argv[1]);
+  section        telemetry_section;
+
+  bool written = recorder.ok() && recorder.write(telemetry_section.frame(1'000'000'000));
+
+  for (uint32_t i = 0; i < 1000; ++i) telemetry::record_exit(telemetry_section.vcpu(0), 0x013, 0, false, i, 2000);
+  for (uint32_t i = 0; i < 500; ++i)  telemetry::record_exit(telemetry_section.vcpu(0), 0x04e, 0, false, i, 4000);
+  for (uint32_t i = 0; i < 250; ++i)  telemetry::record_exit(telemetry_section.vcpu(1), 0x400, hot_rip, true, i, 8000);
+
+  telemetry_section.syscall(0, 0x12).count           = 300;
+  telemetry_section.syscall(1, nt_slots + 0x2).count = 100;
+
+  written = written && recorder.write(telemetry_section.frame(2'000'000'000));
+
+  if (!written)
+  {
+    fprintf(stderr, "sample_dump: writing %s failed\n", argv[1]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,183 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "snapshot_source.hpp"
+
+#include <string.h>
+#include <chrono>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace ktop
+{
+  namespace
+  {
+#if defined(_WIN32)
+    auto now_ns() noexcept -> uint64_t
+    {
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    class device_source final : public source
+    {
+    public:
+      device_source(HANDLE device, const void* view, const size_t size) noexcept
+        : device_(device), view_(view), size_(size) {}
+
+      // Closing the handle is what unmaps the view, see device_cleanup()
+      ~device_source() override { CloseHandle(device_); }
+
+      auto next(snapshot& out) -> bool override
+      {
+        const auto* current = telemetry::validate(view_, size_);
+        if (current == nullptr) return false;
+
+        out.timestamp_ns = now_ns();
+        out.bytes.resize(static_cast<size_t>(current->total_size));
+        memcpy(out.bytes.data(), view_, out.bytes.size());
+
+        return true;
+      }
+
+      auto live() const noexcept -> bool override { return true; }
+
+    private:
+      HANDLE      device_;
+      const void* view_;
+      size_t      size_;
+    };
+#endif
+
+    class replay_source final : public source
+    {
+    public:
+      explicit replay_source(FILE* file) noexcept : file_(file) {}
+      ~replay_source() override { fclose(file_); }
+
+      auto next(snapshot& out) -> bool override
+      {
+        frame_header frame{};
+
+        if (fread(&frame, sizeof(frame), 1, file_) != 1)  return false;
+        if (frame.size < sizeof(telemetry::header) || frame.size > max_frame) return false;
+
+        out.timestamp_ns = frame.timestamp_ns;
+        out.bytes.resize(static_cast<size_t>(frame.size));
+
+        return fread(out.bytes.data(), 1, out.bytes.size(), file_) == out.bytes.size();
+      }
+
+      auto live() const noexcept -> bool override { return false; }
+
+    private:
+      FILE* file_;
+    };
+  }
+
+  auto open_device() -> std::unique_ptr<source>
+  {
+#if defined(_WIN32)
+    const HANDLE device = CreateFileW(L"\\\\.\\KrakenSvm", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                      nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (device == INVALID_HANDLE_VALUE) return nullptr;
+
+    telemetry::mapping view{};
+    DWORD              returned = 0;
+
+    if (!DeviceIoControl(device, telemetry::ioctl_map_telemetry, nullptr, 0,
+                         &view, sizeof(view), &returned, nullptr) || returned != sizeof(view))
+    {
+      CloseHandle(device);
+      return nullptr;
+    }
+
+    const auto* address = reinterpret_cast<const void*>(static_cast<uintptr_t>(view.address));
+
+    if (telemetry::validate(address, static_cast<size_t>(view.size)) == nullptr)
+    {
+      CloseHandle(device);
+      return nullptr;
+    }
+
+    return std::make_unique<device_source>(device, address, static_cast<size_t>(view.size));
+#else
+    return nullptr;
+#endif
+  }
+
+  auto open_replay(const char* path) -> std::unique_ptr<source>
+  {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) return nullptr;
+
+    dump_header header{};
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != dump_magic || header.version != dump_version)
+    {
+      fclose(file);
+      return nullptr;
+    }
+
+    return std::make_unique<replay_source>(file);
+  }
+
+  recorder::recorder(const char* path)
+  {
+    file_ = fopen(path, "wb");
+    if (file_ == nullptr) return;
+
+    const dump_header header{ dump_magic, dump_version };
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1)
+    {
+      fclose(file_);
+      file_ = nullptr;
+    }
+  }
+
+  recorder::~recorder()
+  {
+    if (file_ != nullptr) fclose(file_);
+  }
+
+  auto recorder::write(const snapshot& current) -> bool
+  {
+    if (file_ == nullptr) return false;
+
+    const frame_header frame{ current.timestamp_ns, current.bytes.size() };
+
+    if (fwrite(&frame, sizeof(frame), 1, file_) != 1) return false;
+    if (fwrite(current.bytes.data(), 1, current.bytes.size(), file_) != current.bytes.size()) return false;
+
+    return fflush(file_) == 0;
+  }
+
+}; // namespace ktop
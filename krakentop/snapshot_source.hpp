@@ -0,0 +1,109 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <memory>
+#include <vector>
+
+#include <telemetry.hpp>
+
+//
+// Where krakentop gets its telemetry from
+//
+// Live: the section the driver shares through \\.\KrakenSvm, copied out once per
+// refresh. Replay: a dump file written by recorder, which is the same copies
+// back to back, so a dump taken on the target can be viewed anywhere.
+//
+// Dump file: dump_header, then one frame_header plus frame_header::size bytes of
+// section per snapshot.
+//
+
+namespace ktop
+{
+  constexpr uint32_t dump_magic   = 0x504f544b; // "KTOP"
+  constexpr uint32_t dump_version = 1;
+
+  // A frame bigger than this is taken as a corrupt dump
+  constexpr uint64_t max_frame    = 256ull << 20;
+
+  struct dump_header
+  {
+    uint32_t magic;
+    uint32_t version;
+  };
+
+  struct frame_header
+  {
+    uint64_t timestamp_ns;       // steady clock of the machine that took it
+    uint64_t size;
+  };
+
+  struct snapshot
+  {
+    uint64_t             timestamp_ns = 0;
+    std::vector<uint8_t> bytes;
+
+    auto stats() const noexcept -> const telemetry::header*
+    {
+      return telemetry::validate(bytes.data(), bytes.size());
+    }
+  };
+
+  class source
+  {
+  public:
+    virtual ~source() = default;
+
+    // Takes the next snapshot, false once the source ran dry or went away
+    virtual auto next(snapshot& out) -> bool = 0;
+
+    // Live sources are paced by the caller, replay follows the recorded timestamps
+    virtual auto live() const noexcept -> bool = 0;
+  };
+
+  // nullptr if the driver isn't loaded, or off Windows
+  auto open_device() -> std::unique_ptr<source>;
+  auto open_replay(const char* path) -> std::unique_ptr<source>;
+
+  class recorder
+  {
+  public:
+    explicit recorder(const char* path);
+    ~recorder();
+
+    recorder(const recorder&)            = delete;
+    recorder& operator=(const recorder&) = delete;
+
+    auto ok() const noexcept -> bool { return file_ != nullptr; }
+    auto write(const snapshot& current) -> bool;
+
+  private:
+    FILE* file_ = nullptr;
+  };
+
+}; // namespace ktop
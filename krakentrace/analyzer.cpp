@@ -0,0 +1,318 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "analyzer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace trace::analysis
+{
+  namespace
+  {
+    constexpr uint32_t bucket_ioio    = 0x7b;
+    constexpr uint32_t bucket_msr     = static_cast<uint32_t>(exit_trace::exit_msr);
+    constexpr uint32_t bucket_cpuid   = static_cast<uint32_t>(exit_trace::exit_cpuid);
+    constexpr uint32_t bucket_vmrun   = 0x80;
+    constexpr uint32_t bucket_vmmcall = 0x81;
+    constexpr uint32_t bucket_vmload  = 0x82;
+    constexpr uint32_t bucket_vmsave  = 0x83;
+
+    // Leaves cpuid_handler changes, the rest it only replays
+    constexpr uint32_t answered_leaves[] = { 0x00000001, 0x40000000, 0x40000001, 0x41414141 };
+
+    auto describe(const source_key& key, char (&text)[48]) -> const char*
+    {
+      char name[24];
+      const char* exit = telemetry::exit_name(key.bucket, name);
+
+      if (key.bucket == bucket_msr)
+      {
+        snprintf(text, sizeof(text), "MSR %08llx %s", static_cast<unsigned long long>(key.qualifier),
+                 key.access == intercept_policy::access_write ? "write" : "read");
+      }
+      else if (key.bucket == bucket_cpuid)
+      {
+        snprintf(text, sizeof(text), "CPUID %08llx.%llx", static_cast<unsigned long long>(key.qualifier & 0xffffffff),
+                 static_cast<unsigned long long>(key.qualifier >> 32));
+      }
+      else if (key.bucket == bucket_ioio)
+      {
+        snprintf(text, sizeof(text), "IOIO port %04llx", static_cast<unsigned long long>(key.qualifier));
+      }
+      else
+      {
+        snprintf(text, sizeof(text), "%s", exit);
+      }
+
+      return text;
+    }
+  }
+
+  auto key_of(const exit_record& record) noexcept -> source_key
+  {
+    const uint32_t bucket = telemetry::bucket_of(record.exit_code);
+
+    // EXITINFO1 is 1 for WRMSR and 0 for RDMSR, the port sits in its upper half for IOIO
+    if (bucket == bucket_msr)
+    {
+      return { bucket, record.exitinfo1 & 1 ? intercept_policy::access_write : intercept_policy::access_read,
+               record.qualifier & 0xffffffff };
+    }
+
+    if (bucket == bucket_cpuid) return { bucket, 0, record.qualifier };
+    if (bucket == bucket_ioio)  return { bucket, 0, (record.exitinfo1 >> 16) & 0xffff };
+
+    // Whatever lands in "other" is told apart by its exit code
+    if (bucket == telemetry::bucket_other) return { bucket, 0, record.exit_code };
+
+    return { bucket, 0, 0 };
+  }
+
+  auto profile::add(const exit_record& record) -> void
+  {
+    source_stats& source = sources[key_of(record)];
+
+    ++source.exits;
+    source.cycles += record.cycles;
+    ++source.rips[record.rip];
+
+    ++exits;
+    cycles   += record.cycles;
+    first_tsc = std::min(first_tsc, record.tsc);
+    last_tsc  = std::max(last_tsc, record.tsc);
+  }
+
+  auto profile::merge(profile&& other) -> void
+  {
+    exits    += other.exits;
+    cycles   += other.cycles;
+    first_tsc = std::min(first_tsc, other.first_tsc);
+    last_tsc  = std::max(last_tsc, other.last_tsc);
+
+    for (auto& [key, theirs] : other.sources)
+    {
+      source_stats& ours = sources[key];
+
+      ours.exits  += theirs.exits;
+      ours.cycles += theirs.cycles;
+
+      if (ours.rips.empty()) ours.rips = std::move(theirs.rips);
+      else for (const auto& [rip, count] : theirs.rips) ours.rips[rip] += count;
+    }
+  }
+
+  //
+  // Chunks decode independently, so threads just take the next one off a
+  // shared counter and keep their own profile until the end
+  //
+
+  auto build_profile(const reader& in, uint32_t thread_count, profile& out) -> bool
+  {
+    const std::vector<index_entry>& chunks = in.chunks();
+
+    thread_count = std::max<uint32_t>(1, std::min<uint32_t>(thread_count, static_cast<uint32_t>(chunks.size())));
+
+    std::vector<profile>     partial(thread_count);
+    std::vector<std::thread> threads;
+    std::atomic<size_t>      next_chunk = 0;
+    std::atomic<bool>        corrupt    = false;
+
+    for (uint32_t worker = 0; worker < thread_count; ++worker)
+    {
+      threads.emplace_back([&, worker]
+      {
+        auto state = std::make_unique<codec_state>();
+
+        for (size_t chunk = next_chunk++; chunk < chunks.size() && !corrupt; chunk = next_chunk++)
+        {
+          const bool decoded = in.decode(chunks[chunk], *state, [&](uint32_t, const exit_record& record)
+          {
+            partial[worker].add(record);
+          });
+
+          if (!decoded) corrupt = true;
+        }
+      });
+    }
+
+    for (std::thread& thread : threads) thread.join();
+
+    for (profile& part : partial) out.merge(std::move(part));
+    return !corrupt;
+  }
+
+  auto classify(const source_key& key) noexcept -> finding
+  {
+    if (key.bucket == bucket_msr)
+    {
+      const uint32_t msr = static_cast<uint32_t>(key.qualifier);
+
+      if (intercept_policy::msrpm_bit(msr) < 0)          return { verdict::fixed, "outside the permission map, always intercepted" };
+      if (intercept_policy::handled(msr, key.access))    return { verdict::keep,  "msr_handler has a case for it" };
+
+      return { verdict::drop, "only msr_handler's default branch, which replays it" };
+    }
+
+    if (key.bucket == bucket_cpuid)
+    {
+      const uint32_t leaf = static_cast<uint32_t>(key.qualifier);
+
+      for (const uint32_t answered : answered_leaves)
+      {
+        if (leaf == answered) return { verdict::keep, "cpuid_handler answers this leaf" };
+      }
+
+      return { verdict::fixed, "replayed, but CPUID is intercepted as a whole" };
+    }
+
+    if (key.bucket == bucket_vmrun)   return { verdict::fixed, "VMRUN is always intercepted" };
+    if (key.bucket == bucket_vmmcall) return { verdict::keep,  "the hypercall interface" };
+
+    if (key.bucket == bucket_vmload || key.bucket == bucket_vmsave)
+    {
+      return { verdict::fixed, "nested SVM is refused with #GP" };
+    }
+
+    return { verdict::fixed, "not part of the default intercepts, look at what enabled it" };
+  }
+
+  auto propose(const profile& current) -> std::vector<intercept_policy::rule>
+  {
+    std::vector<intercept_policy::rule> rules;
+
+    for (const auto& [key, stats] : current.sources)
+    {
+      if (key.bucket != bucket_msr || classify(key).outcome != verdict::keep) continue;
+
+      const uint32_t msr = static_cast<uint32_t>(key.qualifier);
+
+      const auto found = std::find_if(rules.begin(), rules.end(),
+                                      [msr](const intercept_policy::rule& rule) { return rule.msr == msr; });
+
+      if (found != rules.end()) found->access |= key.access;
+      else                      rules.push_back({ msr, key.access });
+    }
+
+    std::sort(rules.begin(), rules.end(), [](const auto& left, const auto& right) { return left.msr < right.msr; });
+    return rules;
+  }
+
+  auto write_policy(const char* path, const std::vector<intercept_policy::rule>& rules) -> bool
+  {
+    if (rules.size() > intercept_policy::max_rules) return false;
+
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) return false;
+
+    const intercept_policy::header header{ intercept_policy::policy_magic, intercept_policy::policy_version,
+                                           static_cast<uint32_t>(rules.size()), 0 };
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(rules.data(), sizeof(intercept_policy::rule), rules.size(), file) == rules.size();
+
+    written = fclose(file) == 0 && written;
+    return written;
+  }
+
+  auto report(const profile& current, const file_header& header, const uint32_t top_count, FILE* out) -> void
+  {
+    using entry = std::pair<const source_key, source_stats>;
+
+    std::vector<const entry*> ranked;
+    for (const entry& source : current.sources) ranked.push_back(&source);
+
+    std::sort(ranked.begin(), ranked.end(), [](const entry* left, const entry* right)
+    {
+      return left->second.cycles > right->second.cycles;
+    });
+
+    const double frequency = static_cast<double>(header.tsc_frequency);
+    const double span      = current.exits && frequency > 0.0
+                           ? static_cast<double>(current.last_tsc - current.first_tsc) / frequency : 0.0;
+    const double cpu_time  = span * frequency * header.cpu_count;
+
+    fprintf(out, "%llu exits on %u cpus over %.3f s, %.3f%% of cpu time in root mode\n\n",
+            static_cast<unsigned long long>(current.exits), header.cpu_count, span,
+            cpu_time > 0.0 ? static_cast<double>(current.cycles) * 100.0 / cpu_time : 0.0);
+
+    fprintf(out, "  #  SOURCE                        EXITS         CYCLES   ROOT%%  CYC/EXIT  VERDICT\n");
+
+    uint64_t dropped_cycles = 0;
+    uint64_t dropped_exits  = 0;
+    uint32_t rank           = 0;
+    char     text[48];
+
+    for (const entry* source : ranked)
+    {
+      const finding verdict_of = classify(source->first);
+
+      if (verdict_of.outcome == verdict::drop)
+      {
+        dropped_cycles += source->second.cycles;
+        dropped_exits  += source->second.exits;
+      }
+
+      if (++rank > top_count) continue;
+
+      fprintf(out, "%3u  %-24s %10llu %14llu  %5.1f%% %9.0f  %s: %s\n", rank, describe(source->first, text),
+              static_cast<unsigned long long>(source->second.exits),
+              static_cast<unsigned long long>(source->second.cycles),
+              current.cycles ? static_cast<double>(source->second.cycles) * 100.0 / static_cast<double>(current.cycles) : 0.0,
+              static_cast<double>(source->second.cycles) / static_cast<double>(source->second.exits),
+              verdict_of.outcome == verdict::drop ? "drop" : verdict_of.outcome == verdict::keep ? "keep" : "fixed",
+              verdict_of.reason);
+
+      // Where the exits come from, the three hottest call sites
+      std::vector<std::pair<uint64_t, uint64_t>> rips(source->second.rips.begin(), source->second.rips.end());
+      const size_t shown = std::min<size_t>(3, rips.size());
+
+      std::partial_sort(rips.begin(), rips.begin() + shown, rips.end(),
+                        [](const auto& left, const auto& right) { return left.second > right.second; });
+
+      fputs("     ", out);
+      for (size_t i = 0; i < shown; ++i)
+      {
+        fprintf(out, " rip %016llx %4.1f%%", static_cast<unsigned long long>(rips[i].first),
+                static_cast<double>(rips[i].second) * 100.0 / static_cast<double>(source->second.exits));
+      }
+      fputc('\n', out);
+    }
+
+    fprintf(out, "\ndropping the avoidable MSR intercepts saves %llu exits and %llu cycles, %.1f%% of root time",
+            static_cast<unsigned long long>(dropped_exits), static_cast<unsigned long long>(dropped_cycles),
+            current.cycles ? static_cast<double>(dropped_cycles) * 100.0 / static_cast<double>(current.cycles) : 0.0);
+
+    if (span > 0.0)
+    {
+      fprintf(out, " (%.0f cycles/s)", static_cast<double>(dropped_cycles) / span);
+    }
+
+    fputc('\n', out);
+  }
+
+}; // namespace trace::analysis
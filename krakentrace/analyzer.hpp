@@ -0,0 +1,111 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unordered_map>
+#include <vector>
+
+#include <intercept_policy.hpp>
+
+#include "trace_reader.hpp"
+
+//
+// Offline trace analysis: where root-mode time goes, exit source by exit
+// source, and which intercepts could go without changing what the
+// hypervisor does. A source is an exit bucket narrowed down by what tells its
+// exits apart: MSR and access for MSR exits, leaf and subleaf for CPUID, port
+// for IOIO.
+//
+
+namespace trace::analysis
+{
+  struct source_key
+  {
+    uint32_t bucket;
+    uint32_t access;          // intercept_policy::access of an MSR exit, 0 otherwise
+    uint64_t qualifier;
+
+    auto operator==(const source_key&) const -> bool = default;
+  };
+
+  struct source_key_hash
+  {
+    auto operator()(const source_key& key) const noexcept -> size_t
+    {
+      return static_cast<size_t>((key.qualifier * 0x9e3779b97f4a7c15) ^ (static_cast<uint64_t>(key.bucket) << 8 | key.access));
+    }
+  };
+
+  struct source_stats
+  {
+    uint64_t                               exits  = 0;
+    uint64_t                               cycles = 0;
+    std::unordered_map<uint64_t, uint64_t> rips;
+  };
+
+  struct profile
+  {
+    uint64_t exits     = 0;
+    uint64_t cycles    = 0;
+    uint64_t first_tsc = ~0ull;
+    uint64_t last_tsc  = 0;
+    std::unordered_map<source_key, source_stats, source_key_hash> sources;
+
+    auto add  (const exit_record& record) -> void;
+    auto merge(profile&& other) -> void;
+  };
+
+  auto key_of(const exit_record& record) noexcept -> source_key;
+
+  // Decodes the chunks on thread_count threads, false on a corrupt chunk
+  auto build_profile(const reader& in, uint32_t thread_count, profile& out) -> bool;
+
+  enum class verdict
+  {
+    drop,                     // intercepted for nothing, the policy leaves it out
+    keep,                     // the handler needs to see it
+    fixed,                    // can't be trimmed through the MSR permission map
+  };
+
+  struct finding
+  {
+    verdict     outcome;
+    const char* reason;
+  };
+
+  auto classify(const source_key& key) noexcept -> finding;
+
+  // MSR accesses the policy keeps intercepting, every handled one the trace saw
+  auto propose(const profile& current) -> std::vector<intercept_policy::rule>;
+
+  auto write_policy(const char* path, const std::vector<intercept_policy::rule>& rules) -> bool;
+
+  // The ranked sources, their hottest RIPs and what dropping the avoidable ones saves
+  auto report(const profile& current, const file_header& header, uint32_t top_count, FILE* out) -> void;
+
+}; // namespace trace::analysis
@@ -0,0 +1,502 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+//
+// krakentrace, records and reads #VMEXIT traces
+//
+//   krakentrace record <trace> [seconds]     drain \\.\KrakenSvm into a trace (Windows)
+//   krakentrace info   <trace>               chunks, records, bytes per exit
+//   krakentrace dump   <trace> [from] [to]   records between two offsets, in seconds
+//   krakentrace bench  [records]             encode/decode throughput on a synthetic load
+//   krakentrace analyze <trace> [--threads n] [--top n] [--policy file]
+//                                            rank exit sources, propose MSR intercepts
+//
+// Everything but record builds anywhere, the top level CMakeLists.txt does it
+// as well:
+//
+//   c++ -std=c++20 -O2 -I../krakensvm/inc -I../krakensvm/hooks
+//       krakentrace.cpp analyzer.cpp trace_reader.cpp trace_writer.cpp -pthread -o krakentrace
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "trace_reader.hpp"
+#include "trace_writer.hpp"
+#include "analyzer.hpp"
+
+namespace
+{
+  using clock_type = std::chrono::steady_clock;
+
+  auto seconds_since(const clock_type::time_point start) -> double
+  {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  auto usage() -> int
+  {
+    fputs("usage: krakentrace record <trace> [seconds]\n"
+          "       krakentrace info   <trace>\n"
+          "       krakentrace dump   <trace> [from seconds] [to seconds]\n"
+          "       krakentrace bench  [records]\n"
+          "       krakentrace analyze <trace> [--threads n] [--top n] [--policy file]\n", stderr);
+    return 2;
+  }
+
+#if defined(_WIN32)
+  std::atomic<bool> stop_requested = false;
+
+  template <typename view_t>
+  auto map_view(const HANDLE device, const uint32_t ioctl, view_t& view) -> bool
+  {
+    DWORD returned = 0;
+    return DeviceIoControl(device, ioctl, nullptr, 0, &view, sizeof(view), &returned, nullptr) &&
+           returned == sizeof(view);
+  }
+
+  auto record(const char* path, const double seconds) -> int
+  {
+    // Writable, the exit trace's tails are mapped read-write
+    const HANDLE device = CreateFileW(L"\\\\.\\KrakenSvm", GENERIC_READ | GENERIC_WRITE,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                                      FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (device == INVALID_HANDLE_VALUE)
+    {
+      fputs("krakentrace: can't open \\\\.\\KrakenSvm, is the driver loaded?\n", stderr);
+      return 1;
+    }
+
+    telemetry::mapping stats_view{};
+    telemetry::stream_mapping trace_view{};
+
+    const telemetry::header* stats = nullptr;
+    const hk::capture::stream_header* stream = nullptr;
+    hk::capture::ring_tail* tails = nullptr;
+
+    if (map_view(device, telemetry::ioctl_map_telemetry, stats_view))
+    {
+      stats = telemetry::validate(reinterpret_cast<const void*>(stats_view.address), stats_view.size);
+    }
+
+    if (map_view(device, telemetry::ioctl_map_exit_trace, trace_view))
+    {
+      stream = hk::capture::stream_validate<exit_trace::exit_record>(
+        reinterpret_cast<const void*>(trace_view.stream.address), trace_view.stream.size);
+
+      if (stream != nullptr)
+      {
+        tails = hk::capture::stream_tails(stream, reinterpret_cast<void*>(trace_view.tails.address), trace_view.tails.size);
+      }
+    }
+
+    if (stats == nullptr || tails == nullptr)
+    {
+      fputs("krakentrace: no exit trace to map, set the ExitTrace registry value\n", stderr);
+      CloseHandle(device);
+      return 1;
+    }
+
+    trace::writer out;
+    if (!out.open(path, stats->tsc_frequency, stream->cpu_count))
+    {
+      fprintf(stderr, "krakentrace: can't create %s\n", path);
+      CloseHandle(device);
+      return 1;
+    }
+
+    SetConsoleCtrlHandler([](DWORD) -> BOOL { stop_requested = true; return TRUE; }, TRUE);
+
+    std::vector<exit_trace::exit_record> batch(4096);
+    const auto start = clock_type::now();
+    bool       written = true;
+
+    while (written && !stop_requested && (seconds <= 0.0 || seconds_since(start) < seconds))
+    {
+      uint32_t drained = 0;
+
+      for (uint32_t cpu = 0; cpu < stream->cpu_count && written; ++cpu)
+      {
+        const hk::capture::ring_header* ring = hk::capture::stream_ring(stream, cpu);
+        const uint32_t count = hk::capture::ring_drain(ring, tails[cpu], batch.data(), static_cast<uint32_t>(batch.size()));
+
+        for (uint32_t i = 0; i < count && written; ++i) written = out.append(cpu, batch[i]);
+        drained += count;
+      }
+
+      // Rings hold thousands of records, a short nap between empty rounds keeps up
+      if (drained == 0) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    uint64_t dropped = 0;
+    for (uint32_t cpu = 0; cpu < stream->cpu_count; ++cpu) dropped += hk::capture::stream_ring(stream, cpu)->dropped;
+
+    written = out.close() && written;
+    CloseHandle(device);
+
+    printf("%llu records, %llu bytes, %llu dropped by the driver\n",
+           static_cast<unsigned long long>(out.records()), static_cast<unsigned long long>(out.bytes()),
+           static_cast<unsigned long long>(dropped));
+
+    return written ? 0 : 1;
+  }
+#else
+  auto record(const char*, double) -> int
+  {
+    fputs("krakentrace: recording needs the driver, only replaying works here\n", stderr);
+    return 1;
+  }
+#endif
+
+  auto info(const char* path) -> int
+  {
+    trace::reader in;
+    if (!in.open(path))
+    {
+      fprintf(stderr, "krakentrace: %s isn't a trace\n", path);
+      return 1;
+    }
+
+    uint64_t records   = 0;
+    uint64_t payload   = 0;
+    uint64_t first_tsc = ~0ull;
+    uint64_t last_tsc  = 0;
+
+    for (const trace::index_entry& entry : in.chunks())
+    {
+      records  += entry.record_count;
+      payload  += in.chunk(entry.offset).payload_size;
+      first_tsc = entry.first_tsc < first_tsc ? entry.first_tsc : first_tsc;
+      last_tsc  = entry.last_tsc  > last_tsc  ? entry.last_tsc  : last_tsc;
+    }
+
+    const double frequency = static_cast<double>(in.header().tsc_frequency);
+
+    printf("cpus          %u\n", in.header().cpu_count);
+    printf("chunks        %zu%s\n", in.chunks().size(), in.indexed() ? "" : " (no index, scanned)");
+    printf("records       %llu\n", static_cast<unsigned long long>(records));
+    printf("payload       %llu bytes, %.2f per exit (%zu raw)\n", static_cast<unsigned long long>(payload),
+           records ? static_cast<double>(payload) / static_cast<double>(records) : 0.0, sizeof(trace::exit_record));
+
+    if (records != 0 && frequency > 0.0)
+    {
+      printf("span          %.3f s\n", static_cast<double>(last_tsc - first_tsc) / frequency);
+    }
+
+    return 0;
+  }
+
+  auto dump(const char* path, const double from, const double to) -> int
+  {
+    trace::reader in;
+    if (!in.open(path))
+    {
+      fprintf(stderr, "krakentrace: %s isn't a trace\n", path);
+      return 1;
+    }
+
+    uint64_t origin = ~0ull;
+    for (const trace::index_entry& entry : in.chunks()) origin = entry.first_tsc < origin ? entry.first_tsc : origin;
+
+    const double   frequency = static_cast<double>(in.header().tsc_frequency);
+    const uint64_t from_tsc  = origin + static_cast<uint64_t>(from * frequency);
+    const uint64_t to_tsc    = to > 0.0 ? origin + static_cast<uint64_t>(to * frequency) : ~0ull;
+
+    char name[24];
+
+    const bool decoded = in.decode_range(from_tsc, to_tsc, [&](const uint32_t cpu, const trace::exit_record& record)
+    {
+      printf("%3u %14.9f %-16s rip %016llx cr3 %016llx info %llx %llx qual %llx %u cycles\n",
+             cpu, static_cast<double>(record.tsc - origin) / frequency,
+             telemetry::exit_name(telemetry::bucket_of(record.exit_code), name),
+             static_cast<unsigned long long>(record.rip), static_cast<unsigned long long>(record.cr3),
+             static_cast<unsigned long long>(record.exitinfo1), static_cast<unsigned long long>(record.exitinfo2),
+             static_cast<unsigned long long>(record.qualifier), record.cycles);
+    });
+
+    if (!decoded) fputs("krakentrace: corrupt chunk\n", stderr);
+    return decoded ? 0 : 1;
+  }
+
+  //
+  // A load shaped like a busy Windows guest under this hypervisor: mostly MSR
+  // and CPUID exits, each MSR and leaf coming from a couple of call sites with
+  // one of them doing most of the work, some hypercalls, a few nested page
+  // faults all over, and a CR3 that rarely changes between two exits
+  //
+
+  class synthetic_load
+  {
+  public:
+    explicit synthetic_load(const uint32_t cpu_count) : tsc_(cpu_count, 1'000'000), cr3_(cpu_count, process(0)) {}
+
+    auto next(const uint32_t cpu) -> trace::exit_record
+    {
+      trace::exit_record record{};
+
+      tsc_[cpu]   += 200 + static_cast<uint64_t>(gap_(random_));
+      record.tsc   = tsc_[cpu];
+
+      if (pick_(random_) < 0.02) cr3_[cpu] = process(static_cast<uint32_t>(random_() % 24));
+      record.cr3 = cr3_[cpu];
+
+      static constexpr uint32_t msrs[]   = { 0xc0000082, 0xc0000080, 0xc0000082, 0xc0000102 };
+      static constexpr uint32_t leaves[] = { 0x00000001, 0x40000000, 0x00000007, 0x0000000d };
+
+      const double   kind = pick_(random_);
+      const uint32_t site = skewed();
+
+      if (kind < 0.50)
+      {
+        const uint32_t msr = msrs[skewed()];
+
+        record.exit_code = exit_trace::exit_msr;
+        record.exitinfo1 = site & 1;                     // rdmsr and wrmsr sites
+        record.qualifier = msr;
+        record.rip       = 0xfffff80412340000ull + msr % 0x1000 * 0x10 + site * 0x40;
+        record.cycles    = 900 + static_cast<uint32_t>(random_() % 48);
+      }
+      else if (kind < 0.80)
+      {
+        const uint64_t leaf = leaves[skewed()];
+
+        record.exit_code = exit_trace::exit_cpuid;
+        record.qualifier = leaf;
+        record.rip       = 0xfffff80412800000ull + leaf % 0x100 * 0x20 + site * 0x10;
+        record.cycles    = 1400 + static_cast<uint32_t>(random_() % 48);
+      }
+      else if (kind < 0.95)
+      {
+        record.exit_code = 0x81;
+        record.rip       = 0xfffff80413000010ull;
+        record.cycles    = 700 + static_cast<uint32_t>(random_() % 32);
+      }
+      else
+      {
+        record.exit_code = 0x400;
+        record.exitinfo1 = 0x100000004ull | (random_() & 3);
+        record.exitinfo2 = (random_() % 0x400000) << 12;
+        record.rip       = 0x00007ff6a0000000ull + (random_() % 0x10000);
+        record.cycles    = 2500 + static_cast<uint32_t>(random_() % 512);
+      }
+
+      return record;
+    }
+
+  private:
+    static auto process(const uint32_t index) noexcept -> uint64_t { return 0x1aa000ull + index * 0x3b000ull; }
+
+    // 0 most of the time, 3 rarely
+    auto skewed() -> uint32_t
+    {
+      const double roll = pick_(random_);
+      return roll < 0.70 ? 0 : roll < 0.90 ? 1 : roll < 0.97 ? 2 : 3;
+    }
+
+    std::mt19937_64                         random_{ 0x6b72616b656e };
+    std::exponential_distribution<double>   gap_{ 1.0 / 4000.0 };
+    std::uniform_real_distribution<double>  pick_{ 0.0, 1.0 };
+    std::vector<uint64_t>                   tsc_;
+    std::vector<uint64_t>                   cr3_;
+  };
+
+  auto analyze(const int argc, char** argv) -> int
+  {
+    const char* path        = argv[2];
+    const char* policy_path = nullptr;
+    uint32_t    threads     = std::max(1u, std::thread::hardware_concurrency());
+    uint32_t    top_count   = 20;
+
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+      if      (!strcmp(argv[i], "--threads")) threads     = static_cast<uint32_t>(strtoul(argv[i + 1], nullptr, 0));
+      else if (!strcmp(argv[i], "--top"))     top_count   = static_cast<uint32_t>(strtoul(argv[i + 1], nullptr, 0));
+      else if (!strcmp(argv[i], "--policy"))  policy_path = argv[i + 1];
+      else                                    return usage();
+    }
+
+    trace::reader in;
+    if (!in.open(path))
+    {
+      fprintf(stderr, "krakentrace: %s isn't a trace\n", path);
+      return 1;
+    }
+
+    trace::analysis::profile current;
+
+    const auto start   = clock_type::now();
+    const bool decoded = trace::analysis::build_profile(in, threads, current);
+
+    if (!decoded)
+    {
+      fputs("krakentrace: corrupt chunk, the analysis only covers what came before it\n", stderr);
+    }
+
+    fprintf(stderr, "parsed %llu exits in %.2f s on %u threads\n",
+            static_cast<unsigned long long>(current.exits), seconds_since(start), threads);
+
+    trace::analysis::report(current, in.header(), top_count, stdout);
+
+    const std::vector<intercept_policy::rule> rules = trace::analysis::propose(current);
+
+    printf("\nproposed MSR intercepts, besides the required ones:\n");
+    for (const intercept_policy::rule& rule : rules)
+    {
+      printf("  %08x %s%s\n", rule.msr, rule.access & intercept_policy::access_read ? "r" : "",
+             rule.access & intercept_policy::access_write ? "w" : "");
+    }
+
+    if (policy_path == nullptr) return decoded ? 0 : 1;
+
+    if (!trace::analysis::write_policy(policy_path, rules))
+    {
+      fprintf(stderr, "krakentrace: can't write %s\n", policy_path);
+      return 1;
+    }
+
+    // REG_BINARY takes the bytes as one hex string
+    printf("\npolicy written to %s, load it before the driver starts with\n"
+           "  reg add HKLM\\SYSTEM\\CurrentControlSet\\Services\\krakensvm /v InterceptPolicy /t REG_BINARY /d ", policy_path);
+
+    const intercept_policy::header header{ intercept_policy::policy_magic, intercept_policy::policy_version,
+                                           static_cast<uint32_t>(rules.size()), 0 };
+
+    const auto hex = [](const void* data, const size_t size)
+    {
+      for (size_t i = 0; i < size; ++i) printf("%02x", static_cast<const uint8_t*>(data)[i]);
+    };
+
+    hex(&header, sizeof(header));
+    hex(rules.data(), rules.size() * sizeof(intercept_policy::rule));
+    putchar('\n');
+
+    return decoded ? 0 : 1;
+  }
+
+  auto same(const trace::exit_record& left, const trace::exit_record& right) -> bool
+  {
+    return left.tsc == right.tsc && left.rip == right.rip && left.cr3 == right.cr3 &&
+           left.exit_code == right.exit_code && left.exitinfo1 == right.exitinfo1 &&
+           left.exitinfo2 == right.exitinfo2 && left.qualifier == right.qualifier && left.cycles == right.cycles;
+  }
+
+  auto bench(const uint64_t count) -> int
+  {
+    constexpr uint32_t cpu_count = 8;
+
+    std::vector<trace::exit_record> records(count);
+    synthetic_load load(cpu_count);
+
+    for (uint64_t i = 0; i < count; ++i) records[i] = load.next(static_cast<uint32_t>(i % cpu_count));
+
+    const char* path = "krakentrace-bench.trace";
+
+    // Encode, with the file writes the collector would do anyway
+    trace::writer out;
+    if (!out.open(path, 3'000'000'000ull, cpu_count))
+    {
+      fprintf(stderr, "krakentrace: can't create %s\n", path);
+      return 1;
+    }
+
+    auto start = clock_type::now();
+
+    for (uint64_t i = 0; i < count; ++i) out.append(static_cast<uint32_t>(i % cpu_count), records[i]);
+    out.close();
+
+    const double encode_seconds = seconds_since(start);
+
+    // Decode through the mapping, checking every record against its source
+    trace::reader in;
+    if (!in.open(path))
+    {
+      fprintf(stderr, "krakentrace: can't read %s back\n", path);
+      return 1;
+    }
+
+    std::vector<uint64_t> next_of_cpu(cpu_count);
+    uint64_t decoded    = 0;
+    bool     mismatched = false;
+
+    start = clock_type::now();
+
+    auto state = std::make_unique<trace::codec_state>();
+
+    for (const trace::index_entry& entry : in.chunks())
+    {
+      mismatched |= !in.decode(entry, *state, [&](const uint32_t cpu, const trace::exit_record& record)
+      {
+        const uint64_t source = next_of_cpu[cpu]++ * cpu_count + cpu;
+
+        mismatched |= source >= count || !same(record, records[source]);
+        ++decoded;
+      });
+    }
+
+    const double decode_seconds = seconds_since(start);
+    const double raw_bytes      = static_cast<double>(count) * sizeof(trace::exit_record);
+
+    printf("records       %llu on %u cpus\n", static_cast<unsigned long long>(count), cpu_count);
+    printf("file          %llu bytes, %.2f per exit (%zu raw)\n", static_cast<unsigned long long>(out.bytes()),
+           static_cast<double>(out.bytes()) / static_cast<double>(count), sizeof(trace::exit_record));
+    printf("encode        %.1f M exits/s, %.0f MB/s raw\n",
+           static_cast<double>(count) / encode_seconds / 1e6, raw_bytes / encode_seconds / 1e6);
+    printf("decode        %.1f M exits/s, %.0f MB/s raw\n",
+           static_cast<double>(decoded) / decode_seconds / 1e6, raw_bytes / decode_seconds / 1e6);
+    printf("round trip    %s\n", !mismatched && decoded == count ? "ok" : "MISMATCH");
+
+    in.close();
+    remove(path);
+
+    return !mismatched && decoded == count ? 0 : 1;
+  }
+}
+
+auto main(int argc, char** argv) -> int
+{
+  if (argc < 2) return usage();
+
+  const char* command = argv[1];
+
+  if (!strcmp(command, "record") && argc >= 3) return record(argv[2], argc >= 4 ? atof(argv[3]) : 0.0);
+  if (!strcmp(command, "info")   && argc == 3) return info(argv[2]);
+  if (!strcmp(command, "dump")   && argc >= 3) return dump(argv[2], argc >= 4 ? atof(argv[3]) : 0.0,
+                                                           argc >= 5 ? atof(argv[4]) : 0.0);
+  if (!strcmp(command, "analyze") && argc >= 3) return analyze(argc, argv);
+  if (!strcmp(command, "bench"))               return bench(argc >= 3 ? strtoull(argv[2], nullptr, 0) : 10'000'000);
+
+  return usage();
+}
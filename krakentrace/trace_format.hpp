@@ -0,0 +1,539 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#include <exit_trace.hpp>
+#include <telemetry.hpp>
+
+//
+// On-disk #VMEXIT traces
+//
+// A trace is written as it's collected, chunk after chunk, and indexed once it's
+// closed:
+//
+//   file_header
+//   chunk_header + payload     one processor's records, decodable on its own
+//   ...
+//   index_entry[chunk_count]   where every chunk is and which TSC range it covers
+//   footer                     last 16 bytes of the file
+//
+// A trace cut short (collector killed, disk full) has no index, readers then
+// walk the chunk headers instead.
+//
+// Records inside a chunk are coded against the record before them and against
+// the bucket's recent call sites, which is what makes repeating exits cheap:
+// the same MSR read from the same RIP in the same process comes down to a
+// bucket byte, a flag byte, the TSC gap and the change in cycles.
+//
+// A call site is (RIP, exitinfo1, exitinfo2, qualifier). Every bucket keeps its
+// site_slots most recent ones, most recent first; a hit names the slot, a miss
+// codes the fields that differ from the most recent one.
+//
+//   bucket   u8       telemetry::bucket_of(exit_code)
+//   flags    u8       see flag_*
+//   [code]   zigzag   exit_code, only for bucket_other
+//   tsc      varint   gap to the previous record, negated by flag_tsc_back
+//   cycles   zigzag   change from the bucket's last record
+//   [cr3]    varint   dictionary index or literal, by flag_cr3_*
+//   [fields] u8       on a site miss, see field_*
+//   [rip]    zigzag   change from the most recent site, by field_rip
+//   [info1]  zigzag   same, by field_exitinfo1
+//   [info2]  zigzag   same, by field_exitinfo2
+//   [qual]   zigzag   same, by field_qualifier
+//
+// The CR3 dictionary and the sites start out empty in every chunk.
+//
+
+namespace trace
+{
+  using exit_trace::exit_record;
+
+  constexpr uint32_t file_magic    = 0x5254584b; // "KXTR"
+  constexpr uint32_t chunk_magic   = 0x4b4e4843; // "CHNK"
+  constexpr uint32_t footer_magic  = 0x4954584b; // "KXTI"
+  constexpr uint32_t file_version  = 1;
+
+  // A chunk is closed by whichever limit comes first
+  constexpr uint32_t chunk_records = 16384;
+  constexpr uint32_t chunk_bytes   = 64 * 1024;
+
+  // Past this many distinct CR3s a chunk writes them out literally
+  constexpr uint32_t cr3_dictionary_size = 1024;
+
+  // Recent call sites remembered per bucket
+  constexpr uint32_t site_slots          = 7;
+
+  // Worst case of a single coded record, three bytes and seven varints
+  constexpr size_t   max_record_bytes    = 3 + 7 * 10;
+
+  struct file_header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tsc_frequency;
+    uint32_t cpu_count;
+    uint32_t reserved;
+  };
+
+  struct chunk_header
+  {
+    uint32_t magic;
+    uint32_t cpu;
+    uint32_t record_count;
+    uint32_t payload_size;
+    uint64_t first_tsc;
+    uint64_t last_tsc;
+  };
+
+  struct index_entry
+  {
+    uint64_t offset;          // of the chunk_header
+    uint64_t first_tsc;
+    uint64_t last_tsc;
+    uint32_t cpu;
+    uint32_t record_count;
+  };
+
+  struct footer
+  {
+    uint64_t index_offset;
+    uint32_t chunk_count;
+    uint32_t magic;
+  };
+
+  static_assert(sizeof(file_header) == 24 && sizeof(chunk_header) == 32 &&
+                sizeof(index_entry) == 32 && sizeof(footer) == 16, "The trace structures are part of the format");
+
+  enum flag : uint8_t
+  {
+    flag_cr3_same   = 0x00,
+    flag_cr3_index  = 0x01,
+    flag_cr3_new    = 0x02,   // added to the dictionary
+    flag_cr3_raw    = 0x03,   // dictionary full
+    flag_cr3_mask   = 0x03,
+
+    flag_site_shift = 2,      // slot of the site, site_miss when it's a new one
+    flag_site_mask  = 0x1c,
+    flag_tsc_back   = 0x80,
+  };
+
+  constexpr uint8_t site_miss = 7;
+
+  enum field : uint8_t
+  {
+    field_rip       = 0x01,
+    field_exitinfo1 = 0x02,
+    field_exitinfo2 = 0x04,
+    field_qualifier = 0x08,
+  };
+
+  static_assert(site_slots <= site_miss, "Site slots have to fit the flags");
+
+  //
+  // Varints, little endian groups of 7 bits
+  //
+
+  inline auto zigzag(const int64_t value) noexcept -> uint64_t
+  {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+  }
+
+  inline auto unzigzag(const uint64_t value) noexcept -> int64_t
+  {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+
+  inline auto put_varint(uint8_t* out, uint64_t value) noexcept -> uint8_t*
+  {
+    while (value >= 0x80)
+    {
+      *out++  = static_cast<uint8_t>(value) | 0x80;
+      value >>= 7;
+    }
+
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+  }
+
+  // nullptr once the input runs out or the varint is longer than 10 bytes
+  inline auto get_varint(const uint8_t* in, const uint8_t* end, uint64_t& value) noexcept -> const uint8_t*
+  {
+    value = 0;
+
+    for (uint32_t shift = 0; shift < 70 && in < end; shift += 7)
+    {
+      const uint8_t byte = *in++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+      if ((byte & 0x80) == 0) return in;
+    }
+
+    return nullptr;
+  }
+
+  //
+  // What both sides remember while going through one chunk
+  //
+
+  struct call_site
+  {
+    uint64_t rip;
+    uint64_t exitinfo1;
+    uint64_t exitinfo2;
+    uint64_t qualifier;
+  };
+
+  struct bucket_state
+  {
+    uint64_t  cycles;
+    call_site sites[site_slots];   // most recent first
+
+    auto find(const call_site& site) const noexcept -> uint32_t
+    {
+      for (uint32_t slot = 0; slot < site_slots; ++slot)
+      {
+        if (sites[slot].rip == site.rip && sites[slot].qualifier == site.qualifier &&
+            sites[slot].exitinfo1 == site.exitinfo1 && sites[slot].exitinfo2 == site.exitinfo2)
+        {
+          return slot;
+        }
+      }
+
+      return site_miss;
+    }
+
+    // Moves a slot to the front, a miss pushes the oldest site out
+    auto promote(const uint32_t slot, const call_site& site) noexcept -> void
+    {
+      for (uint32_t i = slot < site_slots ? slot : site_slots - 1; i > 0; --i) sites[i] = sites[i - 1];
+      sites[0] = site;
+    }
+  };
+
+  class codec_state
+  {
+  public:
+    auto reset(const uint64_t first_tsc) noexcept -> void
+    {
+      tsc = first_tsc;
+      cr3 = 0;
+      cr3_count = 0;
+
+      memset(buckets,  0, sizeof(buckets));
+      memset(cr3_keys, 0, sizeof(cr3_keys));
+    }
+
+    // Linear probing over a power of two table, 0 marks an empty slot
+    auto find_cr3(const uint64_t value) const noexcept -> int32_t
+    {
+      for (uint32_t slot = hash(value);; slot = (slot + 1) & (cr3_slots - 1))
+      {
+        if (cr3_keys[slot] == 0)     return -1;
+        if (cr3_keys[slot] == value) return static_cast<int32_t>(cr3_index[slot]);
+      }
+    }
+
+    auto add_cr3(const uint64_t value) noexcept -> bool
+    {
+      if (value == 0 || cr3_count == cr3_dictionary_size) return false;
+
+      uint32_t slot = hash(value);
+      while (cr3_keys[slot] != 0) slot = (slot + 1) & (cr3_slots - 1);
+
+      cr3_keys  [slot]         = value;
+      cr3_index [slot]         = cr3_count;
+      cr3_values[cr3_count++]  = value;
+
+      return true;
+    }
+
+    uint64_t     tsc       = 0;
+    uint64_t     cr3       = 0;
+    uint32_t     cr3_count = 0;
+    uint64_t     cr3_values[cr3_dictionary_size] = {};
+    bucket_state buckets[telemetry::exit_buckets] = {};
+
+  private:
+    static constexpr uint32_t cr3_slots = cr3_dictionary_size * 2;
+
+    static auto hash(const uint64_t value) noexcept -> uint32_t
+    {
+      return static_cast<uint32_t>((value * 0x9e3779b97f4a7c15) >> 53) & (cr3_slots - 1);
+    }
+
+    uint64_t     cr3_keys [cr3_slots] = {};
+    uint32_t     cr3_index[cr3_slots] = {};
+  };
+
+  //
+  // Encoder side, out has room for max_record_bytes
+  //
+
+  inline auto encode_record(codec_state& state, const exit_record& record, uint8_t* out) noexcept -> uint8_t*
+  {
+    const uint32_t  bucket = telemetry::bucket_of(record.exit_code);
+    bucket_state&   last   = state.buckets[bucket];
+    const call_site site   = { record.rip, record.exitinfo1, record.exitinfo2, record.qualifier };
+    const uint32_t  slot   = last.find(site);
+
+    uint8_t* const head  = out;
+    uint8_t        flags = static_cast<uint8_t>(slot << flag_site_shift);
+
+    out += 2;
+
+    if (bucket == telemetry::bucket_other) out = put_varint(out, zigzag(static_cast<int64_t>(record.exit_code)));
+
+    if (record.tsc >= state.tsc) out = put_varint(out, record.tsc - state.tsc);
+    else                         out = put_varint(out, state.tsc - record.tsc), flags |= flag_tsc_back;
+
+    out = put_varint(out, zigzag(static_cast<int64_t>(record.cycles - last.cycles)));
+
+    if (record.cr3 != state.cr3)
+    {
+      if (const int32_t index = state.find_cr3(record.cr3); index >= 0)
+      {
+        flags |= flag_cr3_index;
+        out    = put_varint(out, static_cast<uint32_t>(index));
+      }
+      else
+      {
+        flags |= state.add_cr3(record.cr3) ? flag_cr3_new : flag_cr3_raw;
+        out    = put_varint(out, record.cr3);
+      }
+    }
+
+    if (slot == site_miss)
+    {
+      const call_site& recent = last.sites[0];
+      uint8_t* const   fields = out++;
+
+      *fields = 0;
+
+      const auto field = [&](const uint64_t value, const uint64_t previous, const uint8_t bit)
+      {
+        if (value == previous) return;
+
+        *fields |= bit;
+        out      = put_varint(out, zigzag(static_cast<int64_t>(value - previous)));
+      };
+
+      field(site.rip,       recent.rip,       field_rip);
+      field(site.exitinfo1, recent.exitinfo1, field_exitinfo1);
+      field(site.exitinfo2, recent.exitinfo2, field_exitinfo2);
+      field(site.qualifier, recent.qualifier, field_qualifier);
+    }
+
+    head[0] = static_cast<uint8_t>(bucket);
+    head[1] = flags;
+
+    state.tsc   = record.tsc;
+    state.cr3   = record.cr3;
+    last.cycles = record.cycles;
+    last.promote(slot, site);
+
+    return out;
+  }
+
+  //
+  // Decoder side, nullptr on anything that doesn't add up
+  //
+
+  inline auto decode_record(codec_state& state, const uint8_t* in, const uint8_t* end,
+                            exit_record& record) noexcept -> const uint8_t*
+  {
+    if (end - in < 2) return nullptr;
+
+    const uint32_t bucket = in[0];
+    const uint8_t  flags  = in[1];
+    const uint32_t slot   = (flags & flag_site_mask) >> flag_site_shift;
+
+    if (bucket >= telemetry::exit_buckets || (slot >= site_slots && slot != site_miss)) return nullptr;
+
+    bucket_state& last = state.buckets[bucket];
+    uint64_t      value;
+
+    in += 2;
+
+    if (bucket == telemetry::bucket_other)
+    {
+      if ((in = get_varint(in, end, value)) == nullptr) return nullptr;
+      record.exit_code = static_cast<uint64_t>(unzigzag(value));
+    }
+    else
+    {
+      record.exit_code = static_cast<uint64_t>(telemetry::exit_code_of(bucket));
+    }
+
+    if ((in = get_varint(in, end, value)) == nullptr) return nullptr;
+    record.tsc = flags & flag_tsc_back ? state.tsc - value : state.tsc + value;
+
+    if ((in = get_varint(in, end, value)) == nullptr) return nullptr;
+    record.cycles = static_cast<uint32_t>(last.cycles + static_cast<uint64_t>(unzigzag(value)));
+
+    switch (flags & flag_cr3_mask)
+    {
+      case flag_cr3_same:
+        record.cr3 = state.cr3;
+        break;
+
+      case flag_cr3_index:
+        if ((in = get_varint(in, end, value)) == nullptr || value >= state.cr3_count) return nullptr;
+        record.cr3 = state.cr3_values[value];
+        break;
+
+      case flag_cr3_new:
+        if ((in = get_varint(in, end, value)) == nullptr || state.cr3_count == cr3_dictionary_size) return nullptr;
+        record.cr3 = state.cr3_values[state.cr3_count++] = value;
+        break;
+
+      default:
+        if ((in = get_varint(in, end, value)) == nullptr) return nullptr;
+        record.cr3 = value;
+    }
+
+    call_site site;
+
+    if (slot != site_miss)
+    {
+      site = last.sites[slot];
+    }
+    else
+    {
+      if (in == end) return nullptr;
+
+      const uint8_t fields = *in++;
+      site = last.sites[0];
+
+      const auto field = [&](uint64_t& current, const uint8_t bit) -> bool
+      {
+        if ((fields & bit) == 0) return true;
+        if ((in = get_varint(in, end, value)) == nullptr) return false;
+
+        current += static_cast<uint64_t>(unzigzag(value));
+        return true;
+      };
+
+      if (!field(site.rip, field_rip) || !field(site.exitinfo1, field_exitinfo1) ||
+          !field(site.exitinfo2, field_exitinfo2) || !field(site.qualifier, field_qualifier))
+      {
+        return nullptr;
+      }
+    }
+
+    record.rip       = site.rip;
+    record.exitinfo1 = site.exitinfo1;
+    record.exitinfo2 = site.exitinfo2;
+    record.qualifier = site.qualifier;
+    record.reserved  = 0;
+
+    state.tsc   = record.tsc;
+    state.cr3   = record.cr3;
+    last.cycles = record.cycles;
+    last.promote(slot, site);
+
+    return in;
+  }
+
+  //
+  // A whole chunk, sink(cpu, record) is called for every record in it
+  //
+
+  template <typename sink_t>
+  inline auto decode_chunk(const chunk_header& chunk, const uint8_t* payload,
+                           codec_state& state, sink_t&& sink) -> bool
+  {
+    const uint8_t* const end = payload + chunk.payload_size;
+    exit_record          record;
+
+    state.reset(chunk.first_tsc);
+
+    for (uint32_t i = 0; i < chunk.record_count; ++i)
+    {
+      if ((payload = decode_record(state, payload, end, record)) == nullptr) return false;
+      sink(chunk.cpu, record);
+    }
+
+    return payload == end;
+  }
+
+  //
+  // One processor's open chunk on the writing side
+  //
+
+  class chunk_encoder
+  {
+  public:
+    explicit chunk_encoder(const uint32_t cpu) : cpu_(cpu) { payload_.reserve(chunk_bytes + max_record_bytes); }
+
+    auto append(const exit_record& record) -> void
+    {
+      if (records_ == 0)
+      {
+        state_.reset(record.tsc);
+        first_tsc_ = record.tsc;
+      }
+
+      const size_t used = payload_.size();
+      payload_.resize(used + max_record_bytes);
+
+      uint8_t* const end = encode_record(state_, record, payload_.data() + used);
+      payload_.resize(static_cast<size_t>(end - payload_.data()));
+
+      last_tsc_ = record.tsc;
+      ++records_;
+    }
+
+    auto full()  const noexcept -> bool { return records_ >= chunk_records || payload_.size() >= chunk_bytes; }
+    auto empty() const noexcept -> bool { return records_ == 0; }
+
+    auto header() const noexcept -> chunk_header
+    {
+      return { chunk_magic, cpu_, records_, static_cast<uint32_t>(payload_.size()), first_tsc_, last_tsc_ };
+    }
+
+    auto payload() const noexcept -> const std::vector<uint8_t>& { return payload_; }
+
+    auto clear() noexcept -> void
+    {
+      payload_.clear();
+      records_ = 0;
+    }
+
+  private:
+    uint32_t             cpu_;
+    uint32_t             records_   = 0;
+    uint64_t             first_tsc_ = 0;
+    uint64_t             last_tsc_  = 0;
+    codec_state          state_;
+    std::vector<uint8_t> payload_;
+  };
+
+}; // namespace trace
@@ -0,0 +1,174 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "trace_reader.hpp"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace trace
+{
+  reader::~reader()
+  {
+    close();
+  }
+
+  auto reader::open(const char* path) -> bool
+  {
+    close();
+
+#if defined(_WIN32)
+    const HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER file_size{};
+
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < static_cast<LONGLONG>(sizeof(file_header)))
+    {
+      CloseHandle(file);
+      return false;
+    }
+
+    const HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+
+    if (mapping == nullptr) return false;
+
+    base_    = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    mapping_ = mapping;
+    size_    = static_cast<size_t>(file_size.QuadPart);
+#else
+    const int file = ::open(path, O_RDONLY);
+    if (file < 0) return false;
+
+    struct stat file_stat{};
+
+    if (fstat(file, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(file_header)))
+    {
+      ::close(file);
+      return false;
+    }
+
+    void* view = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+
+    if (view == MAP_FAILED) return false;
+
+    madvise(view, static_cast<size_t>(file_stat.st_size), MADV_SEQUENTIAL);
+
+    base_ = static_cast<const uint8_t*>(view);
+    size_ = static_cast<size_t>(file_stat.st_size);
+#endif
+
+    if (base_ == nullptr || header().magic != file_magic || header().version != file_version)
+    {
+      close();
+      return false;
+    }
+
+    if (!load_index()) scan_chunks();
+
+    return true;
+  }
+
+  auto reader::close() -> void
+  {
+#if defined(_WIN32)
+    if (base_ != nullptr)    UnmapViewOfFile(base_);
+    if (mapping_ != nullptr) CloseHandle(static_cast<HANDLE>(mapping_));
+#else
+    if (base_ != nullptr)    munmap(const_cast<uint8_t*>(base_), size_);
+#endif
+
+    base_    = nullptr;
+    mapping_ = nullptr;
+    size_    = 0;
+    indexed_ = false;
+    index_.clear();
+  }
+
+  //
+  // Trusts the footer only as far as every entry points at a chunk that fits
+  //
+
+  auto reader::load_index() -> bool
+  {
+    if (size_ < sizeof(file_header) + sizeof(footer)) return false;
+
+    footer tail;
+    memcpy(&tail, base_ + size_ - sizeof(tail), sizeof(tail));
+
+    if (tail.magic != footer_magic || tail.index_offset > size_ - sizeof(tail)) return false;
+    if ((size_ - sizeof(tail) - tail.index_offset) / sizeof(index_entry) != tail.chunk_count) return false;
+
+    index_.resize(tail.chunk_count);
+    memcpy(index_.data(), base_ + tail.index_offset, index_.size() * sizeof(index_entry));
+
+    for (const index_entry& entry : index_)
+    {
+      if (entry.offset < sizeof(file_header) || entry.offset > tail.index_offset - sizeof(chunk_header))
+      {
+        index_.clear();
+        return false;
+      }
+
+      const chunk_header current = chunk(entry.offset);
+
+      if (current.magic != chunk_magic || current.payload_size > tail.index_offset - entry.offset - sizeof(chunk_header))
+      {
+        index_.clear();
+        return false;
+      }
+    }
+
+    indexed_ = true;
+    return true;
+  }
+
+  // A trace that was cut short, take every complete chunk there is
+  auto reader::scan_chunks() -> void
+  {
+    uint64_t offset = sizeof(file_header);
+
+    while (size_ - offset >= sizeof(chunk_header))
+    {
+      const chunk_header current = chunk(offset);
+
+      if (current.magic != chunk_magic || current.payload_size > size_ - offset - sizeof(chunk_header)) break;
+
+      index_.push_back({ offset, current.first_tsc, current.last_tsc, current.cpu, current.record_count });
+      offset += sizeof(chunk_header) + current.payload_size;
+    }
+  }
+
+}; // namespace trace
@@ -0,0 +1,116 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include "trace_format.hpp"
+
+//
+// Reads a trace through a read-only mapping of the whole file. Chunks are
+// located through the index, or by walking the chunk headers when the trace
+// was never closed, and decoded straight out of the mapping.
+//
+// The reader itself is immutable once open, several threads can decode
+// different chunks of it at once, each with its own codec_state.
+//
+
+namespace trace
+{
+  class reader
+  {
+  public:
+    reader() = default;
+    ~reader();
+
+    reader(const reader&)            = delete;
+    reader& operator=(const reader&) = delete;
+
+    auto open (const char* path) -> bool;
+    auto close() -> void;
+
+    auto header() const noexcept -> const file_header& { return *reinterpret_cast<const file_header*>(base_); }
+    auto chunks() const noexcept -> const std::vector<index_entry>& { return index_; }
+
+    // Whether the index came from the footer rather than a scan
+    auto indexed() const noexcept -> bool { return indexed_; }
+
+    // Chunks sit wherever the one before them ended, so their headers are copied out
+    auto chunk(const uint64_t offset) const noexcept -> chunk_header
+    {
+      chunk_header current;
+      memcpy(&current, base_ + offset, sizeof(current));
+      return current;
+    }
+
+    template <typename sink_t>
+    auto decode(const index_entry& entry, codec_state& state, sink_t&& sink) const -> bool
+    {
+      return decode_chunk(chunk(entry.offset), base_ + entry.offset + sizeof(chunk_header), state, sink);
+    }
+
+    //
+    // Every record with from_tsc <= tsc <= to_tsc, chunk by chunk: in order for
+    // a processor, interleaved across processors. Chunks outside the range
+    // aren't touched.
+    //
+
+    template <typename sink_t>
+    auto decode_range(const uint64_t from_tsc, const uint64_t to_tsc, sink_t&& sink) const -> bool
+    {
+      auto state = std::make_unique<codec_state>();
+
+      for (const index_entry& entry : index_)
+      {
+        if (entry.last_tsc < from_tsc || entry.first_tsc > to_tsc) continue;
+
+        const bool decoded = decode(entry, *state, [&](const uint32_t cpu, const exit_record& record)
+        {
+          if (record.tsc >= from_tsc && record.tsc <= to_tsc) sink(cpu, record);
+        });
+
+        if (!decoded) return false;
+      }
+
+      return true;
+    }
+
+  private:
+    auto load_index() -> bool;
+    auto scan_chunks() -> void;
+
+    const uint8_t*           base_    = nullptr;
+    size_t                   size_    = 0;
+    void*                    mapping_ = nullptr;  // the mapping object on Windows
+    bool                     indexed_ = false;
+    std::vector<index_entry> index_;
+  };
+
+}; // namespace trace
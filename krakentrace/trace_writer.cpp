@@ -0,0 +1,116 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "trace_writer.hpp"
+
+namespace trace
+{
+  writer::~writer()
+  {
+    close();
+  }
+
+  auto writer::open(const char* path, const uint64_t tsc_frequency, const uint32_t cpu_count) -> bool
+  {
+    if (file_ != nullptr || cpu_count == 0) return false;
+
+    file_ = fopen(path, "wb");
+    if (file_ == nullptr) return false;
+
+    const file_header header{ file_magic, file_version, tsc_frequency, cpu_count, 0 };
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1)
+    {
+      fclose(file_);
+      file_ = nullptr;
+      return false;
+    }
+
+    offset_  = sizeof(header);
+    records_ = 0;
+
+    chunks_.clear();
+    index_.clear();
+
+    for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) chunks_.push_back(std::make_unique<chunk_encoder>(cpu));
+
+    return true;
+  }
+
+  auto writer::append(const uint32_t cpu, const exit_record& record) -> bool
+  {
+    if (file_ == nullptr || cpu >= chunks_.size()) return false;
+
+    chunk_encoder& chunk = *chunks_[cpu];
+
+    chunk.append(record);
+    ++records_;
+
+    return !chunk.full() || flush_chunk(chunk);
+  }
+
+  auto writer::flush_chunk(chunk_encoder& chunk) -> bool
+  {
+    if (chunk.empty()) return true;
+
+    const chunk_header header = chunk.header();
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1 ||
+        fwrite(chunk.payload().data(), 1, header.payload_size, file_) != header.payload_size)
+    {
+      return false;
+    }
+
+    index_.push_back({ offset_, header.first_tsc, header.last_tsc, header.cpu, header.record_count });
+
+    offset_ += sizeof(header) + header.payload_size;
+    chunk.clear();
+
+    return true;
+  }
+
+  auto writer::close() -> bool
+  {
+    if (file_ == nullptr) return true;
+
+    bool written = true;
+
+    for (auto& chunk : chunks_) written = written && flush_chunk(*chunk);
+
+    const footer tail{ offset_, static_cast<uint32_t>(index_.size()), footer_magic };
+
+    written = written &&
+              fwrite(index_.data(), sizeof(index_entry), index_.size(), file_) == index_.size() &&
+              fwrite(&tail, sizeof(tail), 1, file_) == 1;
+
+    if (written) offset_ += index_.size() * sizeof(index_entry) + sizeof(tail);
+
+    written = fclose(file_) == 0 && written;
+    file_   = nullptr;
+
+    return written;
+  }
+
+}; // namespace trace
@@ -0,0 +1,71 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <memory>
+#include <vector>
+
+#include "trace_format.hpp"
+
+//
+// Streams records into a trace file, one open chunk per processor. A full chunk
+// goes to disk as soon as it closes, so memory stays flat however long the
+// trace runs; only the index grows, by 32 bytes a chunk.
+//
+
+namespace trace
+{
+  class writer
+  {
+  public:
+    writer() = default;
+    ~writer();
+
+    writer(const writer&)            = delete;
+    writer& operator=(const writer&) = delete;
+
+    auto open   (const char* path, uint64_t tsc_frequency, uint32_t cpu_count) -> bool;
+    auto append (uint32_t cpu, const exit_record& record) -> bool;
+
+    // Writes out the open chunks, the index and the footer
+    auto close  () -> bool;
+
+    auto records() const noexcept -> uint64_t { return records_; }
+    auto bytes  () const noexcept -> uint64_t { return offset_; }
+
+  private:
+    auto flush_chunk(chunk_encoder& chunk) -> bool;
+
+    FILE*                                       file_    = nullptr;
+    uint64_t                                    offset_  = 0;
+    uint64_t                                    records_ = 0;
+    std::vector<std::unique_ptr<chunk_encoder>> chunks_;
+    std::vector<index_entry>                    index_;
+  };
+
+}; // namespace trace
@@ -0,0 +1,150 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <analyzer.hpp>
+#include <check.hpp>
+
+//
+// From a recorded profile to the policy the driver loads: what propose()
+// keeps, what write_policy() puts on disk, and that the driver side takes
+// the file and intercepts exactly those accesses plus the required ones.
+//
+
+using namespace trace::analysis;
+
+namespace
+{
+  constexpr uint32_t msr_apic_base = 0x0000001b;
+  constexpr uint32_t msr_tsc_aux   = 0xc0000103;
+  constexpr uint32_t msr_hv_guest  = 0x40000000;   // outside the permission map
+
+  auto msr_exit(const uint64_t tsc, const uint32_t msr, const bool write) -> trace::exit_record
+  {
+    trace::exit_record record = {};
+
+    record.tsc       = tsc;
+    record.rip       = 0xfffff80000100000ull + msr;
+    record.exit_code = exit_trace::exit_msr;
+    record.exitinfo1 = write ? 1 : 0;
+    record.qualifier = msr;
+    record.cycles    = 1500;
+
+    return record;
+  }
+
+  auto intercepted(const uint8_t* msrpm, const uint32_t msr, const uint32_t access) -> bool
+  {
+    const int64_t bit = intercept_policy::msrpm_bit(msr) + (access == intercept_policy::access_write ? 1 : 0);
+    return (msrpm[bit / 8] >> (bit % 8) & 1) != 0;
+  }
+};
+
+int main()
+{
+  // What msr_handler does something with stays, whichever way it's accessed
+  CHECK(classify({ exit_trace::exit_msr, intercept_policy::access_write, intercept_policy::msr_efer }).outcome  == verdict::keep);
+  CHECK(classify({ exit_trace::exit_msr, intercept_policy::access_read,  intercept_policy::msr_lstar }).outcome == verdict::keep);
+  CHECK(classify({ exit_trace::exit_msr, intercept_policy::access_write, intercept_policy::msr_lstar }).outcome == verdict::keep);
+
+  // Its default branch only replays, and past the map nothing can be dropped
+  CHECK(classify({ exit_trace::exit_msr, intercept_policy::access_read,  intercept_policy::msr_efer }).outcome  == verdict::drop);
+  CHECK(classify({ exit_trace::exit_msr, intercept_policy::access_read,  msr_apic_base }).outcome               == verdict::drop);
+  CHECK(classify({ exit_trace::exit_msr, intercept_policy::access_write, msr_tsc_aux }).outcome                 == verdict::drop);
+  CHECK(classify({ exit_trace::exit_msr, intercept_policy::access_read,  msr_hv_guest }).outcome                == verdict::fixed);
+
+  // A trace that saw all of them, the kept ones more than once
+  profile seen;
+  uint64_t tsc = 1000;
+
+  for (int i = 0; i < 3; ++i)
+  {
+    seen.add(msr_exit(tsc += 100, intercept_policy::msr_efer,  true));
+    seen.add(msr_exit(tsc += 100, intercept_policy::msr_efer,  false));
+    seen.add(msr_exit(tsc += 100, intercept_policy::msr_lstar, false));
+    seen.add(msr_exit(tsc += 100, intercept_policy::msr_lstar, true));
+  }
+
+  seen.add(msr_exit(tsc += 100, msr_apic_base, false));
+  seen.add(msr_exit(tsc += 100, msr_tsc_aux,   true));
+  seen.add(msr_exit(tsc += 100, msr_hv_guest,  false));
+
+  const std::vector<intercept_policy::rule> rules = propose(seen);
+
+  // One rule an MSR, its accesses merged, sorted
+  CHECK(rules.size() == 2);
+  CHECK(rules.size() == 2 && rules[0].msr == intercept_policy::msr_efer  && rules[0].access == intercept_policy::access_write);
+  CHECK(rules.size() == 2 && rules[1].msr == intercept_policy::msr_lstar &&
+        rules[1].access == (intercept_policy::access_read | intercept_policy::access_write));
+
+  // Through the file and back the way load_registry() takes it
+  const char* path = "analyzer_test.policy";
+  CHECK(write_policy(path, rules));
+
+  std::vector<uint8_t> blob(4096);
+  size_t               size = 0;
+
+  if (FILE* file = fopen(path, "rb"))
+  {
+    size = fread(blob.data(), 1, blob.size(), file);
+    fclose(file);
+  }
+
+  remove(path);
+
+  CHECK(size == sizeof(intercept_policy::header) + rules.size() * sizeof(intercept_policy::rule));
+
+  const intercept_policy::header* policy = intercept_policy::validate(blob.data(), size);
+  if (!CHECK(policy != nullptr)) return check::finish("analyzer_test");
+
+  CHECK(policy->rule_count == rules.size());
+
+  static uint8_t msrpm[intercept_policy::msrpm_size];
+  intercept_policy::build_msrpm(policy, msrpm);
+
+  CHECK(intercepted(msrpm, intercept_policy::msr_efer,  intercept_policy::access_write));
+  CHECK(intercepted(msrpm, intercept_policy::msr_lstar, intercept_policy::access_read));
+  CHECK(intercepted(msrpm, intercept_policy::msr_lstar, intercept_policy::access_write));
+
+  CHECK(!intercepted(msrpm, intercept_policy::msr_efer, intercept_policy::access_read));
+  CHECK(!intercepted(msrpm, msr_apic_base, intercept_policy::access_read));
+  CHECK(!intercepted(msrpm, msr_tsc_aux,   intercept_policy::access_write));
+
+  // Nothing else in the map
+  uint32_t bits = 0;
+  for (const uint8_t byte : msrpm) bits += static_cast<uint32_t>(__builtin_popcount(byte));
+
+  CHECK(bits == 3);
+
+  // More rules than the driver takes aren't written at all
+  const std::vector<intercept_policy::rule> too_many(intercept_policy::max_rules + 1,
+                                                     { intercept_policy::msr_lstar, intercept_policy::access_read });
+  CHECK(!write_policy(path, too_many));
+
+  return check::finish("analyzer_test");
+}
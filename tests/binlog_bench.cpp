@@ -0,0 +1,138 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <binlog.hpp>
+#include <check.hpp>
+
+//
+// What logging a line costs on the path that logs it: klog_info's encode
+// into a per-CPU ring against snprintf of the same line into a buffer, the
+// least kprint_info does before the debugger transport even sees it. Then
+// the other end, formatting a record back into text the way the flush does.
+// The formatter is checked against snprintf's text first, the numbers mean
+// nothing if the two don't agree.
+//
+
+using namespace binlog;
+
+namespace
+{
+  constexpr uint32_t capacity = 1024;
+
+  alignas(cache_line) uint8_t ring_region[ring_bytes(capacity)];
+
+  auto text_of(const record& current, char* out, const size_t size) -> size_t
+  {
+    return format(current, reinterpret_cast<const char*>(current.format), out, size);
+  }
+
+  template<class... Args>
+  auto agrees(const checked_format<std::type_identity_t<Args>...>& checked, const Args... args) -> bool
+  {
+    record current = {};
+    encode(current, checked, args...);
+
+    char ours[256];
+    char theirs[256];
+
+    text_of(current, ours, sizeof ours);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    snprintf(theirs, sizeof theirs, checked.text, args...);
+#pragma GCC diagnostic pop
+
+    if (strcmp(ours, theirs) == 0) return true;
+
+    fprintf(stderr, "  \"%s\" against snprintf's \"%s\"\n", ours, theirs);
+    return false;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  const uint64_t iterations = check::quick(argc, argv) ? 200000 : 20000000;
+
+  // %p is left out, the driver's is the WDK's 16 upper case digits
+  CHECK(agrees("From %s Canonicalization and Consistency Checks: \n", "vmexit_handler"));
+  CHECK(agrees("*\tCR3 => VALUE: 0x%x; Reserved MBZ %s", 0x1ad000u, "Is Zero\n"));
+  CHECK(agrees("%d %i %u %x", -5, INT32_MIN, 7u, 0xbeefu));
+  CHECK(agrees("%X%c%c", 0xbeefu, 'o', 'k'));
+  CHECK(agrees("[%08x|%-6d|%5u]", 0x2au, -17, 42u));
+  CHECK(agrees("%lld %llu %llx", -1ll, 18446744073709551615ull, 0xfffff80012345678ull));
+  CHECK(agrees("%hu %hhx", static_cast<unsigned short>(65535), static_cast<unsigned char>(0xab)));
+  CHECK(agrees("100%% of %s", "it"));
+
+  // Cut short the way snprintf is, terminated and reporting the full length
+  record current = {};
+  encode(current, "%s and %u more", "a fairly long prefix", 12345u);
+
+  char small[8];
+  CHECK(text_of(current, small, sizeof small) == strlen("a fairly long prefix and 12345 more"));
+  CHECK(strcmp(small, "a fairl") == 0);
+
+  // The same line three ways
+  ring_header* ring = ring_init(ring_region, capacity, 0);
+  char line[256];
+
+  const double encode_ns = check::nanoseconds_per(iterations, [ring](const uint64_t i)
+  {
+    record* slot = ring_reserve(ring);
+
+    encode(*slot, "vCPU %u exit 0x%llx at %llx\n", static_cast<uint32_t>(i & 63), i, 0xfffff80012345000ull + i);
+    ring_commit(slot, i);
+
+    // Single threaded, the consumer skips ahead once the ring fills
+    if (ring->head - ring->tail == capacity) ring->tail = ring->head;
+  });
+
+  CHECK(ring->dropped == 0);
+
+  const double snprintf_ns = check::nanoseconds_per(iterations, [&line](const uint64_t i)
+  {
+    snprintf(line, sizeof line, "vCPU %u exit 0x%llx at %llx\n", static_cast<uint32_t>(i & 63),
+             static_cast<unsigned long long>(i), 0xfffff80012345000ull + i);
+    check::keep(line);
+  });
+
+  encode(current, "vCPU %u exit 0x%llx at %llx\n", 7u, 0x81ull, 0xfffff80012345000ull);
+
+  const double format_ns = check::nanoseconds_per(iterations, [&](const uint64_t i)
+  {
+    current.args[1] = i;
+    text_of(current, line, sizeof line);
+    check::keep(line);
+  });
+
+  printf("encode into the ring %6.1f ns   snprintf %6.1f ns   formatting a record %6.1f ns   (%llu lines)\n",
+         encode_ns, snprintf_ns, format_ns, static_cast<unsigned long long>(iterations));
+
+  return check::finish("binlog_bench");
+}
@@ -0,0 +1,162 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <syscall_capture.hpp>
+#include <check.hpp>
+
+//
+// What a captured syscall costs the trap, ring_push() on its own and with a
+// collector draining the same ring from another thread, which is where the
+// head and tail lines bounce between cores. Then how fast a collector empties
+// a full ring. On a single core box the two threads take turns, only the
+// single threaded numbers mean much there.
+//
+
+using namespace hk::capture;
+
+namespace
+{
+  constexpr uint32_t capacity = 0x1000;
+
+  struct stream
+  {
+    std::vector<uint64_t>         region;
+    std::vector<uint64_t>         tails;
+    ring_producer<capture_record> producer;
+    const ring_header*            first_ring;
+
+    stream()
+    {
+      region.assign(stream_bytes(1, capacity) / sizeof(uint64_t), 0);
+      tails.assign(tails_bytes(1) / sizeof(uint64_t), 0);
+
+      stream_init(region.data(), 1, capacity);
+      producer_init(producer, region.data(), reinterpret_cast<const ring_tail*>(tails.data()), 0, capacity);
+
+      first_ring = stream_ring(reinterpret_cast<stream_header*>(region.data()), 0);
+    }
+
+    auto ring() -> const ring_header* { return first_ring; }
+    auto tail() -> ring_tail& { return *reinterpret_cast<ring_tail*>(tails.data()); }
+  };
+
+  auto record_of(const uint64_t i) -> capture_record
+  {
+    capture_record record = {};
+    record.tsc            = i;
+    record.cr3            = 0x1aa000;
+    record.syscall_number = static_cast<uint32_t>(i & 0x1ff);
+    return record;
+  }
+
+  // Pushes with a collector draining alongside, ns per push and how many got dropped
+  auto contended(const uint64_t iterations, uint64_t& dropped) -> double
+  {
+    stream shared;
+    std::atomic<bool> done = false;
+    uint64_t drained = 0;
+
+    std::thread collector([&]
+    {
+      capture_record out[256];
+
+      while (!done.load(std::memory_order_relaxed))
+      {
+        drained += ring_drain(shared.ring(), shared.tail(), out, 256);
+      }
+
+      while (const uint32_t count = ring_drain(shared.ring(), shared.tail(), out, 256)) drained += count;
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i = 0; i < iterations; ++i) ring_push(shared.producer, record_of(i));
+
+    const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    done = true;
+    collector.join();
+
+    dropped = shared.producer.dropped;
+    CHECK(drained + dropped == iterations);
+
+    return elapsed / iterations;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  const uint64_t iterations = check::quick(argc, argv) ? 100000 : 20000000;
+
+  printf("%u hardware threads, %u records per ring\n", std::thread::hardware_concurrency(), capacity);
+
+  // Uncontended, the ring is emptied in between so every push lands
+  {
+    stream shared;
+    std::vector<capture_record> out(capacity);
+
+    const double push_ns = check::nanoseconds_per(iterations, [&](const uint64_t i)
+    {
+      if ((i & (capacity - 1)) == 0) ring_drain(shared.ring(), shared.tail(), out.data(), capacity);
+      ring_push(shared.producer, record_of(i));
+    });
+
+    CHECK(shared.producer.dropped == 0);
+    printf("push, no collector running      %6.1f ns/record\n", push_ns);
+
+    // Full ring, drained in batches of 256
+    uint64_t drained = 0;
+
+    const double drain_ns = check::nanoseconds_per(iterations / capacity, [&](uint64_t)
+    {
+      ring_drain(shared.ring(), shared.tail(), out.data(), capacity);
+      for (uint32_t i = 0; i < capacity; ++i) ring_push(shared.producer, record_of(i));
+
+      for (uint32_t batch = 0; batch < capacity / 256; ++batch)
+      {
+        drained += ring_drain(shared.ring(), shared.tail(), out.data(), 256);
+      }
+
+      check::keep(out[0]);
+    });
+
+    printf("fill and drain a full ring      %6.1f ns/record\n", drain_ns / capacity);
+    check::keep(drained);
+  }
+
+  uint64_t dropped = 0;
+  const double contended_ns = contended(iterations, dropped);
+
+  printf("push, collector draining        %6.1f ns/record, %llu of %llu dropped\n", contended_ns,
+         static_cast<unsigned long long>(dropped), static_cast<unsigned long long>(iterations));
+
+  return check::finish("capture_ring_bench");
+}
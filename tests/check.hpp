@@ -0,0 +1,89 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+//
+// Just enough of a test framework for the host side tests: CHECK() reports
+// and counts, finish() turns the count into the exit code.
+//
+
+namespace check
+{
+  inline int failures = 0;
+
+  inline auto report(const bool passed, const char* expression, const char* file, const int line) -> bool
+  {
+    if (!passed)
+    {
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+      ++failures;
+    }
+
+    return passed;
+  }
+
+  inline auto finish(const char* name) -> int
+  {
+    if (failures == 0) printf("%s: ok\n", name);
+    else               printf("%s: %d failed\n", name, failures);
+
+    return failures == 0 ? 0 : 1;
+  }
+
+  // Benchmarks take --quick under ctest
+  inline auto quick(const int argc, char** argv) -> bool
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      if (strcmp(argv[i], "--quick") == 0) return true;
+    }
+
+    return false;
+  }
+
+  template<class fn_t>
+  auto nanoseconds_per(const uint64_t iterations, fn_t body) -> double
+  {
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i = 0; i < iterations; ++i) body(i);
+
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+  }
+
+  template<class T>
+  inline auto keep(const T& value) -> void
+  {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+};
+
+#define CHECK(expression) ::check::report(static_cast<bool>(expression), #expression, __FILE__, __LINE__)
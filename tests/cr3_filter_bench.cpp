@@ -0,0 +1,131 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <random>
+#include <vector>
+
+#include <cr3_filter.hpp>
+#include <check.hpp>
+
+//
+// How often the Bloom filter lets an uninteresting CR3 through to the table,
+// against the 1 - e^(-kn/m) it should, for sets of a few up to max_entries
+// processes. Then what a lookup costs for the CR3s almost every event has
+// (not in the set) and for the ones in it, against walking a plain array.
+// The table itself has to stay exact whatever the filter says.
+//
+
+using namespace cr3_filter;
+
+namespace
+{
+  // Page aligned, below 2^52, like a real CR3 with PCID bits mixed in
+  auto random_cr3(std::mt19937_64& random) -> uint64_t
+  {
+    return (random() & 0x000ffffffffff000) | (random() & 0xfff);
+  }
+
+  auto expected_rate(const uint32_t count) -> double
+  {
+    double miss = 1.0;
+    for (uint32_t i = 0; i < count * 3; ++i) miss *= 1.0 - 1.0 / bloom_bits;
+
+    const double bit_set = 1.0 - miss;
+    return bit_set * bit_set * bit_set;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  const uint64_t queries = check::quick(argc, argv) ? 200000 : 20000000;
+
+  std::mt19937_64 random(0x33524343);
+
+  printf("%u bit Bloom filter, %u table slots, %llu queries per row\n", bloom_bits, table_slots,
+         static_cast<unsigned long long>(queries));
+
+  for (const uint32_t count : { 4u, 16u, 64u, 128u, 256u })
+  {
+    std::vector<uint64_t> members(count);
+    for (uint64_t& cr3 : members) cr3 = random_cr3(random);
+
+    static set current;
+    CHECK(build(current, members.data(), count));
+
+    for (const uint64_t cr3 : members) CHECK(contains(current, cr3));
+
+    // Fresh CR3s, none of them in the set
+    std::vector<uint64_t> outsiders(4096);
+    for (uint64_t& cr3 : outsiders) cr3 = random_cr3(random);
+
+    uint64_t bloom_passed = 0;
+    uint64_t wrong        = 0;
+
+    // Every query a different CR3, a repeated one would only measure the same bits again
+    for (uint64_t i = 0; i < queries; ++i)
+    {
+      const uint64_t cr3 = random_cr3(random);
+
+      if (!bloom_test(current, mix(normalize(cr3)))) continue;
+      ++bloom_passed;
+
+      if (!contains(current, cr3)) continue;
+
+      bool member = false;
+      for (const uint64_t known : members) member |= normalize(known) == normalize(cr3);
+
+      wrong += !member;
+    }
+
+    CHECK(wrong == 0);
+
+    const double miss_ns = check::nanoseconds_per(queries, [&](const uint64_t i)
+    {
+      check::keep(contains(current, outsiders[i & 4095]));
+    });
+
+    const double hit_ns = check::nanoseconds_per(queries, [&](const uint64_t i)
+    {
+      check::keep(contains(current, members[i % count]));
+    });
+
+    // What the set replaces, a linear scan over the same CR3s
+    const double scan_ns = check::nanoseconds_per(queries, [&](const uint64_t i)
+    {
+      const uint64_t key = normalize(outsiders[i & 4095]);
+      bool found = false;
+
+      for (const uint64_t known : members) found |= normalize(known) == key;
+      check::keep(found);
+    });
+
+    printf("%3u cr3s  false positive %.6f (expected %.6f)  miss %5.1f ns  hit %5.1f ns  linear scan %6.1f ns\n",
+           count, static_cast<double>(bloom_passed) / static_cast<double>(queries), expected_rate(count),
+           miss_ns, hit_ns, scan_ns);
+  }
+
+  return check::finish("cr3_filter_bench");
+}
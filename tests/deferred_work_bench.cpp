@@ -0,0 +1,295 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <deferred_work.hpp>
+#include <check.hpp>
+
+//
+// The deferred queue with 128 producers, as many as vCPUs on a big host,
+// posting into one consumer that sleeps on a doorbell the way the worker
+// does. Every producer numbers its items and the consumer checks they come
+// out in order with none missing; a full queue makes the producer retry so
+// that check stays exact. Against a mutex and a deque with the same
+// consumer. On a single core box the threads take turns, only the totals
+// mean much there.
+//
+
+using namespace deferred;
+
+namespace
+{
+  using clock_type = std::chrono::steady_clock;
+
+  std::vector<uint64_t> last_seen;      // per producer, the consumer's
+  std::atomic<uint64_t> consumed  = 0;
+  std::atomic<uint64_t> reordered = 0;
+
+  auto in_order(const work& item) -> void
+  {
+    const uint64_t producer = item.args[0];
+    const uint64_t number   = item.args[1];
+
+    if (number != last_seen[producer] + 1) reordered.fetch_add(1, std::memory_order_relaxed);
+
+    last_seen[producer] = number;
+    consumed.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Stands in for the worker's wake event
+  struct doorbell_event
+  {
+    std::mutex              lock;
+    std::condition_variable changed;
+    bool                    signaled = false;
+
+    auto signal() -> void
+    {
+      std::lock_guard guard(lock);
+      signaled = true;
+      changed.notify_one();
+    }
+
+    auto wait(const std::chrono::milliseconds timeout) -> bool
+    {
+      std::unique_lock guard(lock);
+      const bool woken = changed.wait_for(guard, timeout, [this] { return signaled; });
+      signaled = false;
+      return woken;
+    }
+  };
+
+  auto seconds_since(const clock_type::time_point start) -> double
+  {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  auto basics() -> void
+  {
+    alignas(cache_line) static uint8_t region[queue_bytes(4)];
+    queue_header* queue = queue_init(region, 4);
+
+    work item = {};
+    work out  = {};
+
+    for (uint64_t i = 0; i < 4; ++i)
+    {
+      item.args[0] = i;
+      CHECK(push(queue, item) != posted::full);
+    }
+
+    CHECK(push(queue, item) == posted::full);
+    CHECK(queue->dropped == 1);
+
+    for (uint64_t i = 0; i < 4; ++i) CHECK(pop(queue, out) && out.args[0] == i);
+    CHECK(!pop(queue, out));
+
+    // Only the first post into a sleeping consumer rings
+    CHECK(prepare_sleep(queue));
+    CHECK(push(queue, item) == posted::queued_ring);
+    CHECK(push(queue, item) == posted::queued);
+    CHECK(!prepare_sleep(queue));
+  }
+
+  auto lock_free(const uint32_t producers, const uint64_t per_producer) -> void
+  {
+    constexpr uint32_t capacity = 1024;
+
+    void* region = aligned_alloc(cache_line, queue_bytes(capacity));
+    queue_header* queue = queue_init(region, capacity);
+
+    last_seen.assign(producers, 0);
+    consumed  = 0;
+    reordered = 0;
+
+    doorbell_event        bell;
+    std::atomic<bool>     stop    = false;
+    std::atomic<uint64_t> rung    = 0;
+    std::atomic<uint64_t> full    = 0;
+    std::atomic<uint64_t> push_ns = 0;
+    uint64_t              wakes   = 0;
+
+    std::thread consumer([&]
+    {
+      for (;;)
+      {
+        drain(queue);
+        if (!prepare_sleep(queue)) continue;
+
+        if (stop.load())
+        {
+          drain(queue);
+          break;
+        }
+
+        wakes += bell.wait(std::chrono::milliseconds(250));
+        std::atomic_ref<uint32_t>(queue->sleeping).store(0, std::memory_order_relaxed);
+      }
+    });
+
+    const auto start = clock_type::now();
+    std::vector<std::thread> posters;
+
+    for (uint32_t producer = 0; producer < producers; ++producer)
+    {
+      posters.emplace_back([&, producer]
+      {
+        const auto posting = clock_type::now();
+
+        for (uint64_t number = 1; number <= per_producer;)
+        {
+          const work item = { in_order, 0, { producer, number } };
+          const posted result = push(queue, item);
+
+          if (result == posted::full)
+          {
+            full.fetch_add(1, std::memory_order_relaxed);
+            std::this_thread::yield();
+            continue;
+          }
+
+          if (result == posted::queued_ring)
+          {
+            rung.fetch_add(1, std::memory_order_relaxed);
+            bell.signal();
+          }
+
+          ++number;
+        }
+
+        push_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - posting).count());
+      });
+    }
+
+    for (std::thread& poster : posters) poster.join();
+
+    const uint64_t total = producers * per_producer;
+    while (consumed.load() != total) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    const double elapsed = seconds_since(start);
+
+    stop = true;
+    bell.signal();
+    consumer.join();
+
+    CHECK(reordered == 0);
+    for (uint32_t producer = 0; producer < producers; ++producer) CHECK(last_seen[producer] == per_producer);
+
+    printf("lock free    %3u producers  %6.2f M items/s  %7.1f ns per post  %llu doorbells, %llu wakes, %llu full\n",
+           producers, static_cast<double>(total) / elapsed / 1e6,
+           static_cast<double>(push_ns.load()) / static_cast<double>(total),
+           static_cast<unsigned long long>(rung.load()), static_cast<unsigned long long>(wakes),
+           static_cast<unsigned long long>(full.load()));
+
+    free(region);
+  }
+
+  auto mutex_deque(const uint32_t producers, const uint64_t per_producer) -> void
+  {
+    std::mutex            lock;
+    std::deque<work>      items;
+    std::atomic<bool>     stop    = false;
+    std::atomic<uint64_t> push_ns = 0;
+
+    last_seen.assign(producers, 0);
+    consumed  = 0;
+    reordered = 0;
+
+    const uint64_t total = producers * per_producer;
+
+    std::thread consumer([&]
+    {
+      while (!stop.load() || consumed.load() != total)
+      {
+        std::deque<work> batch;
+
+        {
+          std::lock_guard guard(lock);
+          batch.swap(items);
+        }
+
+        for (const work& item : batch) item.routine(item);
+        if (batch.empty()) std::this_thread::yield();
+      }
+    });
+
+    const auto start = clock_type::now();
+    std::vector<std::thread> posters;
+
+    for (uint32_t producer = 0; producer < producers; ++producer)
+    {
+      posters.emplace_back([&, producer]
+      {
+        const auto posting = clock_type::now();
+
+        for (uint64_t number = 1; number <= per_producer; ++number)
+        {
+          std::lock_guard guard(lock);
+          items.push_back({ in_order, 0, { producer, number } });
+        }
+
+        push_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - posting).count());
+      });
+    }
+
+    for (std::thread& poster : posters) poster.join();
+
+    stop = true;
+    consumer.join();
+
+    const double elapsed = seconds_since(start);
+
+    CHECK(reordered == 0);
+
+    printf("mutex deque  %3u producers  %6.2f M items/s  %7.1f ns per post\n", producers,
+           static_cast<double>(total) / elapsed / 1e6, static_cast<double>(push_ns.load()) / static_cast<double>(total));
+  }
+};
+
+int main(int argc, char** argv)
+{
+  const uint64_t per_producer = check::quick(argc, argv) ? 200 : 20000;
+
+  printf("%u hardware threads\n", std::thread::hardware_concurrency());
+
+  basics();
+
+  for (const uint32_t producers : { 1u, 8u, 128u })
+  {
+    lock_free(producers, per_producer);
+    mutex_deque(producers, per_producer);
+  }
+
+  return check::finish("deferred_work_bench");
+}
@@ -0,0 +1,109 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#include <event_filter.hpp>
+#include <check.hpp>
+
+//
+// The compiled program against the plain switch interpreter a filter would
+// otherwise be run with. Same program the driver documentation uses: accept
+// syscall 0x55 from one CR3, or exit 0x7c with RIP in a range.
+//
+
+using namespace filter;
+
+static const insn sample[] =
+{
+  { op::ld_field, kind,          0, 0, 0, 0 },
+  { op::jeq,      0,             0, 4, 0, static_cast<uint64_t>(event_kind::syscall) },
+  { op::ld_field, syscall_index, 0, 0, 0, 0 },
+  { op::jeq,      0,             0, 8, 0, 0x55 },
+  { op::ld_field, cr3,           0, 0, 0, 0 },
+  { op::jeq,      0,             5, 6, 0, 0x1000 },
+  { op::ld_field, exit_code,     0, 0, 0, 0 },
+  { op::jeq,      0,             0, 4, 0, 0x7c },
+  { op::ld_field, rip,           0, 0, 0, 0 },
+  { op::jge,      0,             0, 2, 0, 0x1000 },
+  { op::jge,      0,             1, 0, 0, 0x2000 },
+  { op::ret_imm,  0,             0, 0, 0, 1 },
+  { op::ret_imm,  0,             0, 0, 0, 0 },
+};
+
+static auto interpret(const insn* insns, const event& current) -> uint64_t
+{
+  uint64_t a = 0;
+
+  for (uint32_t pc = 0;;)
+  {
+    const insn& i = insns[pc];
+
+    switch (i.code)
+    {
+      case op::ld_field: a = current.fields[i.field]; ++pc; break;
+      case op::jeq:      pc += 1 + (a == i.k ? i.jt : i.jf); break;
+      case op::jge:      pc += 1 + (a >= i.k ? i.jt : i.jf); break;
+      case op::ret_imm:  return i.k;
+      case op::ret_a:    return a;
+      default:           ++pc; break;
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const uint64_t iterations = check::quick(argc, argv) ? 1000000 : 50000000;
+
+  program compiled;
+  CHECK(compile(sample, 13, compiled) == load_status::ok);
+
+  event current = {};
+  current.fields[kind]      = static_cast<uint64_t>(event_kind::vmexit);
+  current.fields[exit_code] = 0x7c;
+
+  uint64_t accepted = 0;
+
+  const double source_ns = check::nanoseconds_per(iterations, [&](const uint64_t i)
+  {
+    current.fields[rip] = 0x1000 + (i & 0x1fff);
+    accepted += interpret(sample, current);
+  });
+
+  const double compiled_ns = check::nanoseconds_per(iterations, [&](const uint64_t i)
+  {
+    current.fields[rip] = 0x1000 + (i & 0x1fff);
+    accepted -= run(compiled, current);
+  });
+
+  check::keep(accepted);
+  CHECK(accepted == 0);
+
+  printf("%u instructions compiled to %u\n", compiled.source_length, compiled.length);
+  printf("interpreted source %6.2f ns/event\n", source_ns);
+  printf("compiled           %6.2f ns/event\n", compiled_ns);
+
+  return check::finish("event_filter_bench");
+}
@@ -0,0 +1,189 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <random>
+
+#include <event_filter.hpp>
+#include <check.hpp>
+
+//
+// Differential fuzzing of the filter loader: random programs, most of them a
+// few mutations away from valid ones, go through validate() and compile(),
+// and every one that loads has to return what a plain interpreter of the
+// source returns, for every event thrown at it.
+//
+
+using namespace filter;
+
+// Straight from the op comments in event_filter.hpp, no folding, no fusion
+static auto interpret(const insn* insns, const uint32_t count, const event& current) -> uint64_t
+{
+  uint64_t a = 0;
+
+  for (uint32_t pc = 0; pc < count;)
+  {
+    const insn& i = insns[pc];
+
+    switch (i.code)
+    {
+      case op::ld_field: a = current.fields[i.field]; break;
+      case op::ld_imm:   a = i.k;   break;
+      case op::and_imm:  a &= i.k;  break;
+      case op::or_imm:   a |= i.k;  break;
+      case op::add_imm:  a += i.k;  break;
+      case op::sub_imm:  a -= i.k;  break;
+      case op::lsh_imm:  a <<= i.k; break;
+      case op::rsh_imm:  a >>= i.k; break;
+
+      case op::ja:   pc += 1 + i.jt; continue;
+      case op::jeq:  pc += 1 + (a == i.k ? i.jt : i.jf); continue;
+      case op::jgt:  pc += 1 + (a >  i.k ? i.jt : i.jf); continue;
+      case op::jge:  pc += 1 + (a >= i.k ? i.jt : i.jf); continue;
+      case op::jset: pc += 1 + ((a & i.k) ? i.jt : i.jf); continue;
+
+      case op::ret_imm: return i.k;
+      case op::ret_a:   return a;
+
+      default: return ~0ull;
+    }
+
+    ++pc;
+  }
+
+  return ~0ull;   // validate() doesn't let this happen
+}
+
+// Constants the events are made of, so compares actually go both ways
+static constexpr uint64_t interesting[] = { 0, 1, 2, 0x55, 0x1000, 0x1fff, 0x2000, 0x7c, 0xffffffffffffffff, 0x8000000000000000 };
+
+static auto random_k(std::mt19937_64& rng) -> uint64_t
+{
+  return rng() % 4 == 0 ? rng() : interesting[rng() % std::size(interesting)];
+}
+
+static auto random_program(std::mt19937_64& rng, insn* out) -> uint32_t
+{
+  const uint32_t count = 1 + static_cast<uint32_t>(rng() % 24);
+
+  for (uint32_t pc = 0; pc < count; ++pc)
+  {
+    insn& i = out[pc];
+    i = {};
+
+    i.code  = static_cast<op>(rng() % static_cast<uint32_t>(op::op_count));
+    i.field = static_cast<uint8_t>(rng() % field_count);
+    i.k     = random_k(rng);
+
+    if (i.code == op::lsh_imm || i.code == op::rsh_imm) i.k %= 64;
+
+    const uint32_t room = count - pc - 1;
+    i.jt = static_cast<uint8_t>(room ? rng() % room : 0);
+    i.jf = static_cast<uint8_t>(room ? rng() % room : 0);
+  }
+
+  out[count - 1].code = rng() % 2 ? op::ret_a : op::ret_imm;
+
+  // Break about one in eight on purpose
+  if (rng() % 8 == 0)
+  {
+    insn& victim = out[rng() % count];
+
+    switch (rng() % 5)
+    {
+      case 0: victim.code  = static_cast<op>(static_cast<uint32_t>(op::op_count) + rng() % 8); break;
+      case 1: victim.code  = op::ld_field; victim.field = static_cast<uint8_t>(field_count + rng() % 8); break;
+      case 2: victim.code  = op::rsh_imm;  victim.k = 64 + rng() % 64; break;
+      case 3: victim.code  = op::jeq;      victim.jt = 0xff; break;
+      case 4: out[count - 1].code = op::add_imm; break;
+    }
+  }
+
+  return count;
+}
+
+static auto random_event(std::mt19937_64& rng) -> event
+{
+  event current = {};
+  for (uint64_t& value : current.fields) value = random_k(rng);
+  return current;
+}
+
+int main()
+{
+  std::mt19937_64 rng(0x6b72616b);
+
+  uint64_t loaded = 0, refused = 0, runs = 0;
+
+  for (uint32_t round = 0; round < 200000; ++round)
+  {
+    insn source[32];
+    const uint32_t count = random_program(rng, source);
+
+    program compiled;
+    memset(&compiled, 0xcc, sizeof compiled);
+
+    const load_status validated = validate(source, count);
+    const load_status status    = compile(source, count, compiled);
+
+    CHECK(status == validated);
+
+    if (status != load_status::ok)
+    {
+      // Untouched on failure
+      CHECK(compiled.length == 0xcccccccc);
+      ++refused;
+      continue;
+    }
+
+    ++loaded;
+    CHECK(compiled.length != 0 && compiled.length <= count && compiled.source_length == count);
+
+    for (uint32_t e = 0; e < 16; ++e, ++runs)
+    {
+      const event current = random_event(rng);
+
+      if (!CHECK(run(compiled, current) == interpret(source, count, current)))
+      {
+        fprintf(stderr, "  round %u, %u instructions\n", round, count);
+        return check::finish("event_filter_fuzz");
+      }
+    }
+  }
+
+  // Refused outright
+  CHECK(validate(nullptr, 1) == load_status::empty);
+  CHECK(validate(nullptr, 0) == load_status::empty);
+
+  static insn too_long[max_insns + 1] = {};
+  too_long[max_insns].code = op::ret_a;
+  CHECK(validate(too_long, max_insns + 1) == load_status::too_long);
+
+  printf("%llu loaded, %llu refused, %llu runs compared\n", (unsigned long long)loaded,
+         (unsigned long long)refused, (unsigned long long)runs);
+
+  CHECK(loaded > 100000 && refused > 10000);
+  return check::finish("event_filter_fuzz");
+}
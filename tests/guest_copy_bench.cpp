@@ -0,0 +1,171 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <guest_copy.hpp>
+#include <check.hpp>
+
+//
+// What merging runs and batching buys over a walk and a copy per page, on
+// simulated memory: a 64 KB contiguous read, 64 small reads out of 4 pages,
+// and a 64 KB write, whose first pass has every A/D bit to set.
+//
+
+using namespace ia32e::walk;
+
+namespace
+{
+  struct simulated
+  {
+    std::vector<uint8_t> ram = std::vector<uint8_t>(16u << 20);
+    context              paging = {};
+
+    auto entry(const uint64_t gpa) -> uint64_t&
+    {
+      return *reinterpret_cast<uint64_t*>(&ram[gpa]);
+    }
+
+    auto translate(const uint64_t va, const uint32_t access, translation& result) -> status
+    {
+      const auto read_entry = [this](const uint64_t gpa, uint64_t& value) -> bool
+      {
+        value = entry(gpa);
+        return true;
+      };
+
+      const auto update_entry = [this](const uint64_t gpa, const uint64_t expected, const uint64_t desired) -> bool
+      {
+        if (entry(gpa) != expected) return false;
+
+        entry(gpa) = desired;
+        return true;
+      };
+
+      return ia32e::walk::translate(paging, va, access, read_entry, update_entry, result);
+    }
+
+    auto read_physical(const uint64_t gpa, void* buffer, const size_t size) -> bool
+    {
+      memcpy(buffer, &ram[gpa], size);
+      return true;
+    }
+
+    auto write_physical(const uint64_t gpa, const void* buffer, const size_t size) -> bool
+    {
+      memcpy(&ram[gpa], buffer, size);
+      return true;
+    }
+  };
+};
+
+int main(int argc, char** argv)
+{
+  const uint64_t iterations = check::quick(argc, argv) ? 2000 : 100000;
+  constexpr uint64_t pages  = 16;
+
+  static simulated memory;
+
+  // PML4 0x1000, PDPT 0x2000, PD 0x3000, PT 0x4000, data from 1 MB
+  const uint64_t base = 0xffff800000000000ull;
+
+  memory.paging = { 0x1000, false, true, true };
+  memory.entry(0x1000 + ((base >> 39) & 0x1ff) * 8) = 0x2000 | entry_present | entry_write;
+  memory.entry(0x2000 + ((base >> 30) & 0x1ff) * 8) = 0x3000 | entry_present | entry_write;
+  memory.entry(0x3000 + ((base >> 21) & 0x1ff) * 8) = 0x4000 | entry_present | entry_write;
+
+  for (uint64_t page = 0; page < 512; ++page)
+  {
+    memory.entry(0x4000 + page * 8) = (0x100000 + page * page_size_4k) | entry_present | entry_write;
+  }
+
+  std::vector<uint8_t> buffer(pages * page_size_4k);
+
+  const double per_page_us = check::nanoseconds_per(iterations, [&](uint64_t)
+  {
+    for (uint64_t page = 0; page < pages; ++page)
+    {
+      translation result{};
+      memory.translate(base + page * page_size_4k, access_read, result);
+      memory.read_physical(result.gpa, buffer.data() + page * page_size_4k, page_size_4k);
+    }
+  }) / 1000;
+
+  const double merged_us = check::nanoseconds_per(iterations, [&](uint64_t)
+  {
+    guest_copy::read(memory, base, buffer.data(), buffer.size());
+  }) / 1000;
+
+  // 64 structures of 24 bytes, 16 to a page
+  constexpr size_t small = 64;
+
+  std::vector<uint8_t>            structures(small * 24);
+  std::vector<guest_copy::segment> segments(small);
+
+  for (size_t i = 0; i < small; ++i)
+  {
+    segments[i] = { base + (i / 16) * page_size_4k + (i % 16) * 200, &structures[i * 24], 24 };
+  }
+
+  const double one_by_one_us = check::nanoseconds_per(iterations, [&](uint64_t)
+  {
+    for (const guest_copy::segment& current : segments)
+    {
+      guest_copy::read(memory, current.va, current.buffer, current.size);
+    }
+  }) / 1000;
+
+  const double batch_us = check::nanoseconds_per(iterations, [&](uint64_t)
+  {
+    guest_copy::read_batch(memory, segments.data(), small);
+  }) / 1000;
+
+  // Writes, with every A/D bit cleared before each pass and left set
+  const double dirtying_us = check::nanoseconds_per(iterations, [&](uint64_t)
+  {
+    for (uint64_t gpa = 0x1000; gpa < 0x5000; gpa += 8) memory.entry(gpa) &= ~(entry_accessed | entry_dirty);
+
+    guest_copy::write(memory, base, buffer.data(), buffer.size());
+  }) / 1000;
+
+  const double dirty_us = check::nanoseconds_per(iterations, [&](uint64_t)
+  {
+    guest_copy::write(memory, base, buffer.data(), buffer.size());
+  }) / 1000;
+
+  CHECK((memory.entry(0x4000 + (pages - 1) * 8) & entry_dirty) != 0);
+  CHECK((memory.entry(0x4000 + pages * 8) & entry_dirty) == 0);
+
+  printf("64 KB read, per page   %7.2f us\n", per_page_us);
+  printf("64 KB read, merged     %7.2f us\n", merged_us);
+  printf("64 x 24 B, one by one  %7.2f us\n", one_by_one_us);
+  printf("64 x 24 B, batched     %7.2f us\n", batch_us);
+  printf("64 KB write, A/D clear %7.2f us (clearing included)\n", dirtying_us);
+  printf("64 KB write, A/D set   %7.2f us\n", dirty_us);
+
+  return check::finish("guest_copy_bench");
+}
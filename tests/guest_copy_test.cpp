@@ -0,0 +1,311 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <guest_copy.hpp>
+#include <check.hpp>
+
+//
+// guest_copy over simulated physical memory: runs merged across contiguous
+// pages, scattered ones, failures part way through, batches, and the A/D
+// bits writes leave behind.
+//
+
+using namespace ia32e::walk;
+
+namespace
+{
+  struct simulated
+  {
+    std::vector<uint8_t> ram = std::vector<uint8_t>(64u << 20);
+    uint64_t             next_table = page_size_4k;
+    context              paging     = {};
+    size_t               translates = 0;
+    size_t               copies     = 0;
+    uint32_t             collisions = 0;      // exchanges to fail, the guest raced us
+    bool                 unmapping  = false;  // by clearing P, or an ignored bit
+
+    auto table() -> uint64_t
+    {
+      const uint64_t page = next_table;
+      next_table += page_size_4k;
+      return page;
+    }
+
+    auto entry(const uint64_t gpa) -> uint64_t&
+    {
+      return *reinterpret_cast<uint64_t*>(&ram[gpa]);
+    }
+
+    auto translate(const uint64_t va, const uint32_t access, translation& result) -> status
+    {
+      ++translates;
+
+      const auto read_entry = [this](const uint64_t gpa, uint64_t& value) -> bool
+      {
+        if (gpa + 8 > ram.size()) return false;
+
+        value = entry(gpa);
+        return true;
+      };
+
+      const auto update_entry = [this](const uint64_t gpa, const uint64_t expected, const uint64_t desired) -> bool
+      {
+        if (collisions != 0)
+        {
+          --collisions;
+          entry(gpa) ^= unmapping ? entry_present : 1ull << 9;
+          return false;
+        }
+
+        if (entry(gpa) != expected) return false;
+
+        entry(gpa) = desired;
+        return true;
+      };
+
+      return ia32e::walk::translate(paging, va, access, read_entry, update_entry, result);
+    }
+
+    auto read_physical(const uint64_t gpa, void* buffer, const size_t size) -> bool
+    {
+      ++copies;
+      if (gpa + size > ram.size()) return false;
+
+      memcpy(buffer, &ram[gpa], size);
+      return true;
+    }
+
+    auto write_physical(const uint64_t gpa, const void* buffer, const size_t size) -> bool
+    {
+      ++copies;
+      if (gpa + size > ram.size()) return false;
+
+      memcpy(&ram[gpa], buffer, size);
+      return true;
+    }
+  };
+
+  constexpr auto index(const uint64_t va, const int32_t level) -> uint64_t
+  {
+    return (va >> (12 + 9 * (level - 1))) & 0x1ff;
+  }
+};
+
+int main()
+{
+  static simulated memory;
+
+  const uint64_t pml4 = memory.table();
+  const uint64_t pdpt = memory.table();
+  const uint64_t pd   = memory.table();
+  const uint64_t pt   = memory.table();
+
+  memory.paging = { pml4, false, true, true };
+
+  const uint64_t base = 0xffff800000000000ull;
+
+  memory.entry(pml4 + index(base, 4) * 8) = pdpt | entry_present | entry_write;
+  memory.entry(pdpt + index(base, 3) * 8) = pd   | entry_present | entry_write;
+  memory.entry(pd   + index(base, 2) * 8) = pt   | entry_present | entry_write;
+
+  // Pages 0 - 127 contiguous from 16 MB, 128 - 254 scattered (every other
+  // page from 32 MB, backwards), 255 not present, 256 - 511 read-only
+  std::vector<uint64_t> frame(512);
+
+  for (uint64_t page = 0; page < 512; ++page)
+  {
+    if      (page < 128)  frame[page] = 0x1000000 + page * page_size_4k;
+    else if (page < 255)  frame[page] = 0x2000000 + (254 - page) * 2 * page_size_4k;
+    else if (page == 255) continue;
+    else                  frame[page] = 0x3000000 + page * page_size_4k;
+
+    memory.entry(pt + page * 8) = frame[page] | entry_present | (page < 256 ? entry_write : 0);
+  }
+
+  for (size_t i = 0x1000000; i < memory.ram.size(); ++i) memory.ram[i] = static_cast<uint8_t>(i * 7 + 3);
+
+  const auto expected = [&](const uint64_t va) -> uint8_t
+  {
+    return memory.ram[frame[(va - base) >> 12] + (va & 0xfff)];
+  };
+
+  std::vector<uint8_t> buffer(1 << 20);
+
+  // Contiguous: a translation per page, one copy
+  memory.translates = memory.copies = 0;
+
+  CHECK(guest_copy::read(memory, base + 0x10, buffer.data(), 127 * page_size_4k) == status::ok);
+  CHECK(memory.copies == 1 && memory.translates == 128);
+
+  bool same = true;
+  for (size_t i = 0; i < 127 * page_size_4k; ++i) same = same && buffer[i] == expected(base + 0x10 + i);
+  CHECK(same);
+
+  // Scattered
+  memory.translates = memory.copies = 0;
+
+  CHECK(guest_copy::read(memory, base + 128 * page_size_4k + 5, buffer.data(), 100 * page_size_4k) == status::ok);
+  CHECK(memory.translates == 101 && memory.copies == 101);
+
+  same = true;
+  for (size_t i = 0; i < 100 * page_size_4k; ++i) same = same && buffer[i] == expected(base + 128 * page_size_4k + 5 + i);
+  CHECK(same);
+
+  // Running into the page that isn't there
+  CHECK(guest_copy::read(memory, base + 254 * page_size_4k + 0xff0, buffer.data(), 0x20) == status::not_present);
+
+  // Reads leave A and D alone
+  CHECK((memory.entry(pt) & (entry_accessed | entry_dirty)) == 0);
+  CHECK((memory.entry(pml4 + index(base, 4) * 8) & entry_accessed) == 0);
+
+  // Written and read back, across a contiguous and a scattered page
+  std::vector<uint8_t> source(3 * page_size_4k + 77);
+  for (size_t i = 0; i < source.size(); ++i) source[i] = static_cast<uint8_t>(i ^ 0x5a);
+
+  CHECK(guest_copy::write(memory, base + 126 * page_size_4k + 9, source.data(), source.size()) == status::ok);
+  CHECK(guest_copy::read(memory, base + 126 * page_size_4k + 9, buffer.data(), source.size()) == status::ok);
+  CHECK(memcmp(buffer.data(), source.data(), source.size()) == 0);
+
+  // A on every level on the way, D on the pages written to and only there
+  for (uint64_t page = 126; page <= 129; ++page)
+  {
+    CHECK((memory.entry(pt + page * 8) & (entry_accessed | entry_dirty)) == (entry_accessed | entry_dirty));
+  }
+
+  CHECK((memory.entry(pt + 125 * 8) & (entry_accessed | entry_dirty)) == 0);
+  CHECK((memory.entry(pt + 130 * 8) & (entry_accessed | entry_dirty)) == 0);
+
+  CHECK((memory.entry(pml4 + index(base, 4) * 8) & (entry_accessed | entry_dirty)) == entry_accessed);
+  CHECK((memory.entry(pdpt + index(base, 3) * 8) & (entry_accessed | entry_dirty)) == entry_accessed);
+  CHECK((memory.entry(pd   + index(base, 2) * 8) & (entry_accessed | entry_dirty)) == entry_accessed);
+
+  // A write that isn't allowed doesn't touch them, one that skips the
+  // permission check (a hook patching code) still dirties the page
+  const uint64_t read_only = base + 300 * page_size_4k;
+
+  CHECK(guest_copy::write(memory, read_only, source.data(), 8) == status::protection);
+  CHECK((memory.entry(pt + 300 * 8) & (entry_accessed | entry_dirty)) == 0);
+
+  CHECK(guest_copy::write(memory, read_only, source.data(), 8, access_read) == status::ok);
+  CHECK((memory.entry(pt + 300 * 8) & entry_dirty) != 0);
+
+  // The guest unmapping the page between our read and the exchange: the
+  // walk starts over, finds it gone, and no bit lands in what's now
+  // Windows' own software PTE
+  memory.collisions = 1;
+  memory.unmapping  = true;
+
+  CHECK(guest_copy::write(memory, base + 10 * page_size_4k, source.data(), 8) == status::not_present);
+  CHECK(memory.entry(pt + 10 * 8) == (frame[10] | entry_write));
+
+  // An entry that keeps changing gives up eventually, one that settles
+  // down in time gets its bits
+  memory.unmapping  = false;
+  memory.collisions = max_update_attempts;
+
+  translation result = {};
+  CHECK(memory.translate(base + 11 * page_size_4k, access_write | access_dirty, result) == status::unreadable);
+  CHECK((memory.entry(pt + 11 * 8) & (entry_accessed | entry_dirty)) == 0);
+
+  memory.collisions = max_update_attempts - 1;
+
+  CHECK(memory.translate(base + 11 * page_size_4k, access_write | access_dirty, result) == status::ok);
+  CHECK(result.dirty && (memory.entry(pt + 11 * 8) & (entry_accessed | entry_dirty)) == (entry_accessed | entry_dirty));
+
+  // 2 MB page, D goes into the PDE
+  const uint64_t large    = 0xffff800040000000ull;
+  const uint64_t large_pd = memory.table();
+
+  memory.entry(pdpt + index(large, 3) * 8) = large_pd | entry_present | entry_write;
+  memory.entry(large_pd + index(large, 2) * 8) = 0x1000000 | entry_present | entry_write | entry_large;
+
+  CHECK(guest_copy::write(memory, large + 0x1234, source.data(), 16) == status::ok);
+  CHECK((memory.entry(large_pd + index(large, 2) * 8) & (entry_accessed | entry_dirty)) == (entry_accessed | entry_dirty));
+
+  //
+  // The cache remembers D like a TLB does: a clean entry walks again for a
+  // write, a dirty one doesn't
+  //
+
+  static tlb cache;
+
+  const auto read_entry = [](const uint64_t gpa, uint64_t& value) -> bool
+  {
+    value = memory.entry(gpa);
+    return true;
+  };
+
+  size_t exchanges = 0;
+
+  const auto update_entry = [&](const uint64_t gpa, const uint64_t old_value, const uint64_t new_value) -> bool
+  {
+    ++exchanges;
+    if (memory.entry(gpa) != old_value) return false;
+
+    memory.entry(gpa) = new_value;
+    return true;
+  };
+
+  const uint64_t clean = base + 20 * page_size_4k;
+
+  CHECK(translate_cached(cache, memory.paging, clean, access_read, read_entry, update_entry, result) == status::ok);
+  CHECK(!result.dirty && exchanges == 0);
+
+  CHECK(translate_cached(cache, memory.paging, clean, access_write | access_dirty, read_entry, update_entry, result) == status::ok);
+  CHECK(result.dirty && exchanges == 1 && (memory.entry(pt + 20 * 8) & entry_dirty) != 0);
+
+  CHECK(translate_cached(cache, memory.paging, clean, access_write | access_dirty, read_entry, update_entry, result) == status::ok);
+  CHECK(exchanges == 1 && cache.hits == 2);
+
+  // Batches: a result per segment, the page memo carried across them
+  uint8_t first[24], second[24], missing[24], last[24];
+
+  const guest_copy::segment segments[] =
+  {
+    { base + 0x100,              first,   sizeof first },
+    { base + 0x200,              second,  sizeof second },
+    { base + 255 * page_size_4k, missing, sizeof missing },
+    { base + 0x300,              last,    sizeof last },
+  };
+
+  status results[4] = {};
+  memory.translates = 0;
+
+  CHECK(guest_copy::read_batch(memory, segments, 4, results) == 3);
+  CHECK(results[0] == status::ok && results[2] == status::not_present && results[3] == status::ok);
+  CHECK(memory.translates == 2);
+
+  same = true;
+  for (size_t i = 0; i < 24; ++i) same = same && first[i] == expected(base + 0x100 + i) && last[i] == expected(base + 0x300 + i);
+  CHECK(same);
+
+  CHECK(guest_copy::read(memory, base, buffer.data(), 0) == status::ok);
+
+  return check::finish("guest_copy_test");
+}
@@ -0,0 +1,209 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <hook_transaction.hpp>
+#include <check.hpp>
+
+//
+// How long every processor is held when 1, 100 and 1000 hooks go in, as
+// one transaction against one window per hook the way inline_hook::install()
+// does it. Threads spinning on a doorbell stand in for the processors the
+// IPI brings in, one per hardware thread unless --processors says otherwise;
+// the pause is the writer's, from the first arrival to the release, and
+// leaves out what delivering the IPI costs, which one window per hook pays
+// every time as well. On a single core box there's nobody to wait for, the
+// numbers are the writes and the bookkeeping around them.
+//
+
+using namespace hk::transaction;
+
+namespace
+{
+  using clock_type = std::chrono::steady_clock;
+
+  auto now() -> uint64_t
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now().time_since_epoch()).count();
+  }
+
+  auto staged(uint8_t* target, const uint8_t fill) -> item
+  {
+    item entry = {};
+    entry.address  = reinterpret_cast<uint64_t>(target);
+    entry.writable = target;
+    entry.size     = hk::trampoline::jump_size;
+    entry.status   = item_status::staged;
+
+    memcpy(entry.expected, target, entry.size);
+    memset(entry.bytes, fill, entry.size);
+
+    return entry;
+  }
+
+  // The processors other than the writer, parked until the next window
+  struct processors
+  {
+    uint32_t                 count;
+    bool                     oversubscribed;
+    std::atomic<rendezvous*> current = nullptr;
+    std::atomic<uint32_t>    generation = 0;
+    std::atomic<uint32_t>    left = 0;
+    std::atomic<bool>        quit = false;
+    std::vector<std::thread> threads;
+
+    processors(const uint32_t total, const uint32_t hardware) : count(total), oversubscribed(total > hardware)
+    {
+      for (uint32_t self = 1; self < count; ++self)
+      {
+        threads.emplace_back([this, self]
+        {
+          for (uint32_t seen = 0;;)
+          {
+            while (generation.load(std::memory_order_acquire) == seen)
+            {
+              if (quit.load()) return;
+              relax();
+            }
+
+            seen = generation.load(std::memory_order_acquire);
+
+            join(*current.load(), self, now, [this] { relax(); });
+            left.fetch_add(1, std::memory_order_release);
+          }
+        });
+      }
+    }
+
+    ~processors()
+    {
+      quit = true;
+      for (std::thread& thread : threads) thread.join();
+    }
+
+    auto relax() const -> void
+    {
+      if (oversubscribed) std::this_thread::yield();
+      else                __builtin_ia32_pause();
+    }
+
+    // One stop-the-world window over items, returns the pause
+    auto window(item* items, const size_t item_count, const bool forward) -> uint64_t
+    {
+      rendezvous shared = {};
+      shared.items        = items;
+      shared.count        = item_count;
+      shared.forward      = forward;
+      shared.participants = count;
+      shared.writer       = 0;
+
+      left = 0;
+      current.store(&shared, std::memory_order_release);
+      generation.fetch_add(1, std::memory_order_acq_rel);
+
+      join(shared, 0, now, [this] { relax(); });
+
+      while (left.load(std::memory_order_acquire) != count - 1) relax();
+
+      CHECK(shared.result);
+      return shared.pause;
+    }
+  };
+
+  auto median(std::vector<uint64_t>& samples) -> double
+  {
+    std::sort(samples.begin(), samples.end());
+    return static_cast<double>(samples[samples.size() / 2]);
+  }
+};
+
+int main(int argc, char** argv)
+{
+  const bool quick = check::quick(argc, argv);
+
+  const uint32_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  uint32_t participants   = hardware;
+
+  for (int i = 1; i + 1 < argc; ++i)
+  {
+    if (strcmp(argv[i], "--processors") == 0) participants = std::max(1, atoi(argv[i + 1]));
+  }
+
+  processors parked(participants, hardware);
+
+  printf("%u processors in every window (%u hardware threads)\n", participants, hardware);
+
+  constexpr size_t max_hooks = 1000;
+  std::vector<uint8_t> code(max_hooks * 16);
+
+  for (const size_t hooks : { size_t(1), size_t(100), max_hooks })
+  {
+    std::vector<item> items(hooks);
+    for (size_t i = 0; i < hooks; ++i) items[i] = staged(&code[i * 16], static_cast<uint8_t>(i + 1));
+
+    const uint32_t rounds    = quick ? 10 : 500;
+    const uint32_t per_hooks = quick ? 2 : (hooks == max_hooks ? 20 : 200);
+
+    // Installed and removed as one transaction each
+    std::vector<uint64_t> batched;
+
+    for (uint32_t round = 0; round < rounds; ++round)
+    {
+      batched.push_back(parked.window(items.data(), hooks, true));
+      batched.push_back(parked.window(items.data(), hooks, false));
+    }
+
+    // One window per hook, the pauses summed over the install
+    std::vector<uint64_t> one_by_one;
+
+    for (uint32_t round = 0; round < per_hooks; ++round)
+    {
+      uint64_t total = 0;
+
+      for (size_t i = 0; i < hooks; ++i) total += parked.window(&items[i], 1, true);
+      for (size_t i = 0; i < hooks; ++i) parked.window(&items[i], 1, false);
+
+      one_by_one.push_back(total);
+    }
+
+    for (size_t i = 0; i < hooks; ++i)
+    {
+      CHECK(items[i].status == item_status::reverted && code[i * 16] == 0);
+    }
+
+    printf("%4zu hooks  one transaction %9.2f us   one window per hook %9.2f us over %zu windows\n",
+           hooks, median(batched) / 1000.0, median(one_by_one) / 1000.0, hooks);
+  }
+
+  return check::finish("hook_transaction_bench");
+}
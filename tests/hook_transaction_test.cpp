@@ -0,0 +1,128 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include <hook_transaction.hpp>
+#include <check.hpp>
+
+//
+// What a transaction does to the bytes it's given: everything lands or
+// nothing does, a conflict or an unmapped target anywhere rolls back what
+// was already written, reverting is just as all-or-nothing, and items that
+// overlap come out right both ways.
+//
+
+using namespace hk::transaction;
+
+namespace
+{
+  auto staged(uint8_t* target, const uint8_t fill, const uint8_t size = 14) -> item
+  {
+    item entry = {};
+    entry.address  = reinterpret_cast<uint64_t>(target);
+    entry.writable = target;
+    entry.size     = size;
+    entry.status   = item_status::staged;
+
+    memcpy(entry.expected, target, size);
+    memset(entry.bytes, fill, size);
+
+    return entry;
+  }
+};
+
+int main()
+{
+  uint8_t code[64];
+  uint8_t original[64];
+
+  for (uint8_t i = 0; i < sizeof code; ++i) code[i] = i;
+  memcpy(original, code, sizeof code);
+
+  // A conflict in the last item rolls back the first two
+  item items[3] = { staged(code, 0xaa), staged(code + 20, 0xbb), staged(code + 40, 0xcc) };
+  items[2].expected[0] ^= 1;
+
+  CHECK(!transfer(items, 3, true));
+  CHECK(memcmp(code, original, sizeof code) == 0);
+  CHECK(items[0].status == item_status::rolled_back && items[1].status == item_status::rolled_back);
+  CHECK(items[2].status == item_status::conflict);
+
+  items[2].expected[0] ^= 1;
+  for (item& entry : items) entry.status = item_status::staged;
+
+  CHECK(transfer(items, 3, true));
+  CHECK(code[0] == 0xaa && code[20] == 0xbb && code[40] == 0xcc);
+  CHECK(items[0].status == item_status::applied && items[2].status == item_status::applied);
+
+  // Someone wrote over the middle one, reverting leaves all three applied
+  code[25] = 0;
+
+  CHECK(!transfer(items, 3, false));
+  CHECK(items[0].status == item_status::applied && items[2].status == item_status::applied);
+  CHECK(items[1].status == item_status::conflict);
+  CHECK(code[0] == 0xaa && code[40] == 0xcc);
+
+  code[25] = 0xbb;
+
+  CHECK(transfer(items, 3, false));
+  CHECK(memcmp(code, original, sizeof code) == 0);
+  CHECK(items[0].status == item_status::reverted && items[2].status == item_status::reverted);
+
+  // The second item expects what the first one wrote over half of it
+  item overlapping[2] = { staged(code, 0x11, 8), staged(code + 4, 0x22, 8) };
+  memset(overlapping[1].expected, 0x11, 4);
+
+  CHECK(transfer(overlapping, 2, true));
+  CHECK(code[0] == 0x11 && code[3] == 0x11 && code[4] == 0x22 && code[11] == 0x22);
+  CHECK(transfer(overlapping, 2, false));
+  CHECK(memcmp(code, original, sizeof code) == 0);
+
+  // A target that couldn't be mapped fails the lot
+  item unmapped[2] = { staged(code, 0x01), {} };
+  unmapped[1].size = 4;
+
+  CHECK(!transfer(unmapped, 2, true));
+  CHECK(unmapped[0].status == item_status::rolled_back && unmapped[1].status == item_status::unmapped);
+  CHECK(memcmp(code, original, sizeof code) == 0);
+
+  // Single participant rendezvous, the writer doesn't wait on anyone
+  item single = staged(code, 0x5a);
+  rendezvous window = {};
+  window.items        = &single;
+  window.count        = 1;
+  window.forward      = true;
+  window.participants = 1;
+
+  uint64_t ticks = 0;
+  join(window, 0, [&ticks] { return ticks += 10; }, [] {});
+
+  CHECK(window.result && window.released == 1 && window.arrived == 1);
+  CHECK(window.pause == 10 && code[0] == 0x5a);
+
+  return check::finish("hook_transaction_test");
+}
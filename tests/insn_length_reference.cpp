@@ -0,0 +1,534 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <elf.h>
+#include <chrono>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm-c/Disassembler.h>
+#include <llvm-c/Target.h>
+
+#include <insn_length.hpp>
+
+//
+// The length decoder against LLVM's MC disassembler, which capstone's x86
+// tables are generated from. Only built when CMake finds LLVM.
+//
+//   insn_length_reference check   [--fuzz N] <elf>...
+//       every instruction of each file's .text, then N random encodings
+//       biased towards prefixes and the VEX/XOP/EVEX escapes: length,
+//       RIP-relative operand and relative branch have to agree
+//
+//   insn_length_reference capture [--fuzz N] <elf>...
+//       one instruction per distinct mnemonic, operand kinds and sizing out
+//       of the same, as the initializers insn_length_vectors.inc is made of
+//
+//   insn_length_reference bench   <elf>
+//       both over the first 8 MB of .text
+//
+// A few encodings are left out because LLVM and the processor disagree on
+// them: prefixes LLVM splits off on their own, VEX/XOP/EVEX after a 66, F2,
+// F3, LOCK or REX prefix and VEX encoded legacy opcodes (all #UD), and near
+// branches with 66 next to F2/F3 or REX.W, which are rel32 on AMD.
+//
+
+using namespace ia32e::insn;
+
+extern "C"
+{
+  void LLVMInitializeX86TargetInfo();
+  void LLVMInitializeX86TargetMC();
+  void LLVMInitializeX86Disassembler();
+}
+
+namespace
+{
+  LLVMDisasmContextRef disassembler = nullptr;
+
+  // Length per LLVM, 0 if it doesn't decode. text gets the AT&T form.
+  auto reference(const uint8_t* code, const size_t size, char (&text)[256]) -> size_t
+  {
+    return LLVMDisasmInstruction(disassembler, const_cast<uint8_t*>(code), size, 0, text, sizeof text);
+  }
+
+  auto text_section(const char* path) -> std::vector<uint8_t>
+  {
+    std::vector<uint8_t> file;
+
+    if (FILE* handle = fopen(path, "rb"))
+    {
+      fseek(handle, 0, SEEK_END);
+      file.resize(static_cast<size_t>(ftell(handle)));
+      fseek(handle, 0, SEEK_SET);
+
+      if (fread(file.data(), 1, file.size(), handle) != file.size()) file.clear();
+      fclose(handle);
+    }
+
+    if (file.size() < sizeof(Elf64_Ehdr) || memcmp(file.data(), ELFMAG, SELFMAG) != 0) return {};
+
+    const auto* header = reinterpret_cast<const Elf64_Ehdr*>(file.data());
+    if (header->e_ident[EI_CLASS] != ELFCLASS64 || header->e_shstrndx >= header->e_shnum) return {};
+    if (header->e_shoff + header->e_shnum * sizeof(Elf64_Shdr) > file.size()) return {};
+
+    const auto* sections = reinterpret_cast<const Elf64_Shdr*>(file.data() + header->e_shoff);
+    const Elf64_Shdr& names = sections[header->e_shstrndx];
+
+    for (uint32_t index = 0; index < header->e_shnum; ++index)
+    {
+      const Elf64_Shdr& section = sections[index];
+
+      if (names.sh_offset + section.sh_name >= file.size()) continue;
+      if (strcmp(reinterpret_cast<const char*>(file.data() + names.sh_offset + section.sh_name), ".text") != 0) continue;
+      if (section.sh_offset + section.sh_size > file.size()) return {};
+
+      return { file.begin() + section.sh_offset, file.begin() + section.sh_offset + section.sh_size };
+    }
+
+    return {};
+  }
+
+  // The AT&T text split into words, prefixes LLVM prints on their own dropped
+  auto words(const char* text) -> std::vector<std::string>
+  {
+    static const char* const prefixes[] = { "lock", "rep", "repne", "repe", "xacquire", "xrelease", "cs", "ds",
+                                            "es", "fs", "gs", "ss", "data16", "addr32", "notrack", "bnd" };
+
+    std::vector<std::string> result;
+    std::string current;
+
+    for (const char* cursor = text;; ++cursor)
+    {
+      if (*cursor != '\0' && *cursor != ' ' && *cursor != '\t')
+      {
+        current += *cursor;
+        continue;
+      }
+
+      bool prefix = false;
+      for (const char* name : prefixes) prefix |= current == name;
+
+      if (!current.empty() && !(prefix && result.empty())) result.push_back(current);
+      current.clear();
+
+      if (*cursor == '\0') break;
+    }
+
+    return result;
+  }
+
+  auto starts_with(const std::string& word, const char* prefix) -> bool
+  {
+    return word.compare(0, strlen(prefix), prefix) == 0;
+  }
+
+  // LLVM decoded nothing but prefixes, rex included
+  auto prefix_only(const char* text) -> bool
+  {
+    const std::vector<std::string> parts = words(text);
+    return parts.empty() || (parts.size() == 1 && (parts[0] == "rex64" || starts_with(parts[0], "rex")));
+  }
+
+  auto vector_mnemonic(const std::string& mnemonic) -> bool
+  {
+    static const char* const names[] = { "andn", "bextr", "blsi", "blsmsk", "blsr", "bzhi", "mulx", "pdep",
+                                         "pext", "rorx", "sarx", "shlx", "shrx", "blc", "blsfill", "blsic",
+                                         "t1mskc", "tzmsk", "llwpcb", "slwpcb", "lwp", "k", "tile",
+                                         "ldtilecfg", "sttilecfg", "tdp", "v" };
+
+    for (const char* name : names)
+    {
+      if (starts_with(mnemonic, name)) return true;
+    }
+
+    return false;
+  }
+
+  // A VEX/XOP/EVEX escape behind 66, F2, F3, LOCK or REX
+  auto vector_after_prefix(const uint8_t* code, const size_t size) -> bool
+  {
+    bool offending = false;
+
+    for (size_t at = 0; at < size; ++at)
+    {
+      const uint8_t byte = code[at];
+
+      if (byte == 0x66 || byte == 0xf2 || byte == 0xf3 || byte == 0xf0 || (byte & 0xf0) == 0x40)
+      {
+        offending = true;
+        continue;
+      }
+
+      if (byte == 0x2e || byte == 0x3e || byte == 0x26 || byte == 0x36 || byte == 0x64 || byte == 0x65 || byte == 0x67)
+      {
+        continue;
+      }
+
+      return offending && (byte == 0xc4 || byte == 0xc5 || byte == 0x62 || byte == 0x8f);
+    }
+
+    return false;
+  }
+
+  struct tally
+  {
+    uint64_t compared       = 0;
+    uint64_t length         = 0;
+    uint64_t rip_relative   = 0;
+    uint64_t branch         = 0;
+    uint64_t prefix_only    = 0;
+    uint64_t undefined      = 0;        // #UD on hardware, see above
+    uint64_t branch_size    = 0;
+  };
+
+  auto hex(const uint8_t* code, const size_t size) -> std::string
+  {
+    std::string text;
+    char byte[4];
+
+    for (size_t at = 0; at < size; ++at)
+    {
+      snprintf(byte, sizeof byte, at == 0 ? "%02x" : " %02x", code[at]);
+      text += byte;
+    }
+
+    return text;
+  }
+
+  auto compare(const uint8_t* code, const size_t size, tally& counts) -> size_t
+  {
+    char text[256];
+    const size_t expected = reference(code, size, text);
+    if (expected == 0) return 0;
+
+    if (prefix_only(text))
+    {
+      ++counts.prefix_only;
+      return expected;
+    }
+
+    instruction decoded;
+    const bool decodes = decode(code, size, decoded);
+
+    const std::vector<std::string> parts = words(text);
+    const std::string& mnemonic = parts[0];
+
+    if ((!decodes && vector_after_prefix(code, expected)) ||
+        (decodes && decoded.encoding != encoding_legacy && !vector_mnemonic(mnemonic)))
+    {
+      ++counts.undefined;
+      return expected;
+    }
+
+    if (decodes && decoded.relative_branch && (decoded.prefixes & prefix_operand_size) != 0 &&
+        ((decoded.prefixes & (prefix_rep | prefix_repne)) != 0 || (decoded.rex & 8) != 0))
+    {
+      ++counts.branch_size;
+      return expected;
+    }
+
+    ++counts.compared;
+
+    if (!decodes || decoded.length != expected)
+    {
+      if (counts.length++ < 20)
+      {
+        printf("  length %zu, decoder %d: %s  %s\n", expected, decodes ? decoded.length : 0,
+               hex(code, expected).c_str(), text);
+      }
+
+      return expected;
+    }
+
+    const bool rip_relative = strstr(text, "(%rip)") != nullptr || strstr(text, "(%eip)") != nullptr;
+
+    if (rip_relative != decoded.rip_relative && counts.rip_relative++ < 20)
+    {
+      printf("  rip relative %d, decoder %d: %s  %s\n", rip_relative, decoded.rip_relative,
+             hex(code, expected).c_str(), text);
+    }
+
+    const bool branch = parts.size() > 1 &&
+                        (mnemonic[0] == 'j' || starts_with(mnemonic, "loop") || starts_with(mnemonic, "call") ||
+                         starts_with(mnemonic, "xbegin")) &&
+                        (parts[1][0] == '-' || isdigit(static_cast<unsigned char>(parts[1][0])));
+
+    if (branch != decoded.relative_branch && counts.branch++ < 20)
+    {
+      printf("  relative branch %d, decoder %d: %s  %s\n", branch, decoded.relative_branch,
+             hex(code, expected).c_str(), text);
+    }
+
+    return expected;
+  }
+
+  // Random bytes behind a random mix of prefixes and an escape
+  template<class visit_t>
+  auto fuzz(const uint64_t count, const uint64_t seed, visit_t visit) -> void
+  {
+    constexpr uint8_t prefixes[] = { 0x66, 0x67, 0xf2, 0xf3, 0xf0, 0x2e, 0x3e, 0x26, 0x64, 0x65, 0x36 };
+    constexpr uint8_t evex_maps[] = { 1, 2, 3, 5, 6 };
+
+    std::mt19937_64 random(seed);
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      uint8_t code[16];
+      for (uint8_t& byte : code) byte = static_cast<uint8_t>(random());
+
+      size_t at = 0;
+      const uint32_t prefix_count = random() % 4;
+
+      for (uint32_t j = 0; j < prefix_count && at < 3; ++j) code[at++] = prefixes[random() % sizeof prefixes];
+
+      switch (random() % 8)
+      {
+        case 0: if (random() % 2) code[at++] = static_cast<uint8_t>(0x40 | (random() & 15)); break;
+        case 1: code[at++] = 0x0f; break;
+        case 2: code[at++] = 0x0f; code[at++] = 0x38; break;
+        case 3: code[at++] = 0x0f; code[at++] = 0x3a; break;
+        case 4: code[at++] = 0xc4; code[at++] = static_cast<uint8_t>((random() & 0xe0) | (1 + random() % 3)); break;
+        case 5: code[at++] = 0xc5; break;
+
+        case 6:
+          code[at++] = 0x62;
+          code[at++] = static_cast<uint8_t>((random() & 0xf0) | evex_maps[random() % sizeof evex_maps]);
+          code[at++] = static_cast<uint8_t>(random() | 4);
+          break;
+
+        case 7:
+          if (random() % 4 == 0)
+          {
+            code[at++] = 0x8f;
+            code[at++] = static_cast<uint8_t>((random() & 0xe0) | (8 + random() % 3));
+          }
+          break;
+      }
+
+      visit(code, max_length);
+    }
+  }
+
+  // Instruction after instruction, visit returns how long LLVM says each is
+  template<class visit_t>
+  auto walk(const std::vector<uint8_t>& text, visit_t visit) -> void
+  {
+    for (size_t at = 0; at < text.size();)
+    {
+      const size_t size     = text.size() - at < max_length ? text.size() - at : max_length;
+      const size_t expected = visit(&text[at], size);
+
+      at += expected != 0 ? expected : 1;
+    }
+  }
+
+  // --fuzz N among the file names
+  auto fuzz_count(int& argc, char** argv) -> uint64_t
+  {
+    uint64_t count = 0;
+
+    for (int i = 0; i < argc; ++i)
+    {
+      if (strcmp(argv[i], "--fuzz") != 0 || i + 1 >= argc) continue;
+
+      count = strtoull(argv[i + 1], nullptr, 0);
+
+      for (int j = i; j + 2 < argc; ++j) argv[j] = argv[j + 2];
+      argc -= 2;
+      break;
+    }
+
+    return count;
+  }
+
+  auto check(int argc, char** argv) -> int
+  {
+    const uint64_t fuzzed = fuzz_count(argc, argv);
+
+    tally counts;
+    const auto compare_one = [&counts](const uint8_t* code, const size_t size) { return compare(code, size, counts); };
+
+    for (int i = 0; i < argc; ++i)
+    {
+      const std::vector<uint8_t> text = text_section(argv[i]);
+
+      if (text.empty())
+      {
+        printf("%s: no .text\n", argv[i]);
+        return 1;
+      }
+
+      const uint64_t before = counts.compared;
+      walk(text, compare_one);
+
+      printf("%s: %llu instructions\n", argv[i], static_cast<unsigned long long>(counts.compared - before));
+    }
+
+    if (fuzzed != 0)
+    {
+      const uint64_t before = counts.compared;
+      fuzz(fuzzed, 1, compare_one);
+
+      printf("fuzzed: %llu instructions\n", static_cast<unsigned long long>(counts.compared - before));
+    }
+
+    printf("left out: %llu prefixes on their own, %llu #UD encodings, %llu 66 branches with F2/F3 or REX.W\n",
+           static_cast<unsigned long long>(counts.prefix_only), static_cast<unsigned long long>(counts.undefined),
+           static_cast<unsigned long long>(counts.branch_size));
+
+    printf("%llu compared: %llu length, %llu RIP-relative and %llu relative branch differences\n",
+           static_cast<unsigned long long>(counts.compared), static_cast<unsigned long long>(counts.length),
+           static_cast<unsigned long long>(counts.rip_relative), static_cast<unsigned long long>(counts.branch));
+
+    return counts.length == 0 && counts.rip_relative == 0 && counts.branch == 0 ? 0 : 1;
+  }
+
+  //
+  // One vector per shape: the mnemonic, whether each operand is an
+  // immediate, memory or a register, and how the decoder sized the parts
+  //
+
+  auto shape_of(const char* text, const instruction& decoded) -> std::string
+  {
+    const std::vector<std::string> parts = words(text);
+    std::string shape = parts[0];
+
+    for (size_t index = 1; index < parts.size(); ++index)
+    {
+      const std::string& operand = parts[index];
+
+      if      (operand[0] == '$')                       shape += " i";
+      else if (operand.find('(') != std::string::npos) shape += " m";
+      else if (operand[0] == '%')                       shape += " r";
+      else                                              shape += " o";
+    }
+
+    char sizes[32];
+    snprintf(sizes, sizeof sizes, " %u/%u/%u/%u", decoded.encoding, decoded.displacement_size,
+             decoded.immediate_size, decoded.rip_relative);
+
+    return shape + sizes;
+  }
+
+  auto capture(int argc, char** argv) -> int
+  {
+    const uint64_t fuzzed = fuzz_count(argc, argv);
+
+    std::set<std::string> seen;
+
+    const auto capture_one = [&seen](const uint8_t* code, const size_t size) -> size_t
+    {
+      char disassembly[256];
+
+      tally counts;
+      const size_t expected = compare(code, size, counts);
+
+      instruction decoded;
+
+      // Only what was compared and agrees, the rest is reported by check
+      if (counts.compared == 1 && counts.length + counts.rip_relative + counts.branch == 0 &&
+          reference(code, size, disassembly) != 0 && decode(code, size, decoded) &&
+          seen.insert(shape_of(disassembly, decoded)).second)
+      {
+        printf("  { \"%s\", %zu, %d, %d },\n", hex(code, expected).c_str(), expected,
+               decoded.rip_relative, decoded.relative_branch);
+      }
+
+      return expected;
+    };
+
+    for (int i = 0; i < argc; ++i) walk(text_section(argv[i]), capture_one);
+
+    if (fuzzed != 0) fuzz(fuzzed, 1, capture_one);
+
+    return 0;
+  }
+
+  auto bench(const char* path) -> int
+  {
+    std::vector<uint8_t> text = text_section(path);
+    if (text.size() > (8u << 20)) text.resize(8u << 20);
+
+    using clock_type = std::chrono::steady_clock;
+
+    char disassembly[256];
+    uint64_t instructions = 0;
+
+    const auto start = clock_type::now();
+
+    for (size_t at = 0; at + max_length < text.size(); ++instructions)
+    {
+      const size_t size = reference(&text[at], max_length, disassembly);
+      at += size != 0 ? size : 1;
+    }
+
+    const auto middle = clock_type::now();
+
+    for (size_t at = 0; at + max_length < text.size();)
+    {
+      const size_t size = length(&text[at], max_length);
+      at += size != 0 ? size : 1;
+    }
+
+    const auto end = clock_type::now();
+
+    const double llvm_ns    = std::chrono::duration<double, std::nano>(middle - start).count() / instructions;
+    const double decoder_ns = std::chrono::duration<double, std::nano>(end - middle).count() / instructions;
+
+    printf("LLVM %.1f ns, decoder %.2f ns per instruction (%.0fx), %llu instructions\n", llvm_ns, decoder_ns,
+           llvm_ns / decoder_ns, static_cast<unsigned long long>(instructions));
+
+    return 0;
+  }
+};
+
+int main(int argc, char** argv)
+{
+  LLVMInitializeX86TargetInfo();
+  LLVMInitializeX86TargetMC();
+  LLVMInitializeX86Disassembler();
+
+  disassembler = LLVMCreateDisasmCPU("x86_64-unknown-linux-gnu", "znver3", nullptr, 0, nullptr, nullptr);
+
+  if (disassembler == nullptr || argc < 3)
+  {
+    fprintf(stderr, "usage: %s check [--fuzz count] elf... | capture [--fuzz count] elf... | bench elf\n", argv[0]);
+    return 2;
+  }
+
+  if (strcmp(argv[1], "check") == 0)   return check(argc - 2, argv + 2);
+  if (strcmp(argv[1], "capture") == 0) return capture(argc - 2, argv + 2);
+  if (strcmp(argv[1], "bench") == 0)   return bench(argv[2]);
+
+  return 2;
+}
@@ -0,0 +1,122 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <insn_length.hpp>
+#include <check.hpp>
+
+//
+// The length decoder against instructions LLVM's disassembler sized, see
+// insn_length_vectors.inc for where they come from. Each has to decode to
+// the same length and flags whatever follows it, and not at all when it's
+// cut short. insn_length_reference compares whole binaries where LLVM is
+// around.
+//
+
+using namespace ia32e::insn;
+
+namespace
+{
+  struct vector
+  {
+    const char* bytes;
+    size_t      length;
+    bool        rip_relative;
+    bool        relative_branch;
+  };
+
+  constexpr vector vectors[] =
+  {
+#include "insn_length_vectors.inc"
+  };
+
+  auto parse(const char* text, uint8_t* out) -> size_t
+  {
+    size_t count = 0;
+
+    for (char* end = nullptr; *text != '\0' && count < max_length; text = end)
+    {
+      out[count++] = static_cast<uint8_t>(strtoul(text, &end, 16));
+    }
+
+    return count;
+  }
+};
+
+int main()
+{
+  uint32_t failed = 0;
+
+  for (const vector& expected : vectors)
+  {
+    uint8_t code[max_length + 1];
+    memset(code, 0xcc, sizeof code);
+
+    const size_t size = parse(expected.bytes, code);
+    instruction decoded;
+
+    // Followed by int3s, exactly as long, and cut short
+    const bool padded  = decode(code, max_length, decoded) && decoded.length == expected.length &&
+                         decoded.rip_relative == expected.rip_relative &&
+                         decoded.relative_branch == expected.relative_branch;
+    const bool exact   = length(code, size) == expected.length;
+    const bool short_  = length(code, size - 1) == 0;
+
+    if (!CHECK(size == expected.length && padded && exact && short_) && failed++ < 20)
+    {
+      fprintf(stderr, "  %s: length %zu rip %d branch %d, decoded %d rip %d branch %d\n", expected.bytes,
+              expected.length, expected.rip_relative, expected.relative_branch, decoded.length,
+              decoded.rip_relative, decoded.relative_branch);
+    }
+  }
+
+  // Past 15 bytes nothing decodes, whatever the prefixes
+  uint8_t prefixed[max_length + 1];
+  memset(prefixed, 0x66, sizeof prefixed);
+  prefixed[14] = 0x90;
+
+  CHECK(length(prefixed, sizeof prefixed) == 15);
+
+  prefixed[14] = 0x66;
+  prefixed[15] = 0x90;
+
+  CHECK(length(prefixed, sizeof prefixed) == 0);
+
+  // Removed in long mode
+  const uint8_t removed[] = { 0x06, 0x27, 0x60, 0xd4, 0xce, 0x9a };
+
+  for (const uint8_t opcode : removed)
+  {
+    const uint8_t code[8] = { opcode };
+    CHECK(length(code, sizeof code) == 0);
+  }
+
+  printf("%zu captured instructions\n", sizeof vectors / sizeof vectors[0]);
+  return check::finish("insn_length_test");
+}
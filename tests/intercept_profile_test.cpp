@@ -0,0 +1,145 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#include <intercept_profile.hpp>
+#include <check.hpp>
+
+using namespace intercept_profile;
+
+//
+// What a vCPU ends up intercepting for each profile on machines with and
+// without DecodeAssists and INVPCID, when a cache of translations can trust
+// that, and the hypercall argument and per-vCPU switch around it.
+//
+
+static auto same(const intercept_set& a, const intercept_set& b) -> bool
+{
+  return a.misc3 == b.misc3 && a.misc4 == b.misc4 && a.cr_write == b.cr_write && a.misc5 == b.misc5;
+}
+
+int main()
+{
+  // Everything there, the profiles go in as written
+  for (uint32_t profile = 0; profile < profile_count; ++profile)
+  {
+    CHECK(same(resolve(static_cast<id>(profile), true, true), profiles[profile]));
+  }
+
+  // Out of range falls back to standard
+  CHECK(same(resolve(profile_count, true, true), profiles[standard]));
+  CHECK(same(resolve(static_cast<id>(0xff), true, true), profiles[standard]));
+
+  // No DecodeAssists, nothing needing the operands stays
+  const intercept_set blind = resolve(tracing, false, true);
+  CHECK(blind.cr_write == 0);
+  CHECK((blind.misc3 & misc3_invlpg) == 0);
+  CHECK(blind.misc5 == 0);
+  CHECK((blind.misc3 & misc3_rdtsc) != 0 && (blind.misc4 & misc4_rdtscp) != 0);
+  CHECK((blind.misc3 & required_misc3) == required_misc3 && (blind.misc4 & required_misc4) == required_misc4);
+
+  // No INVPCID, only that bit goes
+  const intercept_set no_invpcid = resolve(tracing, true, false);
+  CHECK(no_invpcid.misc5 == 0);
+  CHECK(no_invpcid.cr_write == (cr_cr3 | cr_cr4) && (no_invpcid.misc3 & misc3_invlpg) != 0);
+
+  // Neither touches profiles that didn't ask for them
+  CHECK(same(resolve(standard, false, false), profiles[standard]));
+  CHECK(same(resolve(minimal, false, false), profiles[minimal]));
+
+  // Only tracing sees every invalidation, and only with the operands decoded
+  CHECK(tracks_invalidations(resolve(tracing, true, true), true, false));
+  CHECK(tracks_invalidations(resolve(tracing, true, false), false, false));
+  CHECK(!tracks_invalidations(resolve(tracing, false, true), true, false));
+  CHECK(!tracks_invalidations(resolve(standard, true, true), true, false));
+  CHECK(!tracks_invalidations(resolve(minimal, true, true), true, false));
+
+  // INVPCID on the processor but not intercepted, it slips past
+  CHECK(!tracks_invalidations(resolve(tracing, true, false), true, false));
+
+  // INVLPGB reaches other processors without an exit on them
+  CHECK(!tracks_invalidations(resolve(tracing, true, true), true, true));
+  CHECK(!tracks_invalidations(resolve(tracing, true, false), false, true));
+
+  // One missing piece is enough
+  intercept_set partial = resolve(tracing, true, true);
+  partial.cr_write = cr_cr3;
+  CHECK(!tracks_invalidations(partial, true, false));
+
+  partial = resolve(tracing, true, true);
+  partial.misc3 &= ~misc3_invlpg;
+  CHECK(!tracks_invalidations(partial, true, false));
+
+  // The intercept clean bit goes when any vector changes, nothing else does
+  constexpr uint64_t all_clean = ~0ull;
+
+  CHECK(clean_after(profiles[standard], profiles[standard], all_clean) == all_clean);
+  CHECK(clean_after(profiles[standard], profiles[minimal], all_clean) == (all_clean & ~clean_intercepts));
+  CHECK(clean_after(profiles[standard], profiles[tracing], 0x30) == 0x30);
+  CHECK(clean_after(profiles[minimal], profiles[tracing], 0x31) == 0x30);
+
+  intercept_set cr_only = profiles[standard];
+  cr_only.cr_write = cr_cr4;
+  CHECK(clean_after(profiles[standard], cr_only, all_clean) == (all_clean & ~clean_intercepts));
+
+  intercept_set misc5_only = profiles[standard];
+  misc5_only.misc5 = misc5_invpcid;
+  CHECK(clean_after(profiles[standard], misc5_only, all_clean) == (all_clean & ~clean_intercepts));
+
+  // Hypercall argument round trips, anything past bit 39 or an unknown profile is refused
+  uint32_t processor = 0;
+  id       profile   = standard;
+
+  CHECK(decode(encode(5, minimal), processor, profile) && processor == 5 && profile == minimal);
+  CHECK(decode(encode(all_processors, tracing), processor, profile) && processor == all_processors && profile == tracing);
+  CHECK(decode(encode(0, standard), processor, profile) && processor == 0 && profile == standard);
+
+  CHECK(!decode(static_cast<uint64_t>(profile_count) << 32, processor, profile));
+  CHECK(!decode(1ull << 40 | encode(1, minimal), processor, profile));
+  CHECK(!decode(1ull << 63, processor, profile));
+
+  // A request is taken once, asking for what's active or for garbage isn't a switch
+  vcpu_state state = { standard, standard };
+  id         next  = standard;
+
+  CHECK(!take_pending(state, next));
+
+  request(state, tracing);
+  CHECK(take_pending(state, next) && next == tracing && state.active == tracing);
+  CHECK(!take_pending(state, next));
+
+  request(state, minimal);
+  request(state, tracing);
+  CHECK(!take_pending(state, next) && state.active == tracing);
+
+  request(state, profile_count);
+  CHECK(!take_pending(state, next) && state.active == tracing);
+
+  request(state, standard);
+  CHECK(take_pending(state, next) && next == standard);
+
+  return check::finish("intercept_profile_test");
+}
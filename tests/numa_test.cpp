@@ -0,0 +1,124 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#include <numa.hpp>
+#include <check.hpp>
+
+using namespace numa;
+
+static auto two_groups() -> processor_mask::topology
+{
+  processor_mask::topology layout = {};
+
+  layout.group_count    = 2;
+  layout.first_index[0] = 0;
+  layout.group_size[0]  = 64;
+  layout.first_index[1] = 64;
+  layout.group_size[1]  = 64;
+
+  return layout;
+}
+
+int main()
+{
+  const processor_mask::topology layout = two_groups();
+  const processor_mask::set everything = processor_mask::all(layout);
+
+  static node_map map;
+
+  // 3 nodes over 2 groups of 64: node 0 in group 0, node 1 spanning the top
+  // of group 0 and the bottom of group 1, node 2 at the top of group 1
+  affinity_list affinities = {};
+  affinities.add(0, 0, 0x00000000ffffffffull);
+  affinities.add(1, 0, 0xffffffff00000000ull);
+  affinities.add(1, 1, 0x000000000000ffffull);
+  affinities.add(2, 1, 0x00000000ffff0000ull);
+
+  CHECK(build(affinities, 3, layout, map));
+  CHECK(map.node_count == 3);
+
+  CHECK(map.node(0) == 0 && map.node(31) == 0);
+  CHECK(map.node(32) == 1 && map.node(63) == 1);
+  CHECK(map.node(64) == 1 && map.node(64 + 15) == 1);
+  CHECK(map.node(64 + 16) == 2 && map.node(64 + 31) == 2);
+
+  // The group 1 half of node 1 counts, it's what KeQueryNodeActiveAffinity missed
+  CHECK(map.count(everything, 0) == 32);
+  CHECK(map.count(everything, 1) == 48);
+  CHECK(map.count(everything, 2) == 16);
+
+  // Not named by any entry, those get the unplaced pool
+  CHECK(map.node(64 + 32) == unknown_node && map.node(127) == unknown_node);
+  CHECK(map.count(everything, unknown_node) == 32);
+  CHECK(map.node(processor_mask::max_processors) == unknown_node);
+
+  // Only the group node 1 starts in, what the old query reported
+  affinity_list first_group = {};
+  first_group.add(0, 0, 0x00000000ffffffffull);
+  first_group.add(1, 0, 0xffffffff00000000ull);
+  first_group.add(2, 1, 0x00000000ffff0000ull);
+
+  CHECK(build(first_group, 3, layout, map));
+  CHECK(map.count(everything, 1) == 32);
+  CHECK(map.count(everything, unknown_node) == 48);
+
+  // Processors or nodes the topology doesn't have
+  processor_mask::topology small = layout;
+  small.group_size[1] = 16;
+
+  affinity_list past_group = {};
+  past_group.add(0, 1, 1ull << 20);
+  CHECK(!build(past_group, 1, small, map));
+
+  affinity_list past_groups = {};
+  past_groups.add(0, 2, 1);
+  CHECK(!build(past_groups, 1, layout, map));
+
+  affinity_list past_nodes = {};
+  past_nodes.add(3, 0, 1);
+  CHECK(!build(past_nodes, 3, layout, map));
+
+  // Empty masks take no room, overflow is remembered and leaves the rest unknown
+  affinity_list full = {};
+  full.add(0, 0, 0);
+  CHECK(full.count == 0);
+
+  for (uint32_t entry = 0; entry < max_affinities; ++entry) full.add(0, 0, 1);
+  CHECK(full.count == max_affinities && !full.truncated);
+
+  full.add(1, 1, 1);
+  CHECK(full.count == max_affinities && full.truncated);
+
+  CHECK(build(full, 2, layout, map));
+  CHECK(map.node(0) == 0 && map.node(64) == unknown_node);
+
+  // Own node first, then round the rest, out of range starts at node 0
+  CHECK(fallback(2, 4, 0) == 2 && fallback(2, 4, 1) == 3 && fallback(2, 4, 3) == 1);
+  CHECK(fallback(unknown_node, 4, 0) == 0 && fallback(9, 4, 3) == 3);
+
+  return check::finish("numa_test");
+}
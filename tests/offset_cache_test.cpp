@@ -0,0 +1,81 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#include <offset_cache.hpp>
+#include <check.hpp>
+
+using namespace utils::cache;
+
+int main()
+{
+  const kernel_identity identity = { 0x5f3e1c2a, 0x01000000, 0x00a1b2c3 };
+
+  offset_blob out = {};
+  offset_blob blob = blob_build(identity, 0x400000, 0xc00000, 0xc00040);
+
+  CHECK(blob_validate(&blob, sizeof blob, identity, out));
+  CHECK(out.service_table == 0xc00000);
+
+  // Wrong size, magic, integrity, kernel
+  CHECK(!blob_validate(&blob, sizeof blob - 1, identity, out));
+  CHECK(!blob_validate(nullptr, sizeof blob, identity, out));
+
+  offset_blob corrupt = blob;
+  corrupt.service_table ^= 1;
+  CHECK(!blob_validate(&corrupt, sizeof corrupt, identity, out));
+
+  corrupt = blob;
+  corrupt.magic = 0;
+  CHECK(!blob_validate(&corrupt, sizeof corrupt, identity, out));
+
+  kernel_identity other = identity;
+  other.checksum++;
+  CHECK(!blob_validate(&blob, sizeof blob, other, out));
+
+  // The signature and both lea's have to fit in the image, not only the start
+  const uint32_t size = identity.size_of_image;
+
+  blob = blob_build(identity, size - verified_span, 0xc00000, 0xc00040);
+  CHECK(blob_validate(&blob, sizeof blob, identity, out));
+
+  for (uint32_t short_by = 1; short_by <= verified_span; ++short_by)
+  {
+    blob = blob_build(identity, size - verified_span + short_by, 0xc00000, 0xc00040);
+    CHECK(!blob_validate(&blob, sizeof blob, identity, out));
+  }
+
+  blob = blob_build(identity, 0xffffffff, 0xc00000, 0xc00040);
+  CHECK(!blob_validate(&blob, sizeof blob, identity, out));
+
+  blob = blob_build(identity, 0, 0xc00000, 0xc00040);
+  CHECK(!blob_validate(&blob, sizeof blob, identity, out));
+
+  blob = blob_build(identity, 0x400000, size, 0xc00040);
+  CHECK(!blob_validate(&blob, sizeof blob, identity, out));
+
+  return check::finish("offset_cache_test");
+}
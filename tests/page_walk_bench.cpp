@@ -0,0 +1,106 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <vector>
+
+#include <page_walk.hpp>
+#include <check.hpp>
+
+//
+// A 4 level walk against a cache hit, and the miss path (walk plus insert)
+// with addresses spread over more pages than the cache has entries. Tables
+// come out of a vector here, in the driver every level is a mapping window
+// update on top, which only makes the walk dearer.
+//
+
+using namespace ia32e::walk;
+
+int main(int argc, char** argv)
+{
+  const uint64_t iterations = check::quick(argc, argv) ? 1000000 : 20000000;
+
+  std::vector<uint64_t> physical(1 << 16);
+
+  const auto read_entry = [&](const uint64_t gpa, uint64_t& entry) -> bool
+  {
+    if (gpa / 8 >= physical.size()) return false;
+
+    entry = physical[gpa / 8];
+    return true;
+  };
+
+  // PML4 at 0x1000 down to a PT at 0x4000 mapping 512 pages
+  const uint64_t base = 0x00007ff600000000ull;
+
+  physical[(0x1000 + ((base >> 39) & 0x1ff) * 8) / 8] = 0x2000 | entry_present | entry_write;
+  physical[(0x2000 + ((base >> 30) & 0x1ff) * 8) / 8] = 0x3000 | entry_present | entry_write;
+  physical[(0x3000 + ((base >> 21) & 0x1ff) * 8) / 8] = 0x4000 | entry_present | entry_write;
+
+  for (uint64_t page = 0; page < 512; ++page)
+  {
+    physical[(0x4000 + page * 8) / 8] = (0x100000 + page * page_size_4k) | entry_present | entry_write;
+  }
+
+  const context paging = { 0x1000, false, true, true };
+  uint64_t sum = 0;
+
+  const double walk_ns = check::nanoseconds_per(iterations, [&](const uint64_t i)
+  {
+    translation result{};
+    translate(paging, base + (i & 0xff8), access_read, read_entry, result);
+    sum += result.gpa;
+  });
+
+  static tlb hot;
+
+  const double hit_ns = check::nanoseconds_per(iterations, [&](const uint64_t i)
+  {
+    translation result{};
+    translate_cached(hot, paging, base + (i & 0xff8), access_read, read_entry, result);
+    sum -= result.gpa;
+  });
+
+  static tlb cold;
+
+  // Consecutive pages 64 apart land on the same entry, every lookup misses
+  const double miss_ns = check::nanoseconds_per(iterations, [&](const uint64_t i)
+  {
+    translation result{};
+    translate_cached(cold, paging, base + ((i * tlb_entries) & 0x1ff) * page_size_4k, access_read, read_entry, result);
+    check::keep(result.gpa);
+  });
+
+  check::keep(sum);
+  CHECK(sum == 0);
+  CHECK(hot.misses == 1 && hot.hits == iterations - 1);
+  CHECK(cold.hits == 0 && cold.misses == iterations);
+
+  printf("walk        %6.2f ns/translation\n", walk_ns);
+  printf("cache hit   %6.2f ns/translation\n", hit_ns);
+  printf("cache miss  %6.2f ns/translation\n", miss_ns);
+
+  return check::finish("page_walk_bench");
+}
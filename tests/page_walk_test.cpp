@@ -0,0 +1,201 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <vector>
+
+#include <page_walk.hpp>
+#include <check.hpp>
+
+//
+// The walker over made-up tables: 4 KB, 2 MB and 1 GB mappings, 5 level
+// paging, the permission checks and the cache in front of it all.
+//
+
+using namespace ia32e::walk;
+
+namespace
+{
+  // 8 MB of "physical memory", tables handed out a page at a time
+  struct memory
+  {
+    std::vector<uint64_t> qwords = std::vector<uint64_t>(1 << 20);
+    uint64_t              next   = page_size_4k;
+    uint64_t              reads  = 0;
+
+    auto table() -> uint64_t
+    {
+      const uint64_t page = next;
+      next += page_size_4k;
+      return page;
+    }
+
+    auto at(const uint64_t gpa) -> uint64_t& { return qwords[gpa / 8]; }
+
+    auto reader()
+    {
+      return [this](const uint64_t gpa, uint64_t& entry) -> bool
+      {
+        if (gpa / 8 >= qwords.size()) return false;
+
+        ++reads;
+        entry = at(gpa);
+        return true;
+      };
+    }
+  };
+
+  constexpr auto index(const uint64_t va, const int32_t level) -> uint64_t
+  {
+    return (va >> (12 + 9 * (level - 1))) & 0x1ff;
+  }
+};
+
+int main()
+{
+  memory physical;
+  auto read_entry = physical.reader();
+
+  const uint64_t pml4 = physical.table();
+  const uint64_t pdpt = physical.table();
+  const uint64_t pd   = physical.table();
+  const uint64_t pt   = physical.table();
+
+  // A read-only, no-execute user page
+  const uint64_t va = 0x00007ff612345000ull;
+
+  physical.at(pml4 + index(va, 4) * 8) = pdpt | entry_present | entry_write | entry_user;
+  physical.at(pdpt + index(va, 3) * 8) = pd   | entry_present | entry_write | entry_user;
+  physical.at(pd   + index(va, 2) * 8) = pt   | entry_present | entry_write | entry_user;
+  physical.at(pt   + index(va, 1) * 8) = 0x345000 | entry_present | entry_user | entry_nx;
+
+  const context paging = { pml4, false, true, true };
+  translation result = {};
+
+  CHECK(translate(paging, va + 0x10, access_read | access_user, read_entry, result) == status::ok);
+  CHECK(result.gpa == 0x345010 && result.page_size == page_size_4k && !result.writable && result.user);
+  CHECK(translate(paging, va, access_write | access_user, read_entry, result) == status::protection);
+  CHECK(translate(paging, va, access_execute, read_entry, result) == status::protection);
+
+  // NX only counts with EFER.NXE, read-only only for supervisor writes with CR0.WP
+  context no_nx = paging;
+  no_nx.nxe = false;
+  CHECK(translate(no_nx, va, access_execute, read_entry, result) == status::ok);
+
+  context no_wp = paging;
+  no_wp.write_protect = false;
+  CHECK(translate(no_wp, va, access_write, read_entry, result) == status::ok);
+  CHECK(translate(no_wp, va, access_write | access_user, read_entry, result) == status::protection);
+
+  CHECK(translate(paging, va + page_size_4k, access_read, read_entry, result) == status::not_present);
+  CHECK(translate(paging, 0x0000800000000000ull, access_read, read_entry, result) == status::non_canonical);
+
+  // 2 MB supervisor page
+  const uint64_t large = 0xffff800000200000ull + 0x1234;
+
+  physical.at(pml4 + index(large, 4) * 8) = pdpt | entry_present | entry_write;
+  physical.at(pdpt + index(large, 3) * 8) = pd   | entry_present | entry_write;
+  physical.at(pd   + index(large, 2) * 8) = 0x40000000 | entry_present | entry_write | entry_large;
+
+  CHECK(translate(paging, large, access_write, read_entry, result) == status::ok);
+  CHECK(result.gpa == 0x40001234 && result.page_size == page_size_2m);
+  CHECK(translate(paging, large, access_user, read_entry, result) == status::protection);
+
+  // 1 GB page
+  const uint64_t huge = 0xffff880000000000ull + 0x12345678;
+
+  physical.at(pml4 + index(huge, 4) * 8) = pdpt | entry_present | entry_write;
+  physical.at(pdpt + index(huge, 3) * 8) = 0x80000000ull | entry_present | entry_write | entry_large;
+
+  CHECK(translate(paging, huge, access_read, read_entry, result) == status::ok);
+  CHECK(result.gpa == 0x80000000ull + 0x12345678 && result.page_size == page_size_1g);
+
+  // PS is reserved in a PML4E
+  const uint64_t reserved_va = 0xffff900000000000ull;
+  physical.at(pml4 + index(reserved_va, 4) * 8) = pdpt | entry_present | entry_large;
+
+  CHECK(translate(paging, reserved_va, access_read, read_entry, result) == status::reserved);
+
+  // A table past the end of memory
+  const uint64_t unreadable_va = 0xffffa00000000000ull;
+  physical.at(pml4 + index(unreadable_va, 4) * 8) = 0x10000000000ull | entry_present;
+
+  CHECK(translate(paging, unreadable_va, access_read, read_entry, result) == status::unreadable);
+
+  // 5 levels, the same PML4 one level down. Canonical at 57 bits, not at 48.
+  const uint64_t pml5   = physical.table();
+  const uint64_t va_57  = va | 1ull << 48;
+
+  physical.at(pml5 + index(va_57, 5) * 8) = pml4 | entry_present | entry_write | entry_user;
+
+  const context paging_57 = { pml5, true, true, true };
+
+  CHECK(translate(paging_57, va_57, access_user, read_entry, result) == status::ok && result.gpa == 0x345000);
+  CHECK(translate(paging, va_57, access_read, read_entry, result) == status::non_canonical);
+
+  //
+  // The cache: hits skip the walk, permissions are checked either way, and
+  // it's keyed by CR3
+  //
+
+  static tlb cache;
+
+  physical.reads = 0;
+  CHECK(translate_cached(cache, paging, va, access_user, read_entry, result) == status::ok);
+  CHECK(cache.misses == 1 && physical.reads == 4);
+
+  CHECK(translate_cached(cache, paging, va + 8, access_user, read_entry, result) == status::ok);
+  CHECK(cache.hits == 1 && physical.reads == 4 && result.gpa == 0x345008);
+
+  CHECK(translate_cached(cache, paging, va, access_user | access_write, read_entry, result) == status::protection);
+  CHECK(cache.hits == 2);
+
+  CHECK(!cache.lookup(pml5, va, result));
+
+  // INVLPG narrows, a flush drops everything
+  cache.invalidate(va);
+  CHECK(!cache.lookup(paging.cr3, va, result));
+
+  translate_cached(cache, paging, va, access_read, read_entry, result);
+  cache.flush();
+  CHECK(!cache.lookup(paging.cr3, va, result));
+
+  // With a large page in the cache any INVLPG drops everything, it may have
+  // been for another 4 KB piece of it
+  translate_cached(cache, paging, large, access_read, read_entry, result);
+  translate_cached(cache, paging, va, access_read, read_entry, result);
+  cache.invalidate(large + 0x5000);
+  CHECK(!cache.lookup(paging.cr3, va, result));
+
+  // Entries changed behind the cache's back are only seen after a flush
+  translate_cached(cache, paging, va, access_read, read_entry, result);
+  physical.at(pt + index(va, 1) * 8) = 0x346000 | entry_present | entry_user;
+
+  CHECK(translate_cached(cache, paging, va, access_read, read_entry, result) == status::ok && result.gpa == 0x345000);
+  cache.flush();
+  CHECK(translate_cached(cache, paging, va, access_read, read_entry, result) == status::ok && result.gpa == 0x346000);
+
+  return check::finish("page_walk_test");
+}
@@ -0,0 +1,302 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pe_image.hpp>
+#include <check.hpp>
+
+using namespace pe::literals;
+
+//
+// Export tables laid out the way the linker does it: names sorted, ordinals
+// past the named ones, forwarder strings inside of the export directory, all
+// of it in a section whose file offset isn't its RVA.
+//
+
+struct export_spec
+{
+  std::string name;           // empty for ordinal only
+  std::string forwarder;      // empty for code
+};
+
+constexpr uint32_t section_rva    = 0x3000;
+constexpr uint32_t section_offset = 0x400;
+constexpr uint32_t code_rva       = 0x100000;
+
+static auto build_file(std::vector<export_spec> exports) -> std::vector<uint8_t>
+{
+  std::stable_sort(exports.begin(), exports.end(),
+    [](const export_spec& a, const export_spec& b) { return !a.name.empty() && (b.name.empty() || a.name < b.name); });
+
+  uint32_t named = 0;
+  for (const export_spec& spec : exports) named += !spec.name.empty();
+
+  const uint32_t count     = static_cast<uint32_t>(exports.size());
+  const uint32_t functions = sizeof(pe::export_directory_t);
+  const uint32_t names     = functions + count * 4;
+  const uint32_t ordinals  = names + named * 4;
+  uint32_t       strings   = ordinals + named * 2;
+
+  std::vector<uint8_t> edata(strings);
+
+  const auto add_string = [&](const std::string& text) -> uint32_t
+  {
+    const uint32_t at = static_cast<uint32_t>(edata.size());
+    edata.insert(edata.end(), text.begin(), text.end());
+    edata.push_back(0);
+
+    return section_rva + at;
+  };
+
+  const auto put32 = [&](const uint32_t at, const uint32_t value) { memcpy(edata.data() + at, &value, 4); };
+  const auto put16 = [&](const uint32_t at, const uint16_t value) { memcpy(edata.data() + at, &value, 2); };
+
+  pe::export_directory_t directory = {};
+  directory.name                     = add_string("ntoskrnl.exe");
+  directory.base                     = 1;
+  directory.number_of_functions      = count;
+  directory.number_of_names          = named;
+  directory.address_of_functions     = section_rva + functions;
+  directory.address_of_names         = section_rva + names;
+  directory.address_of_name_ordinals = section_rva + ordinals;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    const export_spec& spec = exports[i];
+
+    put32(functions + i * 4, spec.forwarder.empty() ? code_rva + i * 0x10 : add_string(spec.forwarder));
+
+    if (!spec.name.empty())
+    {
+      put32(names + i * 4, add_string(spec.name));
+      put16(ordinals + i * 2, static_cast<uint16_t>(i));
+    }
+  }
+
+  memcpy(edata.data(), &directory, sizeof directory);
+
+  const uint32_t text_offset = section_offset + static_cast<uint32_t>((edata.size() + 0x1ff) & ~0x1ffull);
+  const uint32_t text_size   = count * 0x10;
+
+  std::vector<uint8_t> file(text_offset + text_size, 0xcc);
+  memset(file.data(), 0, text_offset);
+
+  auto* dos = reinterpret_cast<pe::dos_header_t*>(file.data());
+  dos->e_magic  = pe::dos_signature;
+  dos->e_lfanew = 0x80;
+
+  auto* nt = reinterpret_cast<pe::nt_headers64_t*>(file.data() + 0x80);
+  nt->signature                               = pe::nt_signature;
+  nt->file_header.number_of_sections          = 2;
+  nt->file_header.size_of_optional_header     = sizeof(pe::optional_header64_t);
+  nt->optional_header.magic                   = pe::optional_magic_64;
+  nt->optional_header.size_of_image           = code_rva + text_size;
+  nt->optional_header.size_of_headers         = section_offset;
+  nt->optional_header.number_of_rva_and_sizes = 16;
+  nt->optional_header.data_directory[pe::directory_export] = { section_rva, static_cast<uint32_t>(edata.size()) };
+
+  auto* section = reinterpret_cast<pe::section_header_t*>(nt + 1);
+  memcpy(section->name, ".edata", 6);
+  section->virtual_address     = section_rva;
+  section->virtual_size        = static_cast<uint32_t>(edata.size());
+  section->size_of_raw_data    = static_cast<uint32_t>(edata.size());
+  section->pointer_to_raw_data = section_offset;
+
+  memcpy(section[1].name, ".text", 5);
+  section[1].virtual_address     = code_rva;
+  section[1].virtual_size        = text_size;
+  section[1].size_of_raw_data    = text_size;
+  section[1].pointer_to_raw_data = text_offset;
+
+  memcpy(file.data() + section_offset, edata.data(), edata.size());
+
+  return file;
+}
+
+//
+// Every named export of an indexed image against a plain map of the names:
+// unique hashes resolve to their own RVA, shared ones to nothing, and the
+// image counts as many collisions as the map finds
+//
+
+static auto check_exports(const pe::image& module) -> uint32_t
+{
+  const auto* directory_entry = module.data_directory(pe::directory_export);
+  if (directory_entry == nullptr || directory_entry->size == 0) return 0;
+
+  const auto* directory = reinterpret_cast<const pe::export_directory_t*>(
+    module.rva_to_pointer(directory_entry->virtual_address, sizeof(pe::export_directory_t)));
+  if (!CHECK(directory != nullptr)) return 0;
+
+  const auto* names     = reinterpret_cast<const uint32_t*>(module.rva_to_pointer(directory->address_of_names, directory->number_of_names * 4));
+  const auto* ordinals  = reinterpret_cast<const uint16_t*>(module.rva_to_pointer(directory->address_of_name_ordinals, directory->number_of_names * 2));
+  const auto* functions = reinterpret_cast<const uint32_t*>(module.rva_to_pointer(directory->address_of_functions, directory->number_of_functions * 4));
+  if (!CHECK(names && ordinals && functions)) return 0;
+
+  std::unordered_map<uint64_t, uint32_t> sharing;
+  std::vector<std::pair<uint64_t, uint32_t>> named;
+
+  for (uint32_t i = 0; i < directory->number_of_names; ++i)
+  {
+    const char* name = reinterpret_cast<const char*>(module.rva_to_pointer(names[i]));
+    if (!CHECK(name != nullptr)) continue;
+
+    const uint64_t hash = pe::name_hash(name);
+
+    ++sharing[hash];
+    named.emplace_back(hash, functions[ordinals[i]]);
+  }
+
+  uint32_t collisions = 0;
+  for (const auto& [hash, count] : sharing) collisions += count - 1;
+
+  CHECK(module.hash_collisions() == collisions);
+  CHECK(module.export_count() == directory->number_of_names);
+
+  for (const auto& [hash, rva] : named)
+  {
+    CHECK(module.export_by_hash(hash) == (sharing[hash] == 1 ? rva : 0));
+  }
+
+  return collisions;
+}
+
+static auto index(pe::image& module, const std::vector<uint8_t>& file, std::vector<uint8_t>& storage) -> bool
+{
+  if (!module.parse(file.data(), file.size(), pe::layout::file)) return false;
+
+  storage.resize(module.index_size());
+  return module.build_index(storage.data(), storage.size());
+}
+
+// Any PE32+ image on disk, i.e. a copy of ntoskrnl.exe
+static auto check_file(const char* path) -> void
+{
+  FILE* stream = fopen(path, "rb");
+  if (!CHECK(stream != nullptr)) return;
+
+  std::vector<uint8_t> file;
+  uint8_t chunk[65536];
+
+  for (size_t read; (read = fread(chunk, 1, sizeof chunk, stream)) != 0;) file.insert(file.end(), chunk, chunk + read);
+  fclose(stream);
+
+  pe::image module;
+  std::vector<uint8_t> storage;
+
+  if (!CHECK(index(module, file, storage))) return;
+
+  const uint32_t collisions = check_exports(module);
+  printf("%s: %u exports, %u colliding\n", path, module.export_count(), collisions);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1)
+  {
+    for (int i = 1; i < argc; ++i) check_file(argv[i]);
+
+    return check::finish("pe_image_test");
+  }
+
+  std::vector<export_spec> exports =
+  {
+    { "RtlPcToFileHeader",          {} },
+    { "KeQueryNodeActiveAffinity",  {} },
+    { "KeQueryNodeActiveAffinity2", {} },
+    { "ExAllocatePool2",            {} },
+    { "RtlGetVersion",              "NTDLL.RtlGetVersion" },
+    { {},                           {} },
+  };
+
+  for (uint32_t i = 0; i < 3000; ++i) exports.push_back({ "Routine" + std::to_string(i), {} });
+
+  const std::vector<uint8_t> file = build_file(exports);
+
+  pe::image module;
+  std::vector<uint8_t> storage;
+
+  CHECK(index(module, file, storage));
+  CHECK(module.export_count() == exports.size() - 1);
+  CHECK(check_exports(module) == 0);
+
+  // Hashed at compile time, resolved against the file layout
+  const uint8_t* base = module.base();
+
+  const auto* routine = pe::resolve<"KeQueryNodeActiveAffinity2"_h, const uint8_t*>(module);
+  CHECK(routine != nullptr && routine == module.rva_to_pointer(module.export_by_name("KeQueryNodeActiveAffinity2")));
+
+  // Through the section table, in the file the code isn't at base + rva
+  CHECK(routine != base + module.export_by_name("KeQueryNodeActiveAffinity2") && *routine == 0xcc);
+
+  CHECK(pe::resolve<"KeQueryNodeActiveAffinity3"_h>(module) == nullptr);
+
+  // Forwarders point into the export directory, never at code
+  const uint32_t forwarded = module.export_by_name("RtlGetVersion");
+  CHECK(forwarded != 0 && module.is_forwarder(forwarded));
+  CHECK(pe::resolve<"RtlGetVersion"_h>(module) == nullptr);
+
+  // The ordinal only one is reachable by ordinal and by nothing else
+  CHECK(module.export_by_ordinal(static_cast<uint32_t>(exports.size())) != 0);
+  CHECK(module.export_by_ordinal(static_cast<uint32_t>(exports.size()) + 1) == 0);
+  CHECK(module.export_by_ordinal(0) == 0);
+
+  // The same name twice, how a hash collision looks to the index: counted, and
+  // neither of them resolves rather than resolving to the wrong one
+  exports.push_back({ "KeQueryNodeActiveAffinity2", {} });
+  exports.push_back({ "Routine7", {} });
+  exports.push_back({ "Routine7", {} });
+
+  const std::vector<uint8_t> colliding = build_file(exports);
+
+  CHECK(index(module, colliding, storage));
+  CHECK(module.hash_collisions() == 3);
+  CHECK(check_exports(module) == 3);
+
+  CHECK(pe::resolve<"KeQueryNodeActiveAffinity2"_h>(module) == nullptr);
+  CHECK(module.export_by_name("Routine7") == 0);
+  CHECK(module.export_by_name("Routine8") != 0);
+
+  // A name running off the end of the file is hashed up to the end, not past it
+  std::vector<uint8_t> truncated = build_file({ { "RtlPcToFileHeader", {} } });
+
+  const auto* sections = reinterpret_cast<const pe::section_header_t*>(
+    reinterpret_cast<const pe::nt_headers64_t*>(truncated.data() + 0x80) + 1);
+
+  truncated.resize(section_offset + sections[0].size_of_raw_data - strlen("Header") - 1);
+
+  CHECK(index(module, truncated, storage));
+  CHECK(module.export_by_name("RtlPcToFileHeader") == 0);
+  CHECK(module.export_by_name("RtlPcToFile") != 0);
+
+  return check::finish("pe_image_test");
+}
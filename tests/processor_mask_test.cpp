@@ -0,0 +1,142 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <wchar.h>
+
+#include <processor_mask.hpp>
+#include <check.hpp>
+
+using namespace processor_mask;
+
+//
+// VirtualizedProcessors against a two group box, 64 processors in group 0
+// and 16 in group 1: the forms the top of processor_mask.hpp documents,
+// what gets refused, and the set and topology underneath.
+//
+
+static auto two_groups() -> topology
+{
+  topology layout = {};
+
+  layout.group_count    = 2;
+  layout.first_index[0] = 0;
+  layout.group_size[0]  = 64;
+  layout.first_index[1] = 64;
+  layout.group_size[1]  = 16;
+
+  return layout;
+}
+
+// Like the registry hands it over, terminator included
+static auto parse_value(const wchar_t* text, const topology& layout, set& selected) -> bool
+{
+  return parse(text, wcslen(text) + 1, layout, selected);
+}
+
+int main()
+{
+  const topology layout = two_groups();
+  set selected = {};
+
+  // Topology
+  CHECK(layout.processor_count() == 80);
+  CHECK(layout.index_of(0, 0) == 0 && layout.index_of(0, 63) == 63);
+  CHECK(layout.index_of(1, 0) == 64 && layout.index_of(1, 15) == 79);
+  CHECK(layout.index_of(1, 16) == none && layout.index_of(2, 0) == none);
+  CHECK(all(layout).count() == 80 && all(layout).next(80) == none);
+
+  // Set
+  set members = {};
+  members.insert(3);
+  members.insert(64);
+  members.insert(max_processors - 1);
+  members.insert(max_processors);
+  CHECK(members.count() == 3);
+  CHECK(members.contains(3) && !members.contains(4) && !members.contains(max_processors));
+  CHECK(members.next(0) == 3 && members.next(4) == 64 && members.next(65) == max_processors - 1);
+  CHECK(members.next(max_processors) == none);
+
+  members.erase(64);
+  members.erase(max_processors);
+  CHECK(members.count() == 2 && members.next(4) == max_processors - 1);
+
+  // Every processor, and everything minus a range
+  CHECK(parse_value(L"*", layout, selected) && selected.count() == 80);
+
+  CHECK(parse_value(L"*,~6-7", layout, selected) && selected.count() == 78);
+  CHECK(!selected.contains(6) && !selected.contains(7) && selected.contains(5) && selected.contains(8));
+
+  // Group relative, blanks around anything
+  CHECK(parse_value(L" 1:0-3 , 5", layout, selected) && selected.count() == 5);
+  CHECK(selected.contains(64) && selected.contains(67) && !selected.contains(68) && selected.contains(5));
+
+  CHECK(parse_value(L"1 : 15\t,\t~ 1:15 , 0", layout, selected) && selected.count() == 1 && selected.contains(0));
+
+  // Applied left to right, a later entry puts back what an earlier one took
+  CHECK(parse_value(L"0-15,~0-15,3", layout, selected) && selected.count() == 1 && selected.contains(3));
+  CHECK(parse_value(L"~0,*", layout, selected) && selected.count() == 80);
+  CHECK(parse_value(L"*,~1:0-15", layout, selected) && selected.count() == 64 && selected.next(64) == none);
+
+  // Both ends of both groups
+  CHECK(parse_value(L"63,64,79", layout, selected) && selected.count() == 3);
+  CHECK(selected.next(0) == 63 && selected.next(64) == 64 && selected.next(65) == 79);
+
+  // Not a processor the topology has
+  CHECK(!parse_value(L"80", layout, selected));
+  CHECK(!parse_value(L"1:16", layout, selected));
+  CHECK(!parse_value(L"2:0", layout, selected));
+  CHECK(!parse_value(L"60-80", layout, selected));
+  CHECK(!parse_value(L"99999999999", layout, selected));
+
+  // Malformed
+  CHECK(!parse_value(L"", layout, selected));
+  CHECK(!parse_value(L"  ", layout, selected));
+  CHECK(!parse_value(L"3-1", layout, selected));
+  CHECK(!parse_value(L"0,3-1", layout, selected));
+  CHECK(!parse_value(L"0,", layout, selected));
+  CHECK(!parse_value(L",0", layout, selected));
+  CHECK(!parse_value(L"0 x", layout, selected));
+  CHECK(!parse_value(L"0-", layout, selected));
+  CHECK(!parse_value(L"1:", layout, selected));
+  CHECK(!parse_value(L"~", layout, selected));
+  CHECK(!parse_value(L"-3", layout, selected));
+
+  // Nothing left to run on
+  CHECK(!parse_value(L"~*", layout, selected));
+  CHECK(!parse_value(L"*,~*", layout, selected));
+  CHECK(!parse_value(L"5,~5", layout, selected));
+
+  // Stops at the terminator or the length, whichever comes first
+  const wchar_t padded[] = { L'4', 0, L',', L'x' };
+  CHECK(parse(padded, 4, layout, selected) && selected.count() == 1 && selected.contains(4));
+
+  CHECK(parse(L"12", 1, layout, selected) && selected.count() == 1 && selected.contains(1));
+
+  // Narrow text goes through the same code
+  CHECK(parse("1:2-3", 5, layout, selected) && selected.count() == 2 && selected.contains(66) && selected.contains(67));
+
+  return check::finish("processor_mask_test");
+}
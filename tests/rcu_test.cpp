@@ -0,0 +1,204 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <rcu.hpp>
+#include <check.hpp>
+
+//
+// Grace periods with threads standing in for vCPUs: enter() and leave()
+// around a simulated #VMEXIT, a spin in between for the guest. A vCPU parked
+// in an exit has to hold the writer, one in the guest mustn't. Then readers
+// check the table they hold while a writer keeps publishing, poisoning and
+// freeing the old ones; run it under ASan or TSan for the full story. On a
+// single core box the threads take turns, which still interleaves them at
+// every preemption point.
+//
+
+namespace
+{
+  constexpr uint64_t alive = 0x7ab1e;
+
+  struct table
+  {
+    uint64_t magic;
+    uint64_t generation;
+    uint64_t slots[64];
+  };
+
+  table* published = nullptr;
+
+  auto yield() -> void
+  {
+    std::this_thread::yield();
+  }
+
+  // synchronize() on another thread, done once it returned
+  struct writer
+  {
+    std::atomic<bool> done = false;
+    std::thread       thread;
+
+    writer(std::vector<rcu::vcpu_state>& states)
+      : thread([this, &states] { rcu::synchronize(states.data(), static_cast<uint32_t>(states.size()), yield); done = true; })
+    {
+    }
+
+    auto finish() -> bool
+    {
+      thread.join();
+      return done;
+    }
+  };
+
+  auto held_by_an_exit() -> void
+  {
+    std::vector<rcu::vcpu_state> states(4);
+
+    // Nobody inside an exit, nothing to wait for
+    {
+      writer idle(states);
+      CHECK(idle.finish());
+    }
+
+    rcu::enter(states[1]);
+    CHECK(rcu::inside(states[1]));
+
+    writer waiting(states);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    CHECK(!waiting.done);
+
+    rcu::leave(states[1]);
+    CHECK(waiting.finish());
+
+    // Leaving and entering the next exit counts just the same
+    rcu::enter(states[2]);
+
+    writer next(states);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    CHECK(!next.done);
+
+    rcu::leave(states[2]);
+    rcu::enter(states[2]);
+    CHECK(next.finish());
+
+    rcu::leave(states[2]);
+  }
+
+  auto readers_never_see_a_freed_table(const uint32_t vcpus, const std::chrono::milliseconds duration) -> void
+  {
+    // The last one never exits, like an idle processor
+    std::vector<rcu::vcpu_state> states(vcpus + 1);
+    std::atomic<bool>            stop    = false;
+    std::atomic<uint64_t>        exits   = 0;
+    std::atomic<uint64_t>        corrupt = 0;
+
+    published = new table { alive, 0, {} };
+
+    std::vector<std::thread> readers;
+
+    for (uint32_t vcpu = 0; vcpu < vcpus; ++vcpu)
+    {
+      readers.emplace_back([&, vcpu]
+      {
+        uint64_t count = 0;
+
+        while (!stop.load(std::memory_order_relaxed))
+        {
+          rcu::enter(states[vcpu]);
+
+          const table* current = rcu::dereference(published);
+          uint64_t     sum     = 0;
+
+          for (uint32_t slot = 0; slot < 64; ++slot) sum += current->slots[slot];
+
+          if (current->magic != alive || sum != current->generation * 64) corrupt.fetch_add(1);
+
+          rcu::leave(states[vcpu]);
+          ++count;
+
+          // Guest time
+          for (uint32_t spin = 0; spin < 64; ++spin) check::keep(spin);
+        }
+
+        exits.fetch_add(count);
+      });
+    }
+
+    uint64_t   versions = 0;
+    double     waited   = 0;
+    const auto end      = std::chrono::steady_clock::now() + duration;
+
+    while (std::chrono::steady_clock::now() < end)
+    {
+      auto* next = new table(*published);
+
+      ++next->generation;
+      for (uint64_t& slot : next->slots) slot = next->generation;
+
+      table* previous = rcu::publish(published, next);
+
+      const auto start = std::chrono::steady_clock::now();
+      rcu::synchronize(states.data(), vcpus + 1, yield);
+      waited += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+      previous->magic = 0xdead;
+      for (uint64_t& slot : previous->slots) slot = ~0ull;
+      delete previous;
+
+      ++versions;
+    }
+
+    stop = true;
+    for (std::thread& reader : readers) reader.join();
+
+    delete published;
+    published = nullptr;
+
+    CHECK(corrupt == 0);
+    CHECK(versions != 0);
+
+    printf("%2u vCPUs  %8llu versions  %10llu exits  mean grace period %7.1f us\n", vcpus,
+           static_cast<unsigned long long>(versions), static_cast<unsigned long long>(exits.load()),
+           versions ? waited / static_cast<double>(versions) : 0.0);
+  }
+};
+
+int main()
+{
+  held_by_an_exit();
+
+  for (const uint32_t vcpus : { 1u, 4u, 16u })
+  {
+    readers_never_see_a_freed_table(vcpus, std::chrono::milliseconds(300));
+  }
+
+  return check::finish("rcu_test");
+}
@@ -0,0 +1,122 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include <ssdt.hpp>
+#include <check.hpp>
+
+using namespace hk::ssdt;
+
+//
+// The start of a KiServiceTable as "dd nt!KiServiceTable" shows it, with the
+// handlers the debugger resolves them to. The first handlers sit below the
+// table, so the offsets are negative.
+//
+
+constexpr uint64_t captured_base = 0xfffff8025f2c7b00;
+
+constexpr int32_t captured_entries[] =
+{
+  static_cast<int32_t>(0xfcf5c204), static_cast<int32_t>(0xfcf93900),
+  static_cast<int32_t>(0x02b64902), static_cast<int32_t>(0x04747500),
+  static_cast<int32_t>(0x01c9d205),
+};
+
+constexpr uint64_t captured_handlers[] =
+{
+  0xfffff8025efbd720, 0xfffff8025efc0e90,
+  0xfffff8025f57df90, 0xfffff8025f73c250,
+  0xfffff8025f491820,
+};
+
+constexpr uint8_t captured_stack_args[] = { 4, 0, 2, 0, 5 };
+
+constexpr uint32_t captured_count = sizeof captured_entries / sizeof captured_entries[0];
+
+int main()
+{
+  uint64_t handlers[captured_count] = {};
+  uint8_t  stack_args[captured_count] = {};
+
+  decode(captured_entries, captured_count, captured_base, handlers, stack_args);
+
+  for (uint32_t i = 0; i < captured_count; ++i)
+  {
+    CHECK(handlers[i] == captured_handlers[i]);
+    CHECK(stack_args[i] == captured_stack_args[i]);
+  }
+
+  static_assert(decode_handler(captured_base, captured_entries[0]) == captured_handlers[0]);
+  static_assert(decode_stack_args(captured_entries[4]) == captured_stack_args[4]);
+
+  // The SSE2 path against the scalar one, every tail length, entries anywhere
+  // in the 32 bit range, a table near the top of the address space
+  std::mt19937 random(29);
+  std::vector<int32_t> entries(max_services);
+
+  for (int32_t& entry : entries) entry = static_cast<int32_t>(random());
+
+  std::vector<uint64_t> wide(max_services + 1);
+  std::vector<uint8_t>  args(max_services + 1);
+
+  for (const uint64_t base : { captured_base, uint64_t { 0xfffffffffffff000 }, uint64_t { 0x1000 } })
+  {
+    for (uint32_t count = 0; count <= 37; ++count)
+    {
+      wide[count] = 0x5a5a5a5a5a5a5a5a;
+      args[count] = 0x5a;
+
+      decode(entries.data(), count, base, wide.data(), args.data());
+
+      for (uint32_t i = 0; i < count; ++i)
+      {
+        CHECK(wide[i] == decode_handler(base, entries[i]));
+        CHECK(args[i] == decode_stack_args(entries[i]));
+      }
+
+      // Nothing written past count
+      CHECK(wide[count] == 0x5a5a5a5a5a5a5a5a && args[count] == 0x5a);
+    }
+
+    decode(entries.data(), max_services, base, wide.data(), args.data());
+
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < max_services; ++i)
+    {
+      mismatches += wide[i] != decode_handler(base, entries[i]) || args[i] != decode_stack_args(entries[i]);
+    }
+
+    CHECK(mismatches == 0);
+  }
+
+  // Syscall numbers: table in bit 12, index below
+  CHECK((0x1005u >> table_shift) == 1 && (0x1005u & index_mask) == 5);
+
+  return check::finish("ssdt_test");
+}
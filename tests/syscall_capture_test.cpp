@@ -0,0 +1,194 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <vector>
+
+#include <syscall_capture.hpp>
+#include <check.hpp>
+
+//
+// The capture stream as root mode and a collector see it: layout, what
+// stream_validate() turns down, and that the producer only ever goes by its
+// own copy of the layout, whatever the collector writes into its tails.
+//
+
+using namespace hk::capture;
+
+namespace
+{
+  struct stream
+  {
+    std::vector<uint64_t>                      region;
+    std::vector<uint64_t>                      tails;
+    std::vector<ring_producer<capture_record>> producers;
+
+    stream(const uint32_t cpus, const uint32_t records)
+    {
+      region.assign(stream_bytes(cpus, records) / sizeof(uint64_t), 0);
+      tails.assign(tails_bytes(cpus) / sizeof(uint64_t), 0);
+      producers.resize(cpus);
+
+      stream_init(region.data(), cpus, records);
+
+      for (uint32_t cpu = 0; cpu < cpus; ++cpu)
+      {
+        producer_init(producers[cpu], region.data(), reinterpret_cast<const ring_tail*>(tails.data()), cpu, records);
+      }
+    }
+
+    auto size() const -> size_t { return region.size() * sizeof(uint64_t); }
+    auto header() -> stream_header* { return reinterpret_cast<stream_header*>(region.data()); }
+    auto tail(const uint32_t cpu) -> ring_tail& { return reinterpret_cast<ring_tail*>(tails.data())[cpu]; }
+  };
+
+  auto make_record(const uint64_t sequence) -> capture_record
+  {
+    capture_record record = {};
+    record.tsc            = sequence;
+    record.syscall_number = static_cast<uint32_t>(sequence);
+    return record;
+  }
+
+  auto layout() -> void
+  {
+    stream shared(4, 64);
+
+    const stream_header* header = stream_validate(shared.region.data(), shared.size());
+    CHECK(header != nullptr);
+    CHECK(stream_tails(header, shared.tails.data(), tails_bytes(4)) != nullptr);
+    CHECK(stream_tails(header, shared.tails.data(), sizeof(ring_tail) * 3) == nullptr);
+
+    // producer_init() lands where stream_ring() and ring_records() say
+    for (uint32_t cpu = 0; cpu < 4; ++cpu)
+    {
+      CHECK(shared.producers[cpu].shared == stream_ring(header, cpu));
+      CHECK(shared.producers[cpu].records == ring_records(stream_ring(header, cpu)));
+      CHECK(shared.producers[cpu].tail == &shared.tail(cpu));
+    }
+
+    CHECK(stream_validate(shared.region.data(), shared.size() - 1) == nullptr);
+  }
+
+  auto validate_rejects() -> void
+  {
+    stream shared(2, 64);
+    ring_header* ring = stream_ring(shared.header(), 1);
+
+    ring->capacity = 48;
+    CHECK(stream_validate(shared.region.data(), shared.size()) == nullptr);
+
+    ring->capacity = 1u << 20;
+    CHECK(stream_validate(shared.region.data(), shared.size()) == nullptr);
+
+    ring->capacity       = 64;
+    ring->records_offset = shared.header()->ring_bytes;
+    CHECK(stream_validate(shared.region.data(), shared.size()) == nullptr);
+
+    ring->records_offset = 8;
+    CHECK(stream_validate(shared.region.data(), shared.size()) == nullptr);
+
+    ring->records_offset = round_up(sizeof(ring_header), cache_line);
+    CHECK(stream_validate(shared.region.data(), shared.size()) != nullptr);
+
+    shared.header()->ring_bytes = 8;
+    CHECK(stream_validate(shared.region.data(), shared.size()) == nullptr);
+  }
+
+  auto push_and_drain() -> void
+  {
+    stream shared(1, 16);
+    const stream_header* header = stream_validate(shared.region.data(), shared.size());
+    capture_record out[32] = {};
+
+    for (uint64_t i = 0; i < 20; ++i) ring_push(shared.producers[0], make_record(i));
+
+    // 16 fit, 4 dropped
+    CHECK(stream_ring(header, 0)->head == 16);
+    CHECK(stream_ring(header, 0)->dropped == 4);
+
+    CHECK(ring_drain(stream_ring(header, 0), shared.tail(0), out, 10) == 10);
+    CHECK(out[0].tsc == 0 && out[9].tsc == 9);
+
+    // Wraps around
+    for (uint64_t i = 100; i < 110; ++i) CHECK(ring_push(shared.producers[0], make_record(i)));
+    CHECK(!ring_push(shared.producers[0], make_record(110)));
+
+    CHECK(ring_drain(stream_ring(header, 0), shared.tail(0), out, 32) == 16);
+    CHECK(out[0].tsc == 10 && out[5].tsc == 15 && out[6].tsc == 100 && out[15].tsc == 109);
+    CHECK(ring_drain(stream_ring(header, 0), shared.tail(0), out, 32) == 0);
+  }
+
+  // The collector owns the tails and the stream's contents might as well be
+  // anything, none of it moves the producer off its own ring
+  auto hostile_collector() -> void
+  {
+    stream shared(2, 16);
+    ring_producer<capture_record>& producer = shared.producers[0];
+
+    const uint8_t* first = reinterpret_cast<const uint8_t*>(producer.records);
+    const uint8_t* last  = first + sizeof(capture_record) * 16;
+
+    const ring_header* other = stream_ring(shared.header(), 1);
+
+    stream_ring(shared.header(), 0)->capacity       = 0x40000000;
+    stream_ring(shared.header(), 0)->records_offset = 0x7fff0000;
+    stream_ring(shared.header(), 0)->head           = 0xdead;
+    shared.header()->rings_offset                   = 0x100000;
+
+    for (const uint64_t tail : { 0ull, 3ull, 0x8000000000000000ull, ~0ull, 1000ull })
+    {
+      shared.tail(0).tail = tail;
+
+      for (uint64_t i = 0; i < 40; ++i)
+      {
+        const uint64_t head = producer.head;
+
+        if (ring_push(producer, make_record(i)))
+        {
+          const auto* written = reinterpret_cast<const uint8_t*>(&producer.records[head & 15]);
+          CHECK(written >= first && written < last);
+        }
+      }
+
+      CHECK(producer.capacity == 16);
+      CHECK(reinterpret_cast<const uint8_t*>(producer.records) == first);
+    }
+
+    // The other ring never got a record
+    CHECK(shared.producers[1].head == 0);
+    CHECK(other->head == 0);
+  }
+};
+
+int main()
+{
+  layout();
+  validate_rejects();
+  push_and_drain();
+  hostile_collector();
+
+  return check::finish("syscall_capture_test");
+}
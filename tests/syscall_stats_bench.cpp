@@ -0,0 +1,208 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <syscall_stats.hpp>
+#include <syscall_trap.hpp>
+#include <check.hpp>
+
+//
+// What the profile adds to a trapped syscall, entry and return together:
+// the row updates and the vCPU's in-flight table, one thread per simulated
+// CPU. Against the same counts kept in one shared row with atomic
+// increments, which is what the per-CPU rows are there to avoid. Then the
+// host side of a whole trapped round trip, decoding and carrying out the
+// SYSCALL and the SYSRET on top of the profile, and what a reader pays to
+// aggregate a slot. On a single core box the threads take turns, so only
+// the single threaded numbers mean much there.
+//
+// None of it counts the two #VMEXITs the trap costs per syscall, a VMRUN
+// and #VMEXIT round trip each, which only a virtualized processor can time.
+//
+
+using namespace hk;
+
+namespace
+{
+  constexpr uint32_t nt_slots     = 480;
+  constexpr uint32_t win32k_slots = 1300;
+
+  auto run(const uint32_t cpus, const uint64_t iterations, const bool shared_row) -> double
+  {
+    static std::vector<stats::syscall_row>     rows;
+    static std::vector<trap::in_flight<0x400>> syscalls;
+
+    rows.assign(static_cast<size_t>(cpus) * (nt_slots + win32k_slots), {});
+    syscalls.assign(cpus, {});
+
+    stats::per_cpu_table table;
+    table.init(rows.data(), cpus, nt_slots, win32k_slots);
+
+    std::vector<std::thread> workers;
+    std::atomic<uint32_t>    ready = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t cpu = 0; cpu < cpus; ++cpu)
+    {
+      workers.emplace_back([&, cpu]
+      {
+        ready.fetch_add(1);
+        while (ready.load() != cpus) {}
+
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+          const uint32_t number = static_cast<uint32_t>(i * 7 % nt_slots);
+          const uint64_t thread = trap::thread_key(0x1000 * (cpu + 1), 0x7ff000000000ull + (i & 63) * 0x2000);
+
+          if (shared_row)
+          {
+            std::atomic_ref<uint64_t>(table.row(0, number).count).fetch_add(1, std::memory_order_relaxed);
+          }
+          else
+          {
+            table.record_entry(cpu, number);
+          }
+
+          syscalls[cpu].begin(thread, trap::pack(i, number));
+
+          uint64_t packed = {};
+          if (!syscalls[cpu].end(thread, packed)) continue;
+
+          const uint64_t cycles = trap::cycles_since(packed, i + 300);
+
+          if (shared_row)
+          {
+            std::atomic_ref<uint32_t>(table.row(0, number).buckets[stats::bucket_of(cycles)])
+              .fetch_add(1, std::memory_order_relaxed);
+          }
+          else
+          {
+            table.record_return(cpu, trap::number_of(packed), cycles);
+          }
+        }
+      });
+    }
+
+    for (std::thread& worker : workers) worker.join();
+
+    const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    stats::syscall_summary summary = {};
+    table.aggregate_slot(0, summary);
+    check::keep(summary.count);
+
+    return elapsed / iterations;
+  }
+
+  //
+  // What the #UD intercept does for one SYSCALL and its SYSRET, the
+  // profile included, on one vCPU
+  //
+
+  auto round_trip(const uint64_t iterations) -> double
+  {
+    static std::vector<stats::syscall_row> rows(nt_slots + win32k_slots);
+    static trap::in_flight<0x400>          syscalls;
+
+    stats::per_cpu_table table;
+    table.init(rows.data(), 1, nt_slots, win32k_slots);
+
+    constexpr uint8_t  syscall_bytes[]  = { 0x0f, 0x05 };
+    constexpr uint8_t  sysret64_bytes[] = { 0x48, 0x0f, 0x07 };
+
+    constexpr trap::msrs windows = { trap::efer_sce | trap::efer_lma, 0x0023001000000000ull,
+                                     0xfffff80012345000ull, 0xfffff80012346000ull, 0x4700 };
+
+    trap::state guest = { 0x00007ffb1234a012ull, 0x246, 0, 0,
+                          { 0x33, trap::attr_user_cs, 0xffffffff, 0 },
+                          { 0x2b, trap::attr_user_ss, 0xffffffff, 0 }, 3 };
+
+    return check::nanoseconds_per(iterations, [&](uint64_t i)
+    {
+      const uint32_t number = static_cast<uint32_t>(i * 7 % nt_slots);
+      const uint64_t thread = trap::thread_key(0x1000, 0x7ff000000000ull + (i & 63) * 0x2000);
+
+      const trap::decoded entry = trap::decode(syscall_bytes, sizeof syscall_bytes);
+      trap::emulate_syscall(guest, windows, entry.length);
+
+      table.record_entry(0, number);
+      syscalls.begin(thread, trap::pack(i, number));
+
+      const trap::decoded leave = trap::decode(sysret64_bytes, sizeof sysret64_bytes);
+      trap::emulate_sysret(guest, windows, leave.kind == trap::instruction::sysret64);
+
+      uint64_t packed = {};
+      if (syscalls.end(thread, packed)) table.record_return(0, trap::number_of(packed), trap::cycles_since(packed, i + 300));
+
+      check::keep(guest.rip);
+    });
+  }
+};
+
+int main(int argc, char** argv)
+{
+  const uint64_t iterations = check::quick(argc, argv) ? 20000 : 2000000;
+  const uint32_t cores      = std::thread::hardware_concurrency();
+
+  printf("%u hardware threads\n", cores);
+
+  for (const uint32_t cpus : { 1u, 4u, 16u })
+  {
+    const double per_cpu = run(cpus, iterations, false);
+    const double shared  = run(cpus, iterations, true);
+
+    printf("%2u cpus  per-CPU rows %6.1f ns/syscall   shared row %6.1f ns/syscall\n", cpus, per_cpu, shared);
+  }
+
+  printf("trapped round trip, host side %6.1f ns/syscall\n", round_trip(iterations));
+
+  // Readers sum every CPU's row of a slot
+  static std::vector<stats::syscall_row> rows(64 * (nt_slots + win32k_slots));
+
+  stats::per_cpu_table table;
+  CHECK(table.init(rows.data(), 64, nt_slots, win32k_slots));
+
+  for (uint32_t cpu = 0; cpu < 64; ++cpu) table.record_entry(cpu, 0x1005);
+
+  stats::syscall_summary summary = {};
+
+  const double aggregate_ns = check::nanoseconds_per(iterations / 10, [&](uint64_t)
+  {
+    table.aggregate(0x1005, summary);
+    check::keep(summary.count);
+  });
+
+  CHECK(summary.count == 64);
+
+  printf("aggregate one slot over 64 cpus %6.1f ns\n", aggregate_ns);
+
+  return check::finish("syscall_stats_bench");
+}
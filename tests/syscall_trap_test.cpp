@@ -0,0 +1,266 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include <syscall_trap.hpp>
+#include <syscall_stats.hpp>
+#include <check.hpp>
+
+//
+// SYSCALL and SYSRET the way the #UD intercept carries them out, against
+// what the processor does with Windows' STAR, and the table pairing up a
+// thread's entry with its return.
+//
+
+using namespace hk::trap;
+
+namespace
+{
+  // KGDT64_R0_CODE 0x10 for SYSCALL, KGDT64_R3_CMCODE 0x23 - 3 for SYSRET
+  constexpr msrs windows =
+  {
+    efer_sce | efer_lma | (1ull << 8) | (1ull << 11),
+    0x0023001000000000ull,
+    0xfffff80012345000ull,
+    0xfffff80012346000ull,
+    0x4700,
+  };
+
+  constexpr state user_mode =
+  {
+    0x00007ffb1234a012ull,
+    0x246 | (1ull << 8),                      // IF, ZF, PF and TF
+    0x1111,
+    0x2222,
+    { 0x33, attr_user_cs, 0xffffffff, 0 },
+    { 0x2b, attr_user_ss, 0xffffffff, 0 },
+    3,
+  };
+};
+
+int main()
+{
+  // Decoding
+  const uint8_t syscall_bytes[]  = { 0x0f, 0x05 };
+  const uint8_t sysret64_bytes[] = { 0x48, 0x0f, 0x07 };
+  const uint8_t sysret_bytes[]   = { 0x0f, 0x07 };
+  const uint8_t rex_syscall[]    = { 0x41, 0x0f, 0x05 };
+  const uint8_t ud2_bytes[]      = { 0x0f, 0x0b };
+
+  CHECK(decode(syscall_bytes, 2).kind == instruction::syscall && decode(syscall_bytes, 2).length == 2);
+  CHECK(decode(sysret64_bytes, 3).kind == instruction::sysret64 && decode(sysret64_bytes, 3).length == 3);
+  CHECK(decode(sysret_bytes, 2).kind == instruction::sysret);
+  CHECK(decode(rex_syscall, 3).kind == instruction::syscall && decode(rex_syscall, 3).length == 3);
+  CHECK(decode(ud2_bytes, 2).kind == instruction::other);
+
+  // Cut short by an unmapped page
+  CHECK(decode(syscall_bytes, 1).kind == instruction::other);
+  CHECK(decode(sysret64_bytes, 2).kind == instruction::other);
+  CHECK(decode(syscall_bytes, 0).kind == instruction::other);
+
+  // SYSCALL from 64-bit user mode
+  state guest = user_mode;
+
+  CHECK(emulate_syscall(guest, windows, 2) == outcome::done);
+  CHECK(guest.rip == windows.lstar);
+  CHECK(guest.rcx == user_mode.rip + 2);
+  CHECK(guest.r11 == user_mode.rflags);
+  CHECK(guest.rflags == ((user_mode.rflags & ~0x4700ull) | rflags_fixed));
+  CHECK(guest.cs.selector == 0x10 && guest.cs.attribute == attr_kernel_cs);
+  CHECK(guest.ss.selector == 0x18 && guest.ss.attribute == attr_kernel_ss);
+  CHECK(guest.cpl == 0);
+
+  // And back
+  CHECK(emulate_sysret(guest, windows, true) == outcome::done);
+  CHECK(guest.rip == user_mode.rip + 2);
+  CHECK(guest.rflags == user_mode.rflags);
+  CHECK(guest.cs.selector == 0x33 && guest.cs.attribute == attr_user_cs);
+  CHECK(guest.ss.selector == 0x2b && guest.ss.attribute == attr_user_ss);
+  CHECK(guest.cpl == 3);
+
+  // R11 can't sneak in RF, VM or reserved bits
+  guest = user_mode;
+  guest.cpl = 0;
+  guest.r11 = ~0ull;
+
+  CHECK(emulate_sysret(guest, windows, true) == outcome::done);
+  CHECK(guest.rflags == (sysret_rflags | rflags_fixed));
+
+  // From compatibility mode through CSTAR, back to a 32-bit code segment
+  guest = user_mode;
+  guest.cs.attribute = attr_user_cs32;
+
+  CHECK(emulate_syscall(guest, windows, 2) == outcome::done);
+  CHECK(guest.rip == windows.cstar);
+
+  guest.rcx = 0xffffffff77001234ull;
+  CHECK(emulate_sysret(guest, windows, false) == outcome::done);
+  CHECK(guest.rip == 0x77001234);
+  CHECK(guest.cs.selector == 0x23 && guest.cs.attribute == attr_user_cs32);
+
+  // What faults: SYSRET from user mode, to a non-canonical RIP, and both
+  // without EFER.SCE as the guest set it
+  guest = user_mode;
+  CHECK(emulate_sysret(guest, windows, true) == outcome::general_protection);
+
+  guest.cpl = 0;
+  guest.rcx = 0x0000800000000000ull;
+  CHECK(emulate_sysret(guest, windows, true) == outcome::general_protection);
+
+  msrs off = windows;
+  off.efer &= ~efer_sce;
+
+  guest = user_mode;
+  CHECK(emulate_syscall(guest, off, 2) == outcome::undefined);
+  CHECK(guest.rip == user_mode.rip && guest.cpl == 3);
+
+  guest.cpl = 0;
+  CHECK(emulate_sysret(guest, off, true) == outcome::undefined);
+
+  // Packing
+  const uint64_t packed = pack(0x123456789abcull, 0x1042);
+  CHECK(number_of(packed) == 0x1042);
+  CHECK(cycles_since(packed, 0x123456789abcull + 500) == 500);
+  CHECK(cycles_since(pack(0xffffffffffffull, 1), 0x1000000000063ull) == 100);
+
+  CHECK(thread_key(0x1aa000, 0x7ff0001000) != thread_key(0x1bb000, 0x7ff0001000));
+  CHECK(thread_key(0x1aa000, 0x7ff0001000) == thread_key(0x1aa001, 0x7ff0001000));
+  CHECK(thread_key(0, 0) != 0);
+
+  // One thread's entry and return
+  static in_flight<64> table;
+  uint64_t value = {};
+
+  const uint64_t thread = thread_key(0x1aa000, 0x7ff0001000);
+
+  table.begin(thread, pack(1000, 7));
+  CHECK(table.end(thread, value) && number_of(value) == 7);
+  CHECK(!table.end(thread, value));
+
+  // A syscall that left through IRETQ, the next SYSCALL takes the slot over
+  table.begin(thread, pack(2000, 8));
+  table.begin(thread, pack(3000, 9));
+  CHECK(table.end(thread, value) && number_of(value) == 9 && cycles_since(value, 3000) == 0);
+  CHECK(!table.end(thread, value));
+
+  // More threads than a probe window holds, the oldest one goes
+  static in_flight<8> small;
+  uint32_t evicted = 0;
+
+  for (uint64_t i = 1; i <= 9; ++i) evicted += small.begin(i, pack(i * 100, static_cast<uint32_t>(i))) ? 1 : 0;
+
+  CHECK(evicted == 1);
+  CHECK(!small.end(1, value));
+  CHECK(small.end(9, value) && number_of(value) == 9);
+  CHECK(small.end(2, value) && number_of(value) == 2);
+
+  // A thread that blocked and came back on another vCPU has no entry there,
+  // and the one it left behind is only taken back by its next SYSCALL
+  static in_flight<64> vcpu0, vcpu1;
+
+  vcpu0.begin(thread, pack(4000, 0x11));
+  CHECK(!vcpu1.end(thread, value));
+
+  CHECK(!vcpu0.begin(thread, pack(5000, 0x12)));
+  CHECK(vcpu0.end(thread, value) && number_of(value) == 0x12);
+  CHECK(!vcpu0.end(thread, value));
+
+  // vCPUs entering and leaving at once, each on its own table, each thread
+  // pairs with its own entry
+  constexpr uint32_t vcpus    = 8;
+  constexpr uint32_t threads  = 64;
+  constexpr uint32_t rounds   = 2000;
+
+  static in_flight<1024> tables[vcpus];
+
+  uint32_t mismatched[vcpus] = {};
+  uint32_t unpaired[vcpus]   = {};
+  uint32_t pushed_out[vcpus] = {};
+
+  std::vector<std::thread> workers;
+
+  for (uint32_t vcpu = 0; vcpu < vcpus; ++vcpu)
+  {
+    workers.emplace_back([&, vcpu]
+    {
+      for (uint32_t round = 0; round < rounds; ++round)
+      {
+        for (uint32_t t = 0; t < threads; ++t)
+        {
+          const uint32_t number = vcpu * threads + t;
+          if (tables[vcpu].begin(thread_key(0x1000 * (vcpu + 1), 0x7ff000000000ull + t * 0x2000), pack(round, number)))
+          {
+            ++pushed_out[vcpu];
+          }
+        }
+
+        for (uint32_t t = 0; t < threads; ++t)
+        {
+          uint64_t returned = {};
+
+          if (!tables[vcpu].end(thread_key(0x1000 * (vcpu + 1), 0x7ff000000000ull + t * 0x2000), returned)) ++unpaired[vcpu];
+          else if (number_of(returned) != vcpu * threads + t) ++mismatched[vcpu];
+        }
+      }
+    });
+  }
+
+  for (std::thread& worker : workers) worker.join();
+
+  uint32_t total_mismatched = 0, total_unpaired = 0, total_pushed_out = 0;
+
+  for (uint32_t vcpu = 0; vcpu < vcpus; ++vcpu)
+  {
+    total_mismatched += mismatched[vcpu];
+    total_unpaired   += unpaired[vcpu];
+    total_pushed_out += pushed_out[vcpu];
+  }
+
+  // 64 threads in 1024 slots per vCPU, an unlucky probe window may evict but never mix up
+  CHECK(total_mismatched == 0);
+  CHECK(total_unpaired == total_pushed_out);
+
+  // What the profile makes of a pair
+  static hk::stats::syscall_row rows[2 * 16] = {};
+  hk::stats::per_cpu_table profile;
+
+  CHECK(profile.init(rows, 2, 8, 8));
+
+  table.begin(thread, pack(10000, 0x1003));
+  profile.record_entry(1, 0x1003);
+
+  CHECK(table.end(thread, value));
+  profile.record_return(1, number_of(value), cycles_since(value, 10000 + 300));
+
+  hk::stats::syscall_summary summary = {};
+  CHECK(profile.aggregate(0x1003, summary));
+  CHECK(summary.count == 1 && summary.completed == 1);
+  CHECK(summary.buckets[hk::stats::bucket_of(300)] == 1);
+
+  return check::finish("syscall_trap_test");
+}
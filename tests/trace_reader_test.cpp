@@ -0,0 +1,183 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <trace_reader.hpp>
+#include <trace_writer.hpp>
+#include <check.hpp>
+
+//
+// Reading a time window out of a closed trace: decode_range() finds its
+// chunks through the index and hands back exactly the records of the
+// window, and never decodes a chunk outside of it. A chunk outside the
+// window is wrecked on disk to prove the latter.
+//
+
+namespace
+{
+  constexpr uint32_t cpus    = 2;
+  constexpr uint32_t records = 6 * trace::chunk_records;
+
+  auto record_at(const uint32_t i) -> trace::exit_record
+  {
+    trace::exit_record record = {};
+
+    record.tsc       = 1'000'000ull + i * 100ull;
+    record.rip       = 0xfffff80000200000ull + (i % 13) * 0x40;
+    record.cr3       = 0x1aa000 + (i % 3) * 0x1000;
+    record.exit_code = exit_trace::exit_msr;
+    record.qualifier = 0xc0000080 + (i % 4);
+    record.cycles    = 1000 + i % 500;
+
+    return record;
+  }
+
+  struct window
+  {
+    uint64_t from;
+    uint64_t to;
+  };
+
+  // What decode_range() should hand back, by brute force over what was written
+  auto expected(const window range) -> uint32_t
+  {
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < records; ++i)
+    {
+      const uint64_t tsc = record_at(i).tsc;
+      if (tsc >= range.from && tsc <= range.to) ++count;
+    }
+
+    return count;
+  }
+
+  // Count and order of what decode_range() returned, false on a record that doesn't belong
+  auto read_range(const trace::reader& in, const window range, uint32_t& count) -> bool
+  {
+    uint64_t last_tsc[cpus] = {};
+    bool     belongs        = true;
+
+    count = 0;
+
+    const bool decoded = in.decode_range(range.from, range.to, [&](const uint32_t cpu, const trace::exit_record& record)
+    {
+      const uint32_t i = static_cast<uint32_t>((record.tsc - 1'000'000ull) / 100);
+      const trace::exit_record written = record_at(i);
+
+      belongs &= cpu == i % cpus && cpu < cpus && record.tsc > last_tsc[cpu];
+      belongs &= record.rip == written.rip && record.cr3 == written.cr3 && record.qualifier == written.qualifier;
+      belongs &= record.tsc >= range.from && record.tsc <= range.to;
+
+      last_tsc[cpu % cpus] = record.tsc;
+      ++count;
+    });
+
+    return decoded && belongs;
+  }
+};
+
+int main()
+{
+  const char* path = "trace_reader_test.trace";
+
+  trace::writer out;
+  if (!CHECK(out.open(path, 3'000'000'000ull, cpus))) return check::finish("trace_reader_test");
+
+  for (uint32_t i = 0; i < records; ++i) out.append(i % cpus, record_at(i));
+
+  CHECK(out.close());
+
+  trace::reader in;
+  if (!CHECK(in.open(path))) return check::finish("trace_reader_test");
+
+  CHECK(in.indexed());
+
+  const std::vector<trace::index_entry> chunks = in.chunks();
+  CHECK(chunks.size() >= 6);
+
+  // Somewhere in the middle of a chunk to somewhere in the middle of a later one
+  const uint64_t first = record_at(0).tsc;
+  const uint64_t last  = record_at(records - 1).tsc;
+  const window   middle = { first + (last - first) * 2 / 5 + 50, first + (last - first) * 3 / 5 + 50 };
+
+  uint32_t count = 0;
+
+  CHECK(read_range(in, middle, count) && count == expected(middle));
+  CHECK(count != 0);
+
+  // Bounds are inclusive, a single TSC is a single record
+  const window one = { record_at(777).tsc, record_at(777).tsc };
+  CHECK(read_range(in, one, count) && count == 1);
+
+  // Also right at the edges of a chunk
+  if (chunks.size() > 2)
+  {
+    CHECK(read_range(in, { chunks[2].first_tsc, chunks[2].first_tsc }, count) && count == 1);
+    CHECK(read_range(in, { chunks[2].last_tsc, chunks[2].last_tsc }, count) && count == 1);
+  }
+
+  // Before and after the trace, nothing and no error
+  CHECK(read_range(in, { 0, first - 1 }, count) && count == 0);
+  CHECK(read_range(in, { last + 1, ~0ull }, count) && count == 0);
+
+  // Every chunk the window doesn't reach is skipped, wreck them all and
+  // the window still reads back whole
+  uint32_t outside = 0;
+
+  in.close();
+
+  if (FILE* file = fopen(path, "r+b"))
+  {
+    const std::vector<uint8_t> garbage(64, 0xff);
+
+    for (const trace::index_entry& entry : chunks)
+    {
+      if (entry.last_tsc >= middle.from && entry.first_tsc <= middle.to) continue;
+
+      fseek(file, static_cast<long>(entry.offset + sizeof(trace::chunk_header)), SEEK_SET);
+      fwrite(garbage.data(), 1, garbage.size(), file);
+      ++outside;
+    }
+
+    fclose(file);
+  }
+
+  CHECK(outside != 0);
+  CHECK(in.open(path));
+
+  CHECK(read_range(in, middle, count) && count == expected(middle));
+
+  // The same damage is seen as soon as a window touches it
+  CHECK(!read_range(in, { first, last }, count));
+
+  in.close();
+  remove(path);
+
+  return check::finish("trace_reader_test");
+}
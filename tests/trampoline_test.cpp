@@ -0,0 +1,234 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <trampoline.hpp>
+#include <check.hpp>
+
+//
+// Trampolines run for real: every function in trampoline_functions.S is
+// relocated into memory within rel32 reach of it and into memory that's too
+// far for that, called through the trampoline, then hooked with the jump
+// the driver writes and called again through a detour that goes on through
+// the trampoline. Both have to return what the untouched function did.
+//
+
+using namespace hk::trampoline;
+
+using function_t = uint64_t (*)(uint64_t);
+
+extern "C"
+{
+  uint64_t f_riprel(uint64_t), f_call(uint64_t), f_jcc(uint64_t), f_jcc32(uint64_t), f_vex(uint64_t),
+           f_vex3(uint64_t), f_evex(uint64_t), f_jrcxz(uint64_t), f_short(uint64_t), f_loopback(uint64_t),
+           f_cmp(uint64_t), f_norex(uint64_t), f_imm(uint64_t), f_r11(uint64_t), f_store(uint64_t),
+           f_xmm4(uint64_t), f_jmp(uint64_t);
+
+  extern uint64_t data1[];
+  extern uint8_t  hookable_begin[], hookable_end[];
+}
+
+namespace
+{
+  constexpr uint64_t detour_offset = 1000;
+  constexpr uint64_t inputs[]      = { 0, 1, 5, 0x1111, 77 };
+
+  function_t original = nullptr;
+
+  auto detour(const uint64_t argument) -> uint64_t
+  {
+    return original(argument) + detour_offset;
+  }
+
+  // f_store writes data1[2] before reading it back, every call starts over
+  auto call(const function_t function, const uint64_t argument) -> uint64_t
+  {
+    data1[2] = 0;
+    return function(argument);
+  }
+
+  auto region(const uint64_t hint) -> uint8_t*
+  {
+    void* memory = mmap(reinterpret_cast<void*>(hint), 1 << 16, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    return memory != MAP_FAILED ? static_cast<uint8_t*>(memory) : nullptr;
+  }
+
+  // Within 2 GB of the functions, the first free spot past them
+  auto near_region() -> uint8_t*
+  {
+    const uint64_t text = reinterpret_cast<uint64_t>(hookable_begin) & ~0xffffull;
+
+    for (uint64_t distance = 1ull << 24; distance < 1ull << 30; distance += 1ull << 24)
+    {
+      if (uint8_t* memory = region(text + distance)) return memory;
+    }
+
+    return nullptr;
+  }
+
+  // Well out of rel32 reach, on either side of the functions
+  auto far_region() -> uint8_t*
+  {
+    const uint64_t text = reinterpret_cast<uint64_t>(hookable_begin);
+
+    for (const uint64_t hint : { 0x100000000000ull, 0x200000000000ull, 0x10000000000ull })
+    {
+      const uint64_t distance = hint > text ? hint - text : text - hint;
+      if (distance < 1ull << 33) continue;
+
+      if (uint8_t* memory = region(hint)) return memory;
+    }
+
+    return nullptr;
+  }
+
+  struct expectation
+  {
+    const char* name;
+    function_t  function;
+    status      near_result;
+    status      far_result;
+    bool        runs;         // the processor has what the function needs
+  };
+
+  auto exercise(const expectation& test, uint8_t* trampoline, const bool near) -> void
+  {
+    auto* code = reinterpret_cast<uint8_t*>(test.function);
+
+    size_t stolen  = 0;
+    size_t written = 0;
+
+    const status result = build(code, max_stolen, reinterpret_cast<uint64_t>(code), trampoline, max_size,
+                                reinterpret_cast<uint64_t>(trampoline), stolen, written);
+
+    if (!CHECK(result == (near ? test.near_result : test.far_result)))
+    {
+      fprintf(stderr, "  %s, %s: status %u\n", test.name, near ? "near" : "far", static_cast<uint32_t>(result));
+      return;
+    }
+
+    if (result != status::ok || !test.runs) return;
+
+    CHECK(stolen >= jump_size && stolen <= max_stolen && written <= max_size);
+
+    uint64_t expected[sizeof inputs / sizeof inputs[0]];
+
+    for (size_t i = 0; i < sizeof inputs / sizeof inputs[0]; ++i)
+    {
+      expected[i] = call(test.function, inputs[i]);
+    }
+
+    // Through the trampoline, the function itself untouched
+    const auto relocated = reinterpret_cast<function_t>(trampoline);
+
+    for (size_t i = 0; i < sizeof inputs / sizeof inputs[0]; ++i)
+    {
+      if (!CHECK(call(relocated, inputs[i]) == expected[i]))
+      {
+        fprintf(stderr, "  %s, %s: trampoline(%llu)\n", test.name, near ? "near" : "far",
+                static_cast<unsigned long long>(inputs[i]));
+      }
+    }
+
+    // Hooked the way the driver does it
+    uint8_t saved[max_stolen];
+    memcpy(saved, code, stolen);
+
+    emit_jump(code, reinterpret_cast<uint64_t>(&detour));
+    original = relocated;
+
+    for (size_t i = 0; i < sizeof inputs / sizeof inputs[0]; ++i)
+    {
+      if (!CHECK(call(test.function, inputs[i]) == expected[i] + detour_offset))
+      {
+        fprintf(stderr, "  %s, %s: hooked(%llu)\n", test.name, near ? "near" : "far",
+                static_cast<unsigned long long>(inputs[i]));
+      }
+    }
+
+    memcpy(code, saved, stolen);
+  }
+};
+
+int main()
+{
+  // The functions are patched in place, like the driver does through its alias
+  const auto page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  const uint64_t begin = reinterpret_cast<uint64_t>(hookable_begin) & ~(page_size - 1);
+  const uint64_t end   = reinterpret_cast<uint64_t>(hookable_end);
+
+  if (!CHECK(mprotect(reinterpret_cast<void*>(begin), end - begin, PROT_READ | PROT_WRITE | PROT_EXEC) == 0))
+  {
+    return check::finish("trampoline_test");
+  }
+
+  uint8_t* near = near_region();
+  uint8_t* far  = far_region();
+
+  if (!CHECK(near != nullptr && far != nullptr)) return check::finish("trampoline_test");
+
+  CHECK( hk::trampoline::detail::fits_rel32(near - hookable_begin));
+  CHECK(!hk::trampoline::detail::fits_rel32(far  - hookable_begin));
+
+  const bool avx2    = __builtin_cpu_supports("avx2");
+  const bool avx512f = __builtin_cpu_supports("avx512f");
+
+  // movaps xmm4 has 4 in ModRM.reg, which a legacy encoding doesn't tell
+  // apart from rsp, so it's only relocated while the disp32 reaches
+  const expectation tests[] =
+  {
+    { "riprel",   f_riprel,   status::ok,                status::ok,                true    },
+    { "call",     f_call,     status::ok,                status::ok,                true    },
+    { "jcc",      f_jcc,      status::ok,                status::ok,                true    },
+    { "jcc32",    f_jcc32,    status::ok,                status::ok,                true    },
+    { "vex",      f_vex,      status::ok,                status::ok,                true    },
+    { "vex3",     f_vex3,     status::ok,                status::ok,                avx2    },
+    { "evex",     f_evex,     status::ok,                status::ok,                avx512f },
+    { "jrcxz",    f_jrcxz,    status::ok,                status::ok,                true    },
+    { "cmp",      f_cmp,      status::ok,                status::ok,                true    },
+    { "norex",    f_norex,    status::ok,                status::ok,                true    },
+    { "imm",      f_imm,      status::ok,                status::ok,                true    },
+    { "r11",      f_r11,      status::ok,                status::ok,                true    },
+    { "store",    f_store,    status::ok,                status::ok,                true    },
+    { "jmp",      f_jmp,      status::ok,                status::ok,                true    },
+    { "xmm4",     f_xmm4,     status::ok,                status::unsupported,       true    },
+    { "short",    f_short,    status::too_short,         status::too_short,         true    },
+    { "loopback", f_loopback, status::branch_into_patch, status::branch_into_patch, true    },
+  };
+
+  for (const expectation& test : tests)
+  {
+    exercise(test, near, true);
+    exercise(test, far, false);
+  }
+
+  return check::finish("trampoline_test");
+}
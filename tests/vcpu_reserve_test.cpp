@@ -0,0 +1,90 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#include <thread>
+#include <vector>
+
+#include <vcpu_reserve.hpp>
+#include <check.hpp>
+
+using namespace vcpu_reserve;
+
+int main()
+{
+  // Nothing to hot add, only the selected ones
+  CHECK(capacity(8, 8, 8, default_spare) == 8);
+  CHECK(capacity(0, 8, 8, default_spare) == 0);
+
+  // Room to grow, the spares on top but never more than can be added
+  CHECK(capacity(8, 8, 64, default_spare) == 12);
+  CHECK(capacity(8, 8, 10, default_spare) == 10);
+  CHECK(capacity(8, 8, 64, 0) == 8);
+
+  // VirtualizedProcessors left some out, they don't get a slot
+  CHECK(capacity(2, 8, 64, default_spare) == 6);
+
+  // Maximum below active is nonsense, no spares rather than a huge count
+  CHECK(capacity(8, 16, 8, default_spare) == 8);
+
+  // Every slot handed out exactly once, however many race for them
+  pool reserve = { 1000, 0 };
+
+  std::vector<uint32_t> taken[8];
+  std::vector<std::thread> threads;
+
+  for (std::vector<uint32_t>& mine : taken)
+  {
+    threads.emplace_back([&reserve, &mine]()
+    {
+      for (uint32_t slot = claim(reserve); slot != none; slot = claim(reserve)) mine.push_back(slot);
+    });
+  }
+
+  for (std::thread& thread : threads) thread.join();
+
+  std::vector<bool> seen(reserve.capacity, false);
+  uint32_t total = 0;
+
+  for (const std::vector<uint32_t>& mine : taken)
+  {
+    for (const uint32_t slot : mine)
+    {
+      CHECK(slot < reserve.capacity && !seen[slot]);
+      if (slot < reserve.capacity) seen[slot] = true;
+
+      ++total;
+    }
+  }
+
+  CHECK(total == reserve.capacity);
+  CHECK(claim(reserve) == none);
+
+  pool empty = {};
+  CHECK(claim(empty) == none);
+
+  return check::finish("vcpu_reserve_test");
+}
@@ -0,0 +1,180 @@
+/* This file is part of krakensvm-mg by medievalghoul, licensed under the MIT license:
+*
+* MIT License
+*
+* Copyright (c) medievalghoul 2021
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <vcpu_table.hpp>
+#include <check.hpp>
+
+using namespace vcpu_table;
+
+//
+// Slots by system wide processor index: group relative numbers land where
+// the topology says, nothing past max_processors is touched, and a slot
+// published on one thread reads back whole on another.
+//
+
+static auto two_groups() -> processor_mask::topology
+{
+  processor_mask::topology layout = {};
+
+  layout.group_count    = 2;
+  layout.first_index[0] = 0;
+  layout.group_size[0]  = 48;
+  layout.first_index[1] = 48;
+  layout.group_size[1]  = 40;
+
+  return layout;
+}
+
+struct fake_vcpu
+{
+  uint32_t index;
+  uint64_t pattern;
+};
+
+int main()
+{
+  const processor_mask::topology layout = two_groups();
+
+  static table vcpus;
+  static fake_vcpu contexts[processor_mask::max_processors];
+
+  // Groups don't have to be full, the second starts right after the first
+  CHECK(index_of(layout, 0, 0) == 0 && index_of(layout, 0, 47) == 47);
+  CHECK(index_of(layout, 1, 0) == 48 && index_of(layout, 1, 39) == 87);
+  CHECK(index_of(layout, 0, 48) == processor_mask::none);
+  CHECK(index_of(layout, 1, 40) == processor_mask::none);
+  CHECK(index_of(layout, 2, 0) == processor_mask::none);
+
+  // Every processor of the topology gets a slot of its own
+  for (uint32_t group = 0; group < layout.group_count; ++group)
+  {
+    for (uint32_t number = 0; number < layout.group_size[group]; ++number)
+    {
+      const uint32_t index = index_of(layout, group, number);
+      if (!CHECK(index != processor_mask::none)) continue;
+
+      contexts[index] = { index, 0x5a5a5a5a00000000ull | index };
+      CHECK(lookup(vcpus, index) == nullptr);
+      CHECK(publish(vcpus, index, &contexts[index]));
+    }
+  }
+
+  for (uint32_t index = 0; index < layout.processor_count(); ++index)
+  {
+    const auto* vcpu = static_cast<const fake_vcpu*>(lookup(vcpus, index));
+    CHECK(vcpu == &contexts[index] && vcpu->index == index);
+  }
+
+  CHECK(lookup(vcpus, layout.processor_count()) == nullptr);
+
+  // Out of range is refused, not written past the table
+  CHECK(!publish(vcpus, processor_mask::max_processors, &contexts[0]));
+  CHECK(!publish(vcpus, processor_mask::none, &contexts[0]));
+  CHECK(lookup(vcpus, processor_mask::max_processors) == nullptr);
+  CHECK(lookup(vcpus, processor_mask::none) == nullptr);
+  CHECK(retire(vcpus, processor_mask::none) == nullptr);
+
+  // The last slot is a slot like any other
+  CHECK(publish(vcpus, processor_mask::max_processors - 1, &contexts[1]));
+  CHECK(lookup(vcpus, processor_mask::max_processors - 1) == &contexts[1]);
+
+  // Retiring hands back what was there, once
+  CHECK(retire(vcpus, 50) == &contexts[50]);
+  CHECK(retire(vcpus, 50) == nullptr);
+  CHECK(lookup(vcpus, 50) == nullptr && lookup(vcpus, 49) == &contexts[49] && lookup(vcpus, 51) == &contexts[51]);
+
+  for (uint32_t index = 0; index < processor_mask::max_processors; ++index) retire(vcpus, index);
+
+  // Processors coming and going on their own threads while a reader on
+  // another one looks around: a slot holds nothing or one of its own
+  // processor's contexts, never a neighbour's
+  static fake_vcpu spares[processor_mask::max_processors];
+
+  for (uint32_t index = 0; index < layout.processor_count(); ++index)
+  {
+    spares[index] = { index, 0xa5a5a5a500000000ull | index };
+  }
+
+  constexpr uint32_t rounds = 2000;
+
+  std::atomic<bool> done   = false;
+  std::atomic<bool> broken = false;
+
+  std::thread reader([&]()
+  {
+    while (!done.load(std::memory_order_acquire))
+    {
+      for (uint32_t index = 0; index < layout.processor_count(); ++index)
+      {
+        const auto* vcpu = static_cast<const fake_vcpu*>(lookup(vcpus, index));
+
+        if (vcpu != nullptr && ((vcpu != &contexts[index] && vcpu != &spares[index]) || vcpu->index != index))
+        {
+          broken = true;
+        }
+      }
+    }
+  });
+
+  std::vector<std::thread> processors;
+
+  for (uint32_t group = 0; group < layout.group_count; ++group)
+  {
+    processors.emplace_back([&, group]()
+    {
+      for (uint32_t round = 0; round < rounds; ++round)
+      {
+        for (uint32_t number = 0; number < layout.group_size[group]; ++number)
+        {
+          const uint32_t index = index_of(layout, group, number);
+          if (index == processor_mask::none) continue;
+
+          if (retire(vcpus, index) != nullptr) continue;
+          publish(vcpus, index, round % 4 == 2 ? &spares[index] : &contexts[index]);
+        }
+      }
+    });
+  }
+
+  for (std::thread& processor : processors) processor.join();
+
+  done = true;
+  reader.join();
+
+  CHECK(!broken);
+
+  // Even rounds published and odd ones retired, every slot ends up empty
+  for (uint32_t index = 0; index < layout.processor_count(); ++index)
+  {
+    CHECK(lookup(vcpus, index) == nullptr);
+  }
+
+  return check::finish("vcpu_table_test");
+}